@@ -40,6 +40,37 @@ inline void vid_wridx( void *cx, int idx_reg, int idx, v_byte data )
     vid_outw( cx, idx_reg, idx | (data << 8) );
 }
 
+#ifdef QEMU
+/* DISPI registers in the QEMU std-vga MMIO BAR, NULL if not mapped. */
+static volatile v_word __far *dispi_mmio;
+#endif
+
+/* Write a DISPI register. A single MMIO access when the QEMU register
+ * window is available, the index/data port pair otherwise.
+ */
+static void dispi_wr( void *cx, int idx, unsigned val )
+{
+#ifdef QEMU
+    if( dispi_mmio ) {
+        dispi_mmio[idx] = val;
+        return;
+    }
+#endif
+    vid_outw( cx, VBE_DISPI_IOPORT_INDEX, idx );
+    vid_outw( cx, VBE_DISPI_IOPORT_DATA, val );
+}
+
+/* Read a DISPI register, see dispi_wr(). */
+static unsigned dispi_rd( void *cx, int idx )
+{
+#ifdef QEMU
+    if( dispi_mmio )
+        return( dispi_mmio[idx] );
+#endif
+    vid_outw( cx, VBE_DISPI_IOPORT_INDEX, idx );
+    return( vid_inw( cx, VBE_DISPI_IOPORT_DATA ) );
+}
+
 /* Set an extended non-VGA mode with given parameters. 8bpp and higher only.
  * Returns non-zero value on failure.
  */
@@ -55,39 +86,29 @@ int BOXV_ext_mode_set( void *cx, int xres, int yres, int bpp, int v_xres, int v_
     vid_wridx( cx, VGA_SEQUENCER, VGA_SR_RESET, VGA_SR_RESET );
 
     /* Disable the extended display registers. */
-    vid_outw( cx, VBE_DISPI_IOPORT_INDEX, VBE_DISPI_INDEX_ENABLE );
-    vid_outw( cx, VBE_DISPI_IOPORT_DATA, VBE_DISPI_DISABLED );
+    dispi_wr( cx, VBE_DISPI_INDEX_ENABLE, VBE_DISPI_DISABLED );
 
     /* Program the extended non-VGA registers. */
 
     /* Set X resoultion. */
-    vid_outw( cx, VBE_DISPI_IOPORT_INDEX, VBE_DISPI_INDEX_XRES );
-    vid_outw( cx, VBE_DISPI_IOPORT_DATA, xres );
+    dispi_wr( cx, VBE_DISPI_INDEX_XRES, xres );
     /* Set Y resoultion. */
-    vid_outw( cx, VBE_DISPI_IOPORT_INDEX, VBE_DISPI_INDEX_YRES );
-    vid_outw( cx, VBE_DISPI_IOPORT_DATA, yres );
+    dispi_wr( cx, VBE_DISPI_INDEX_YRES, yres );
     /* Set bits per pixel. */
-    vid_outw( cx, VBE_DISPI_IOPORT_INDEX, VBE_DISPI_INDEX_BPP );
-    vid_outw( cx, VBE_DISPI_IOPORT_DATA, bpp );
+    dispi_wr( cx, VBE_DISPI_INDEX_BPP, bpp );
     /* Set the virtual resolution. */
-    vid_outw( cx, VBE_DISPI_IOPORT_INDEX, VBE_DISPI_INDEX_VIRT_WIDTH );
-    vid_outw( cx, VBE_DISPI_IOPORT_DATA, v_xres );
-    vid_outw( cx, VBE_DISPI_IOPORT_INDEX, VBE_DISPI_INDEX_VIRT_HEIGHT );
-    vid_outw( cx, VBE_DISPI_IOPORT_DATA, v_yres );
+    dispi_wr( cx, VBE_DISPI_INDEX_VIRT_WIDTH, v_xres );
+    dispi_wr( cx, VBE_DISPI_INDEX_VIRT_HEIGHT, v_yres );
     /* Reset the current bank. */
-    vid_outw( cx, VBE_DISPI_IOPORT_INDEX, VBE_DISPI_INDEX_BANK );
-    vid_outw( cx, VBE_DISPI_IOPORT_DATA, 0 );
+    dispi_wr( cx, VBE_DISPI_INDEX_BANK, 0 );
     /* Set the X and Y display offset to 0. */
-    vid_outw( cx, VBE_DISPI_IOPORT_INDEX, VBE_DISPI_INDEX_X_OFFSET );
-    vid_outw( cx, VBE_DISPI_IOPORT_DATA, 0 );
-    vid_outw( cx, VBE_DISPI_IOPORT_INDEX, VBE_DISPI_INDEX_Y_OFFSET );
-    vid_outw( cx, VBE_DISPI_IOPORT_DATA, 0 );
+    dispi_wr( cx, VBE_DISPI_INDEX_X_OFFSET, 0 );
+    dispi_wr( cx, VBE_DISPI_INDEX_Y_OFFSET, 0 );
     /* Enable the extended display registers. */
-    vid_outw( cx, VBE_DISPI_IOPORT_INDEX, VBE_DISPI_INDEX_ENABLE );
 #ifdef QEMU
-    vid_outw( cx, VBE_DISPI_IOPORT_DATA, VBE_DISPI_ENABLED | VBE_DISPI_8BIT_DAC | VBE_DISPI_LFB_ENABLED | VBE_DISPI_NOCLEARMEM  );
+    dispi_wr( cx, VBE_DISPI_INDEX_ENABLE, VBE_DISPI_ENABLED | VBE_DISPI_8BIT_DAC | VBE_DISPI_LFB_ENABLED | VBE_DISPI_NOCLEARMEM  );
 #else
-    vid_outw( cx, VBE_DISPI_IOPORT_DATA, VBE_DISPI_ENABLED | VBE_DISPI_8BIT_DAC );
+    dispi_wr( cx, VBE_DISPI_INDEX_ENABLE, VBE_DISPI_ENABLED | VBE_DISPI_8BIT_DAC );
 #endif
 
     /* Re-enable the sequencer. */
@@ -124,6 +145,19 @@ int BOXV_dac_set( void *cx, unsigned start, unsigned count, void *pal )
     return( 0 );
 }
 
+/* Set the top left corner of displayed area inside the virtual screen
+ * (used for page flipping). Returns non-zero on failure.
+ */
+int BOXV_set_display_start( void *cx, int x, int y )
+{
+    if( x < 0 || y < 0 )
+        return( -1 );
+
+    dispi_wr( cx, VBE_DISPI_INDEX_X_OFFSET, x );
+    dispi_wr( cx, VBE_DISPI_INDEX_Y_OFFSET, y );
+    return( 0 );
+}
+
 /* Detect the presence of a supported adapter and amount of installed
  * video memory. Returns zero if not found.
  */
@@ -131,20 +165,20 @@ int BOXV_detect( void *cx, unsigned long *vram_size )
 {
     v_word      boxv_id;
 
-    vid_outw( cx, VBE_DISPI_IOPORT_INDEX, VBE_DISPI_INDEX_ID );
-
-    boxv_id = vid_inw( cx, VBE_DISPI_IOPORT_DATA );
 #ifdef QEMU
+    boxv_id = dispi_rd( cx, VBE_DISPI_INDEX_ID );
     if( boxv_id < VBE_DISPI_ID0 || boxv_id > VBE_DISPI_ID6 )
         return( 0 );
 
     if( vram_size ) {
-        vid_outw( cx, VBE_DISPI_IOPORT_INDEX, VBE_DISPI_INDEX_VIDEO_MEMORY_64K );
-        *vram_size = (unsigned long)vid_inw( cx, VBE_DISPI_IOPORT_DATA ) << 16;
+        *vram_size = (unsigned long)dispi_rd( cx, VBE_DISPI_INDEX_VIDEO_MEMORY_64K ) << 16;
     }
 
     return( boxv_id );
 #else
+    vid_outw( cx, VBE_DISPI_IOPORT_INDEX, VBE_DISPI_INDEX_ID );
+
+    boxv_id = vid_inw( cx, VBE_DISPI_IOPORT_DATA );
     if( vram_size ) {
         *vram_size = vid_ind( cx, VBE_DISPI_IOPORT_DATA );
     }
@@ -156,14 +190,45 @@ int BOXV_detect( void *cx, unsigned long *vram_size )
 #endif
 }
 
+/* Check if the adapter supports HGSMI (VirtualBox host/guest shared memory
+ * interface). Original ID is restored, it is checked by BOXV_detect.
+ * Returns non-zero if supported.
+ */
+int BOXV_hgsmi_detect( void *cx )
+{
+#ifdef QEMU
+    return( 0 );
+#else
+    v_word      old_id;
+    v_word      id;
+
+    vid_outw( cx, VBE_DISPI_IOPORT_INDEX, VBE_DISPI_INDEX_ID );
+    old_id = vid_inw( cx, VBE_DISPI_IOPORT_DATA );
+    vid_outw( cx, VBE_DISPI_IOPORT_DATA, VBE_DISPI_ID_HGSMI );
+    id = vid_inw( cx, VBE_DISPI_IOPORT_DATA );
+    vid_outw( cx, VBE_DISPI_IOPORT_DATA, old_id );
+
+    return( id == VBE_DISPI_ID_HGSMI );
+#endif
+}
+
+/* Pass HGSMI buffer on 'offset' from VRAM start to the host. Host processes
+ * it before the port write returns.
+ */
+void BOXV_hgsmi_submit( void *cx, unsigned long offset )
+{
+#ifndef QEMU
+    vid_outd( cx, VGA_PORT_HGSMI_GUEST, offset );
+#endif
+}
+
 /* Disable extended mode and place the hardware into a VGA compatible state.
  * Returns non-zero on failure.
  */
 int BOXV_ext_disable( void *cx )
 {
     /* Disable the extended display registers. */
-    vid_outw( cx, VBE_DISPI_IOPORT_INDEX, VBE_DISPI_INDEX_ENABLE );
-    vid_outw( cx, VBE_DISPI_IOPORT_DATA, VBE_DISPI_DISABLED );
+    dispi_wr( cx, VBE_DISPI_INDEX_ENABLE, VBE_DISPI_DISABLED );
     return( 0 );
 }
 
@@ -175,8 +240,7 @@ unsigned long BOXV_get_lfb_base( void *cx )
     unsigned long   fb_base;
 
     /* Ask the virtual hardware for the high 16 bits. */
-    vid_outw( cx, VBE_DISPI_IOPORT_INDEX, VBE_DISPI_INDEX_FB_BASE_HI );
-    fb_base = vid_inw( cx, VBE_DISPI_IOPORT_DATA );
+    fb_base = dispi_rd( cx, VBE_DISPI_INDEX_FB_BASE_HI );
 
     /* Old versions didn't support that, so use the default
      * if the value looks like garbage.
@@ -188,3 +252,26 @@ unsigned long BOXV_get_lfb_base( void *cx )
 
     return( fb_base );
 }
+
+#ifdef QEMU
+/* Use the DISPI registers of the QEMU std-vga MMIO BAR (BAR 2 at offset
+ * 0x500, one word per register) instead of port I/O. The window is
+ * accepted only if it returns the same ID as the ports; NULL reverts to
+ * port I/O. Returns non-zero on failure.
+ */
+int BOXV_mmio_set( void *cx, void __far *mmio )
+{
+    volatile v_word __far   *regs;
+
+    dispi_mmio = 0;
+    if( !mmio )
+        return( 0 );
+
+    regs = (volatile v_word __far *)((char __far *)mmio + VBE_DISPI_MMIO_OFFSET);
+    if( regs[VBE_DISPI_INDEX_ID] != dispi_rd( cx, VBE_DISPI_INDEX_ID ) )
+        return( -1 );
+
+    dispi_mmio = regs;
+    return( 0 );
+}
+#endif
@@ -47,6 +47,12 @@ extern int  BOXV_mode_set( void *cx, int mode_no );
 extern int  BOXV_dac_set( void *cx, unsigned start, unsigned count, void *pal );
 extern int  BOXV_ext_disable( void *cx );
 extern unsigned long BOXV_get_lfb_base( void *cx );
+extern int  BOXV_set_display_start( void *cx, int x, int y );
+extern int  BOXV_hgsmi_detect( void *cx );
+extern void BOXV_hgsmi_submit( void *cx, unsigned long offset );
+#ifdef QEMU
+extern int  BOXV_mmio_set( void *cx, void __far *mmio );
+#endif
 
 #define PCI_VENDOR_ID_VMWARE            0x15AD
 #define PCI_DEVICE_ID_VMWARE_SVGA2      0x0405
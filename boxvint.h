@@ -95,6 +95,9 @@ THE SOFTWARE.
 #define VBE_DISPI_IOPORT_INDEX          0x01CE
 #define VBE_DISPI_IOPORT_DATA           0x01CF
 
+/* QEMU std-vga MMIO BAR: register n is a word at offset + n * 2. */
+#define VBE_DISPI_MMIO_OFFSET           0x0500
+
 #define VBE_DISPI_INDEX_ID              0x0
 #define VBE_DISPI_INDEX_XRES            0x1
 #define VBE_DISPI_INDEX_YRES            0x2
@@ -116,6 +119,12 @@ THE SOFTWARE.
 #define VBE_DISPI_ID5                   0xB0C5
 #define VBE_DISPI_ID6                   0xB0C6
 
+/* VirtualBox extensions */
+#define VBE_DISPI_ID_HGSMI              0xBE01
+
+/* HGSMI buffers are submitted by writing their VRAM offset here */
+#define VGA_PORT_HGSMI_GUEST            0x03D0
+
 #define VBE_DISPI_DISABLED              0x00
 #define VBE_DISPI_ENABLED               0x01
 #define VBE_DISPI_GETCAPS               0x02
@@ -38,6 +38,10 @@ THE SOFTWARE.
 #ifdef SVGA
 # include "svga_all.h"
 # include "control_vxd.h"
+# include "vmwsvxd.h"
+# include "dpmi.h"
+#else
+# include "vbva.h"
 #endif
 
 /*
@@ -76,6 +80,16 @@ THE SOFTWARE.
 /* update buffer if 'need_call_update' is set */
 #define FBHDA_UPDATE         0x110C
 
+/* page flipping: scan out from other surface in VRAM / check if it's done */
+#define FBHDA_FLIP           0x110D
+#define FBHDA_FLIP_STATUS    0x110E
+
+/* as FBHDA_UPDATE, but for more rects in one call */
+#define FBHDA_UPDATE_RECTS   0x1108
+
+/* present pacing for calling task: input uint32 (0 = opt out, 1 = paced) */
+#define FBHDA_PACING         0x1109
+
 /* check for drv <-> vxd <-> dll match */
 #define SVGA_API             0x110F
 
@@ -86,10 +100,30 @@ THE SOFTWARE.
 #define SVGA_REGION_FREE     0x1115
 #define SVGA_SYNC            0x1116
 #define SVGA_RING            0x1117
+#define SVGA_DDBLT           0x1118
+#define SVGA_DDBLT_STATUS    0x1119
+#define SVGA_REGION_CREATE_BATCH 0x111A
+#define SVGA_REGION_FREE_BATCH   0x111B
+#define SVGA_SCREENTARGET        0x111C
+#define SVGA_STAGING_ACQUIRE     0x111D
+#define SVGA_STAGING_RELEASE     0x111E
+#define SVGA_OVERLAY             0x111F
+#define SVGA_OVERLAY_POSITION    0x1120
 
 #define SVGA_HWINFO_REGS   0x1121
 #define SVGA_HWINFO_FIFO   0x1122
 #define SVGA_HWINFO_CAPS   0x1123
+#define SVGA_PERF_COUNTERS 0x1124
+
+#define SVGA_DDLOCK        0x1125
+#define SVGA_DDUNLOCK      0x1126
+#define SVGA_HDA_SPARSE    0x1127
+
+/* client back buffer (GMR backed) and present of its dirty rects to screen */
+#define FBHDA_BACKBUFFER   0x1128
+#define FBHDA_PRESENT      0x1129
+
+#define SVGA_PERF_RESET    0x1 /* SVGA_PERF_COUNTERS input flag */
 
 typedef struct _longRECT {
   LONG left;
@@ -98,6 +132,67 @@ typedef struct _longRECT {
   LONG bottom;
 } longRECT;
 
+#ifdef SVGA
+/* SVGA_DDBLT input, surfaces are addressed by linear address in VRAM */
+#define SVGA_DDBLT_FILL 1
+#define SVGA_DDBLT_COPY 2
+
+typedef struct _svga_ddblt_t {
+  DWORD op;
+  DWORD dst;        /* destination surface */
+  DWORD dstPitch;
+  longRECT dstRect;
+  DWORD src;        /* COPY: source surface */
+  DWORD srcPitch;
+  LONG  srcX;       /* COPY: source left top corner (no stretch) */
+  LONG  srcY;
+  DWORD color;      /* FILL: color in surface format */
+} svga_ddblt_t;
+
+/* SVGA_DDBLT_STATUS input */
+typedef struct _svga_ddblt_status_t {
+  DWORD fence;
+  DWORD wait;       /* non zero = wait for completion (Lock) */
+} svga_ddblt_status_t;
+
+/* SVGA_DDLOCK input (SVGA_DDUNLOCK input is DWORD surface) */
+#define SVGA_DDLOCK_RECT 0x1 /* 'rect' is valid, otherwise whole surface is locked */
+
+typedef struct _svga_ddlock_t {
+  DWORD surface;    /* linear address in VRAM */
+  DWORD pitch;
+  DWORD flags;
+  longRECT rect;
+} svga_ddlock_t;
+#endif
+
+/**
+ * Batched escapes pass count + array through 16-bit far pointer, count
+ * must not go out of the buffer segment (offset would wrap in it).
+ **/
+static uint32_t esc_fit(const void __far *lp, WORD hdr, WORD entry)
+{
+	DWORD limit;
+	
+	if(lp == NULL)
+	{
+		return 0;
+	}
+	
+	limit = GetSelectorLimit(SELECTOROF(lp));
+	if(limit > 0xFFFFUL)
+	{
+		limit = 0xFFFFUL;
+	}
+	
+	if((DWORD)OFFSETOF(lp) + hdr > limit + 1)
+	{
+		return 0;
+	}
+	
+	return (limit + 1 - OFFSETOF(lp) - hdr) / entry;
+}
+
 /**
  * OpenGL ICD driver name (0x1101):
  * -------------------------------------
@@ -145,7 +240,14 @@ const static opengl_icd_t vmwsvga_icd = {
 #pragma pack(push)
 #pragma pack(1)
 
-/* SVGA HDA = hardware direct access */
+/*
+ * SVGA HDA = hardware direct access
+ *
+ * Userlist: flags, fence, GMR/context/surface slots (or directories of
+ * sparse userlist) and then the tail
+ * (devcap table, owned regions, pending updates, lock waiters and ID
+ * allocation maps), see UL_TAIL_* below.
+ */
 typedef struct _svga_hda_t
 {
 	uint32_t       vram_linear;   /* frame buffer address from PM32 (shared memory region, accesable with user space programs too) */
@@ -180,11 +282,126 @@ typedef struct _svga_hda_t
 #define ULF_PITCH  4
 #define ULF_LOCK_UL   5
 #define ULF_LOCK_FIFO 6
+#define ULF_ENABLED   8 /* SVGA_REG_ENABLE mirrored by driver, VxD time-outs can't read it */
+#define ULF_COUNT     9
 
 #define GMR_INDEX_CNT 6
 #define CTX_INDEX_CNT 2
 
+/*
+ * Sparse userlist ([display] ul_sparse=1 in SYSTEM.INI enables it):
+ * GMR and surface slots are in pages committed by VxD on first use of
+ * ID range (DIOC SVGA_UL_COMMIT), userlist holds only directories of
+ * their linear addresses (see vmwsvxd.h). Layout is flags, fence, GMR
+ * directory, context slots, surface directory and tail. ul_gmr_start
+ * and ul_surf_start are 0 in this case, directories and tail are
+ * returned by SVGA_HDA_SPARSE. Off by default, user space which knows
+ * only SVGA_HDA_REQ indexes flat sections and would overwrite flags.
+ */
+#define UL_PAGE_DWORDS   1024
+#define UL_GMR_PAGE_IDS  (UL_PAGE_DWORDS/GMR_INDEX_CNT)
+#define UL_SURF_PAGE_IDS UL_PAGE_DWORDS
+
+typedef struct _svga_hda_sparse_t
+{
+	uint32_t gmr_dir;       /* userlist index of GMR directory */
+	uint32_t gmr_page_ids;  /* GMRs in one page */
+	uint32_t surf_dir;      /* userlist index of surface directory */
+	uint32_t surf_page_ids; /* surfaces in one page */
+	uint32_t tail_start;    /* userlist index of devcap table */
+} svga_hda_sparse_t;
+
+/*
+ * Fixed device caps are in userlist behind surfaces
+ * (from ul_surf_start + ul_surf_count, or behind surface directory in
+ * sparse userlist), present if userlist_length includes them.
+ */
+#define DEVCAP_TABLE_SIZE 512
+
+/*
+ * Host owned screen regions are in userlist behind devcap table. After
+ * 3D present user space adds rects (under FIFO lock) where the frame
+ * buffer doesn't contain presented pixels yet, or sets fence of its own
+ * readback. More rects than UL_OWNED_MAX means whole screen.
+ */
+#define UL_OWNED_FENCE 0
+#define UL_OWNED_CNT   1
+#define UL_OWNED_RECTS 2 /* left, top, right, bottom */
+#define UL_OWNED_MAX   8
+#define UL_OWNED_SIZE  (UL_OWNED_RECTS + 4*UL_OWNED_MAX)
+
+/*
+ * Pending screen updates follow the owned regions. When GDI cannot get
+ * FIFO lock, it appends damage rects here (single producer ring, free
+ * running indexes) and the one who releases FIFO lock should send
+ * SVGA_CMD_UPDATE for rects from tail to head and move tail. Used only
+ * in modes where damage is presented by SVGA_CMD_UPDATE only. With async
+ * present GDI queues all damage here and the VxD worker is a consumer too
+ * (it takes FIFO lock as well).
+ */
+#define UL_PENDING_HEAD  0 /* written by GDI */
+#define UL_PENDING_TAIL  1 /* written by consumer */
+#define UL_PENDING_RECTS 2 /* left, top, right, bottom */
+#define UL_PENDING_MAX   16
+#define UL_PENDING_SIZE  (UL_PENDING_RECTS + 4*UL_PENDING_MAX)
+
+/*
+ * Lock waiters follow: number of sleeping lockers for every lock
+ * (indexed by lock id). Who releases a lock with waiters should wake
+ * them by VxD (SVGA_LOCK_WAKE).
+ */
+#define UL_WAITERS_SIZE 8
+
+/*
+ * ID allocation maps are the last: 3 hints (GMR, context, surface: index
+ * of dword where to start search) followed by bitmaps of ul_gmr_count,
+ * ul_ctx_count and ul_surf_count bits (rounded up to dwords), set bit =
+ * ID is used. IDs used by driver itself (and GMR 0) are set on init.
+ *
+ * Allocation: from hint find dword which isn't 0xFFFFFFFF, take its
+ * lowest zero bit by 'lock bts', when the bit was already set (carry)
+ * try again, then store dword index as hint. Free: 'lock btr' and lower
+ * hint to dword index. Hints are advisory only and may be stale.
+ */
+#define UL_IDMAP_HINT_GMR  0
+#define UL_IDMAP_HINT_CTX  1
+#define UL_IDMAP_HINT_SURF 2
+#define UL_IDMAP_BITMAPS   3
+#define UL_IDMAP_WORDS(_n) (((_n) + 31)/32)
+
+/* offsets from devcap table (tail start) */
+#define UL_TAIL_OWNED   DEVCAP_TABLE_SIZE
+#define UL_TAIL_PENDING (UL_TAIL_OWNED   + UL_OWNED_SIZE)
+#define UL_TAIL_WAITERS (UL_TAIL_PENDING + UL_PENDING_SIZE)
+#define UL_TAIL_IDMAP   (UL_TAIL_WAITERS + UL_WAITERS_SIZE)
+
 static svga_hda_t SVGAHDA;
+static svga_hda_sparse_t SVGAHDA_sparse; /* zeroed when userlist isn't sparse */
+
+/*
+ * Async present: state of VxD worker which sends pending updates,
+ * 'idle' is the first dword. [display] async_present=0 in SYSTEM.INI
+ * disables it.
+ */
+static volatile uint32_t __far *present_idle = NULL;
+
+/* userlist ULF_ENABLED, written on every SVGA_REG_ENABLE change */
+volatile uint32_t __far *SVGAHDA_enabled = NULL;
+
+/*
+ * VxD hot-path trace ring (see vmwsvxd.h), driver records escapes and
+ * FIFO stalls to the same ring, so both sides share one time base.
+ */
+static trace_ring_t __far *trace_ring = NULL;
+
+/* gSVGADevBusy is moved to page shared with VxD once */
+static BOOL dev_lock_shared = FALSE;
+
+/*
+ * Userlist is usually larger than 64K, so the part behind surfaces has
+ * its own selector.
+ */
+static uint32_t __far *userlist_tail = NULL;
 
 #endif /* SVGA only */
 
@@ -242,8 +459,70 @@ uint32_t FixDevCap(uint32_t cap_id, uint32_t cap_val)
  *   SVGA_REG_DEV_CAP HW register
  *
  **/
+/*
+ * Device caps are constant, all of them are read and fixed only once
+ * to this table (and copied to userlist for ring-3 clients)
+ */
+static uint32_t devcap_table[DEVCAP_TABLE_SIZE];
+static BOOL devcap_built = FALSE;
+
+static void DevCapBuild()
+{
+	uint32_t i;
+	
+	_fmemset(devcap_table, 0, sizeof(devcap_table));
+	
+	if (gSVGA.capabilities & SVGA_CAP_GBOBJECTS)
+	{
+		/* new way to read device CAPS */
+		for(i = 0; i < DEVCAP_TABLE_SIZE; i++)
+		{
+			SVGA_WriteReg(SVGA_REG_DEV_CAP, i);
+			devcap_table[i] = SVGA_ReadReg(SVGA_REG_DEV_CAP);
+		}
+	}
+	else
+	{
+		/* old way to read device CAPS */
+		SVGA3dCapsRecord  __far *pCaps = (SVGA3dCapsRecord  __far *)&(gSVGA.fifoMem[SVGA_FIFO_3D_CAPS]);
+		while(pCaps->header.length != 0)
+		{
+			if(pCaps->header.type == SVGA3DCAPS_RECORD_DEVCAPS)
+			{
+				uint32_t datalen = (pCaps->header.length - 2)/2;
+				SVGA3dCapPair __far *pData = (SVGA3dCapPair __far *)(&pCaps->data);
+				
+				for(i = 0; i < datalen; i++)
+				{
+					if(pData[i][0] < DEVCAP_TABLE_SIZE)
+					{
+						devcap_table[pData[i][0]] = pData[i][1];
+					}
+				}
+			}
+			pCaps = (SVGA3dCapsRecord __far *)((uint32_t __far *)pCaps + pCaps->header.length);
+		}
+	}
+	
+	/* FixDevCap reads other caps by GetDevCap, so table is marked valid before fixing */
+	devcap_built = TRUE;
+	for(i = 0; i < DEVCAP_TABLE_SIZE; i++)
+	{
+		devcap_table[i] = FixDevCap(i, devcap_table[i]);
+	}
+}
+
+/*
+ * Table is built by SVGA_3DProbe, until then (2D only session) caps are
+ * read one by one, full table is 512 trapped register round trips.
+ */
 uint32_t GetDevCap(uint32_t search_id)
 {
+	if(devcap_built && search_id < DEVCAP_TABLE_SIZE)
+	{
+		return devcap_table[search_id];
+	}
+	
 	if (gSVGA.capabilities & SVGA_CAP_GBOBJECTS)
 	{
 		/* new way to read device CAPS */
@@ -287,7 +566,7 @@ uint32_t GetDevCap(uint32_t search_id)
  *   GPU gen10 - eg. DirectX surfaces jet aren't supported)
  *
  **/
-WORD SVGA_3DSupport()
+static WORD SVGA_3DSupport()
 {
 	if(SVGA_HasFIFOCap(SVGA_FIFO_CAP_FENCE) && (SVGA_HasFIFOCap(SVGA_FIFO_CAP_SCREEN_OBJECT) || SVGA_HasFIFOCap(SVGA_FIFO_CAP_SCREEN_OBJECT_2)))
 	{
@@ -312,28 +591,151 @@ WORD SVGA_3DSupport()
 	return 0;
 }
 
+static BOOL SVGA_3d_probed = FALSE;
+
+/**
+ * Negotiate 3D version, build caps table and publish it to userlist.
+ * Called on first 3D escape (or on mode set with defer_3d=0), not during
+ * enable, most sessions never start 3D application. FIFO must be enabled.
+ **/
+void SVGA_3DProbe()
+{
+	if(SVGA_3d_probed || gSVGA.fifoLinear == 0)
+	{
+		return;
+	}
+	SVGA_3d_probed = TRUE;
+	
+	/* host capabilities don't change with mode */
+	DevCapBuild();
+	
+	wMesa3DEnabled = 0;
+	if(SVGA3D_Init())
+	{
+		wMesa3DEnabled = SVGA_3DSupport();
+	}
+	
+	if(userlist_tail != NULL)
+	{
+		_fmemcpy(userlist_tail, devcap_table, sizeof(devcap_table));
+	}
+	
+	dbg_printf("SVGA_3DProbe: %d\n", wMesa3DEnabled);
+}
+
+/**
+ * GMR ids used by driver, from top of GMR space: guest image blits,
+ * STAGING_MAX staging buffers and BACK_MAX FBHDA back buffers.
+ **/
+#define STAGING_MAX  2
+#define BACK_MAX     4
+#define BACK_GMR_TOP (1 + STAGING_MAX) /* ids on top of GMR space used by guest image blits and staging */
+#define GMR_DRV_IDS  (BACK_GMR_TOP + BACK_MAX)
+
+/* mark ID as used in map (only during init, not atomic) */
+static void idmap_reserve(uint32_t __far *map, uint32_t count, uint32_t id)
+{
+	if(id < count)
+	{
+		map[id >> 5] |= 1UL << (id & 31);
+	}
+}
+
+/* ID maps are zeroed, reserve IDs used by driver */
+static void SVGAHDA_idmapInit()
+{
+	uint32_t __far *idmap = userlist_tail + UL_TAIL_IDMAP;
+	uint32_t __far *gmr   = idmap + UL_IDMAP_BITMAPS;
+	uint32_t __far *surf  = gmr + UL_IDMAP_WORDS(SVGAHDA.ul_gmr_count) + UL_IDMAP_WORDS(SVGAHDA.ul_ctx_count);
+	uint32_t cnt = SVGAHDA.ul_gmr_count;
+	uint32_t i;
+	
+	/* region id 0 = no region */
+	idmap_reserve(gmr, cnt, 0);
+	/* guest image blits, staging ring and back buffers (top of GMR space) */
+	for(i = 1; i <= GMR_DRV_IDS && i < cnt; i++)
+	{
+		idmap_reserve(gmr, cnt, cnt - i);
+	}
+	
+	/* stretch scratch surfaces and screen target primary */
+	idmap_reserve(surf, SVGAHDA.ul_surf_count, SVGA_SCRATCH_SRC_SID);
+	idmap_reserve(surf, SVGAHDA.ul_surf_count, SVGA_SCRATCH_DST_SID);
+	idmap_reserve(surf, SVGAHDA.ul_surf_count, SVGA_PRIMARY_SID);
+}
+
 /**
  * init SVGAHDA -> memory map between user space and (virtual) hardware memory
  *
  **/
 void SVGAHDA_init()
 {
+	DWORD idmap_size;
+	DWORD tail_size;
+	DWORD tail_start;
+	DWORD gmr_pages  = 0;
+	DWORD surf_pages = 0;
+	BOOL  sparse     = FALSE;
+	
 	_fmemset(&SVGAHDA, 0, sizeof(svga_hda_t));
+	_fmemset(&SVGAHDA_sparse, 0, sizeof(svga_hda_sparse_t));
   
-  SVGAHDA.ul_flags_index = 0; // dirty, width, height, bpp, pitch, fifo_lock, ul_lock, fb_lock
-  SVGAHDA.ul_fence_index = SVGAHDA.ul_flags_index + 8;
-  SVGAHDA.ul_gmr_start   = SVGAHDA.ul_fence_index + 1;
-  SVGAHDA.ul_gmr_count   = SVGA_ReadReg(SVGA_REG_GMR_MAX_IDS);
-  SVGAHDA.ul_ctx_start   = SVGAHDA.ul_gmr_start + SVGAHDA.ul_gmr_count*GMR_INDEX_CNT;
+  SVGAHDA.ul_flags_index = 0; // dirty, width, height, bpp, pitch, fifo_lock, ul_lock, fb_lock, enabled
+  SVGAHDA.ul_fence_index = SVGAHDA.ul_flags_index + ULF_COUNT;
+  SVGAHDA.ul_gmr_count   = SVGA_ReadRegCached(SVGA_REG_GMR_MAX_IDS);
   SVGAHDA.ul_ctx_count   = GetDevCap(SVGA3D_DEVCAP_MAX_CONTEXT_IDS);
-  SVGAHDA.ul_surf_start  = SVGAHDA.ul_ctx_start + SVGAHDA.ul_ctx_count*CTX_INDEX_CNT;
   SVGAHDA.ul_surf_count  = GetDevCap(SVGA3D_DEVCAP_MAX_SURFACE_IDS);
-	SVGAHDA.userlist_length = SVGAHDA.ul_surf_start + SVGAHDA.ul_surf_count;
+  
+	/* pages are committed by VxD */
+	if(VXD_apiver() != 0 && GetPrivateProfileInt("display", "ul_sparse", 0, "system.ini"))
+	{
+		gmr_pages  = (SVGAHDA.ul_gmr_count  + UL_GMR_PAGE_IDS  - 1) / UL_GMR_PAGE_IDS;
+		surf_pages = (SVGAHDA.ul_surf_count + UL_SURF_PAGE_IDS - 1) / UL_SURF_PAGE_IDS;
+		sparse = gmr_pages <= UL_DIR_MAX && surf_pages <= UL_DIR_MAX;
+	}
+	
+	if(sparse)
+	{
+		SVGAHDA_sparse.gmr_dir       = SVGAHDA.ul_fence_index + 1;
+		SVGAHDA_sparse.gmr_page_ids  = UL_GMR_PAGE_IDS;
+		SVGAHDA.ul_ctx_start         = SVGAHDA_sparse.gmr_dir + gmr_pages;
+		SVGAHDA_sparse.surf_dir      = SVGAHDA.ul_ctx_start + SVGAHDA.ul_ctx_count*CTX_INDEX_CNT;
+		SVGAHDA_sparse.surf_page_ids = UL_SURF_PAGE_IDS;
+		tail_start                   = SVGAHDA_sparse.surf_dir + surf_pages;
+		SVGAHDA_sparse.tail_start    = tail_start;
+	}
+	else
+	{
+		SVGAHDA.ul_gmr_start   = SVGAHDA.ul_fence_index + 1;
+		SVGAHDA.ul_ctx_start   = SVGAHDA.ul_gmr_start + SVGAHDA.ul_gmr_count*GMR_INDEX_CNT;
+		SVGAHDA.ul_surf_start  = SVGAHDA.ul_ctx_start + SVGAHDA.ul_ctx_count*CTX_INDEX_CNT;
+		tail_start             = SVGAHDA.ul_surf_start + SVGAHDA.ul_surf_count;
+	}
+	
+	idmap_size = UL_IDMAP_BITMAPS + UL_IDMAP_WORDS(SVGAHDA.ul_gmr_count) +
+		UL_IDMAP_WORDS(SVGAHDA.ul_ctx_count) + UL_IDMAP_WORDS(SVGAHDA.ul_surf_count);
+	tail_size = UL_TAIL_IDMAP + idmap_size;
+	SVGAHDA.userlist_length = tail_start + tail_size;
 	
 	SVGAHDA.userlist_pm16  = drv_malloc(SVGAHDA.userlist_length * sizeof(uint32_t), &SVGAHDA.userlist_linear);
 	
 	if(SVGAHDA.userlist_pm16)
 	{
+		WORD wSel = DPMI_AllocLDTDesc(1);
+		DWORD tail_offset = tail_start * sizeof(uint32_t);
+		
+		if(wSel)
+		{
+			DPMI_SetSegBase(wSel, SVGAHDA.userlist_linear + tail_offset);
+			DPMI_SetSegLimit(wSel, tail_size * sizeof(uint32_t) - 1);
+			userlist_tail = wSel :> 0;
+		}
+		else
+		{
+			/* works only when whole userlist is in one segment */
+			userlist_tail = SVGAHDA.userlist_pm16 + tail_start;
+		}
+		
 		SVGAHDA.userlist_pm16[ULF_DIRTY] = 0xFFFFFFFFUL;
 		
 		/* zero the memory, because is large than 64k, is much easier do it in PM32 */
@@ -341,6 +743,82 @@ void SVGAHDA_init()
 		
 		SVGAHDA.userlist_pm16[ULF_LOCK_UL] = 0;
 		SVGAHDA.userlist_pm16[ULF_LOCK_FIFO] = 0;
+		
+		/* device is enabled by mode set */
+		SVGAHDA_enabled = SVGAHDA.userlist_pm16 + ULF_ENABLED;
+		*SVGAHDA_enabled = 0;
+		
+		/* caps in tail are filled by SVGA_3DProbe */
+		SVGAHDA_idmapInit();
+		
+		/* directories are zeroed, pages are committed on first use */
+		if(sparse)
+		{
+			if(!VXD_ULSparse(UL_SECTION_GMR, SVGAHDA.userlist_linear + SVGAHDA_sparse.gmr_dir*sizeof(uint32_t),
+				gmr_pages, UL_GMR_PAGE_IDS) ||
+				!VXD_ULSparse(UL_SECTION_SURF, SVGAHDA.userlist_linear + SVGAHDA_sparse.surf_dir*sizeof(uint32_t),
+				surf_pages, UL_SURF_PAGE_IDS))
+			{
+				dbg_printf("SVGAHDA_init: sparse userlist not registered\n");
+			}
+		}
+		
+		/* last passed fence, updated by driver and VxD when they see it */
+		SVGAHDA.userlist_pm16[SVGAHDA.ul_fence_index] = 0;
+		gSVGAFenceMirror = SVGAHDA.userlist_pm16 + SVGAHDA.ul_fence_index;
+		VXD_FenceMirror(SVGAHDA.userlist_linear + SVGAHDA.ul_fence_index*sizeof(uint32_t));
+		
+		if(GetPrivateProfileInt("display", "async_present", 1, "system.ini"))
+		{
+			DWORD tail_linear = SVGAHDA.userlist_linear + tail_offset;
+			DWORD state = VXD_PresentStart(SVGAHDA.userlist_linear,
+				SVGAHDA.userlist_length * sizeof(uint32_t),
+				tail_linear + UL_TAIL_PENDING*sizeof(uint32_t),
+				tail_linear + UL_TAIL_OWNED*sizeof(uint32_t));
+			
+			if(state)
+			{
+				WORD wStateSel = DPMI_AllocLDTDesc(1);
+				if(wStateSel)
+				{
+					DPMI_SetSegBase(wStateSel, state);
+					DPMI_SetSegLimit(wStateSel, sizeof(uint32_t) - 1);
+					present_idle = wStateSel :> 0;
+				}
+			}
+		}
+	}
+	
+	/* VxD time-outs check it before they touch registers */
+	if(!dev_lock_shared)
+	{
+		DWORD lock = VXD_DevLock();
+		if(lock)
+		{
+			WORD wLockSel = DPMI_AllocLDTDesc(1);
+			if(wLockSel)
+			{
+				DPMI_SetSegBase(wLockSel, lock);
+				DPMI_SetSegLimit(wLockSel, sizeof(uint32_t) - 1);
+				gSVGADevBusy = wLockSel :> 0;
+				dev_lock_shared = TRUE;
+			}
+		}
+	}
+	
+	if(trace_ring == NULL)
+	{
+		DWORD ring = VXD_TraceRing();
+		if(ring)
+		{
+			WORD wRingSel = DPMI_AllocLDTDesc(1);
+			if(wRingSel)
+			{
+				DPMI_SetSegBase(wRingSel, ring);
+				DPMI_SetSegLimit(wRingSel, sizeof(trace_ring_t) - 1);
+				trace_ring = wRingSel :> 0;
+			}
+		}
 	}
 	
 	dbg_printf("SVGAHDA_init\n");
@@ -366,44 +844,101 @@ void SVGAHDA_setmode()
 	}
 }
 
+BOOL SVGAHDA_trylock(uint32_t lockid);
+
+/* number of lockers sleeping on lock */
+static volatile uint32_t __far *SVGAHDA_waiters(uint32_t lockid)
+{
+	return userlist_tail + UL_TAIL_WAITERS + lockid;
+}
+
 /**
  * Lock resource
  *
- * Note: this is simple spinlock implementation because multitasking isn't
- * preemptive in Win9x this can lead to deadlock. Please use SVGAHDA_trylock
- * instead.
+ * Lock is taken atomically in userlist, on contention the caller sleeps
+ * in VxD until the lock is released (or short time-out) and tries again.
+ * Without VxD this is a spinlock.
+ *
+ * Note: the owner may be waiting for us (Win16Mutex), so never call this
+ * from paths which user space can enter while holding the lock. Prefer
+ * SVGAHDA_trylock on GDI paths.
  *
  * Note: please call SVGAHDA_unlock every time after this function
  *
  **/
-BOOL SVGAHDA_lock(uint32_t lockid)
+static BOOL SVGAHDA_lockWait(uint32_t lockid, DWORD ms)
 {
-	volatile uint32_t __far * ptr_lock = SVGAHDA.userlist_pm16 + lockid;
+	volatile uint32_t __far * ptr_waiters;
+	BOOL locked;
+	DWORD start = 0;
 	
-	if(SVGAHDA.userlist_pm16)
+	if(SVGAHDA.userlist_pm16 == NULL)
+	{
+		return FALSE;
+	}
+	
+	ptr_waiters = SVGAHDA_waiters(lockid);
+	if(ms != 0)
+	{
+		start = VXD_GetTime();
+	}
+	
+	while(!SVGAHDA_trylock(lockid))
 	{
+		/* owner died or hangs (no time means there is no VxD and no other owner) */
+		if(ms != 0 && (start == 0 || VXD_GetTime() - start >= ms))
+		{
+			dbg_printf("SVGAHDA_lock: lock %ld taken by force\n", lockid);
+			SVGAHDA.userlist_pm16[lockid] = 1;
+			break;
+		}
+		
 		_asm
 		{
 			.386
-			push eax
 			push ebx
-			
-			spin_lock:
-				mov  eax, 1
-				les   bx, ptr_lock
-				lock xchg eax, es:[bx]
-				test eax, eax
-				jnz  spin_lock
-			
+			les  bx, ptr_waiters
+			lock inc dword ptr es:[bx]
+			pop ebx
+		};
+		
+		/* lock may be released before unlocker saw us */
+		locked = SVGAHDA_trylock(lockid);
+		if(!locked)
+		{
+			VXD_LockWait();
+		}
+		
+		_asm
+		{
+			.386
+			push ebx
+			les  bx, ptr_waiters
+			lock dec dword ptr es:[bx]
 			pop ebx
-			pop eax
-			
 		};
 		
-		return TRUE;
+		if(locked)
+		{
+			break;
+		}
 	}
 	
-	return FALSE;
+	return TRUE;
+}
+
+BOOL SVGAHDA_lock(uint32_t lockid)
+{
+	return SVGAHDA_lockWait(lockid, 0);
+}
+
+/**
+ * Same as SVGAHDA_lock, but after 'ms' of waiting the lock is taken by
+ * force, for paths which must not be skipped nor hang (mode set).
+ **/
+BOOL SVGAHDA_lockBounded(uint32_t lockid, DWORD ms)
+{
+	return SVGAHDA_lockWait(lockid, ms);
 }
 
 /**
@@ -466,25 +1001,982 @@ void SVGAHDA_unlock(uint32_t lockid)
 			pop eax
 			
 		};
+		
+		if(*SVGAHDA_waiters(lockid) != 0)
+		{
+			VXD_LockWake();
+		}
 	}
 }
 
+/* list of host owned regions, may be used only if userlist exists */
+static uint32_t __far *SVGAHDA_owned()
+{
+	return userlist_tail + UL_TAIL_OWNED;
+}
+
+/* pending update ring, may be used only if userlist exists */
+static uint32_t __far *SVGAHDA_pending()
+{
+	return userlist_tail + UL_TAIL_PENDING;
+}
+
+/* atomic store visible for user space */
+static void SVGAHDA_store(volatile uint32_t __far *ptr, uint32_t value)
+{
+	volatile uint32_t __far *ptr_store = ptr;
+	uint32_t val = value;
+	
+	_asm
+	{
+		.386
+		push eax
+		push ebx
+		
+		mov   eax, val
+		les   bx, ptr_store
+		lock xchg eax, es:[bx]
+		
+		pop ebx
+		pop eax
+	};
+}
+
 /**
- * This is called after every screen change
+ * Record event to VxD trace ring
  **/
-void SVGAHDA_update(DWORD width, DWORD height, DWORD bpp, DWORD pitch)
+void SVGA_TraceEvent(uint32 event, uint32 arg)
 {
-	if(SVGAHDA.userlist_pm16)
+	static uint32_t slot;
+	static uint32_t tsc_lo;
+	static uint32_t tsc_hi;
+	trace_ring_t __far *ring = trace_ring;
+	trace_entry_t __far *entry;
+	
+	if(ring == NULL)
 	{
-		SVGAHDA.userlist_pm16[ULF_WIDTH]  = width;
-		SVGAHDA.userlist_pm16[ULF_HEIGHT] = height;
-		SVGAHDA.userlist_pm16[ULF_BPP]    = bpp;
-		SVGAHDA.userlist_pm16[ULF_PITCH]  = pitch;
+		return;
 	}
+	
+	_asm
+	{
+		.586
+		push eax
+		push edx
+		push ebx
+		
+		mov  eax, 1
+		les   bx, ring
+		lock xadd es:[bx], eax
+		mov  [slot], eax
+		rdtsc
+		mov  [tsc_lo], eax
+		mov  [tsc_hi], edx
+		
+		pop ebx
+		pop edx
+		pop eax
+	};
+	
+	entry = &ring->entries[slot % TRACE_ENTRIES];
+	entry->tsc_lo = tsc_lo;
+	entry->tsc_hi = tsc_hi;
+	entry->event  = event | TRACE_SRC_DRIVER;
+	entry->arg    = arg;
 }
 
-#endif /* SVGA only */
-
+/**
+ * Stale areas: GDI accessed them while FIFO was busy, so owned rects there
+ * weren't read back and frame buffer is newer than host. Next locked
+ * readback reads owned rects which intersect them only outside of the
+ * stale parts (readback after access would overwrite GDI drawing). More
+ * than SVGAHDA_STALE_MAX areas are merged into the last one.
+ **/
+#define SVGAHDA_STALE_MAX 4
+
+static LONG SVGAHDA_stale[SVGAHDA_STALE_MAX][4]; /* left, top, right, bottom */
+static WORD SVGAHDA_stale_cnt = 0;
+
+/**
+ * This is called after every screen change
+ **/
+void SVGAHDA_update(DWORD width, DWORD height, DWORD bpp, DWORD pitch)
+{
+	if(SVGAHDA.userlist_pm16)
+	{
+		SVGAHDA.userlist_pm16[ULF_WIDTH]  = width;
+		SVGAHDA.userlist_pm16[ULF_HEIGHT] = height;
+		SVGAHDA.userlist_pm16[ULF_BPP]    = bpp;
+		SVGAHDA.userlist_pm16[ULF_PITCH]  = pitch;
+		
+		/* presented image belongs to old mode */
+		SVGAHDA_owned()[UL_OWNED_CNT]   = 0;
+		SVGAHDA_owned()[UL_OWNED_FENCE] = 0;
+		SVGAHDA_stale_cnt = 0;
+		
+		/* and so are pending updates */
+		SVGAHDA_pending()[UL_PENDING_TAIL] = SVGAHDA_pending()[UL_PENDING_HEAD];
+	}
+}
+
+static void SVGAHDA_rectSet(LONG *r, LONG left, LONG top, LONG right, LONG bottom)
+{
+	r[0] = left;
+	r[1] = top;
+	r[2] = right;
+	r[3] = bottom;
+}
+
+/* grow 'r' to contain 'add' */
+static void SVGAHDA_rectUnion(LONG *r, const LONG *add)
+{
+	r[0] = add[0] < r[0] ? add[0] : r[0];
+	r[1] = add[1] < r[1] ? add[1] : r[1];
+	r[2] = add[2] > r[2] ? add[2] : r[2];
+	r[3] = add[3] > r[3] ? add[3] : r[3];
+}
+
+static void SVGAHDA_staleAdd(LONG left, LONG top, LONG right, LONG bottom)
+{
+	LONG add[4];
+	
+	if(left >= right || top >= bottom)
+	{
+		return;
+	}
+	
+	SVGAHDA_rectSet(add, left, top, right, bottom);
+	if(SVGAHDA_stale_cnt < SVGAHDA_STALE_MAX)
+	{
+		_fmemcpy(SVGAHDA_stale[SVGAHDA_stale_cnt++], add, sizeof(add));
+	}
+	else
+	{
+		SVGAHDA_rectUnion(SVGAHDA_stale[SVGAHDA_STALE_MAX-1], add);
+	}
+}
+
+/*
+ * Read back owned rects which intersect stale areas without the stale part
+ * (bounding box of intersections) and drop them, return new count.
+ * FIFO must be locked.
+ */
+static uint32_t SVGAHDA_staleResolve(uint32_t __far *owned, uint32_t cnt, BOOL *sync)
+{
+	uint32_t i = 0;
+	WORD j;
+	
+	while(i < cnt && SVGAHDA_stale_cnt > 0)
+	{
+		uint32_t __far *r = owned + UL_OWNED_RECTS + i*4;
+		LONG o[4];   /* owned rect */
+		LONG box[4]; /* stale parts of it */
+		LONG pieces[4][4];
+		BOOL hit = FALSE;
+		WORD n = 0;
+		
+		SVGAHDA_rectSet(o, r[0], r[1], r[2], r[3]);
+		for(j = 0; j < SVGAHDA_stale_cnt; j++)
+		{
+			LONG *s = SVGAHDA_stale[j];
+			if(s[0] < o[2] && o[0] < s[2] && s[1] < o[3] && o[1] < s[3])
+			{
+				if(!hit)
+				{
+					_fmemcpy(box, s, sizeof(box));
+					hit = TRUE;
+				}
+				else
+				{
+					SVGAHDA_rectUnion(box, s);
+				}
+			}
+		}
+		
+		if(!hit)
+		{
+			i++;
+			continue;
+		}
+		
+		/* clip box to rect */
+		box[0] = box[0] > o[0] ? box[0] : o[0];
+		box[1] = box[1] > o[1] ? box[1] : o[1];
+		box[2] = box[2] < o[2] ? box[2] : o[2];
+		box[3] = box[3] < o[3] ? box[3] : o[3];
+		
+		/* rect minus box: bands above and below, pieces left and right */
+		if(box[1] > o[1])
+		{
+			SVGAHDA_rectSet(pieces[n++], o[0], o[1], o[2], box[1]);
+		}
+		if(o[3] > box[3])
+		{
+			SVGAHDA_rectSet(pieces[n++], o[0], box[3], o[2], o[3]);
+		}
+		if(box[0] > o[0])
+		{
+			SVGAHDA_rectSet(pieces[n++], o[0], box[1], box[0], box[3]);
+		}
+		if(o[2] > box[2])
+		{
+			SVGAHDA_rectSet(pieces[n++], box[2], box[1], o[2], box[3]);
+		}
+		
+		if(n > 0)
+		{
+			SVGA3dRect __far *rects;
+			
+			SVGA3D_BeginPresentReadback(&rects, n);
+			for(j = 0; j < n; j++)
+			{
+				rects[j].x = pieces[j][0];
+				rects[j].y = pieces[j][1];
+				rects[j].w = pieces[j][2] - pieces[j][0];
+				rects[j].h = pieces[j][3] - pieces[j][1];
+			}
+			SVGA3D_FIFOCommitAll();
+			*sync = TRUE;
+		}
+		
+		/* rect is resolved, replace it by the last one */
+		cnt--;
+		if(i != cnt)
+		{
+			_fmemcpy(r, owned + UL_OWNED_RECTS + cnt*4, 4*sizeof(uint32_t));
+		}
+	}
+	
+	SVGAHDA_stale_cnt = 0;
+	
+	return cnt;
+}
+
+/**
+ * Make frame buffer in rect valid before CPU access: wait for user space
+ * readback fence and read back host owned rects which intersects.
+ * FIFO must be locked.
+ **/
+void SVGAHDA_readbackLocked(LONG left, LONG top, LONG right, LONG bottom)
+{
+	uint32_t __far *owned;
+	uint32_t cnt;
+	uint32_t i;
+	uint32_t fence;
+	BOOL sync = FALSE;
+	
+	if(SVGAHDA.userlist_pm16 == NULL || wMesa3DEnabled == 0)
+	{
+		return;
+	}
+	
+	owned = SVGAHDA_owned();
+	
+	fence = owned[UL_OWNED_FENCE];
+	if(fence != 0)
+	{
+		if(!SVGA_HasFencePassed(fence))
+		{
+			SVGA_SyncToFence(fence);
+		}
+		owned[UL_OWNED_FENCE] = 0;
+	}
+	
+	cnt = owned[UL_OWNED_CNT];
+	if(cnt > UL_OWNED_MAX)
+	{
+		/* overflow: whole screen */
+		uint32_t __far *r = owned + UL_OWNED_RECTS;
+		r[0] = 0;
+		r[1] = 0;
+		r[2] = SVGAHDA.userlist_pm16[ULF_WIDTH];
+		r[3] = SVGAHDA.userlist_pm16[ULF_HEIGHT];
+		cnt = 1;
+	}
+	
+	/* GDI accessed some owned parts while FIFO was busy */
+	cnt = SVGAHDA_staleResolve(owned, cnt, &sync);
+	
+	for(i = 0; i < cnt;)
+	{
+		uint32_t __far *r = owned + UL_OWNED_RECTS + i*4;
+		
+		if((LONG)r[0] < right && left < (LONG)r[2] && (LONG)r[1] < bottom && top < (LONG)r[3])
+		{
+			SVGA3dRect __far *rb;
+			
+			SVGA3D_BeginPresentReadback(&rb, 1);
+			rb->x = r[0];
+			rb->y = r[1];
+			rb->w = r[2] - r[0];
+			rb->h = r[3] - r[1];
+			SVGA3D_FIFOCommitAll();
+			sync = TRUE;
+			
+			/* rect is valid now, replace it by the last one */
+			cnt--;
+			if(i != cnt)
+			{
+				_fmemcpy(r, owned + UL_OWNED_RECTS + cnt*4, 4*sizeof(uint32_t));
+			}
+		}
+		else
+		{
+			i++;
+		}
+	}
+	owned[UL_OWNED_CNT] = cnt;
+	
+	if(sync)
+	{
+		SVGA_SyncToFence(SVGA_InsertFence());
+	}
+}
+
+/**
+ * Same as SVGAHDA_readbackLocked, when FIFO is busy (user space holds it)
+ * access goes ahead and rect is remembered as stale, so it isn't read
+ * back over GDI drawing later.
+ **/
+void SVGAHDA_readback(LONG left, LONG top, LONG right, LONG bottom)
+{
+	uint32_t __far *owned;
+	
+	if(SVGAHDA.userlist_pm16 == NULL)
+	{
+		return;
+	}
+	
+	owned = SVGAHDA_owned();
+	if(owned[UL_OWNED_CNT] == 0 && owned[UL_OWNED_FENCE] == 0)
+	{
+		return;
+	}
+	
+	if(SVGAHDA_trylock(ULF_LOCK_FIFO))
+	{
+		SVGAHDA_readbackLocked(left, top, right, bottom);
+		SVGAHDA_unlock(ULF_LOCK_FIFO);
+	}
+	else
+	{
+		/* user space readback could land after the access, waiting needs no FIFO */
+		uint32_t fence = owned[UL_OWNED_FENCE];
+		if(fence != 0 && !SVGA_HasFencePassed(fence))
+		{
+			SVGA_SyncToFence(fence);
+		}
+		
+		SVGAHDA_staleAdd(left, top, right, bottom);
+	}
+}
+
+/**
+ * Insert fence under FIFO lock, 0 when FIFO is busy (user space holds it),
+ * then caller has to fence its work later or wait by SVGA_Flush, which
+ * needs no FIFO. Without userlist there is no other FIFO writer.
+ **/
+static uint32_t SVGAHDA_fenceTry()
+{
+	uint32_t fence = 0;
+	
+	if(SVGAHDA.userlist_pm16 == NULL)
+	{
+		return SVGA_InsertFence();
+	}
+	
+	if(SVGAHDA_trylock(ULF_LOCK_FIFO))
+	{
+		fence = SVGA_InsertFence();
+		SVGAHDA_unlock(ULF_LOCK_FIFO);
+	}
+	
+	return fence;
+}
+
+/**
+ * Queue screen update for FIFO lock owner, FALSE when ring is full
+ * (or doesn't exist).
+ **/
+BOOL SVGAHDA_pendingPush(LONG left, LONG top, LONG right, LONG bottom)
+{
+	volatile uint32_t __far *ring;
+	uint32_t head;
+	uint32_t __far *r;
+	
+	if(SVGAHDA.userlist_pm16 == NULL)
+	{
+		return FALSE;
+	}
+	
+	ring = SVGAHDA_pending();
+	head = ring[UL_PENDING_HEAD];
+	if(head - ring[UL_PENDING_TAIL] >= UL_PENDING_MAX)
+	{
+		return FALSE;
+	}
+	
+	r = (uint32_t __far *)ring + UL_PENDING_RECTS + (head % UL_PENDING_MAX)*4;
+	r[0] = left;
+	r[1] = top;
+	r[2] = right;
+	r[3] = bottom;
+	
+	/* publish rect */
+	SVGAHDA_store(ring + UL_PENDING_HEAD, head + 1);
+	
+	return TRUE;
+}
+
+/**
+ * Queue screen update for VxD present worker, FALSE when it isn't running,
+ * 3D owns some part of screen (readback is needed) or the ring is full.
+ **/
+BOOL SVGAHDA_presentPush(LONG left, LONG top, LONG right, LONG bottom)
+{
+	uint32_t __far *owned;
+	
+	if(present_idle == NULL)
+	{
+		return FALSE;
+	}
+	
+	owned = SVGAHDA_owned();
+	if(owned[UL_OWNED_CNT] != 0 || owned[UL_OWNED_FENCE] != 0)
+	{
+		return FALSE;
+	}
+	
+	if(!SVGAHDA_pendingPush(left, top, right, bottom))
+	{
+		return FALSE;
+	}
+	
+	/* head was published by locked xchg, so now idle can be read */
+	if(*present_idle)
+	{
+		SVGAHDA_store(present_idle, 0);
+		VXD_PresentKick();
+	}
+	
+	return TRUE;
+}
+
+/**
+ * Send pending updates which the user space didn't process,
+ * FIFO must be locked.
+ **/
+void SVGAHDA_pendingDrainLocked()
+{
+	volatile uint32_t __far *ring;
+	uint32_t tail;
+	uint32_t head;
+	
+	if(SVGAHDA.userlist_pm16 == NULL)
+	{
+		return;
+	}
+	
+	ring = SVGAHDA_pending();
+	head = ring[UL_PENDING_HEAD];
+	tail = ring[UL_PENDING_TAIL];
+	
+	if(head == tail)
+	{
+		return;
+	}
+	
+	for(; tail != head; tail++)
+	{
+		uint32_t __far *r = (uint32_t __far *)ring + UL_PENDING_RECTS + (tail % UL_PENDING_MAX)*4;
+		
+		SVGAHDA_readbackLocked(r[0], r[1], r[2], r[3]);
+		SVGA_Update(r[0], r[1], r[2] - r[0], r[3] - r[1]);
+	}
+	
+	SVGAHDA_store(ring + UL_PENDING_TAIL, tail);
+}
+
+/**
+ * Deferred region destruction: freed region is unbound and its pages
+ * are released when all commands submitted before free are processed
+ * (fence passed). Queue is checked lazily on next region calls. Fence 0
+ * means the FIFO was busy on free, entry is fenced on next pass.
+ **/
+#define REGION_DEFER_MAX 32
+
+typedef struct _region_defer_t
+{
+	uint32_t id;
+	uint32_t linear;
+	uint32_t pgblk;
+	uint32_t fence;
+} region_defer_t;
+
+static region_defer_t region_defer[REGION_DEFER_MAX];
+static WORD region_defer_cnt = 0;
+
+static void region_release(WORD i)
+{
+	SVGA_WriteReg(SVGA_REG_GMR_ID, region_defer[i].id);
+	SVGA_WriteReg(SVGA_REG_GMR_DESCRIPTOR, 0);
+	
+	VXD_FreeRegion(region_defer[i].linear, region_defer[i].pgblk);
+	
+	region_defer_cnt--;
+	for(; i < region_defer_cnt; i++)
+	{
+		region_defer[i] = region_defer[i+1];
+	}
+}
+
+/* wait until host processed everything submitted before entry was freed */
+static void region_wait(WORD i)
+{
+	if(region_defer[i].fence == 0)
+	{
+		SVGA_Flush();
+	}
+	else
+	{
+		SVGA_SyncToFence(region_defer[i].fence);
+	}
+}
+
+/* release all regions with passed fence, if 'id' is in queue, wait for it */
+static void region_reap(uint32_t id)
+{
+	WORD i = 0;
+	
+	while(i < region_defer_cnt)
+	{
+		if(region_defer[i].fence == 0)
+		{
+			region_defer[i].fence = SVGAHDA_fenceTry();
+		}
+		
+		if(region_defer[i].id == id)
+		{
+			region_wait(i);
+			region_release(i);
+		}
+		else if(region_defer[i].fence != 0 && SVGA_HasFencePassed(region_defer[i].fence))
+		{
+			region_release(i);
+		}
+		else
+		{
+			i++;
+		}
+	}
+}
+
+static void region_defer_free(uint32_t id, uint32_t linear, uint32_t pgblk)
+{
+	/* queue full: wait for the oldest */
+	if(region_defer_cnt == REGION_DEFER_MAX)
+	{
+		region_wait(0);
+		region_release(0);
+	}
+	
+	region_defer[region_defer_cnt].id     = id;
+	region_defer[region_defer_cnt].linear = linear;
+	region_defer[region_defer_cnt].pgblk  = pgblk;
+	region_defer[region_defer_cnt].fence  = SVGAHDA_fenceTry();
+	region_defer_cnt++;
+}
+
+/* allocate region and bind it to GMR id, output: id, linear, pgblk (zeros on failure), caller must flush */
+static void region_create(uint32_t rid, uint32_t pages, uint32_t __far *lpOut)
+{
+	uint32_t lAddr;
+	uint32_t ppn;
+	uint32_t pgblk;
+	
+	/* release finished regions, rid may be still waiting in queue */
+	region_reap(rid);
+	
+	if(VXD_CreateRegion(pages, &lAddr, &ppn, &pgblk)) /* allocate physical memory */
+	{
+		dbg_printf("Region address = %lX, PPN = %lX, GMRBLK = %lX\n", lAddr, ppn, pgblk);
+		
+		SVGA_WriteReg(SVGA_REG_GMR_ID, rid);
+		SVGA_WriteReg(SVGA_REG_GMR_DESCRIPTOR, ppn);
+		
+		lpOut[0] = rid;
+		lpOut[1] = lAddr;
+		lpOut[2] = pgblk;
+	}
+	else
+	{
+		lpOut[0] = 0;
+		lpOut[1] = 0;
+		lpOut[2] = 0;
+	}
+}
+
+/**
+ * Staging ring: persistent regions from VxD for streaming uploads. User
+ * space acquires the next buffer, fills it, submits DMA from it and
+ * releases it. Release inserts fence and the buffer is given out again
+ * only when the fence passed, so filling of the next buffer overlaps
+ * with host DMA from the previous one. GMR ids are taken from top of
+ * the GMR space, below the id used by guest image blits.
+ **/
+typedef struct _staging_t
+{
+	uint32_t id;
+	uint32_t linear;
+	uint32_t size;
+	uint32_t fence;
+	BOOL     unfenced; /* released while FIFO was busy */
+} staging_t;
+
+static staging_t staging[STAGING_MAX];
+static WORD staging_cnt  = 0;
+static WORD staging_next = 0;
+static BOOL staging_init_done = FALSE;
+
+static void staging_init()
+{
+	uint32_t maxid = SVGA_ReadRegCached(SVGA_REG_GMR_MAX_IDS);
+	DWORD lAddr;
+	DWORD ppn;
+	DWORD pages;
+	
+	staging_init_done = TRUE;
+	
+	while(staging_cnt < STAGING_MAX && maxid >= staging_cnt + 3)
+	{
+		if(!VXD_GetStaging(staging_cnt, &lAddr, &ppn, &pages))
+		{
+			break;
+		}
+		
+		staging[staging_cnt].id     = maxid - 2 - staging_cnt;
+		staging[staging_cnt].linear = lAddr;
+		staging[staging_cnt].size   = pages * 4096UL;
+		staging[staging_cnt].fence  = 0;
+		staging[staging_cnt].unfenced = FALSE;
+		
+		SVGA_WriteReg(SVGA_REG_GMR_ID, staging[staging_cnt].id);
+		SVGA_WriteReg(SVGA_REG_GMR_DESCRIPTOR, ppn);
+		
+		staging_cnt++;
+	}
+	
+	if(staging_cnt)
+	{
+		SVGA_Flush();
+	}
+}
+
+/* next free staging buffer, output: id, linear, size (zeros when there is no staging) */
+static void staging_acquire(uint32_t __far *lpOut)
+{
+	staging_t *st;
+	
+	if(!staging_init_done)
+	{
+		staging_init();
+	}
+	
+	if(staging_cnt == 0)
+	{
+		lpOut[0] = 0;
+		lpOut[1] = 0;
+		lpOut[2] = 0;
+		return;
+	}
+	
+	st = &staging[staging_next];
+	staging_next = (staging_next + 1) % staging_cnt;
+	
+	/* host may still read from it */
+	if(st->unfenced)
+	{
+		st->fence = SVGAHDA_fenceTry();
+		if(st->fence == 0)
+		{
+			SVGA_Flush();
+		}
+	}
+	
+	if(st->fence != 0 && !SVGA_HasFencePassed(st->fence))
+	{
+		SVGA_SyncToFence(st->fence);
+	}
+	st->fence = 0;
+	st->unfenced = FALSE;
+	
+	lpOut[0] = st->id;
+	lpOut[1] = st->linear;
+	lpOut[2] = st->size;
+}
+
+/* all commands using buffer 'id' are submitted */
+static void staging_release(uint32_t id)
+{
+	WORD i;
+	
+	for(i = 0; i < staging_cnt; i++)
+	{
+		if(staging[i].id == id)
+		{
+			/* fenced on acquire when FIFO is busy now */
+			staging[i].fence    = SVGAHDA_fenceTry();
+			staging[i].unfenced = staging[i].fence == 0;
+			break;
+		}
+	}
+}
+
+/**
+ * FBHDA back buffers: software renderers (Mesa softpipe/llvmpipe, Glide
+ * wrappers) render to their own GMR backed buffer (32 bpp, screen size,
+ * one per task) instead of visible frame buffer and FBHDA_PRESENT sends
+ * dirty rects by SVGA_CMD_BLIT_GMRFB_TO_SCREEN, so there is no tearing and
+ * no copy on guest side. Present returns after host read the rects, next
+ * frame can be rendered to the buffer right away. GMR ids are below the
+ * staging ring, buffers of exited tasks are freed when slot is needed.
+ **/
+#define BACK_BLITS   16
+
+typedef struct _back_t
+{
+	HTASK    task;
+	uint32_t id;
+	uint32_t linear;
+	uint32_t pgblk;
+	uint32_t pitch;
+	uint32_t width;
+	uint32_t height;
+} back_t;
+
+static back_t backs[BACK_MAX];
+
+static BOOL back_possible()
+{
+	return SVGA_CanBlitOffscreen() && (gSVGA.capabilities & SVGA_CAP_GMR) != 0 &&
+		SVGA_ReadRegCached(SVGA_REG_GMR_MAX_IDS) >= GMR_DRV_IDS + 1;
+}
+
+static void back_free(back_t *b)
+{
+	if(b->linear != 0)
+	{
+		/* unbind and delete after host finished reading */
+		region_defer_free(b->id, b->linear, b->pgblk);
+		region_reap(0);
+	}
+	b->task   = NULL;
+	b->linear = 0;
+}
+
+static back_t *back_find(HTASK task)
+{
+	WORD i;
+	
+	for(i = 0; i < BACK_MAX; i++)
+	{
+		if(backs[i].linear != 0 && backs[i].task == task)
+		{
+			return &backs[i];
+		}
+	}
+	
+	return NULL;
+}
+
+/* back buffer of task (allocated on first call), output: linear, pitch, width, height (zeros on failure) */
+static void back_get(HTASK task, uint32_t __far *lpOut)
+{
+	back_t *b;
+	WORD i;
+	
+	lpOut[0] = 0;
+	lpOut[1] = 0;
+	lpOut[2] = 0;
+	lpOut[3] = 0;
+	
+	if(!back_possible())
+	{
+		return;
+	}
+	
+	b = back_find(task);
+	if(b != NULL && (b->width != wScrX || b->height != wScrY))
+	{
+		/* mode was changed */
+		back_free(b);
+	}
+	
+	for(i = 0; b == NULL && i < BACK_MAX; i++)
+	{
+		if(backs[i].linear == 0 || !IsTask(backs[i].task))
+		{
+			b = &backs[i];
+			back_free(b);
+		}
+	}
+	
+	if(b == NULL)
+	{
+		return;
+	}
+	
+	if(b->linear == 0)
+	{
+		uint32_t maxid = SVGA_ReadRegCached(SVGA_REG_GMR_MAX_IDS);
+		uint32_t pitch = (uint32_t)wScrX * 4;
+		uint32_t region[3];
+		
+		region_create(maxid - BACK_GMR_TOP - 1 - (b - backs), (pitch * wScrY + 4095) / 4096, region);
+		if(region[0] == 0)
+		{
+			return;
+		}
+		SVGA_Flush();
+		
+		b->task   = task;
+		b->id     = region[0];
+		b->linear = region[1];
+		b->pgblk  = region[2];
+		b->pitch  = pitch;
+		b->width  = wScrX;
+		b->height = wScrY;
+	}
+	
+	lpOut[0] = b->linear;
+	lpOut[1] = b->pitch;
+	lpOut[2] = b->width;
+	lpOut[3] = b->height;
+}
+
+static void back_release(HTASK task)
+{
+	back_t *b = back_find(task);
+	
+	if(b != NULL)
+	{
+		back_free(b);
+	}
+}
+
+/* input: uint32_t count + count*RECT in screen coordinates, FALSE when count doesn't fit */
+static BOOL back_present(HTASK task, uint32_t __far *lpIn)
+{
+	back_t *b = back_find(task);
+	uint32_t cnt = lpIn[0];
+	longRECT __far *lpRECT = (longRECT __far *)(lpIn + 1);
+	svga_blit_t blits[BACK_BLITS];
+	WORD n = 0;
+	DWORD fence = 0;
+	LONG w, h;
+	uint32_t i;
+	
+	if(b == NULL || cnt > esc_fit(lpIn, sizeof(uint32_t), sizeof(longRECT)))
+	{
+		return FALSE;
+	}
+	
+	w = b->width  < wScrX ? b->width  : wScrX;
+	h = b->height < wScrY ? b->height : wScrY;
+	
+	for(i = 0; i < cnt; i++, lpRECT++)
+	{
+		LONG left   = lpRECT->left   > 0 ? lpRECT->left   : 0;
+		LONG top    = lpRECT->top    > 0 ? lpRECT->top    : 0;
+		LONG right  = lpRECT->right  < w ? lpRECT->right  : w;
+		LONG bottom = lpRECT->bottom < h ? lpRECT->bottom : h;
+		
+		if(left < right && top < bottom)
+		{
+			blits[n].sx = blits[n].dx = (WORD)left;
+			blits[n].sy = blits[n].dy = (WORD)top;
+			blits[n].w  = (WORD)(right - left);
+			blits[n].h  = (WORD)(bottom - top);
+			n++;
+		}
+		
+		if(n == BACK_BLITS || (n > 0 && i + 1 == cnt))
+		{
+			fence = SVGA_BlitGMR(b->id, b->pitch, blits, n);
+			if(fence == 0)
+			{
+				return FALSE;
+			}
+			n = 0;
+		}
+	}
+	
+	/* client writes next frame to the buffer */
+	if(fence != 0 && !SVGA_HasFencePassed(fence))
+	{
+		SVGA_SyncToFence(fence);
+	}
+	
+	return TRUE;
+}
+
+/*
+ * Tasks which opted out of present pacing (FBHDA_PACING), their
+ * FBHDA_UPDATE is flushed immediately. Handles of exited tasks are
+ * dropped when the slot is needed.
+ */
+#define PACING_OPTOUT_MAX 8
+
+static HTASK pacing_tasks[PACING_OPTOUT_MAX];
+
+static BOOL pacing_optout(HTASK task)
+{
+	WORD i;
+	
+	for(i = 0; i < PACING_OPTOUT_MAX; i++)
+	{
+		if(pacing_tasks[i] == task)
+		{
+			return TRUE;
+		}
+	}
+	
+	return FALSE;
+}
+
+static void pacing_set(HTASK task, BOOL paced)
+{
+	WORD i;
+	
+	for(i = 0; i < PACING_OPTOUT_MAX; i++)
+	{
+		if(pacing_tasks[i] == task)
+		{
+			if(paced)
+			{
+				pacing_tasks[i] = NULL;
+			}
+			return;
+		}
+	}
+	
+	if(paced)
+	{
+		return;
+	}
+	
+	for(i = 0; i < PACING_OPTOUT_MAX; i++)
+	{
+		if(pacing_tasks[i] == NULL || !IsTask(pacing_tasks[i]))
+		{
+			pacing_tasks[i] = task;
+			return;
+		}
+	}
+}
+
+#endif /* SVGA only */
+
 /**
  * 2022:
  * Control now serve system QUERYESCSUPPORT (0x8), OPENGL_ICD_DRIVER (0x1101),
@@ -516,6 +2008,10 @@ LONG WINAPI __loadds Control(LPVOID lpDevice, UINT function,
 	
 	dbg_printf("Control (16bit): %d (0x%x)\n", function, function);
 	
+#ifdef SVGA
+	SVGA_TraceEvent(TRACE_ESCAPE_ENTER, function);
+#endif
+	
   if(function == QUERYESCSUPPORT)
   {
   	WORD function_code = 0;
@@ -525,7 +2021,9 @@ LONG WINAPI __loadds Control(LPVOID lpDevice, UINT function,
   		case OPENGL_GETINFO:
   		case FBHDA_REQ:
   		case FBHDA_UPDATE:
+  		case FBHDA_UPDATE_RECTS:
 #ifdef SVGA
+  		case FBHDA_PACING:
   		case SVGA_API:	
   		/*
   		 * allow read HW registry/fifo registry and caps even if 3D is 
@@ -534,21 +2032,65 @@ LONG WINAPI __loadds Control(LPVOID lpDevice, UINT function,
   		case SVGA_HWINFO_REGS:
   		case SVGA_HWINFO_FIFO:
   		case SVGA_HWINFO_CAPS:
+  		case SVGA_PERF_COUNTERS:
 #endif
   			rc = 1;
   			break;
+  		case FBHDA_FLIP:
+  		case FBHDA_FLIP_STATUS:
+  			if(CanSetDisplayStart())
+  			{
+  				rc = 1;
+  			}
+  			break;
 #ifdef SVGA
   		case SVGA_READ_REG:
   		case SVGA_HDA_REQ:
+  		case SVGA_HDA_SPARSE:
   		case SVGA_REGION_CREATE:
   		case SVGA_REGION_FREE:
+  		case SVGA_REGION_CREATE_BATCH:
+  		case SVGA_REGION_FREE_BATCH:
+  		case SVGA_STAGING_ACQUIRE:
+  		case SVGA_STAGING_RELEASE:
   		case SVGA_SYNC:
 			case SVGA_RING:
+  			SVGA_3DProbe();
   			if(wMesa3DEnabled)
   			{
   				rc = 1;
   			}
   			break;
+  		case FBHDA_BACKBUFFER:
+  		case FBHDA_PRESENT:
+  			if(back_possible())
+  			{
+  				rc = 1;
+  			}
+  			break;
+  		case SVGA_DDBLT:
+  		case SVGA_DDBLT_STATUS:
+  			if(CanAccelDDBlt())
+  			{
+  				rc = 1;
+  			}
+  			break;
+  		case SVGA_DDLOCK:
+  		case SVGA_DDUNLOCK:
+  			rc = 1;
+  			break;
+  		case SVGA_OVERLAY:
+  		case SVGA_OVERLAY_POSITION:
+  			if(CanOverlay())
+  			{
+  				rc = 1;
+  			}
+  			break;
+# ifdef SCREENTARGET
+  		case SVGA_SCREENTARGET:
+  			rc = 1;
+  			break;
+# endif
 #endif
   		case DCICOMMAND:
   			rc = DD_HAL_VERSION;
@@ -565,6 +2107,7 @@ LONG WINAPI __loadds Control(LPVOID lpDevice, UINT function,
   else if(function == OPENGL_GETINFO) /* input: NULL, output: opengl_icd_t */
   {
 #ifdef SVGA  	
+  	SVGA_3DProbe();
   	if(wMesa3DEnabled == 0)
   	{
   		_fmemcpy(lpOutput, &software_icd, OPENGL_ICD_SIZE); /* no 3D use software OPENGL */
@@ -672,7 +2215,79 @@ LONG WINAPI __loadds Control(LPVOID lpDevice, UINT function,
 #ifdef SVGA
 		longRECT __far *lpRECT = lpInput;
 		SVGA_UpdateRect(lpRECT->left, lpRECT->top, lpRECT->right - lpRECT->left, lpRECT->bottom - lpRECT->top);
+		/* application requested update explicitly, don't wait for next tick */
+		if(pacing_optout(GetCurrentTask()) || SVGA_UpdatePace())
+		{
+			SVGA_UpdateFlush();
+		}
+#else
+		longRECT __far *lpRECT = lpInput;
+		VBVA_UpdateRect(lpRECT->left, lpRECT->top, lpRECT->right - lpRECT->left, lpRECT->bottom - lpRECT->top);
+		VBVA_UpdateFlush();
+#endif
+  }
+  else if(function == FBHDA_UPDATE_RECTS) /* input: uint32_t count + count*RECT, output: NULL, rc = 0 when count doesn't fit */
+  {
+  	uint32_t cnt = *((uint32_t __far *)lpInput);
+  	longRECT __far *lpRECT = (longRECT __far *)(((uint32_t __far *)lpInput) + 1);
+  	uint32_t i;
+  	
+  	if(cnt > esc_fit(lpInput, sizeof(uint32_t), sizeof(longRECT)))
+  	{
+  		rc = 0;
+  	}
+  	else
+  	{
+  		for(i = 0; i < cnt; i++, lpRECT++)
+  		{
+#ifdef SVGA
+  			SVGA_UpdateRect(lpRECT->left, lpRECT->top, lpRECT->right - lpRECT->left, lpRECT->bottom - lpRECT->top);
+#else
+  			VBVA_UpdateRect(lpRECT->left, lpRECT->top, lpRECT->right - lpRECT->left, lpRECT->bottom - lpRECT->top);
+#endif
+  		}
+  		
+  		/* one flush for all rects, damage accumulator merges them */
+#ifdef SVGA
+  		if(pacing_optout(GetCurrentTask()) || SVGA_UpdatePace())
+  		{
+  			SVGA_UpdateFlush();
+  		}
+#else
+  		VBVA_UpdateFlush();
+#endif
+  		rc = 1;
+  	}
+  }
+#ifdef SVGA
+  else if(function == FBHDA_PACING) /* input: uint32, output: NULL */
+  {
+  	pacing_set(GetCurrentTask(), *((uint32_t __far *)lpInput) != 0);
+  	rc = 1;
+  }
 #endif
+  else if(function == FBHDA_FLIP) /* input: uint32 (linear address of new front buffer), output: uint32 */
+  {
+  	DWORD addr = *((DWORD __far *)lpInput);
+  	DWORD done = 0;
+  	
+  	if(addr >= dwScreenFlatAddr)
+  	{
+  		done = SetDisplayStart(addr - dwScreenFlatAddr);
+  	}
+  	
+  	if(lpOutput)
+  	{
+  		*((DWORD __far *)lpOutput) = done;
+  	}
+  	
+  	rc = 1;
+  }
+  else if(function == FBHDA_FLIP_STATUS) /* input: NULL, output: uint32 (1 = flip done, 0 = in progress) */
+  {
+  	*((DWORD __far *)lpOutput) = IsDisplayStartDone();
+  	
+  	rc = 1;
   }
 #ifdef SVGA
   else if(function == SVGA_READ_REG) /* input: uint32_t, output: uint32_t */
@@ -690,7 +2305,8 @@ LONG WINAPI __loadds Control(LPVOID lpDevice, UINT function,
   	}
   	else
   	{
-  		val = SVGA_ReadReg(regname);
+  		/* constant and mode registers are served from shadow */
+  		val = SVGA_ReadRegCached(regname);
   	}
   	
   	*((unsigned long __far *)lpOutput) = val;
@@ -700,47 +2316,76 @@ LONG WINAPI __loadds Control(LPVOID lpDevice, UINT function,
   else if(function == SVGA_HDA_REQ) /* input: NULL, output: svga_hda_t  */
   {
   	svga_hda_t __far *lpHDA  = lpOutput;
+  	SVGA_3DProbe(); /* user space reads caps from userlist tail */
   	_fmemcpy(lpHDA, &SVGAHDA, sizeof(svga_hda_t));
   	rc = 1;
   }
+  else if(function == SVGA_HDA_SPARSE) /* input: NULL, output: svga_hda_sparse_t, rc = 0 when userlist is flat */
+  {
+  	if(SVGAHDA_sparse.gmr_page_ids != 0)
+  	{
+  		_fmemcpy(lpOutput, &SVGAHDA_sparse, sizeof(svga_hda_sparse_t));
+  		rc = 1;
+  	}
+  	else
+  	{
+  		rc = 0;
+  	}
+  }
   else if(function == SVGA_REGION_CREATE) /* input: 2*uint32_t, output: 2*uint32_t */
   {
   	uint32_t __far *lpIn  = lpInput;
   	uint32_t __far *lpOut = lpOutput;
   	uint32_t rid = lpIn[0];
   	
-  	dbg_printf("Region id = %ld, max desc = %ld\n", rid, SVGA_ReadReg(SVGA_REG_GMR_MAX_DESCRIPTOR_LENGTH));	
+  	dbg_printf("Region id = %ld, max desc = %ld\n", rid, SVGA_ReadRegCached(SVGA_REG_GMR_MAX_DESCRIPTOR_LENGTH));	
   	
 	  if(rid)
 	  {
-	  	uint32_t lAddr;
-	  	uint32_t ppn;
-	  	uint32_t pgblk;
+	  	region_create(rid, lpIn[1], lpOut);
 	  	
-	  	if(VXD_CreateRegion(lpIn[1], &lAddr, &ppn, &pgblk)) /* allocate physical memory */
-	  	{
-	  		dbg_printf("Region address = %lX, PPN = %lX, GMRBLK = %lX\n", lAddr, ppn, pgblk);
-	  		
-		    SVGA_WriteReg(SVGA_REG_GMR_ID, rid);
-		    SVGA_WriteReg(SVGA_REG_GMR_DESCRIPTOR, ppn);
-		    
-		    /* refresh all register, so make sure that new commands will accepts this region */
-		    SVGA_Flush();
-		    
-		    lpOut[0] = rid;
-		    lpOut[1] = lAddr;
-		    lpOut[2] = pgblk;
-	  	}
-	  	else
-	  	{
-	  		lpOut[0] = 0;
-	  		lpOut[1] = 0;
-	  		lpOut[2] = 0;
-	  	}
+	  	/* refresh all register, so make sure that new commands will accepts this region */
+	  	SVGA_Flush();
 	  }
 	  
 	  rc = 1;
   }
+  else if(function == SVGA_REGION_CREATE_BATCH) /* input: uint32_t count + count*2*uint32_t, output: count*3*uint32_t, rc = 0 when count doesn't fit */
+  {
+  	uint32_t __far *lpIn  = lpInput;
+  	uint32_t __far *lpOut = lpOutput;
+  	uint32_t cnt = lpIn[0];
+  	uint32_t i;
+  	
+  	if(cnt > esc_fit(lpIn, sizeof(uint32_t), 2*sizeof(uint32_t)) ||
+  		cnt > esc_fit(lpOut, 0, 3*sizeof(uint32_t)))
+  	{
+  		rc = 0;
+  	}
+  	else
+  	{
+  		for(i = 0; i < cnt; i++)
+  		{
+  			uint32_t __far *lpReq = lpIn + 1 + i*2;
+  			
+  			if(lpReq[0])
+  			{
+  				region_create(lpReq[0], lpReq[1], lpOut + i*3);
+  			}
+  			else
+  			{
+  				lpOut[i*3 + 0] = 0;
+  				lpOut[i*3 + 1] = 0;
+  				lpOut[i*3 + 2] = 0;
+  			}
+  		}
+  		
+  		/* one flush for all regions */
+  		SVGA_Flush();
+  		
+  		rc = 1;
+  	}
+  }
   else if(function == SVGA_REGION_FREE) /* input: 2*uint32_t, output: NULL */
   {
   	uint32_t __far *lpin = lpInput;
@@ -748,20 +2393,62 @@ LONG WINAPI __loadds Control(LPVOID lpDevice, UINT function,
     uint32_t linear = lpin[1];
     uint32_t pgblk  = lpin[2];
     
-    /* flush all register inc. fifo so make sure, that all commands are processed */
-    SVGA_Flush();
-    
-    SVGA_WriteReg(SVGA_REG_GMR_ID, id);
-    SVGA_WriteReg(SVGA_REG_GMR_DESCRIPTOR, 0);
-    
-    /* sync again */
-    SVGA_Flush();
-    
-    /* region physical delete */
-    VXD_FreeRegion(linear, pgblk);
+    /* unbind and delete after all commands already in FIFO are done */
+    region_defer_free(id, linear, pgblk);
+    region_reap(0);
     
     rc = 1;
   }
+  else if(function == SVGA_REGION_FREE_BATCH) /* input: uint32_t count + count*3*uint32_t, output: NULL, rc = 0 when count doesn't fit */
+  {
+  	uint32_t __far *lpIn = lpInput;
+  	uint32_t cnt = lpIn[0];
+  	uint32_t i;
+  	
+  	if(cnt > esc_fit(lpIn, sizeof(uint32_t), 3*sizeof(uint32_t)))
+  	{
+  		rc = 0;
+  	}
+  	else
+  	{
+  		for(i = 0; i < cnt; i++)
+  		{
+  			uint32_t __far *lpReq = lpIn + 1 + i*3;
+  			region_defer_free(lpReq[0], lpReq[1], lpReq[2]);
+  		}
+  		region_reap(0);
+  		
+  		rc = 1;
+  	}
+  }
+  else if(function == SVGA_STAGING_ACQUIRE) /* input: NULL, output: 3*uint32_t */
+  {
+  	staging_acquire(lpOutput);
+  	rc = 1;
+  }
+  else if(function == SVGA_STAGING_RELEASE) /* input: uint32_t, output: NULL */
+  {
+  	uint32_t __far *lpIn = lpInput;
+  	staging_release(lpIn[0]);
+  	rc = 1;
+  }
+  else if(function == FBHDA_BACKBUFFER) /* input: uint32_t (1 = get, 0 = free), output: 4*uint32_t */
+  {
+  	uint32_t __far *lpIn = lpInput;
+  	if(lpIn[0])
+  	{
+  		back_get(GetCurrentTask(), lpOutput);
+  	}
+  	else
+  	{
+  		back_release(GetCurrentTask());
+  	}
+  	rc = 1;
+  }
+  else if(function == FBHDA_PRESENT) /* input: uint32_t count + count*RECT, output: NULL */
+  {
+  	rc = back_present(GetCurrentTask(), lpInput) ? 1 : 0;
+  }
   else if(function == SVGA_HWINFO_REGS) /* input: NULL, output: 256*uint32_t */
   {
   	int i;
@@ -789,67 +2476,158 @@ LONG WINAPI __loadds Control(LPVOID lpDevice, UINT function,
   }
   else if(function == SVGA_HWINFO_CAPS) /* input: NULL, output: 512*uint32_t */
   {
-  	int i;
-  	uint32_t         __far *lpreg = lpOutput;
-    SVGA3dCapsRecord __far *pCaps;
-    SVGA3dCapPair    __far *pData;
-    
-    
-    if (gSVGA.capabilities & SVGA_CAP_GBOBJECTS)
-    {
-    	/* new way to read device CAPS */
-			for (i = 0; i < 512; i++)
-			{
-				SVGA_WriteReg(SVGA_REG_DEV_CAP, i);
-				lpreg[i] = FixDevCap(i, SVGA_ReadReg(SVGA_REG_DEV_CAP));
-				dbg_printf("VMSVGA3d_3: cap[%d]=0x%lX\n", i, lpreg[i]);
-			}
-		}
-    else
-    {
-	    /* old way to read device CAPS */
-	    pCaps = (SVGA3dCapsRecord  __far *)&(gSVGA.fifoMem[SVGA_FIFO_3D_CAPS]);
-	    
-	    while(pCaps->header.length != 0)
-	    {
-	    	dbg_printf("SVGA_FIFO_3D_CAPS: %ld, %ld\n", pCaps->header.type, pCaps->header.length);
-		    if(pCaps->header.type == SVGA3DCAPS_RECORD_DEVCAPS)
-		    {
-		    	uint32_t datalen = (pCaps->header.length - 2)/2;
-		    	pData = (SVGA3dCapPair __far *)(&pCaps->data);
-		  		for(i = 0; i < datalen; i++)
-		  		{
-		  			uint32_t id  = pData[i][0];
-		  			uint32_t val = pData[i][1];
-		  			
-		  			if(id < 512)
-		  			{
-		  				lpreg[id] = FixDevCap(id, val);
-		  			}
-		  			
-		  			dbg_printf("VMSVGA3d_2: cap[%ld]=0x%lX\n", id, val);
-		  		}
-		  	}
-		  	dbg_printf("SVGA_FIFO_3D_CAPS: end\n");
-		  	
-		  	pCaps = (SVGA3dCapsRecord __far *)((uint32_t __far *)pCaps + pCaps->header.length);
-		  }
-		}
+  	SVGA_3DProbe(); /* make sure that table is built */
+  	_fmemcpy(lpOutput, devcap_table, sizeof(devcap_table));
+  	
+  	rc = 1;
+  }
+  else if(function == SVGA_PERF_COUNTERS) /* input: NULL or uint32_t flags, output: NULL or SVGAPerfCounters */
+  {
+  	uint32_t __far *lpFlags = lpInput;
+  	
+  	if(lpOutput != NULL)
+  	{
+  		_fmemcpy(lpOutput, &gSVGAPerf, sizeof(SVGAPerfCounters));
+  	}
+  	
+  	if(lpFlags != NULL && (lpFlags[0] & SVGA_PERF_RESET))
+  	{
+  		uint32_t path = gSVGAPerf.presentPath;
+  		uint32_t fifo = gSVGAPerf.fifoCost;
+  		uint32_t cb   = gSVGAPerf.cbCost;
+  		
+  		_fmemset(&gSVGAPerf, 0, sizeof(SVGAPerfCounters));
+  		gSVGAPerf.presentPath = path;
+  		gSVGAPerf.fifoCost    = fifo;
+  		gSVGAPerf.cbCost      = cb;
+  	}
   	
   	rc = 1;
   }
   else if(function == SVGA_SYNC) /* input: NULL, output: NULL */
   {
 		SVGA_Flush();
+		region_reap(0);
 		
 		rc = 1;
   }
   else if(function == SVGA_RING) /* input: NULL, output: NULL */
   {
-		SVGA_WriteReg(SVGA_REG_SYNC, 1);
+		SVGA_RingDoorbell();
 		
 		rc = 1;
   }
+  else if(function == SVGA_DDBLT) /* input: svga_ddblt_t, output: uint32_t (fence, 0 = not accelerated) */
+  {
+  	svga_ddblt_t __far *blt = lpInput;
+  	DWORD fence = 0;
+  	LONG w = blt->dstRect.right - blt->dstRect.left;
+  	LONG h = blt->dstRect.bottom - blt->dstRect.top;
+  	
+  	if(blt->dst >= dwScreenFlatAddr && blt->dst - dwScreenFlatAddr < dwVideoMemorySize)
+  	{
+  		if(blt->op == SVGA_DDBLT_FILL)
+  		{
+  			fence = SVGA_DDFill(blt->dst - dwScreenFlatAddr, blt->dstPitch,
+  				blt->dstRect.left, blt->dstRect.top, w, h, blt->color);
+  		}
+  		else if(blt->op == SVGA_DDBLT_COPY && blt->src >= dwScreenFlatAddr)
+  		{
+  			fence = SVGA_DDCopy(blt->src - dwScreenFlatAddr, blt->srcPitch, blt->srcX, blt->srcY,
+  				blt->dst - dwScreenFlatAddr, blt->dstPitch, blt->dstRect.left, blt->dstRect.top, w, h);
+  		}
+  	}
+  	
+  	*((uint32_t __far *)lpOutput) = fence;
+  	
+  	rc = 1;
+  }
+  else if(function == SVGA_OVERLAY) /* input: svga_overlay_t, output: uint32_t (1 = shown by host) */
+  {
+  	BOOL done = SVGA_OverlayUpdate((svga_overlay_t __far *)lpInput);
+  	
+  	*((uint32_t __far *)lpOutput) = done ? 1 : 0;
+  	
+  	rc = 1;
+  }
+  else if(function == SVGA_OVERLAY_POSITION) /* input: 3*uint32_t (stream, x, y), output: uint32_t (1 = moved) */
+  {
+  	uint32_t __far *lpIn = lpInput;
+  	BOOL done = SVGA_OverlayPosition(lpIn[0], (LONG)lpIn[1], (LONG)lpIn[2]);
+  	
+  	*((uint32_t __far *)lpOutput) = done ? 1 : 0;
+  	
+  	rc = 1;
+  }
+  else if(function == SVGA_DDBLT_STATUS) /* input: svga_ddblt_status_t, output: uint32_t (1 = done) */
+  {
+  	svga_ddblt_status_t __far *st = lpInput;
+  	DWORD done = 1;
+  	
+  	if(st->fence != 0 && !SVGA_HasFencePassed(st->fence))
+  	{
+  		done = 0;
+  		if(st->wait)
+  		{
+  			SVGA_SyncToFence(st->fence);
+  			done = 1;
+  		}
+  	}
+  	
+  	*((uint32_t __far *)lpOutput) = done;
+  	
+  	rc = 1;
+  }
+  else if(function == SVGA_DDLOCK) /* input: svga_ddlock_t, output: uint32_t (1 = visible screen, report unlock) */
+  {
+  	svga_ddlock_t __far *lock = lpInput;
+  	BOOL tracked = FALSE;
+  	
+  	if(lock->surface >= dwScreenFlatAddr && lock->surface - dwScreenFlatAddr < dwVideoMemorySize)
+  	{
+  		if(lock->flags & SVGA_DDLOCK_RECT)
+  		{
+  			tracked = SVGA_DDLock(lock->surface - dwScreenFlatAddr, lock->pitch,
+  				lock->rect.left, lock->rect.top, lock->rect.right, lock->rect.bottom);
+  		}
+  		else
+  		{
+  			tracked = SVGA_DDLock(lock->surface - dwScreenFlatAddr, lock->pitch, 0, 0, wScreenX, wScreenY);
+  		}
+  	}
+  	
+  	*((uint32_t __far *)lpOutput) = tracked ? 1 : 0;
+  	
+  	rc = 1;
+  }
+  else if(function == SVGA_DDUNLOCK) /* input: uint32_t surface, output: NULL */
+  {
+  	DWORD surface = *((uint32_t __far *)lpInput);
+  	
+  	if(surface >= dwScreenFlatAddr && SVGA_DDUnlock(surface - dwScreenFlatAddr))
+  	{
+  		/* the application presents by unlock, same rules as FBHDA_UPDATE */
+  		if(pacing_optout(GetCurrentTask()) || SVGA_UpdatePace())
+  		{
+  			SVGA_UpdateFlush();
+  		}
+  	}
+  	
+  	rc = 1;
+  }
+#ifdef SCREENTARGET
+  else if(function == SVGA_SCREENTARGET) /* input: NULL, output: 4x DWORD (stid, sid, width, height) */
+  {
+  	if(SVGA_GetScreenTarget(lpOutput))
+  	{
+  		rc = 1;
+  	}
+  	else
+  	{
+  		rc = 0;
+  	}
+  }
+#endif
   else if(function == SVGA_API) /* input: NULL, output: 2x DWORD */
   {
   	uint32_t __far *lpver = lpOutput;
@@ -862,13 +2640,16 @@ LONG WINAPI __loadds Control(LPVOID lpDevice, UINT function,
   }
 #endif /* SVGA only */
   
-  /* if command accepted, return */
-  if(rc >= 0)
+  /* if command wasn't accepted, call DIB_Control handle */
+  if(rc < 0)
   {
-  	return rc;
+    dbg_printf("Control: unknown code: %d\n", function);
+    rc = DIB_Control(lpDevice, function, lpInput, lpOutput);
   }
   
-  /* else, call DIB_Control handle */
-  dbg_printf("Control: unknown code: %d\n", function);
-  return DIB_Control(lpDevice, function, lpInput, lpOutput);
+#ifdef SVGA
+  SVGA_TraceEvent(TRACE_ESCAPE_EXIT, function);
+#endif
+  
+  return rc;
 }
@@ -32,6 +32,9 @@ THE SOFTWARE.
 #include "control_vxd.h"
 
 #ifdef DBGPRINT
+#include "dpmi.h"
+#include "dbgprint.h"
+
 extern void dbg_printf( const char *s, ... );
 #else
 #define dbg_printf(...)
@@ -39,8 +42,56 @@ extern void dbg_printf( const char *s, ... );
 
 static DWORD VXD_srv = 0;
 
+#ifdef QEMU
+/* QEMU VXD hasn't own device ID, find it by name from its DDB */
+static char VXD_name[8] = {'Q', 'E', 'M', 'U', '_', 'V', 'X', 'D'};
+#endif
+
 #pragma code_seg( _INIT )
 
+#ifdef DBGPRINT
+/* send debug output by VXD ring instead of waiting on serial port */
+static void VXD_DbgRing()
+{
+	static DWORD sring;
+	static uint16_t state;
+	WORD wRingSel;
+	
+	sring = 0;
+	state = 0;
+	
+	_asm
+	{
+		.386
+		push eax
+		push edx
+		push ecx
+		
+		mov edx, VMWSVXD_PM16_DBG_RING
+		call dword ptr [VXD_srv]
+		mov [state], ax
+		mov [sring], ecx
+		
+		pop ecx
+		pop edx
+		pop eax
+	}
+	
+	if(state != 1 || sring == 0)
+	{
+		return;
+	}
+	
+	wRingSel = DPMI_AllocLDTDesc(1);
+	if(wRingSel)
+	{
+		DPMI_SetSegBase(wRingSel, sring);
+		DPMI_SetSegLimit(wRingSel, sizeof(dbg_ring_t) - 1);
+		dbg_buffered(wRingSel :> 0);
+	}
+}
+#endif
+
 BOOL VXD_load()
 {
 	if(VXD_srv != 0)
@@ -55,10 +106,17 @@ BOOL VXD_load()
 		push bx
 		push di
 		
+#ifdef QEMU
+		push ds
+		pop es
+		mov di, offset VXD_name
+		xor bx, bx
+#else
 		xor di,di
 		mov es,di
-		mov ax, 1684H
 		mov bx, VMWSVXD_DEVICE_ID
+#endif
+		mov ax, 1684H
 		int 2FH
 		mov word ptr [VXD_srv],di
 		mov word ptr [VXD_srv+2],es
@@ -70,6 +128,13 @@ BOOL VXD_load()
 		pop es
 	};
 	
+#ifdef DBGPRINT
+	if(VXD_srv != 0)
+	{
+		VXD_DbgRing();
+	}
+#endif
+	
 	return VXD_srv != 0;
 }
 
@@ -164,6 +229,186 @@ BOOL VXD_FreeRegion(DWORD LAddr, DWORD PGBLKAddr)
 	return FALSE;
 }
 
+BOOL VXD_LockRegion(DWORD LAddr, DWORD size, DWORD __far *lpPPN, DWORD __far *lpPGBLKAddr)
+{
+	static DWORD sLAddr;
+	static DWORD ssize;
+	static DWORD sPPN;
+	static DWORD sPGBLKAddr;
+	static uint16_t state;
+	
+	sLAddr = LAddr;
+	ssize = size;
+	
+	if(VXD_srv != 0)
+	{
+		_asm
+		{
+			.386
+			push eax
+			push edx
+			push ecx
+			push ebx
+			push esi
+			
+			mov  edx,      VMWSVXD_PM16_LOCK_REGION
+			mov  esi,      [sLAddr]
+			mov  ecx,      [ssize]
+			call dword ptr [VXD_srv]
+			mov  [state],  ax
+			mov  [sPPN],   ecx
+			mov  [sPGBLKAddr], ebx
+			
+			pop esi
+			pop ebx
+			pop ecx
+			pop edx
+			pop eax
+		};
+		
+		if(state == 1)
+		{
+			*lpPPN = sPPN;
+			*lpPGBLKAddr = sPGBLKAddr;
+			return TRUE;
+		}
+	}
+	
+	return FALSE;
+}
+
+void VXD_UnlockRegion(DWORD LAddr, DWORD size, DWORD PGBLKAddr)
+{
+	static DWORD sLAddr;
+	static DWORD ssize;
+	static DWORD sPGBLKAddr;
+	
+	sLAddr = LAddr;
+	ssize = size;
+	sPGBLKAddr = PGBLKAddr;
+	
+	if(VXD_srv != 0)
+	{
+		_asm
+		{
+			.386
+			push eax
+			push edx
+			push ecx
+			push ebx
+			push esi
+			
+			mov  edx,      VMWSVXD_PM16_UNLOCK_REGION
+			mov  esi,      [sLAddr]
+			mov  ecx,      [ssize]
+			mov  ebx,      [sPGBLKAddr]
+			call dword ptr [VXD_srv]
+			
+			pop esi
+			pop ebx
+			pop ecx
+			pop edx
+			pop eax
+		};
+	}
+}
+
+/*
+ * Mark GB object table as active, return 0 when table isn't available,
+ * 1 when caller have to set its base (SVGA_3D_CMD_SET_OTABLE_BASE64)
+ * and 2 when table is already set.
+ */
+WORD VXD_OTableActivate(DWORD id, DWORD __far *lpPhy, DWORD __far *lpSize)
+{
+	static DWORD sid;
+	static DWORD sphy;
+	static DWORD ssize;
+	static uint16_t state;
+	
+	sid = id;
+	state = 0;
+	
+	if(VXD_srv != 0)
+	{
+		_asm
+		{
+			.386
+			push eax
+			push edx
+			push ecx
+			push ebx
+			
+			mov  edx,      VMWSVXD_PM16_OTABLE_ACTIVATE
+			mov  ecx,      [sid]
+			call dword ptr [VXD_srv]
+			mov  [state],  ax
+			mov  [sphy],   ecx
+			mov  [ssize],  ebx
+			
+			pop ebx
+			pop ecx
+			pop edx
+			pop eax
+		};
+		
+		if(state == 1 || state == 2)
+		{
+			*lpPhy  = sphy;
+			*lpSize = ssize;
+			return state;
+		}
+	}
+	
+	return 0;
+}
+
+BOOL VXD_GetStaging(DWORD index, DWORD __far *lpLAddr, DWORD __far *lpPPN, DWORD __far *lpPages)
+{
+	static DWORD sindex;
+	static DWORD sLAddr;
+	static DWORD sPPN;
+	static DWORD spages;
+	static uint16_t state;
+	
+	sindex = index;
+	state = 0;
+	
+	if(VXD_srv != 0)
+	{
+		_asm
+		{
+			.386
+			push eax
+			push edx
+			push ecx
+			push ebx
+			
+			mov  edx,      VMWSVXD_PM16_STAGING
+			mov  ecx,      [sindex]
+			call dword ptr [VXD_srv]
+			mov  [state],  ax
+			mov  [sLAddr], edx
+			mov  [sPPN],   ecx
+			mov  [spages], ebx
+			
+			pop ebx
+			pop ecx
+			pop edx
+			pop eax
+		};
+		
+		if(state == 1)
+		{
+			*lpLAddr = sLAddr;
+			*lpPPN   = sPPN;
+			*lpPages = spages;
+			return TRUE;
+		}
+	}
+	
+	return FALSE;
+}
+
 void VXD_zeromem(DWORD LAddr, DWORD size)
 {
 	static DWORD sLAddr;
@@ -195,9 +440,23 @@ void VXD_zeromem(DWORD LAddr, DWORD size)
 	}
 }
 
-DWORD VXD_apiver()
+/*
+ * Memory operation on flat linear addresses done by VXD with dword moves,
+ * ECX = size, EDI = destination, ESI = source, EBX = fill value.
+ */
+static BOOL VXD_memop(DWORD service, DWORD dst, DWORD src, DWORD size)
 {
-	static DWORD sver = 0;
+	static DWORD sservice;
+	static DWORD sdst;
+	static DWORD ssrc;
+	static DWORD ssize;
+	static uint16_t state;
+	
+	sservice = service;
+	sdst = dst;
+	ssrc = src;
+	ssize = size;
+	state = 0;
 	
 	if(VXD_srv != 0)
 	{
@@ -207,23 +466,58 @@ DWORD VXD_apiver()
 			push eax
 			push edx
 			push ecx
-		  
-		  mov edx, VMWSVXD_PM16_APIVER
-		  call dword ptr [VXD_srv]
-		  mov [sver], ecx
-		  
-		  pop ecx
+			push ebx
+			push esi
+			push edi
+			
+			mov edx, [sservice]
+			mov edi, [sdst]
+			mov esi, [ssrc]
+			mov ebx, [ssrc]
+			mov ecx, [ssize]
+			call dword ptr [VXD_srv]
+			mov [state], ax
+			
+			pop edi
+			pop esi
+			pop ebx
+			pop ecx
 			pop edx
 			pop eax
 		}
 	}
 	
-	return sver;
+	return state == 1;
 }
 
+BOOL VXD_memset(DWORD LAddr, BYTE value, DWORD size)
+{
+	return VXD_memop(VMWSVXD_PM16_MEMSET, LAddr, value, size);
+}
 
-void CB_start()
+BOOL VXD_memcpy(DWORD dstLAddr, DWORD srcLAddr, DWORD size)
+{
+	return VXD_memop(VMWSVXD_PM16_MEMCPY, dstLAddr, srcLAddr, size);
+}
+
+BOOL VXD_memmove(DWORD dstLAddr, DWORD srcLAddr, DWORD size)
+{
+	return VXD_memop(VMWSVXD_PM16_MEMMOVE, dstLAddr, srcLAddr, size);
+}
+
+/* request write combining memory type for framebuffer */
+BOOL VXD_FBWriteCombine(DWORD LAddr, DWORD PhysAddr, DWORD size)
 {
+	static DWORD sLAddr;
+	static DWORD sPhysAddr;
+	static DWORD ssize;
+	static uint16_t state;
+	
+	sLAddr = LAddr;
+	sPhysAddr = PhysAddr;
+	ssize = size;
+	state = 0;
+	
 	if(VXD_srv != 0)
 	{
 		_asm
@@ -231,16 +525,37 @@ void CB_start()
 			.386
 			push eax
 			push edx
-		  mov edx, VMWSVXD_PM16_CB_START
-		  call dword ptr [VXD_srv]
+			push ecx
+			push esi
+			push edi
+			
+			mov edx, VMWSVXD_PM16_FB_WC
+			mov esi, [sLAddr]
+			mov edi, [sPhysAddr]
+			mov ecx, [ssize]
+			call dword ptr [VXD_srv]
+			mov [state], ax
+			
+			pop edi
+			pop esi
+			pop ecx
 			pop edx
 			pop eax
 		}
 	}
+	
+	return state == 1;
 }
 
-void CB_stop()
+/* VMM system time in ms, 0 if isn't available */
+DWORD VXD_GetTime()
 {
+	static DWORD stime;
+	static uint16_t state;
+	
+	stime = 0;
+	state = 0;
+	
 	if(VXD_srv != 0)
 	{
 		_asm
@@ -248,8 +563,471 @@ void CB_stop()
 			.386
 			push eax
 			push edx
-		  mov edx, VMWSVXD_PM16_CB_STOP
-		  call dword ptr [VXD_srv]
+			push ecx
+			
+			mov edx, VMWSVXD_PM16_GET_TIME
+			call dword ptr [VXD_srv]
+			mov [state], ax
+			mov [stime], ecx
+			
+			pop ecx
+			pop edx
+			pop eax
+		}
+	}
+	
+	return state == 1 ? stime : 0;
+}
+
+DWORD VXD_TraceRing()
+{
+	static DWORD sring;
+	static uint16_t state;
+	
+	sring = 0;
+	state = 0;
+	
+	if(VXD_srv != 0)
+	{
+		_asm
+		{
+			.386
+			push eax
+			push edx
+			push ecx
+			
+			mov edx, VMWSVXD_PM16_TRACE_RING
+			call dword ptr [VXD_srv]
+			mov [state], ax
+			mov [sring], ecx
+			
+			pop ecx
+			pop edx
+			pop eax
+		}
+	}
+	
+	return state == 1 ? sring : 0;
+}
+
+/* linear address of device lock counter (gSVGADevBusy), 0 without VXD */
+DWORD VXD_DevLock()
+{
+	static DWORD slock;
+	static uint16_t state;
+	
+	slock = 0;
+	state = 0;
+	
+	if(VXD_srv != 0)
+	{
+		_asm
+		{
+			.386
+			push eax
+			push edx
+			push ecx
+			
+			mov edx, VMWSVXD_PM16_DEV_LOCK
+			call dword ptr [VXD_srv]
+			mov [state], ax
+			mov [slock], ecx
+			
+			pop ecx
+			pop edx
+			pop eax
+		}
+	}
+	
+	return state == 1 ? slock : 0;
+}
+
+/* virtual vertical blank for DirectDraw, hz = 0 disables it */
+BOOL VXD_VBlankSet(DWORD hz, DWORD lines)
+{
+	static DWORD shz;
+	static DWORD slines;
+	static uint16_t state;
+	
+	shz = hz;
+	slines = lines;
+	state = 0;
+	
+	if(VXD_srv != 0)
+	{
+		_asm
+		{
+			.386
+			push eax
+			push edx
+			push ecx
+			push ebx
+			
+			mov  edx,      VMWSVXD_PM16_VBLANK_SET
+			mov  ecx,      [shz]
+			mov  ebx,      [slines]
+			call dword ptr [VXD_srv]
+			mov  [state],  ax
+			
+			pop ebx
+			pop ecx
+			pop edx
+			pop eax
+		}
+	}
+	
+	return state == 1;
+}
+
+/* register directory of sparse userlist section (UL_SECTION_*) */
+BOOL VXD_ULSparse(DWORD section, DWORD dirLAddr, DWORD pages, DWORD ids)
+{
+	static DWORD ssection;
+	static DWORD sdir;
+	static DWORD spages;
+	static DWORD sids;
+	static uint16_t state;
+	
+	ssection = section;
+	sdir = dirLAddr;
+	spages = pages;
+	sids = ids;
+	state = 0;
+	
+	if(VXD_srv != 0)
+	{
+		_asm
+		{
+			.386
+			push eax
+			push edx
+			push ecx
+			push ebx
+			push esi
+			push edi
+			
+			mov  edx,      VMWSVXD_PM16_UL_SPARSE
+			mov  ecx,      [ssection]
+			mov  ebx,      [sdir]
+			mov  esi,      [spages]
+			mov  edi,      [sids]
+			call dword ptr [VXD_srv]
+			mov  [state],  ax
+			
+			pop edi
+			pop esi
+			pop ebx
+			pop ecx
+			pop edx
+			pop eax
+		}
+	}
+	
+	return state == 1;
+}
+
+/* scan dirty bits of visible screen at linear address (0 = stop), size in bytes */
+BOOL VXD_DirtyScan(DWORD LAddr, DWORD size)
+{
+	static DWORD sLAddr;
+	static DWORD ssize;
+	static uint16_t state;
+	
+	sLAddr = LAddr;
+	ssize = size;
+	state = 0;
+	
+	if(VXD_srv != 0)
+	{
+		_asm
+		{
+			.386
+			push eax
+			push edx
+			push ecx
+			push esi
+			
+			mov  edx,      VMWSVXD_PM16_DIRTY_SCAN
+			mov  esi,      [sLAddr]
+			mov  ecx,      [ssize]
+			call dword ptr [VXD_srv]
+			mov  [state],  ax
+			
+			pop esi
+			pop ecx
+			pop edx
+			pop eax
+		}
+	}
+	
+	return state == 1;
+}
+
+/* returns path in use (PRESENT_PATH_*), 0 without VXD */
+DWORD VXD_PresentPath(DWORD mode, DWORD __far *lpFifoCost, DWORD __far *lpCBCost)
+{
+	static DWORD smode;
+	static DWORD sfifo;
+	static DWORD scb;
+	static uint16_t state;
+	
+	smode = mode;
+	state = 0;
+	
+	if(VXD_srv != 0)
+	{
+		_asm
+		{
+			.386
+			push eax
+			push edx
+			push ecx
+			push ebx
+			
+			mov  edx,      VMWSVXD_PM16_PRESENT_PATH
+			mov  ecx,      [smode]
+			call dword ptr [VXD_srv]
+			mov  [state],  ax
+			mov  [smode],  ecx
+			mov  [sfifo],  ebx
+			mov  [scb],    edx
+			
+			pop ebx
+			pop ecx
+			pop edx
+			pop eax
+		}
+		
+		if(state == 1)
+		{
+			*lpFifoCost = sfifo;
+			*lpCBCost   = scb;
+			return smode;
+		}
+	}
+	
+	return 0;
+}
+
+DWORD VXD_apiver()
+{
+	static DWORD sver = 0;
+	
+	if(VXD_srv != 0)
+	{
+		_asm
+		{
+			.386
+			push eax
+			push edx
+			push ecx
+		  
+		  mov edx, VMWSVXD_PM16_APIVER
+		  call dword ptr [VXD_srv]
+		  mov [sver], ecx
+		  
+		  pop ecx
+			pop edx
+			pop eax
+		}
+	}
+	
+	return sver;
+}
+
+
+void CB_start()
+{
+	if(VXD_srv != 0)
+	{
+		_asm
+		{
+			.386
+			push eax
+			push edx
+		  mov edx, VMWSVXD_PM16_CB_START
+		  call dword ptr [VXD_srv]
+			pop edx
+			pop eax
+		}
+	}
+}
+
+void CB_stop()
+{
+	if(VXD_srv != 0)
+	{
+		_asm
+		{
+			.386
+			push eax
+			push edx
+		  mov edx, VMWSVXD_PM16_CB_STOP
+		  call dword ptr [VXD_srv]
+			pop edx
+			pop eax
+		}
+	}
+}
+
+/* sleep until some userlist lock is released, FALSE when VxD isn't loaded */
+BOOL VXD_LockWait()
+{
+	if(VXD_srv != 0)
+	{
+		_asm
+		{
+			.386
+			push eax
+			push edx
+			mov edx, VMWSVXD_PM16_LOCK_WAIT
+			call dword ptr [VXD_srv]
+			pop edx
+			pop eax
+		}
+		return TRUE;
+	}
+	
+	return FALSE;
+}
+
+void VXD_FenceMirror(DWORD LAddr)
+{
+	static DWORD sLAddr;
+	
+	sLAddr = LAddr;
+	
+	if(VXD_srv != 0)
+	{
+		_asm
+		{
+			.386
+			push eax
+			push edx
+			push esi
+			mov edx, VMWSVXD_PM16_FENCE_MIRROR
+			mov esi, [sLAddr]
+			call dword ptr [VXD_srv]
+			pop esi
+			pop edx
+			pop eax
+		}
+	}
+}
+
+/* start async present worker, return linear address of its state or 0 */
+DWORD VXD_PresentStart(DWORD ulLAddr, DWORD ulSize, DWORD ringLAddr, DWORD ownedLAddr)
+{
+	static DWORD sul;
+	static DWORD ssize;
+	static DWORD sring;
+	static DWORD sowned;
+	static uint16_t state;
+	
+	sul = ulLAddr;
+	ssize = ulSize;
+	sring = ringLAddr;
+	sowned = ownedLAddr;
+	state = 0;
+	
+	if(VXD_srv != 0)
+	{
+		_asm
+		{
+			.386
+			push eax
+			push edx
+			push ecx
+			push ebx
+			push esi
+			push edi
+			
+			mov edx, VMWSVXD_PM16_PRESENT_START
+			mov esi, [sul]
+			mov ecx, [ssize]
+			mov edi, [sring]
+			mov ebx, [sowned]
+			call dword ptr [VXD_srv]
+			mov [state], ax
+			mov [sul], ecx
+			
+			pop edi
+			pop esi
+			pop ebx
+			pop ecx
+			pop edx
+			pop eax
+		}
+	}
+	
+	return state == 1 ? sul : 0;
+}
+
+/* screen updates for rects array (left, top, right, bottom) on linear address, FIFO must be locked */
+BOOL VXD_UpdateRects(DWORD LAddr, DWORD cnt)
+{
+	static DWORD sLAddr;
+	static DWORD scnt;
+	static uint16_t state;
+	
+	sLAddr = LAddr;
+	scnt = cnt;
+	state = 0;
+	
+	if(VXD_srv != 0)
+	{
+		_asm
+		{
+			.386
+			push eax
+			push edx
+			push ecx
+			push esi
+			
+			mov edx, VMWSVXD_PM16_UPDATE_RECTS
+			mov esi, [sLAddr]
+			mov ecx, [scnt]
+			call dword ptr [VXD_srv]
+			mov [state], ax
+			
+			pop esi
+			pop ecx
+			pop edx
+			pop eax
+		}
+	}
+	
+	return state == 1;
+}
+
+void VXD_PresentKick()
+{
+	if(VXD_srv != 0)
+	{
+		_asm
+		{
+			.386
+			push eax
+			push edx
+			mov edx, VMWSVXD_PM16_PRESENT_KICK
+			call dword ptr [VXD_srv]
+			pop edx
+			pop eax
+		}
+	}
+}
+
+void VXD_LockWake()
+{
+	if(VXD_srv != 0)
+	{
+		_asm
+		{
+			.386
+			push eax
+			push edx
+			mov edx, VMWSVXD_PM16_LOCK_WAKE
+			call dword ptr [VXD_srv]
 			pop edx
 			pop eax
 		}
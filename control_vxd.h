@@ -4,8 +4,29 @@
 BOOL VXD_load();
 BOOL VXD_CreateRegion(DWORD nPages, DWORD __far *lpLAddr, DWORD __far *lpPPN, DWORD __far *lpPGBLKAddr);
 BOOL VXD_FreeRegion(DWORD LAddr, DWORD PGBLKAddr);
+BOOL VXD_LockRegion(DWORD LAddr, DWORD size, DWORD __far *lpPPN, DWORD __far *lpPGBLKAddr);
+void VXD_UnlockRegion(DWORD LAddr, DWORD size, DWORD PGBLKAddr);
+WORD VXD_OTableActivate(DWORD id, DWORD __far *lpPhy, DWORD __far *lpSize);
+BOOL VXD_GetStaging(DWORD index, DWORD __far *lpLAddr, DWORD __far *lpPPN, DWORD __far *lpPages);
 void VXD_zeromem(DWORD LAddr, DWORD size);
+BOOL VXD_memset(DWORD LAddr, BYTE value, DWORD size);
+BOOL VXD_memcpy(DWORD dstLAddr, DWORD srcLAddr, DWORD size);
+BOOL VXD_memmove(DWORD dstLAddr, DWORD srcLAddr, DWORD size);
+BOOL VXD_FBWriteCombine(DWORD LAddr, DWORD PhysAddr, DWORD size);
 DWORD VXD_apiver();
+DWORD VXD_GetTime();
+DWORD VXD_PresentStart(DWORD ulLAddr, DWORD ulSize, DWORD ringLAddr, DWORD ownedLAddr);
+void VXD_PresentKick();
+BOOL VXD_UpdateRects(DWORD LAddr, DWORD cnt);
+DWORD VXD_TraceRing();
+DWORD VXD_DevLock();
+BOOL VXD_VBlankSet(DWORD hz, DWORD lines);
+BOOL VXD_ULSparse(DWORD section, DWORD dirLAddr, DWORD pages, DWORD ids);
+BOOL VXD_DirtyScan(DWORD LAddr, DWORD size);
+DWORD VXD_PresentPath(DWORD mode, DWORD __far *lpFifoCost, DWORD __far *lpCBCost);
+BOOL VXD_LockWait();
+void VXD_FenceMirror(DWORD LAddr);
+void VXD_LockWake();
 void CB_start();
 void CB_stop();
 
@@ -0,0 +1,2 @@
+#define QEMU
+#include "control_vxd.c"
@@ -0,0 +1,464 @@
+/*****************************************************************************
+
+Copyright (c) 2023 Jaroslav Hensl <emulator@emulace.cz>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+
+*****************************************************************************/
+/* Minimal CRT for VXDs, memory functions work with flat addresses */
+
+#include "winhack.h"
+#include "crt32.h"
+
+#include "code32.h"
+
+/*
+ * Large fills and copies (usually VRAM or GMR memory) are done by MMX
+ * non-temporal stores (movntq) when CPU has MMX and SSE. These stores
+ * bypass cache, so smaller blocks still go by rep stosd/movsd.
+ *
+ * MMX registers are shared with FPU, which can belong to any VM/thread
+ * (and CR0.TS can be set by lazy FPU switching). So FPU state is saved
+ * by fnsave (TS cleared before) and restored after work together with
+ * original CR0. Interrupts are disabled during this, so the work is
+ * split to CRT_NT_BLOCK chunks.
+ */
+#define CRT_NT_MIN   65536
+#define CRT_NT_BLOCK 65536
+
+#define CPUID_MMX (1UL << 23)
+#define CPUID_SSE (1UL << 25)
+
+#define CR0_EM 0x4
+
+typedef struct _crt_fpu_t
+{
+	unsigned char state[108];
+	unsigned int  cr0;
+	unsigned int  eflags;
+} crt_fpu_t;
+
+/* -1 = not detected yet */
+static int crt_ntstore = -1;
+
+static int crt_detect()
+{
+	unsigned int features = 0;
+
+	_asm
+	{
+		.586
+		push eax
+		push ebx
+		push ecx
+		push edx
+
+		/* CPUID exists when EFLAGS.ID can be changed */
+		pushfd
+		pop eax
+		mov ecx, eax
+		xor eax, 200000h
+		push eax
+		popfd
+		pushfd
+		pop eax
+		push ecx
+		popfd
+		xor eax, ecx
+		jz crt_no_cpuid
+
+		mov eax, 1
+		cpuid
+		mov [features], edx
+
+		crt_no_cpuid:
+		pop edx
+		pop ecx
+		pop ebx
+		pop eax
+	}
+
+	return (features & (CPUID_MMX | CPUID_SSE)) == (CPUID_MMX | CPUID_SSE);
+}
+
+static BOOL fpu_begin(crt_fpu_t *fpu)
+{
+	unsigned char *sstate = fpu->state;
+	unsigned int scr0;
+	unsigned int sflags;
+
+	_asm
+	{
+		.686p
+		push eax
+		pushfd
+		pop eax
+		mov [sflags], eax
+		cli
+		mov eax, cr0
+		mov [scr0], eax
+		pop eax
+	}
+
+	fpu->cr0    = scr0;
+	fpu->eflags = sflags;
+
+	/* FPU emulation, MMX isn't usable */
+	if(scr0 & CR0_EM)
+	{
+		_asm
+		{
+			push dword ptr [sflags]
+			popfd
+		}
+		return FALSE;
+	}
+
+	_asm
+	{
+		.686p
+		push ecx
+		clts
+		mov ecx, [sstate]
+		fnsave [ecx]
+		pop ecx
+	}
+
+	return TRUE;
+}
+
+static void fpu_end(crt_fpu_t *fpu)
+{
+	unsigned char *sstate = fpu->state;
+	unsigned int scr0 = fpu->cr0;
+	unsigned int sflags = fpu->eflags;
+
+	_asm
+	{
+		.686p
+		push eax
+		push ecx
+		mov ecx, [sstate]
+		frstor [ecx]
+		mov eax, [scr0]
+		mov cr0, eax
+		push dword ptr [sflags]
+		popfd
+		pop ecx
+		pop eax
+	}
+}
+
+static BOOL crt_ntstore_usable(unsigned int size)
+{
+	if(size < CRT_NT_MIN)
+	{
+		return FALSE;
+	}
+
+	if(crt_ntstore < 0)
+	{
+		crt_ntstore = crt_detect();
+	}
+
+	return crt_ntstore;
+}
+
+/* fill 'blocks' * 64 bytes, dst must be 8 bytes aligned */
+static void nt_fill(void *dst, unsigned int par, unsigned int blocks)
+{
+	void *sdst = dst;
+	unsigned int spar = par;
+	unsigned int sblocks = blocks;
+
+	_asm
+	{
+		.686
+		.mmx
+		.xmm
+		push eax
+		push ecx
+		push edi
+
+		mov edi, [sdst]
+		mov eax, [spar]
+		mov ecx, [sblocks]
+		movd mm0, eax
+		punpckldq mm0, mm0
+
+		nt_fill_next:
+		movntq [edi], mm0
+		movntq [edi+8], mm0
+		movntq [edi+16], mm0
+		movntq [edi+24], mm0
+		movntq [edi+32], mm0
+		movntq [edi+40], mm0
+		movntq [edi+48], mm0
+		movntq [edi+56], mm0
+		add edi, 64
+		dec ecx
+		jnz nt_fill_next
+
+		sfence
+		emms
+
+		pop edi
+		pop ecx
+		pop eax
+	}
+}
+
+/* copy 'blocks' * 64 bytes, dst must be 8 bytes aligned */
+static void nt_copy(void *dst, const void *src, unsigned int blocks)
+{
+	void *sdst = dst;
+	const void *ssrc = src;
+	unsigned int sblocks = blocks;
+
+	_asm
+	{
+		.686
+		.mmx
+		.xmm
+		push ecx
+		push esi
+		push edi
+
+		mov esi, [ssrc]
+		mov edi, [sdst]
+		mov ecx, [sblocks]
+
+		nt_copy_next:
+		movq mm0, [esi]
+		movq mm1, [esi+8]
+		movq mm2, [esi+16]
+		movq mm3, [esi+24]
+		movq mm4, [esi+32]
+		movq mm5, [esi+40]
+		movq mm6, [esi+48]
+		movq mm7, [esi+56]
+		movntq [edi], mm0
+		movntq [edi+8], mm1
+		movntq [edi+16], mm2
+		movntq [edi+24], mm3
+		movntq [edi+32], mm4
+		movntq [edi+40], mm5
+		movntq [edi+48], mm6
+		movntq [edi+56], mm7
+		add esi, 64
+		add edi, 64
+		dec ecx
+		jnz nt_copy_next
+
+		sfence
+		emms
+
+		pop edi
+		pop esi
+		pop ecx
+	}
+}
+
+static void rep_fill(void *dst, unsigned int par, unsigned int size)
+{
+	void *sdst = dst;
+	unsigned int spar = par;
+	unsigned int ssize = size;
+
+	_asm
+	{
+		push edi
+		push ecx
+		push eax
+		push edx
+
+		mov edi, [sdst]
+		mov eax, [spar]
+		mov edx, [ssize]
+		cld
+		mov ecx, edx
+		shr ecx, 2
+		rep stosd
+		mov ecx, edx
+		and ecx, 3
+		rep stosb
+
+		pop edx
+		pop eax
+		pop ecx
+		pop edi
+	}
+}
+
+static void rep_copy(void *dst, const void *src, unsigned int size)
+{
+	void *sdst = dst;
+	const void *ssrc = src;
+	unsigned int ssize = size;
+
+	_asm
+	{
+		push esi
+		push edi
+		push ecx
+		push edx
+
+		mov esi, [ssrc]
+		mov edi, [sdst]
+		mov edx, [ssize]
+		cld
+		mov ecx, edx
+		shr ecx, 2
+		rep movsd
+		mov ecx, edx
+		and ecx, 3
+		rep movsb
+
+		pop edx
+		pop ecx
+		pop edi
+		pop esi
+	}
+}
+
+void memset(void *dst, int c, unsigned int size)
+{
+	unsigned int par;
+	unsigned char *pdst = dst;
+	unsigned int align;
+	unsigned int block;
+	crt_fpu_t fpu;
+
+	par = c & 0xFF;
+	par |= par << 8;
+	par |= par << 16;
+
+	if(crt_ntstore_usable(size))
+	{
+		align = (0 - (unsigned int)pdst) & 7;
+		rep_fill(pdst, par, align);
+		pdst += align;
+		size -= align;
+
+		while(size >= 64)
+		{
+			block = size < CRT_NT_BLOCK ? size : CRT_NT_BLOCK;
+			block &= ~63UL;
+
+			if(!fpu_begin(&fpu))
+			{
+				break;
+			}
+			nt_fill(pdst, par, block >> 6);
+			fpu_end(&fpu);
+
+			pdst += block;
+			size -= block;
+		}
+	}
+
+	rep_fill(pdst, par, size);
+}
+
+void memcpy(void *dst, const void *src, unsigned int size)
+{
+	unsigned char *pdst = dst;
+	const unsigned char *psrc = src;
+	unsigned int align;
+	unsigned int block;
+	crt_fpu_t fpu;
+
+	if(crt_ntstore_usable(size))
+	{
+		align = (0 - (unsigned int)pdst) & 7;
+		rep_copy(pdst, psrc, align);
+		pdst += align;
+		psrc += align;
+		size -= align;
+
+		while(size >= 64)
+		{
+			block = size < CRT_NT_BLOCK ? size : CRT_NT_BLOCK;
+			block &= ~63UL;
+
+			if(!fpu_begin(&fpu))
+			{
+				break;
+			}
+			nt_copy(pdst, psrc, block >> 6);
+			fpu_end(&fpu);
+
+			pdst += block;
+			psrc += block;
+			size -= block;
+		}
+	}
+
+	rep_copy(pdst, psrc, size);
+}
+
+/*
+ * Same as memcpy but areas can overlap. When destination is above source,
+ * copy goes from end: first odd bytes, then dwords (never by
+ * non-temporal stores).
+ */
+void memmove(void *dst, const void *src, unsigned int size)
+{
+	void *sdst = dst;
+	const void *ssrc = src;
+	unsigned int ssize = size;
+
+	if((unsigned int)dst <= (unsigned int)src ||
+		(unsigned int)dst >= (unsigned int)src + size)
+	{
+		memcpy(dst, src, size);
+		return;
+	}
+
+	_asm
+	{
+		push esi
+		push edi
+		push ecx
+		push edx
+
+		mov edx, [ssize]
+		mov esi, [ssrc]
+		mov edi, [sdst]
+		add esi, edx
+		add edi, edx
+		dec esi
+		dec edi
+		std
+		mov ecx, edx
+		and ecx, 3
+		rep movsb
+		sub esi, 3
+		sub edi, 3
+		mov ecx, edx
+		shr ecx, 2
+		rep movsd
+		cld
+
+		pop edx
+		pop ecx
+		pop edi
+		pop esi
+	}
+}
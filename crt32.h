@@ -0,0 +1,8 @@
+#ifndef __CRT32_H__INCLUDED__
+#define __CRT32_H__INCLUDED__
+
+void memset(void *dst, int c, unsigned int size);
+void memcpy(void *dst, const void *src, unsigned int size);
+void memmove(void *dst, const void *src, unsigned int size);
+
+#endif /* __CRT32_H__INCLUDED__ */
@@ -0,0 +1,124 @@
+/*****************************************************************************
+
+Copyright (c) 2023 Jaroslav Hensl <emulator@emulace.cz>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+
+*****************************************************************************/
+
+/* Dirty rectangle accumulator */
+
+#include "winhack.h"
+#include "damage.h"
+
+#pragma code_seg( _TEXT )
+
+DWORD Damage_Area(damage_rect_t __far *r)
+{
+	return (DWORD)(r->right - r->left) * (DWORD)(r->bottom - r->top);
+}
+
+/* TRUE if rects overlap or touch each other */
+static BOOL damage_touch(damage_rect_t __far *a, damage_rect_t __far *b)
+{
+	return a->left <= b->right && b->left <= a->right &&
+	       a->top <= b->bottom && b->top <= a->bottom;
+}
+
+static void damage_union(damage_rect_t __far *dst, damage_rect_t __far *src)
+{
+	if(src->left   < dst->left)   dst->left   = src->left;
+	if(src->top    < dst->top)    dst->top    = src->top;
+	if(src->right  > dst->right)  dst->right  = src->right;
+	if(src->bottom > dst->bottom) dst->bottom = src->bottom;
+}
+
+/* remove rect on index i, the last one is moved to its place */
+static void damage_remove(damage_t __far *d, WORD i)
+{
+	d->cnt--;
+	if(i != d->cnt)
+	{
+		d->rects[i] = d->rects[d->cnt];
+	}
+}
+
+void Damage_Add(damage_t __far *d, damage_rect_t __far *r)
+{
+	WORD i;
+
+	/* merge with overlapping/adjacent rects, merged rect can touch others */
+	for(i = 0; i < d->cnt;)
+	{
+		if(damage_touch(&d->rects[i], r))
+		{
+			damage_union(r, &d->rects[i]);
+			damage_remove(d, i);
+			i = 0;
+			continue;
+		}
+		i++;
+	}
+
+	if(d->cnt == DAMAGE_RECTS)
+	{
+		/* set is full, merge with rect which grow least */
+		WORD best = 0;
+		DWORD best_cost = 0xFFFFFFFFUL;
+
+		for(i = 0; i < d->cnt; i++)
+		{
+			damage_rect_t u = d->rects[i];
+			DWORD cost;
+
+			damage_union(&u, r);
+			cost = Damage_Area(&u) - Damage_Area(&d->rects[i]);
+			if(cost < best_cost)
+			{
+				best_cost = cost;
+				best = i;
+			}
+		}
+
+		damage_union(r, &d->rects[best]);
+		damage_remove(d, best);
+	}
+
+	d->rects[d->cnt++] = *r;
+
+	Damage_Recount(d);
+}
+
+/* recalculate area after rects were removed */
+void Damage_Recount(damage_t __far *d)
+{
+	WORD i;
+
+	d->area = 0;
+	for(i = 0; i < d->cnt; i++)
+	{
+		d->area += Damage_Area(&d->rects[i]);
+	}
+}
+
+void Damage_Clear(damage_t __far *d)
+{
+	d->cnt  = 0;
+	d->area = 0;
+}
@@ -0,0 +1,32 @@
+#ifndef __DAMAGE_H__INCLUDED__
+#define __DAMAGE_H__INCLUDED__
+
+/*
+ * Dirty rectangle accumulator, overlapping and adjacent rects are merged
+ * to small bounded set.
+ */
+
+/* max number of dirty rects kept before they are merged together */
+#define DAMAGE_RECTS 8
+
+typedef struct _damage_rect_t
+{
+	LONG left;
+	LONG top;
+	LONG right;
+	LONG bottom;
+} damage_rect_t;
+
+typedef struct _damage_t
+{
+	damage_rect_t rects[DAMAGE_RECTS];
+	WORD          cnt;
+	DWORD         area; /* sum of rect areas */
+} damage_t;
+
+DWORD Damage_Area(damage_rect_t __far *r);
+void  Damage_Add(damage_t __far *d, damage_rect_t __far *r);
+void  Damage_Recount(damage_t __far *d);
+void  Damage_Clear(damage_t __far *d);
+
+#endif /* __DAMAGE_H__INCLUDED__ */
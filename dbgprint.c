@@ -40,15 +40,16 @@ THE SOFTWARE.
 #include "io32.h"
 #include "code32.h"
 #endif
+#include "dbgprint.h"
 
 
 /* Backdoor logging I/O ports. */
 #ifdef COM2
 /* COM2 I/O */
-#define INFO_PORT   0x2F8
+#define INFO_PORT   DBG_PORT_COM2
 #else
 /* default COM1 I/O */
-#define INFO_PORT   0x3F8
+#define INFO_PORT   DBG_PORT_COM1
 #endif
 
 #define FULL_SERIAL
@@ -61,14 +62,18 @@ THE SOFTWARE.
 #ifdef FULL_SERIAL
 static int serial_inited = 0;
 
+static void init_serial_port( unsigned port ) {
+   outp(port + 1, 0x00);    // Disable all interrupts
+   outp(port + 3, 0x80);    // Enable DLAB (set baud rate divisor)
+   outp(port + 0, 0x12);    // Set divisor to 3 (lo byte) 38400 baud
+   outp(port + 1, 0x00);    //                  (hi byte)
+   outp(port + 3, 0x03);    // 8 bits, no parity, one stop bit
+   outp(port + 2, 0xC7);    // Enable FIFO, clear them, with 14-byte threshold
+   //outp(port + 4, 0x0B);    // IRQs enabled, RTS/DSR set
+}
+
 static void init_serial() {
-   outp(INFO_PORT + 1, 0x00);    // Disable all interrupts
-   outp(INFO_PORT + 3, 0x80);    // Enable DLAB (set baud rate divisor)
-   outp(INFO_PORT + 0, 0x12);    // Set divisor to 3 (lo byte) 38400 baud
-   outp(INFO_PORT + 1, 0x00);    //                  (hi byte)
-   outp(INFO_PORT + 3, 0x03);    // 8 bits, no parity, one stop bit
-   outp(INFO_PORT + 2, 0xC7);    // Enable FIFO, clear them, with 14-byte threshold
-   //outp(INFO_PORT + 4, 0x0B);    // IRQs enabled, RTS/DSR set
+   init_serial_port(INFO_PORT);
 }
 
 static int is_transmit_empty()
@@ -77,8 +82,77 @@ static int is_transmit_empty()
 }
 #endif
 
+#ifdef VXD32
+static dbg_ring_t *dbg_ring = NULL;
+
+/* switch output to ring (NULL = synchronous output) */
+void dbg_buffered( dbg_ring_t *ring )
+{
+	dbg_ring = ring;
+}
+
+void dbg_ring_init( dbg_ring_t *ring, uint32_t port )
+{
+	ring->head    = 0;
+	ring->tail    = 0;
+	ring->dropped = 0;
+	ring->port    = port;
+#ifdef FULL_SERIAL
+	init_serial_port(port);
+#endif
+}
+
+/*
+ * Send up to 'max' characters from ring, stop when transmitter is busy,
+ * return number of sent characters. Called from VXD time-out only.
+ */
+uint32_t dbg_drain( dbg_ring_t *ring, uint32_t max )
+{
+	uint32_t tail = ring->tail;
+	uint32_t sent = 0;
+	
+	while(tail != ring->head && sent < max)
+	{
+#ifdef FULL_SERIAL
+		if((inp(ring->port + 5) & 0x20) == 0)
+		{
+			break;
+		}
+#endif
+		outp(ring->port, ring->buf[tail % DBG_RING_SIZE]);
+		tail++;
+		sent++;
+	}
+	ring->tail = tail;
+	
+	return sent;
+}
+#else
+static dbg_ring_t __far *dbg_ring = NULL;
+
+/* switch output to ring (NULL = synchronous output) */
+void dbg_buffered( dbg_ring_t __far *ring )
+{
+	dbg_ring = ring;
+}
+#endif
+
 static void prt_ch( char c )
 {
+	if(dbg_ring != NULL)
+	{
+		uint32_t head = dbg_ring->head;
+		
+		if(head - dbg_ring->tail >= DBG_RING_SIZE)
+		{
+			dbg_ring->dropped++;
+			return;
+		}
+		dbg_ring->buf[head % DBG_RING_SIZE] = c;
+		dbg_ring->head = head + 1;
+		return;
+	}
+	
 #ifdef FULL_SERIAL
 	if(serial_inited == 0)
 	{
@@ -0,0 +1,37 @@
+#ifndef __DBGPRINT_H__INCLUDED__
+#define __DBGPRINT_H__INCLUDED__
+
+/*
+ * Buffered debug output (DBGPRINT builds)
+ *
+ * dbg_printf stores characters to one page ring and VXD time-out sends
+ * them to the UART when transmitter is ready, so callers never wait for
+ * serial I/O. Each ring has one producer (driver or VXD), when the ring
+ * is full characters are dropped and counted. Without ring (before VXD
+ * is loaded, or with other VXD) output is synchronous.
+ */
+
+/* driver logs to COM1, VXD to COM2 (see makefile) */
+#define DBG_PORT_COM1 0x3F8
+#define DBG_PORT_COM2 0x2F8
+
+#define DBG_RING_SIZE 4080
+
+typedef struct dbg_ring
+{
+	volatile uint32_t head;    /* next write, updated by producer */
+	volatile uint32_t tail;    /* next send, updated by VXD */
+	volatile uint32_t dropped; /* characters lost when ring was full */
+	uint32_t port;             /* UART I/O base */
+	char buf[DBG_RING_SIZE];
+} dbg_ring_t; /* 4096 bytes */
+
+#ifdef VXD32
+void dbg_ring_init(dbg_ring_t *ring, uint32_t port);
+uint32_t dbg_drain(dbg_ring_t *ring, uint32_t max);
+void dbg_buffered(dbg_ring_t *ring);
+#else
+void dbg_buffered(dbg_ring_t __far *ring);
+#endif
+
+#endif /* __DBGPRINT_H__INCLUDED__ */
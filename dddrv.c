@@ -34,6 +34,7 @@ THE SOFTWARE.
 #include <string.h> /* _fmemset */
 
 #include "vmdahal.h"
+#include "vramheap.h"
 
 const static DD32BITDRIVERDATA_t drv_bridge99 = {
 	"bridge99.dll",
@@ -41,43 +42,58 @@ const static DD32BITDRIVERDATA_t drv_bridge99 = {
 	0
 };
 
-static DDHALMODEINFO_t modeInfo[] = {
-	{  640,  480,  640,  8, DDMODEINFO_PALETTIZED, 0, 0x00000000, 0x00000000, 0x00000000, 0x00000000 },
-	{  640,  480, 1280, 16,                     0, 0, 0x0000F800, 0x000007E0, 0x0000001F, 0x00000000 },
-	{  640,  480, 2560, 32,                     0, 0, 0x00FF0000, 0x0000FF00, 0x000000FF, 0x00000000 },
-	{  800,  600,  800,  8, DDMODEINFO_PALETTIZED, 0, 0x00000000, 0x00000000, 0x00000000, 0x00000000 },
-	{  800,  600, 1600, 16,                     0, 0, 0x0000F800, 0x000007E0, 0x0000001F, 0x00000000 },
-	{  800,  600, 3200, 32,                     0, 0, 0x00FF0000, 0x0000FF00, 0x000000FF, 0x00000000 },
-	{ 1024,  768, 1024,  8, DDMODEINFO_PALETTIZED, 0, 0x00000000, 0x00000000, 0x00000000, 0x00000000 },
-	{ 1024,  768, 2048, 16,                     0, 0, 0x0000F800, 0x000007E0, 0x0000001F, 0x00000000 },
-	{ 1024,  768, 4096, 32,                     0, 0, 0x00FF0000, 0x0000FF00, 0x000000FF, 0x00000000 },
-	{ 1280, 1024, 1280,  8, DDMODEINFO_PALETTIZED, 0, 0x00000000, 0x00000000, 0x00000000, 0x00000000 },
-	{ 1280, 1024, 2560, 16,                     0, 0, 0x0000F800, 0x000007E0, 0x0000001F, 0x00000000 },
-	{ 1280, 1024, 5120, 32,                     0, 0, 0x00FF0000, 0x0000FF00, 0x000000FF, 0x00000000 },
-	{ 1600, 1200, 1600,  8, DDMODEINFO_PALETTIZED, 0, 0x00000000, 0x00000000, 0x00000000, 0x00000000 },
-	{ 1600, 1200, 3200, 16,                     0, 0, 0x0000F800, 0x000007E0, 0x0000001F, 0x00000000 },
-	{ 1600, 1200, 6400, 32,                     0, 0, 0x00FF0000, 0x0000FF00, 0x000000FF, 0x00000000 },
-	{  720,  480,  720,  8, DDMODEINFO_PALETTIZED, 0, 0x00000000, 0x00000000, 0x00000000, 0x00000000 },
-	{  720,  480, 1440, 16,                     0, 0, 0x0000F800, 0x000007E0, 0x0000001F, 0x00000000 },
-	{  720,  480, 2880, 32,                     0, 0, 0x00FF0000, 0x0000FF00, 0x000000FF, 0x00000000 },
-	{ 1280,  720, 1280,  8, DDMODEINFO_PALETTIZED, 0, 0x00000000, 0x00000000, 0x00000000, 0x00000000 },
-	{ 1280,  720, 2560, 16,                     0, 0, 0x0000F800, 0x000007E0, 0x0000001F, 0x00000000 },
-	{ 1280,  720, 5120, 32,                     0, 0, 0x00FF0000, 0x0000FF00, 0x000000FF, 0x00000000 },
-	{ 1366,  768, 1280,  8, DDMODEINFO_PALETTIZED, 0, 0x00000000, 0x00000000, 0x00000000, 0x00000000 },
-	{ 1366,  768, 2732, 16,                     0, 0, 0x0000F800, 0x000007E0, 0x0000001F, 0x00000000 },
-	{ 1366,  768, 5464, 32,                     0, 0, 0x00FF0000, 0x0000FF00, 0x000000FF, 0x00000000 },
-	{ 1440,  900, 1440,  8, DDMODEINFO_PALETTIZED, 0, 0x00000000, 0x00000000, 0x00000000, 0x00000000 },
-	{ 1440,  900, 2880, 16,                     0, 0, 0x0000F800, 0x000007E0, 0x0000001F, 0x00000000 },
-	{ 1440,  900, 5760, 32,                     0, 0, 0x00FF0000, 0x0000FF00, 0x000000FF, 0x00000000 },
-	{ 1920, 1080, 1920,  8, DDMODEINFO_PALETTIZED, 0, 0x00000000, 0x00000000, 0x00000000, 0x00000000 },
-	{ 1920, 1080, 3840, 16,                     0, 0, 0x0000F800, 0x000007E0, 0x0000001F, 0x00000000 },
-	{ 1920, 1080, 7680, 32,                     0, 0, 0x00FF0000, 0x0000FF00, 0x000000FF, 0x00000000 },
-	{ 1920, 1200, 1920,  8, DDMODEINFO_PALETTIZED, 0, 0x00000000, 0x00000000, 0x00000000, 0x00000000 },
-	{ 1920, 1200, 3840, 16,                     0, 0, 0x0000F800, 0x000007E0, 0x0000001F, 0x00000000 },
-	{ 1920, 1200, 7680, 32,                     0, 0, 0x00FF0000, 0x0000FF00, 0x000000FF, 0x00000000 },
+/*
+ * Resolutions offered to DirectDraw, each one in every depth passing
+ * IsModeOK (same check as ValidateMode). Current mode is added when
+ * it isn't here (host autofit resolution).
+ */
+static const WORD modeRes[][2] = {
+	{  640,  480 },
+	{  720,  480 },
+	{  800,  600 },
+	{ 1024,  768 },
+	{ 1152,  864 },
+	{ 1280,  720 },
+	{ 1280,  800 },
+	{ 1280,  960 },
+	{ 1280, 1024 },
+	{ 1366,  768 },
+	{ 1400, 1050 },
+	{ 1440,  900 },
+	{ 1600,  900 },
+	{ 1600, 1200 },
+	{ 1680, 1050 },
+	{ 1920, 1080 },
+	{ 1920, 1200 },
+	{ 2560, 1440 },
+	{ 2560, 1600 },
 };
 
-#define NUMMODES (sizeof(modeInfo)/sizeof(DDHALMODEINFO_t))
+static const WORD modeBpp[] = {8, 16, 24, 32};
+
+#define NUMRES (sizeof(modeRes)/sizeof(modeRes[0]))
+#define NUMBPP (sizeof(modeBpp)/sizeof(WORD))
+#define MAXMODES ((NUMRES+1)*NUMBPP)
+
+static DDHALMODEINFO_t modeInfo[MAXMODES];
+static DWORD modeCnt = 0;
+
+/* mode list is valid for this screen, modeIdx is index of it */
+static WORD modeScreenX = 0;
+static WORD modeScreenY = 0;
+static WORD modeScreenBpp = 0;
+static int  modeIdx = -1;
+
+/*
+ * overlay formats, host video stream converts them (SVGA_OVERLAY escape)
+ */
+static DWORD overlayFourCC[] = {
+	0x32595559, // 'Y' 'U' 'Y' '2'
+	0x59565955  // 'U' 'Y' 'V' 'Y'
+};
+
+#define NUMFOURCC (sizeof(overlayFourCC)/sizeof(DWORD))
+#define NUMOVERLAYS 2 /* SVGA_OVERLAY_STREAMS */
 
 /*
  * pre-declare our HAL fns
@@ -120,7 +136,7 @@ static DDHAL_DDCALLBACKS_t cbDDCallbacks = {
 	NULL,                       // CreateSurface
 	NULL,                       // SetColorKey
 	NULL,                       // SetMode
-	NULL,                       // WaitForVerticalBlank -> uses 32-bit
+	NULL,                       // WaitForVerticalBlank -> uses 32-bit (VXD vblank)
 	NULL,                       // CanCreateSurface
 	NULL,                       // CreatePalette
 	NULL                        // lpReserved1
@@ -165,6 +181,32 @@ static DWORD linVMDAHAL = 0;
 
 static LPDDHAL_SETINFO lpDDHAL_SetInfo = NULL;
 
+/* DirectDraw heap block in offscreen VRAM */
+static DWORD ddHeapOffset = VRAMHEAP_NULL;
+static DWORD ddHeapSize   = 0;
+
+/* heap was reset (mode change) */
+static void __far DDHeapEvict(DWORD offset, DWORD tag)
+{
+	(void)tag;
+	
+	if(offset == ddHeapOffset)
+	{
+		ddHeapOffset = VRAMHEAP_NULL;
+		ddHeapSize   = 0;
+	}
+}
+
+static void DDHeapFree()
+{
+	if(ddHeapOffset != VRAMHEAP_NULL)
+	{
+		VRAMHeap_Free(ddHeapOffset);
+		ddHeapOffset = VRAMHEAP_NULL;
+		ddHeapSize   = 0;
+	}
+}
+
 #pragma code_seg( _INIT )
 
 static BOOL DDGetPtr(VMDAHAL_t __far *__far *pm16ptr, DWORD __far *linear)
@@ -218,6 +260,99 @@ static void buildPixelFormat(LPDDHALMODEINFO lpMode, LPDDPIXELFORMAT lpddpf)
 	lpddpf->dwRGBAlphaBitMask = lpMode->dwAlphaBitMask;
 } /* buildPixelFormat */
 
+/*
+ * buildModeInfo
+ *
+ * fill modeInfo with modes usable by adapter and VRAM, return index
+ * of current mode or -1
+ */
+static int buildModeInfo(void)
+{
+	WORD r, b;
+	BOOL cur_listed = FALSE;
+	
+	if(modeCnt != 0 && modeScreenX == wScreenX && modeScreenY == wScreenY && modeScreenBpp == wBpp)
+	{
+		return modeIdx;
+	}
+	
+	modeCnt = 0;
+	modeIdx = -1;
+	
+	for(r = 0; r <= NUMRES; r++)
+	{
+		WORD w, h;
+		if(r < NUMRES)
+		{
+			w = modeRes[r][0];
+			h = modeRes[r][1];
+			if(w == wScreenX && h == wScreenY)
+			{
+				cur_listed = TRUE;
+			}
+		}
+		else
+		{
+			/* current resolution isn't in table */
+			if(cur_listed)
+			{
+				break;
+			}
+			w = wScreenX;
+			h = wScreenY;
+		}
+		
+		for(b = 0; b < NUMBPP; b++)
+		{
+			DDHALMODEINFO_t *m;
+			WORD bpp = modeBpp[b];
+			BOOL current = (w == wScreenX && h == wScreenY && bpp == wBpp);
+			
+			if(!current && !IsModeOK(w, h, bpp))
+			{
+				continue;
+			}
+			
+			m = &modeInfo[modeCnt];
+			_fmemset(m, 0, sizeof(DDHALMODEINFO_t));
+			m->dwWidth  = w;
+			m->dwHeight = h;
+			m->lPitch   = CalcPitch(w, bpp);
+			m->dwBPP    = bpp;
+			switch(bpp)
+			{
+				case 8:
+					m->wFlags = DDMODEINFO_PALETTIZED;
+					break;
+				case 16:
+					m->dwRBitMask = 0x0000F800;
+					m->dwGBitMask = 0x000007E0;
+					m->dwBBitMask = 0x0000001F;
+					break;
+				default:
+					m->dwRBitMask = 0x00FF0000;
+					m->dwGBitMask = 0x0000FF00;
+					m->dwBBitMask = 0x000000FF;
+					break;
+			}
+			
+			if(current)
+			{
+				modeIdx = (int)modeCnt;
+			}
+			modeCnt++;
+		}
+	}
+	
+	modeScreenX   = wScreenX;
+	modeScreenY   = wScreenY;
+	modeScreenBpp = wBpp;
+	
+	dbg_printf("DirectDraw modes: %lu, current: %d\n", modeCnt, modeIdx);
+	
+	return modeIdx;
+} /* buildModeInfo */
+
 /*
  * buildDDHALInfo
  *
@@ -229,11 +364,12 @@ static void buildDDHALInfo(VMDAHAL_t __far *hal, int modeidx)
 //    static DWORD      AlignTbl [ 9 ] = { 8, 8, 8, 8, 16, 8, 24, 8, 32 };
 	int                 ii;
 	BOOL                can_flip;
+	BOOL                can_blt = FALSE;
+	BOOL                can_overlay = FALSE;
 	WORD                heap;
 	WORD                bytes_per_pixel;
 //	static DWORD    dwpFOURCCs[3];
 //	DWORD               bufpos;
-	DWORD               screenSize;
 
 	LPDWORD pGbl, pHAL;
 	LPDDHAL_DDEXEBUFCALLBACKS pExeBuf;
@@ -290,22 +426,64 @@ static void buildDDHALInfo(VMDAHAL_t __far *hal, int modeidx)
 	 */
 	hal->ddHALInfo.vmiData.dwNumHeaps  = 0;
 	heap = 0;
-	can_flip = FALSE;
-
-	screenSize = hal->ddHALInfo.vmiData.lDisplayPitch * hal->ddHALInfo.vmiData.dwDisplayHeight;
+	/* flip is done by HAL callback (32-bit) through FBHDA_FLIP escape */
+	can_flip = CanSetDisplayStart() && hal->cb32.Flip != NULL;
 
-	vidMem[0].dwFlags = VIDMEM_ISLINEAR;
-	vidMem[0].ddsCaps.dwCaps = DDSCAPS_OFFSCREENPLAIN;
-	vidMem[0].fpStart = dwScreenFlatAddr + screenSize;
-	vidMem[0].fpEnd   = dwScreenFlatAddr + dwVideoMemorySize - 1;
+	/*
+	 * DirectDraw manages its heap itself, so take the largest free
+	 * block of offscreen heap (GDI cache is evicted)
+	 */
+	DDHeapFree();
+	ddHeapOffset = VRAMHeap_AllocMax(VRAM_OWNER_DDRAW, 0, DDHeapEvict, &ddHeapSize);
 	
-	hal->ddHALInfo.vmiData.dwNumHeaps = 1;
+	if(ddHeapOffset != VRAMHEAP_NULL)
+	{
+		vidMem[0].dwFlags = VIDMEM_ISLINEAR;
+		vidMem[0].ddsCaps.dwCaps = DDSCAPS_OFFSCREENPLAIN;
+		vidMem[0].fpStart = dwScreenFlatAddr + ddHeapOffset;
+		vidMem[0].fpEnd   = dwScreenFlatAddr + ddHeapOffset + ddHeapSize - 1;
+		
+		hal->ddHALInfo.vmiData.dwNumHeaps = 1;
+	}
     
 	/*
 	 * capabilities supported
 	 */
 	 
 	hal->ddHALInfo.ddCaps.dwCaps = DDCAPS_GDI;
+	/*
+	 * Blt is 32-bit callback, it sends fills and VRAM copies to host
+	 * by SVGA_DDBLT escape and does everything else by CPU
+	 */
+	if(CanAccelDDBlt() && hal->cb32.Blt != NULL)
+	{
+		hal->ddHALInfo.ddCaps.dwCaps |= DDCAPS_BLT | DDCAPS_BLTCOLORFILL;
+		can_blt = TRUE;
+	}
+	
+	/*
+	 * UpdateOverlay/SetOverlayPosition are 32-bit callbacks, they set
+	 * host video stream by SVGA_OVERLAY escape, host does YUV conversion,
+	 * scaling and destination color key
+	 */
+	if(CanOverlay() && hal->cb32.UpdateOverlay != NULL && hal->cb32.SetOverlayPosition != NULL)
+	{
+		hal->ddHALInfo.ddCaps.dwCaps |= DDCAPS_OVERLAY | DDCAPS_OVERLAYFOURCC |
+			DDCAPS_OVERLAYSTRETCH | DDCAPS_OVERLAYCANTCLIP | DDCAPS_COLORKEY;
+		hal->ddHALInfo.ddCaps.dwCKeyCaps |= DDCKEYCAPS_DESTOVERLAY | DDCKEYCAPS_DESTOVERLAYONEACTIVE;
+		hal->ddHALInfo.ddCaps.ddsCaps.dwCaps |= DDSCAPS_OVERLAY;
+		hal->ddHALInfo.ddCaps.dwMaxVisibleOverlays = NUMOVERLAYS;
+		hal->ddHALInfo.ddCaps.dwCurrVisibleOverlays = 0;
+		hal->ddHALInfo.ddCaps.dwMinOverlayStretch = 1;      /* host scales both ways */
+		hal->ddHALInfo.ddCaps.dwMaxOverlayStretch = 32000;
+		can_overlay = TRUE;
+	}
+	
+	/* virtual beam position from VXD, 32-bit HAL asks it by DeviceIoControl */
+	if(CanVBlank() && hal->GetScanLine != NULL)
+	{
+		hal->ddHALInfo.ddCaps.dwCaps |= DDCAPS_READSCANLINE;
+	}
 /*
 	hal->ddHALInfo.ddCaps.dwCaps         = DDCAPS_GDI |
                                       DDCAPS_BLT |
@@ -383,6 +561,12 @@ static void buildDDHALInfo(VMDAHAL_t __far *hal, int modeidx)
 	{
 		hal->ddHALInfo.ddCaps.dwRops[ii] = 0;//ropsSupported[ii];
 	}
+	
+	if(can_blt)
+	{
+		/* SRCCOPY only, index is high word of ROP3 */
+		hal->ddHALInfo.ddCaps.dwRops[(SRCCOPY >> 16) / 32] |= 1UL << ((SRCCOPY >> 16) % 32);
+	}
 
 	/*
 	 * required alignments of the scan lines for each kind of memory
@@ -412,13 +596,21 @@ static void buildDDHALInfo(VMDAHAL_t __far *hal, int modeidx)
 	/*
 	 *  FOURCCs supported
 	 */
-	hal->ddHALInfo.ddCaps.dwNumFourCCCodes = 0;
-	hal->ddHALInfo.lpdwFourCC = NULL;
+	if(can_overlay)
+	{
+		hal->ddHALInfo.ddCaps.dwNumFourCCCodes = NUMFOURCC;
+		hal->ddHALInfo.lpdwFourCC = overlayFourCC;
+	}
+	else
+	{
+		hal->ddHALInfo.ddCaps.dwNumFourCCCodes = 0;
+		hal->ddHALInfo.lpdwFourCC = NULL;
+	}
 	
 	/*
 	 * mode information
    */
-	hal->ddHALInfo.dwNumModes = NUMMODES;
+	hal->ddHALInfo.dwNumModes = modeCnt;
 	hal->ddHALInfo.lpModeInfo = modeInfo;
 
 } /* buildDDHALInfo */
@@ -440,20 +632,7 @@ BOOL DDCreateDriverObject(int bReset)
 		return FALSE;
 	}
 
-	for(modeidx = 0; modeidx < NUMMODES; modeidx++)
-	{
-		if((modeInfo[modeidx].dwWidth == wScreenX) &&
-       (modeInfo[modeidx].dwHeight == wScreenY) &&
-       (modeInfo[modeidx].dwBPP == wBpp) )
-    {
-    	break;
-    }
-	}
-	
-	if(modeidx == NUMMODES)
-	{
-		modeidx = -1;
-	}
+	modeidx = buildModeInfo();
 	
 	hal->vramLinear = dwScreenFlatAddr;
 	hal->vramSize   = dwVideoMemorySize;
@@ -479,6 +658,16 @@ BOOL DDCreateDriverObject(int bReset)
 	
 	cbDDCallbacks.CreateSurface = hal->cb32.CreateSurface;	
 	if(cbDDCallbacks.CreateSurface) cbDDCallbacks.dwFlags |= DDHAL_CB32_CREATESURFACE;
+	
+	/* vertical blank is emulated by VXD timer, without it DirectDraw polls VGA status port */
+	if(CanVBlank())
+	{
+		cbDDCallbacks.WaitForVerticalBlank = hal->WaitForVerticalBlank;
+		if(cbDDCallbacks.WaitForVerticalBlank) cbDDCallbacks.dwFlags |= DDHAL_CB32_WAITFORVERTICALBLANK;
+		
+		cbDDCallbacks.GetScanLine = hal->GetScanLine;
+		if(cbDDCallbacks.GetScanLine) cbDDCallbacks.dwFlags |= DDHAL_CB32_GETSCANLINE;
+	}
 
 	cbDDSurfaceCallbacks.Blt = hal->cb32.Blt;
 	if(cbDDSurfaceCallbacks.Blt) cbDDSurfaceCallbacks.dwFlags |= DDHAL_SURFCB32_BLT;
@@ -501,6 +690,16 @@ BOOL DDCreateDriverObject(int bReset)
 	cbDDSurfaceCallbacks.DestroySurface = hal->cb32.DestroySurface;
 	if(cbDDSurfaceCallbacks.DestroySurface) cbDDSurfaceCallbacks.dwFlags |= DDHAL_SURFCB32_DESTROYSURFACE;
 	
+	/* overlay callbacks only when overlays are reported */
+	if(hal->ddHALInfo.ddCaps.dwCaps & DDCAPS_OVERLAY)
+	{
+		cbDDSurfaceCallbacks.UpdateOverlay = hal->cb32.UpdateOverlay;
+		cbDDSurfaceCallbacks.dwFlags |= DDHAL_SURFCB32_UPDATEOVERLAY;
+		
+		cbDDSurfaceCallbacks.SetOverlayPosition = hal->cb32.SetOverlayPosition;
+		cbDDSurfaceCallbacks.dwFlags |= DDHAL_SURFCB32_SETOVERLAYPOSITION;
+	}
+	
 	hal->ddHALInfo.GetDriverInfo = hal->cb32.GetDriverInfo;
 	if(hal->ddHALInfo.GetDriverInfo) hal->ddHALInfo.dwFlags |= DDHALINFO_GETDRIVERINFOSET;
 
@@ -536,6 +735,9 @@ DWORD __loadds __far __fastcall HALDestroyDriver(LPDDHAL_DESTROYDRIVERDATA lpDes
 	
 	lpDDHAL_SetInfo = NULL;
 	
+	/* return offscreen memory to GDI */
+	DDHeapFree();
+	
 	return DDHAL_DRIVER_HANDLED;
 } /* HALDestroyDriver */
 
@@ -31,7 +31,12 @@ THE SOFTWARE.
 
 #ifdef SVGA
 # include "svga_all.h"
+# include "vramheap.h"
+# include "dpmi.h"
+# include "drvlib.h"
 # include <string.h>
+#else
+# include "vbva.h"
 #endif
 
 /*
@@ -60,6 +65,15 @@ typedef struct
 
 #ifdef SVGA
 BOOL cursorVisible = FALSE;
+BOOL cursorDirty   = FALSE; /* DIB engine will redraw cursor on next CheckCursor */
+
+# ifdef HWCURSOR
+/* device cursor in all depths, shape is converted from screen format */
+#  define SVGA_CURSOR_ACTIVE() SVGA_CanHWCursor()
+# else
+/* DIB engine draws cursor, its area is sent as screen update */
+#  define SVGA_CURSOR_ACTIVE() SVGA_CanUpdate()
+# endif
 #endif
 
 #pragma code_seg( _TEXT )
@@ -75,7 +89,7 @@ static LONG cursorHY = 0;
 
 void update_cursor()
 {	
-	if(wBpp == 32)
+	if(SVGA_CanUpdate())
 	{
 		LONG x = cursorX - cursorHX;
 		LONG y = cursorY - cursorHY;
@@ -85,29 +99,265 @@ void update_cursor()
 		SVGA_UpdateRect(x, y, w, h);
 	}
 }
+
+/*
+ * Cursor moved to new position, old and new place are published as one
+ * rect. When they are far from each other (union is much larger than
+ * both cursors), two small rects are cheaper.
+ */
+static void update_cursor_move(LONG newX, LONG newY)
+{
+	LONG ox = cursorX - cursorHX;
+	LONG oy = cursorY - cursorHY;
+	LONG nx = newX - cursorHX;
+	LONG ny = newY - cursorHY;
+	LONG l = (ox < nx) ? ox : nx;
+	LONG t = (oy < ny) ? oy : ny;
+	LONG r = ((ox > nx) ? ox : nx) + cursorW;
+	LONG b = ((oy > ny) ? oy : ny) + cursorH;
+	
+	cursorX = newX;
+	cursorY = newY;
+	
+	if(!SVGA_CanUpdate())
+	{
+		return;
+	}
+	
+	if((r - l) * (b - t) <= 4 * cursorW * cursorH)
+	{
+		SVGA_UpdateRect(l, t, r - l, b - t);
+	}
+	else
+	{
+		SVGA_UpdateRect(ox, oy, cursorW, cursorH);
+		SVGA_UpdateRect(nx, ny, cursorW, cursorH);
+	}
+	
+	/* busy device: DIB engine draws cursor later in CheckCursor */
+	if(lpDriverPDevice->deFlags & BUSY)
+	{
+		cursorDirty = TRUE;
+	}
+}
+# else
+/*
+ * Hash of shape which is currently defined on host, when the same shape is
+ * set again (very common on UI hover) upload is skipped. The SVGA device
+ * hasn't any command to select previously defined cursor by id, so only
+ * the active shape can be reused.
+ */
+static DWORD cursorHash = 0;
+static BOOL  cursorHashValid = FALSE;
+
+/* size of XOR mask line, color cursors are in device format */
+static WORD cursor_xor_pitch(CURSORSHAPE __far *lpCursor)
+{
+	if(lpCursor->BitsPixel <= 1)
+	{
+		return lpCursor->cbWidth;
+	}
+	
+	return ((lpCursor->cx * lpCursor->BitsPixel + 15) >> 4) << 1;
+}
+
+/* FNV-1a of header and both masks */
+static DWORD cursor_hash(CURSORSHAPE __far *lpCursor)
+{
+	BYTE __far *ptr = (BYTE __far *)lpCursor;
+	DWORD size = sizeof(CURSORSHAPE) +
+		(DWORD)(lpCursor->cbWidth + cursor_xor_pitch(lpCursor)) * lpCursor->cy;
+	DWORD hash = 2166136261UL;
+	
+	for(; size > 0; size--)
+	{
+		hash ^= *ptr++;
+		hash *= 16777619UL;
+	}
+	
+	return hash;
+}
+
+/* color of pixel x in color XOR mask line as X8R8G8B8 */
+static DWORD cursor_pixel(BYTE __far *line, WORD bpp, WORD x)
+{
+	switch(bpp)
+	{
+		case 32:
+			return ((DWORD __far *)line)[x] & 0x00FFFFFFUL;
+		case 24:
+			line += x*3;
+			return line[0] | ((DWORD)line[1] << 8) | ((DWORD)line[2] << 16);
+		case 16:
+		{
+			WORD c = ((WORD __far *)line)[x];
+			return ((DWORD)((c >> 8) & 0xF8) << 16) | ((DWORD)((c >> 3) & 0xFC) << 8) | ((c << 3) & 0xF8);
+		}
+		case 8:
+		{
+			RGBQUAD __far *q = &lpColorTable[line[x]];
+			return ((DWORD)q->rgbRed << 16) | ((DWORD)q->rgbGreen << 8) | q->rgbBlue;
+		}
+	}
+	
+	return 0;
+}
+
+/* color cursor to pre-multiplied BGRA image */
+static void cursor_define_alpha(CURSORSHAPE __far *lpCursor)
+{
+	SVGAFifoCmdDefineAlphaCursor cur;
+	void __far *data = NULL;
+	BYTE __far *andMask = (BYTE __far *)(lpCursor+1);
+	BYTE __far *xorMask = andMask + lpCursor->cbWidth*lpCursor->cy;
+	WORD xorPitch = cursor_xor_pitch(lpCursor);
+	WORD x, y;
+	
+	cur.id = 0;
+	cur.hotspotX = lpCursor->xHotSpot;
+	cur.hotspotY = lpCursor->yHotSpot;
+	cur.width    = lpCursor->cx;
+	cur.height   = lpCursor->cy;
+	
+	SVGA_BeginDefineAlphaCursor(&cur, &data);
+	
+	if(data)
+	{
+		DWORD __far *px = (DWORD __far *)data;
+		
+		for(y = 0; y < lpCursor->cy; y++)
+		{
+			BYTE __far *andLine = andMask + y*lpCursor->cbWidth;
+			BYTE __far *xorLine = xorMask + y*xorPitch;
+			
+			for(x = 0; x < lpCursor->cx; x++)
+			{
+				BOOL  transparent = (andLine[x >> 3] >> (7 - (x & 7))) & 1;
+				DWORD color = cursor_pixel(xorLine, lpCursor->BitsPixel, x);
+				
+				/* inverted pixels (AND 1, XOR not 0) can't be blended, draw them opaque */
+				if(transparent && color == 0)
+				{
+					*px++ = 0;
+				}
+				else
+				{
+					*px++ = 0xFF000000UL | color;
+				}
+			}
+		}
+	}
+	
+	SVGA_FIFOCommitAll();
+}
+
+/* monochrome cursor, color one is reduced to non-zero pixel = 1 */
+static void cursor_define_mono(CURSORSHAPE __far *lpCursor)
+{
+	SVGAFifoCmdDefineCursor cur;
+	void __far* ANDMask = NULL;
+	void __far* XORMask = NULL;
+	BYTE __far *andMask = (BYTE __far *)(lpCursor+1);
+	BYTE __far *xorMask = andMask + lpCursor->cbWidth*lpCursor->cy;
+	WORD xorPitch = cursor_xor_pitch(lpCursor);
+	WORD pitch = ((lpCursor->cx + 31) >> 5) << 2;
+	WORD andCopy = (lpCursor->cbWidth < pitch) ? lpCursor->cbWidth : pitch;
+	WORD xorCopy = (xorPitch < pitch) ? xorPitch : pitch;
+	WORD x, y;
+	
+	cur.id = 0;
+	cur.hotspotX = lpCursor->xHotSpot;
+	cur.hotspotY = lpCursor->yHotSpot;
+	cur.width    = lpCursor->cx;
+	cur.height   = lpCursor->cy;
+	cur.andMaskDepth = 1;
+	cur.xorMaskDepth = 1;
+	
+	dbg_printf("cx: %d, cy: %d, cbWidth: %d, Planes: %d\n", lpCursor->cx, lpCursor->cy, lpCursor->cbWidth, lpCursor->Planes);
+	
+	SVGA_BeginDefineCursor(&cur, &ANDMask, &XORMask);
+	
+	if(ANDMask && XORMask)
+	{
+		BYTE __far *dstAnd = (BYTE __far *)ANDMask;
+		BYTE __far *dstXor = (BYTE __far *)XORMask;
+		
+		_fmemset(dstXor, 0, pitch*lpCursor->cy);
+		for(y = 0; y < lpCursor->cy; y++)
+		{
+			_fmemset(dstAnd, 0xFF, pitch);
+			_fmemcpy(dstAnd, andMask + y*lpCursor->cbWidth, andCopy);
+			
+			if(lpCursor->BitsPixel <= 1)
+			{
+				_fmemcpy(dstXor, xorMask + y*xorPitch, xorCopy);
+			}
+			else
+			{
+				for(x = 0; x < lpCursor->cx; x++)
+				{
+					if(cursor_pixel(xorMask + y*xorPitch, lpCursor->BitsPixel, x) != 0)
+					{
+						dstXor[x >> 3] |= 0x80 >> (x & 7);
+					}
+				}
+			}
+			
+			dstAnd += pitch;
+			dstXor += pitch;
+		}
+	}
+	
+	SVGA_FIFOCommitAll();
+}
+
+/* forget defined shape (mode was changed) */
+void SVGA_CursorReset()
+{
+	cursorHashValid = FALSE;
+}
 # endif
 #endif
 
+#if defined(SVGA) && defined(HWBLT)
+static void vbmp_dirty(LPVOID lpDestDev);
+#endif
+
+/*
+ * drawing to busy screen (DOS VM in foreground) is lost, desktop snapshot can't be restored,
+ * drawing to bitmap makes its VRAM copy stale
+ */
+static void switch_draw(LPVOID lpDestDev)
+{
+	if(lpDestDev == (LPVOID)lpDriverPDevice && (lpDriverPDevice->deFlags & BUSY))
+	{
+		bSwitchDrawLost = TRUE;
+	}
+#if defined(SVGA) && defined(HWBLT)
+	vbmp_dirty(lpDestDev);
+#endif
+}
+
 void WINAPI __loadds MoveCursor(WORD absX, WORD absY)
 {
 	if(wEnabled)
 	{
 #ifdef SVGA
-		if(wBpp == 32)
+		if(SVGA_CURSOR_ACTIVE())
 		{
 # ifdef HWCURSOR
 			SVGA_MoveCursor(cursorVisible, absX, absY, 0);
 # else
 	    DIB_MoveCursorExt(absX, absY, lpDriverPDevice);
-	    update_cursor();
-	    cursorX = absX;
-	    cursorY = absY;
-	    update_cursor();
+	    update_cursor_move(absX, absY);
 # endif
 			return;
 		}
 #endif
 		DIB_MoveCursorExt(absX, absY, lpDriverPDevice);
+#ifndef SVGA
+		VBVA_CursorMove(absX, absY);
+#endif
 	}
 }
 
@@ -116,7 +366,7 @@ WORD WINAPI __loadds SetCursor_driver(CURSORSHAPE __far *lpCursor)
 	if(wEnabled)
 	{
 #ifdef SVGA
-		if(wBpp == 32)
+		if(SVGA_CURSOR_ACTIVE())
 		{
 # ifdef HWCURSOR
 			void __far* ANDMask = NULL;
@@ -125,32 +375,25 @@ WORD WINAPI __loadds SetCursor_driver(CURSORSHAPE __far *lpCursor)
 			
 			if(lpCursor != NULL)
 			{
-				cur.id = 0;
-				cur.hotspotX = lpCursor->xHotSpot;
-				cur.hotspotY = lpCursor->yHotSpot;
-				cur.width    = lpCursor->cx;
-				cur.height   = lpCursor->cy;
-				cur.andMaskDepth = 1;
-				cur.xorMaskDepth = 1;
-				
-				dbg_printf("cx: %d, cy: %d, cbWidth: %d, Planes: %d\n", lpCursor->cx, lpCursor->cy, lpCursor->cbWidth, lpCursor->Planes);
+				DWORD hash = cursor_hash(lpCursor);
 				
-				SVGA_BeginDefineCursor(&cur, &ANDMask, &XORMask);
-				
-				if(ANDMask)
+				/* same shape is already on host */
+				if(cursorHashValid && cursorVisible && hash == cursorHash)
 				{
-					_fmemcpy(ANDMask, lpCursor+1, lpCursor->cbWidth*lpCursor->cy);
+					return 1;
 				}
 				
-				if(XORMask)
+				if(lpCursor->BitsPixel > 1 && (gSVGA.capabilities & SVGA_CAP_ALPHA_CURSOR))
+				{
+					cursor_define_alpha(lpCursor);
+				}
+				else
 				{
-					BYTE __far *ptr = (BYTE __far *)(lpCursor+1);
-					ptr += lpCursor->cbWidth*lpCursor->cy;
-					
-					_fmemcpy(XORMask, ptr, lpCursor->cbWidth*lpCursor->cy);
+					cursor_define_mono(lpCursor);
 				}
 				
-				SVGA_FIFOCommitAll();
+				cursorHash = hash;
+				cursorHashValid = TRUE;
 				cursorVisible = TRUE;
 				return 1;
 			}
@@ -176,9 +419,12 @@ WORD WINAPI __loadds SetCursor_driver(CURSORSHAPE __far *lpCursor)
 				
 				SVGA_MoveCursor(FALSE, 0, 0, 0);
 				cursorVisible = FALSE;
+				cursorHashValid = FALSE;
 				return 1;
 			}
 # else
+			/* old shape area, new one is published on next CheckCursor */
+			update_cursor();
 			if(lpCursor != NULL)
 			{
 				cursorW = lpCursor->cx;
@@ -186,10 +432,14 @@ WORD WINAPI __loadds SetCursor_driver(CURSORSHAPE __far *lpCursor)
 				cursorHX = lpCursor->xHotSpot;
 				cursorHY = lpCursor->yHotSpot;
 			}
+			cursorDirty = TRUE;
 # endif
-		} // 32bpp
+		} // SVGA_CURSOR_ACTIVE
 #endif
 		DIB_SetCursorExt(lpCursor, lpDriverPDevice);
+#ifndef SVGA
+		VBVA_CursorUpdate();
+#endif
 		return 1;
 	}
 	return 0;
@@ -202,15 +452,20 @@ void WINAPI __loadds CheckCursor( void )
 #ifdef SVGA
 # ifndef HWCURSOR
 		DIB_CheckCursorExt( lpDriverPDevice );
-		if(wBpp == 32)
+		/* static cursor isn't redrawn, so nothing to send */
+		if(cursorDirty)
 		{
+			cursorDirty = FALSE;
 			update_cursor();
 		}
 # else
-	if(wBpp != 32) DIB_CheckCursorExt( lpDriverPDevice );
+	if(!SVGA_CURSOR_ACTIVE()) DIB_CheckCursorExt( lpDriverPDevice );
 # endif
+		/* periodic flush of accumulated screen damage */
+		SVGA_UpdateFlush();
 #else
 		DIB_CheckCursorExt( lpDriverPDevice );
+		VBVA_UpdateFlush();
 #endif
 	}
 }
@@ -220,9 +475,6 @@ void WINAPI __loadds CheckCursor( void )
  */
 #ifdef HWBLT
 
-extern BOOL WINAPI (* BitBltDevProc)( LPDIBENGINE, WORD, WORD, LPPDEVICE, WORD, WORD,
-                                      WORD, WORD, DWORD, LPBRUSH, LPDRAWMODE );
-
 /* See if a hardware BitBlt can be done. */
 BOOL WINAPI __loadds BitBlt( LPDIBENGINE lpDestDev, WORD wDestX, WORD wDestY, LPPDEVICE lpSrcDev,
                     WORD wSrcX, WORD wSrcY, WORD wXext, WORD wYext, DWORD dwRop3,
@@ -242,19 +494,690 @@ BOOL WINAPI __loadds BitBlt( LPDIBENGINE lpDestDev, WORD wDestX, WORD wDestY, LP
             }
         }
     }
+    switch_draw( lpDestDev );
     return( DIB_BitBlt( lpDestDev, wDestX, wDestY, lpSrcDev, wSrcX, wSrcY, wXext, wYext, dwRop3, lpPBrush, lpDrawMode ) );
 }
 
+#ifdef SVGA
+
+#ifndef SRCCOPY
+#define SRCCOPY 0x00CC0020UL
+#endif
+#ifndef PATCOPY
+#define PATCOPY 0x00F00021UL
 #endif
+#ifndef BLACKNESS
+#define BLACKNESS 0x00000042UL
+#endif
+#ifndef WHITENESS
+#define WHITENESS 0x00FF0062UL
+#endif
+
+/* Solid fill by SVGA_CMD_RECT_FILL */
+static BOOL SVGA_FillDev(LPDIBENGINE lpDestDev, WORD wDestX, WORD wDestY, WORD wXext, WORD wYext, DWORD color)
+{
+	BOOL rc;
+	
+	DIB_BeginAccess(lpDestDev, wDestX, wDestY, wDestX + wXext, wDestY + wYext, CURSOREXCLUDE);
+	rc = SVGA_FillRect(wDestX, wDestY, wXext, wYext, color);
+# ifndef HWCURSOR
+	SVGA_HWSync();
+# endif
+	DIB_EndAccess(lpDestDev, CURSOREXCLUDE);
+	
+	return rc;
+}
+
+/*
+ * VRAM cache of compatible bitmaps: 32 bpp memory bitmap which is
+ * repeatedly blitted to screen unchanged (typically a back buffer or
+ * prepared picture) gets a copy in GDI block of VRAM heap and SRCCOPY to
+ * screen is done by host without CPU copy. Bitmap header isn't touched,
+ * system memory bits stay the only bits GDI and DIB engine know about and
+ * the copy is driver private.
+ *
+ * Every drawing to bitmap goes through driver (switch_draw, DibBlt,
+ * BitmapBits) and makes copy stale, it is refreshed when bitmap is again
+ * blitted VBMP_PROMOTE times without drawing between. Copy is dropped when
+ * bitmap is deselected (header can be freed and reused), when VRAM heap
+ * takes block back (DirectDraw, mode change) and before switch to DOS.
+ * Every host blit is waited for, block can be reused right after it.
+ */
+#define VBMP_MAX      16
+#define VBMP_MIN_SIZE 0x10000UL /* smaller bitmaps are cheap for CPU */
+#define VBMP_PROMOTE  2         /* unchanged blits to screen before copy to VRAM */
+
+typedef struct _vbmp_t
+{
+	LPDIBENGINE bmp;          /* NULL = free slot */
+	DWORD       vram;         /* VRAMHEAP_NULL = no block */
+	BOOL        valid;        /* block holds current bits */
+	WORD        blits;        /* unchanged blits to screen from system memory */
+} vbmp_t;
+
+static vbmp_t vbmp_list[VBMP_MAX];
+
+static vbmp_t __far *vbmp_find(LPDIBENGINE lpBmp)
+{
+	WORD i;
+	
+	for(i = 0; i < VBMP_MAX; i++)
+	{
+		if(vbmp_list[i].bmp == lpBmp)
+		{
+			return &vbmp_list[i];
+		}
+	}
+	
+	return NULL;
+}
+
+/* plain top-down 32 bpp bitmap in screen format */
+static BOOL vbmp_eligible(LPDIBENGINE lpBmp)
+{
+	return lpBmp->deType != 0 && lpBmp != lpDriverPDevice &&
+		lpBmp->deBitsPixel == 32 && lpBmp->dePlanes == 1 &&
+		!(lpBmp->deFlags & (VRAM | OFFSCREEN | SELECTEDDIB | BUSY)) &&
+		lpBmp->deDeltaScan == lpBmp->deWidthBytes && (lpBmp->deWidthBytes & 3) == 0 &&
+		(DWORD)lpBmp->deWidthBytes * lpBmp->deHeight >= VBMP_MIN_SIZE;
+}
+
+/* bitmap is going to be drawn by CPU, VRAM copy is stale */
+static void vbmp_dirty(LPVOID lpDestDev)
+{
+	vbmp_t __far *v;
+	
+	if(lpDestDev == (LPVOID)lpDriverPDevice)
+	{
+		return;
+	}
+	
+	v = vbmp_find((LPDIBENGINE)lpDestDev);
+	if(v != NULL)
+	{
+		v->valid = FALSE;
+		v->blits = 0;
+	}
+}
+
+/* block taken by VRAM heap (DirectDraw needs memory or mode change) */
+static void __far vbmp_evict(DWORD offset, DWORD tag)
+{
+	vbmp_t __far *v = &vbmp_list[(WORD)tag];
+	
+	if(v->bmp != NULL && v->vram == offset)
+	{
+		v->vram  = VRAMHEAP_NULL;
+		v->valid = FALSE;
+		v->blits = 0;
+	}
+}
+
+static BOOL vbmp_upload(vbmp_t __far *v)
+{
+	LPDIBENGINE lpBmp = v->bmp;
+	DWORD size = lpBmp->deDeltaScan * lpBmp->deHeight;
+	
+	if(v->vram == VRAMHEAP_NULL)
+	{
+		v->vram = VRAMHeap_Alloc(size, VRAM_OWNER_GDI, (DWORD)(v - (vbmp_t __far *)vbmp_list), vbmp_evict);
+		if(v->vram == VRAMHEAP_NULL)
+		{
+			return FALSE;
+		}
+	}
+	
+	/* same addressing as screen and glyph atlas */
+	drv_memcpy_large(DPMI_GetSegBase(lpDriverPDevice->deBitsSelector) + lpDriverPDevice->deBitsOffset + v->vram,
+		DPMI_GetSegBase(lpBmp->deBitsSelector) + lpBmp->deBitsOffset, size);
+	v->valid = TRUE;
+	
+	return TRUE;
+}
+
+/* bitmap isn't selected anymore, drop its copy */
+static void vbmp_release(LPDIBENGINE lpBmp)
+{
+	vbmp_t __far *v = vbmp_find(lpBmp);
+	
+	if(v != NULL)
+	{
+		if(v->vram != VRAMHEAP_NULL)
+		{
+			VRAMHeap_Free(v->vram);
+		}
+		v->bmp = NULL;
+	}
+}
+
+/*
+ * Source of SRCCOPY to screen, returns copy offset in VRAM or
+ * VRAMHEAP_NULL when it (still) has to be done by DIB engine.
+ */
+static DWORD vbmp_use(LPDIBENGINE lpBmp)
+{
+	vbmp_t __far *v = vbmp_find(lpBmp);
+	
+	if(v == NULL)
+	{
+		if(!vbmp_eligible(lpBmp) || (v = vbmp_find(NULL)) == NULL)
+		{
+			return VRAMHEAP_NULL;
+		}
+		v->bmp   = lpBmp;
+		v->vram  = VRAMHEAP_NULL;
+		v->valid = FALSE;
+		v->blits = 0;
+	}
+	
+	if(!v->valid)
+	{
+		if(++v->blits < VBMP_PROMOTE || !vbmp_upload(v))
+		{
+			return VRAMHEAP_NULL;
+		}
+	}
+	
+	return v->vram;
+}
+
+/* drop all copies, VRAM content is going to be lost */
+void SVGA_BitmapsDrop()
+{
+	WORD i;
+	
+	for(i = 0; i < VBMP_MAX; i++)
+	{
+		if(vbmp_list[i].bmp != NULL)
+		{
+			vbmp_release(vbmp_list[i].bmp);
+		}
+	}
+}
+
+/*
+ * Screen to screen SRCCOPY by SVGA_CMD_RECT_COPY, VRAM bitmap to screen
+ * SRCCOPY by SVGA_CMD_BLIT_GMRFB_TO_SCREEN, solid fills (PATCOPY with solid
+ * brush, BLACKNESS, WHITENESS) by SVGA_CMD_RECT_FILL, everything else by DIB
+ * engine. Source bitmap is blitted from its VRAM copy, screen is the only
+ * destination of host commands.
+ */
+BOOL WINAPI __loadds SVGA_BitBltDev( LPDIBENGINE lpDestDev, WORD wDestX, WORD wDestY, LPPDEVICE lpSrcDev,
+                    WORD wSrcX, WORD wSrcY, WORD wXext, WORD wYext, DWORD dwRop3,
+                    LPBRUSH lpPBrush, LPDRAWMODE lpDrawMode )
+{
+	LPDIBENGINE lpSrc = (LPDIBENGINE)lpSrcDev;
+	
+	if(lpDestDev != lpDriverPDevice)
+	{
+		return( DIB_BitBlt( lpDestDev, wDestX, wDestY, lpSrcDev, wSrcX, wSrcY, wXext, wYext, dwRop3, lpPBrush, lpDrawMode ) );
+	}
+	
+	if(wXext != 0 && wYext != 0 && lpDestDev->deBitsPixel == 32)
+	{
+		switch(dwRop3)
+		{
+			case BLACKNESS:
+				if(SVGA_FillDev(lpDestDev, wDestX, wDestY, wXext, wYext, 0x00000000UL))
+					return TRUE;
+				break;
+			case WHITENESS:
+				if(SVGA_FillDev(lpDestDev, wDestX, wDestY, wXext, wYext, 0x00FFFFFFUL))
+					return TRUE;
+				break;
+			case PATCOPY:
+			{
+				DIB_Brush32 __far *lpBrush = (DIB_Brush32 __far *)lpPBrush;
+				if(lpBrush != NULL && (lpBrush->dp32BrushFlags & COLORSOLID))
+				{
+					DWORD color = *((DWORD __far *)lpBrush->dp32BrushBits);
+					if(SVGA_FillDev(lpDestDev, wDestX, wDestY, wXext, wYext, color))
+						return TRUE;
+				}
+				break;
+			}
+		}
+	}
+	
+	if(dwRop3 == SRCCOPY && lpSrc != NULL && wXext != 0 && wYext != 0 &&
+		(lpSrc->deFlags & VRAM) &&
+		lpSrc->deBitsSelector == lpDestDev->deBitsSelector &&
+		lpSrc->deBitsOffset   == lpDestDev->deBitsOffset)
+	{
+		WORD left   = wSrcX < wDestX ? wSrcX : wDestX;
+		WORD top    = wSrcY < wDestY ? wSrcY : wDestY;
+		WORD right  = (wSrcX > wDestX ? wSrcX : wDestX) + wXext;
+		WORD bottom = (wSrcY > wDestY ? wSrcY : wDestY) + wYext;
+		BOOL rc;
+		
+		/* hide software cursor from both rects */
+		DIB_BeginAccess(lpDestDev, left, top, right, bottom, CURSOREXCLUDE);
+		rc = SVGA_CopyRect(wSrcX, wSrcY, wDestX, wDestY, wXext, wYext);
+# ifndef HWCURSOR
+		/* DIB engine draws cursor back to frame buffer */
+		SVGA_HWSync();
+# endif
+		DIB_EndAccess(lpDestDev, CURSOREXCLUDE);
+		
+		if(rc)
+		{
+			return TRUE;
+		}
+	}
+	else if(dwRop3 == SRCCOPY && lpSrc != NULL && lpSrc->deType != 0 && wXext != 0 && wYext != 0 &&
+		!(lpDestDev->deFlags & (BUSY | PALETTE_XLAT)) &&
+		(DWORD)wSrcX + wXext <= lpSrc->deWidth && (DWORD)wSrcY + wYext <= lpSrc->deHeight &&
+		SVGA_CanBlitOffscreen())
+	{
+		DWORD vram = vbmp_use(lpSrc);
+		
+		if(vram != VRAMHEAP_NULL)
+		{
+			svga_blit_t blit;
+			BOOL rc;
+			
+			blit.sx = wSrcX;
+			blit.sy = wSrcY;
+			blit.dx = wDestX;
+			blit.dy = wDestY;
+			blit.w  = wXext;
+			blit.h  = wYext;
+			
+			DIB_BeginAccess(lpDestDev, wDestX, wDestY, wDestX + wXext, wDestY + wYext, CURSOREXCLUDE);
+			rc = SVGA_BlitOffscreen(vram, lpSrc->deDeltaScan, &blit, 1);
+			/* CPU draws to bitmap again and DIB engine draws cursor back */
+			SVGA_HWSync();
+			DIB_EndAccess(lpDestDev, CURSOREXCLUDE);
+			
+			if(rc)
+			{
+				return TRUE;
+			}
+		}
+	}
+	
+	return( DIB_BitBlt( lpDestDev, wDestX, wDestY, lpSrcDev, wSrcX, wSrcY, wXext, wYext, dwRop3, lpPBrush, lpDrawMode ) );
+}
+
+#endif /* SVGA */
+
+/* VRAM copy is keyed by bitmap header, which can be freed after deselect. */
+BOOL WINAPI __loadds SelectBitmap( LPPDEVICE lpDevice, LPBITMAP lpPrevBitmap, LPBITMAP lpBitmap, DWORD fFlags )
+{
+#ifdef SVGA
+	if(lpPrevBitmap != NULL)
+	{
+		vbmp_release((LPDIBENGINE)lpPrevBitmap);
+	}
+	vbmp_release((LPDIBENGINE)lpDevice);
+#endif
+	return( DIB_SelectBitmap( lpDevice, lpPrevBitmap, lpBitmap, fFlags ) );
+}
+
+#ifndef DBB_GET
+#define DBB_GET 0x0002
+#endif
+
+extern VOID WINAPI DIB_DibBltExt( LPPDEVICE lpBitmap, WORD fGet, WORD iStart, WORD cScans, LPSTR lpDIBits,
+                                  LPBITMAPINFO lpBitmapInfo, LPDRAWMODE lpDrawMode, LPINT lpTranslate, WORD fPalettized );
+
+/* SetDIBits and SetBitmapBits write to bitmap without switch_draw */
+VOID WINAPI __loadds DibBlt( LPPDEVICE lpBitmap, WORD fGet, WORD iStart, WORD cScans, LPSTR lpDIBits,
+                             LPBITMAPINFO lpBitmapInfo, LPDRAWMODE lpDrawMode, LPINT lpTranslate )
+{
+#ifdef SVGA
+	if(!fGet)
+	{
+		vbmp_dirty(lpBitmap);
+	}
+#endif
+	DIB_DibBltExt( lpBitmap, fGet, iStart, cScans, lpDIBits, lpBitmapInfo, lpDrawMode, lpTranslate, wPalettized );
+}
+
+BOOL WINAPI __loadds BitmapBits( LPPDEVICE lpDevice, DWORD fFlags, DWORD dwCount, LPSTR lpBits )
+{
+#ifdef SVGA
+	if(fFlags != DBB_GET)
+	{
+		vbmp_dirty(lpDevice);
+	}
+#endif
+	return( DIB_BitmapBits( lpDevice, fFlags, dwCount, lpBits ) );
+}
+
+#endif /* HWBLT */
 
 #ifndef ETO_GLYPH_INDEX
 #define ETO_GLYPH_INDEX 0x0010
 #endif
+#ifndef ETO_OPAQUE
+#define ETO_OPAQUE 0x0002
+#endif
+#ifndef R2_COPYPEN
+#define R2_COPYPEN 13
+#endif
+
+#if defined(SVGA) && defined(HWBLT)
+/*
+ * Glyph cache: every glyph is rendered once by DIB engine to atlas in
+ * offscreen VRAM (32 bpp, already in text and background color) and
+ * opaque text runs are composed from atlas by host blits. Transparent
+ * text can't be done by SVGA 2D commands, so it goes to DIB engine as
+ * everything unusual (glyph indices, char widths, underline, ...).
+ *
+ * Atlas is GDI block of VRAM heap with screen pitch, glyphs are packed
+ * in shelves. When atlas is full or evicted, whole cache is dropped by
+ * increasing epoch.
+ */
+#define GLYPH_CACHE_SIZE  256 /* must be power of 2 */
+#define GLYPH_ATLAS_LINES 256
+#define GLYPH_MAX_SIZE    64
+#define GLYPH_RUN_MAX     64
+
+typedef struct _glyph_entry_t
+{
+	DWORD font;  /* lpFontInfo */
+	DWORD face;  /* dfFace (font pointer can be reused) */
+	DWORD fg;
+	DWORD bg;
+	WORD  epoch;
+	WORD  ch;
+	WORD  x;     /* position in atlas */
+	WORD  y;
+	WORD  w;
+	WORD  h;
+} glyph_entry_t;
+
+static glyph_entry_t glyph_cache[GLYPH_CACHE_SIZE];
+static WORD  glyph_epoch = 1;
+static DWORD glyph_atlas = VRAMHEAP_NULL; /* atlas offset in VRAM */
+static WORD  glyph_shelf_x = 0;
+static WORD  glyph_shelf_y = 0;
+static WORD  glyph_shelf_h = 0;
+static DIBENGINE   glyph_dev;             /* atlas as DIB engine surface */
+static svga_blit_t glyph_blits[GLYPH_RUN_MAX];
+static glyph_entry_t glyph_run[GLYPH_RUN_MAX]; /* copies, slot can be reused in the same run */
+
+static void glyph_reset()
+{
+	glyph_epoch++;
+	if(glyph_epoch == 0)
+	{
+		/* wrap around, old entries could match again */
+		_fmemset(glyph_cache, 0, sizeof(glyph_cache));
+		glyph_epoch = 1;
+	}
+	glyph_shelf_x = 0;
+	glyph_shelf_y = 0;
+	glyph_shelf_h = 0;
+}
+
+/* atlas taken by VRAM heap (mode change or DirectDraw needs memory) */
+static void __far glyph_evict(DWORD offset, DWORD tag)
+{
+	glyph_atlas = VRAMHEAP_NULL;
+	glyph_reset();
+}
+
+static BOOL glyph_atlas_alloc()
+{
+	DWORD pitch = lpDriverPDevice->deDeltaScan;
+	
+	if(glyph_atlas != VRAMHEAP_NULL)
+	{
+		return TRUE;
+	}
+	
+	glyph_atlas = VRAMHeap_Alloc(pitch * GLYPH_ATLAS_LINES, VRAM_OWNER_GDI, 0, glyph_evict);
+	if(glyph_atlas == VRAMHEAP_NULL)
+	{
+		return FALSE;
+	}
+	
+	glyph_reset();
+	
+	/* same format as screen, but only memory (no access callbacks) */
+	glyph_dev = *lpDriverPDevice;
+	glyph_dev.deHeight     = GLYPH_ATLAS_LINES;
+	glyph_dev.deBitsOffset = lpDriverPDevice->deBitsOffset + glyph_atlas;
+	glyph_dev.deFlags     &= ~(MINIDRIVER | VRAM | OFFSCREEN | BUSY);
+	
+	return TRUE;
+}
+
+static WORD glyph_hash(LPFONTINFO lpFontInfo, WORD ch, DWORD fg, DWORD bg)
+{
+	DWORD font = (DWORD)lpFontInfo;
+	WORD  h = (WORD)font ^ (WORD)(font >> 16) ^ (ch * 31) ^ (WORD)fg ^ (WORD)(fg >> 16) ^ (WORD)bg;
+	
+	return h & (GLYPH_CACHE_SIZE - 1);
+}
+
+/* find glyph in cache or render it to atlas, NULL if not possible */
+static glyph_entry_t __far *glyph_get(WORD ch, LPFONTINFO lpFontInfo, LPDRAWMODE lpDrawMode,
+	LPTEXTXFORM lpTextXForm)
+{
+	glyph_entry_t __far *e = &glyph_cache[glyph_hash(lpFontInfo, ch, lpDrawMode->TextColor, lpDrawMode->bkColor)];
+	WORD  w;
+	WORD  h = lpFontInfo->dfPixHeight;
+	BYTE  c = (BYTE)ch;
+	RECT  cell;
+	
+	if(e->epoch == glyph_epoch && e->font == (DWORD)lpFontInfo && e->face == lpFontInfo->dfFace &&
+		e->ch == ch && e->fg == lpDrawMode->TextColor && e->bg == lpDrawMode->bkColor)
+	{
+		return e;
+	}
+	
+	if(DIB_GetCharWidth((LPPDEVICE)lpDriverPDevice, &w, ch, ch, lpFontInfo, lpDrawMode, lpTextXForm) == 0)
+	{
+		return NULL;
+	}
+	
+	if(w == 0 || w > GLYPH_MAX_SIZE || h == 0 || h > GLYPH_MAX_SIZE)
+	{
+		return NULL;
+	}
+	
+	if(glyph_shelf_x + w > glyph_dev.deWidth)
+	{
+		glyph_shelf_y += glyph_shelf_h;
+		glyph_shelf_x = 0;
+		glyph_shelf_h = 0;
+	}
+	
+	if(glyph_shelf_y + h > GLYPH_ATLAS_LINES)
+	{
+		/* atlas is full, host can still read old glyphs */
+		SVGA_HWSync();
+		glyph_reset();
+	}
+	
+	cell.left   = glyph_shelf_x;
+	cell.top    = glyph_shelf_y;
+	cell.right  = glyph_shelf_x + w;
+	cell.bottom = glyph_shelf_y + h;
+	
+	DIB_ExtTextOut((LPPDEVICE)&glyph_dev, cell.left, cell.top, &cell, (LPSTR)&c, 1, lpFontInfo, lpDrawMode,
+		lpTextXForm, NULL, &cell, ETO_OPAQUE);
+	
+	e->font  = (DWORD)lpFontInfo;
+	e->face  = lpFontInfo->dfFace;
+	e->fg    = lpDrawMode->TextColor;
+	e->bg    = lpDrawMode->bkColor;
+	e->epoch = glyph_epoch;
+	e->ch    = ch;
+	e->x     = cell.left;
+	e->y     = cell.top;
+	e->w     = w;
+	e->h     = h;
+	
+	glyph_shelf_x += w;
+	if(h > glyph_shelf_h)
+	{
+		glyph_shelf_h = h;
+	}
+	
+	return e;
+}
+
+/* rect intersection, FALSE if empty */
+static BOOL glyph_clip(RECT __far *r, RECT __far *clip)
+{
+	if(r->left   < clip->left)   r->left   = clip->left;
+	if(r->top    < clip->top)    r->top    = clip->top;
+	if(r->right  > clip->right)  r->right  = clip->right;
+	if(r->bottom > clip->bottom) r->bottom = clip->bottom;
+	
+	return r->left < r->right && r->top < r->bottom;
+}
+
+/* Opaque text run by host blits from glyph atlas, FALSE when DIB engine have to do it */
+static BOOL glyph_textout(LPDIBENGINE lpDestDev, WORD wDestXOrg, WORD wDestYOrg, LPRECT lpClipRect,
+	LPSTR lpString, int wCount, LPFONTINFO lpFontInfo, LPDRAWMODE lpDrawMode,
+	LPTEXTXFORM lpTextXForm, LPSHORT lpCharWidths, LPRECT lpOpaqueRect, WORD wOptions, DWORD __far *lpExtent)
+{
+	RECT clip;
+	RECT bound;
+	WORD i;
+	WORD cnt = 0;
+	WORD epoch;
+	BOOL restarted = FALSE;
+	int  x = wDestXOrg;
+	
+	if(lpDestDev != lpDriverPDevice || (lpDestDev->deFlags & BUSY) || !SVGA_CanBlitOffscreen())
+		return FALSE;
+	
+	if(wCount <= 0 || wCount > GLYPH_RUN_MAX || lpCharWidths != NULL || (wOptions & ETO_GLYPH_INDEX))
+		return FALSE;
+	
+	if(lpDrawMode->bkMode != OPAQUE || lpDrawMode->Rop2 != R2_COPYPEN ||
+		lpDrawMode->CharExtra != 0 || lpDrawMode->TBreakExtra != 0)
+		return FALSE;
+	
+	if((lpFontInfo->dfType & 1) || lpFontInfo->dfUnderline || lpFontInfo->dfStrikeOut || lpFontInfo->dfItalic)
+		return FALSE;
+	
+	if(lpTextXForm != NULL && (lpTextXForm->ftUnderline || lpTextXForm->ftStrikeOut ||
+		lpTextXForm->ftItalic || lpTextXForm->ftOverhang != 0))
+		return FALSE;
+	
+	if(!glyph_atlas_alloc())
+		return FALSE;
+	
+	/* resolve all glyphs before touching screen */
+	epoch = glyph_epoch;
+	for(i = 0; i < wCount; i++)
+	{
+		glyph_entry_t __far *e = glyph_get((BYTE)lpString[i], lpFontInfo, lpDrawMode, lpTextXForm);
+		if(e == NULL)
+			return FALSE;
+		
+		if(glyph_epoch != epoch)
+		{
+			/* atlas was reset by this run, glyphs before are lost, try once again */
+			if(restarted)
+				return FALSE;
+			restarted = TRUE;
+			epoch = glyph_epoch;
+			if(i > 0)
+			{
+				i = (WORD)-1;
+				continue;
+			}
+		}
+		glyph_run[i] = *e;
+	}
+	
+	clip.left   = 0;
+	clip.top    = 0;
+	clip.right  = wScreenX;
+	clip.bottom = wScreenY;
+	if(lpClipRect != NULL && !glyph_clip(&clip, lpClipRect))
+		return FALSE;
+	
+	bound.left   = wDestXOrg;
+	bound.top    = wDestYOrg;
+	bound.bottom = wDestYOrg + lpFontInfo->dfPixHeight;
+	for(i = 0; i < wCount; i++)
+	{
+		glyph_entry_t __far *e = &glyph_run[i];
+		RECT r;
+		
+		r.left   = x;
+		r.top    = wDestYOrg;
+		r.right  = x + e->w;
+		r.bottom = wDestYOrg + e->h;
+		if(glyph_clip(&r, &clip))
+		{
+			svga_blit_t __far *b = &glyph_blits[cnt++];
+			b->sx = e->x + (r.left - x);
+			b->sy = e->y + (r.top - wDestYOrg);
+			b->dx = r.left;
+			b->dy = r.top;
+			b->w  = r.right - r.left;
+			b->h  = r.bottom - r.top;
+		}
+		x += e->w;
+	}
+	bound.right = x;
+	
+	if((wOptions & ETO_OPAQUE) && lpOpaqueRect != NULL)
+	{
+		RECT o = *lpOpaqueRect;
+		
+		if(o.left   < bound.left)   bound.left   = o.left;
+		if(o.top    < bound.top)    bound.top    = o.top;
+		if(o.right  > bound.right)  bound.right  = o.right;
+		if(o.bottom > bound.bottom) bound.bottom = o.bottom;
+		if(!glyph_clip(&bound, &clip))
+			return FALSE;
+		
+		DIB_BeginAccess(lpDestDev, bound.left, bound.top, bound.right, bound.bottom, CURSOREXCLUDE);
+		if(glyph_clip(&o, &clip) &&
+			!SVGA_FillRect(o.left, o.top, o.right - o.left, o.bottom - o.top, lpDrawMode->bkColor))
+		{
+			DIB_EndAccess(lpDestDev, CURSOREXCLUDE);
+			return FALSE;
+		}
+	}
+	else
+	{
+		if(!glyph_clip(&bound, &clip))
+			return FALSE;
+		DIB_BeginAccess(lpDestDev, bound.left, bound.top, bound.right, bound.bottom, CURSOREXCLUDE);
+	}
+	
+	if(cnt > 0 && !SVGA_BlitOffscreen(glyph_atlas, glyph_dev.deDeltaScan, glyph_blits, cnt))
+	{
+		/* opaque rect is already filled, DIB engine fill it again */
+		DIB_EndAccess(lpDestDev, CURSOREXCLUDE);
+		return FALSE;
+	}
+# ifndef HWCURSOR
+	/* DIB engine draws cursor back to frame buffer */
+	SVGA_HWSync();
+# endif
+	DIB_EndAccess(lpDestDev, CURSOREXCLUDE);
+	
+	*lpExtent = ((DWORD)lpFontInfo->dfPixHeight << 16) | (WORD)(x - wDestXOrg);
+	return TRUE;
+}
+#endif /* SVGA && HWBLT */
 
 DWORD WINAPI __loadds ExtTextOut( LPDIBENGINE lpDestDev, WORD wDestXOrg, WORD wDestYOrg, LPRECT lpClipRect,
                                         LPSTR lpString, int wCount, LPFONTINFO lpFontInfo, LPDRAWMODE lpDrawMode,
                                         LPTEXTXFORM lpTextXForm, LPSHORT lpCharWidths, LPRECT lpOpaqueRect, WORD wOptions )
 {
+#if defined(SVGA) && defined(HWBLT)
+	DWORD dwExtent;
+	
+	if(glyph_textout(lpDestDev, wDestXOrg, wDestYOrg, lpClipRect, lpString, wCount, lpFontInfo, lpDrawMode,
+		lpTextXForm, lpCharWidths, lpOpaqueRect, wOptions, &dwExtent))
+	{
+		return dwExtent;
+	}
+#endif
 /*	if(wOptions & ETO_GLYPH_INDEX)
 	{
 		return 0x80000000UL;
@@ -270,5 +1193,246 @@ DWORD WINAPI __loadds ExtTextOut( LPDIBENGINE lpDestDev, WORD wDestXOrg, WORD wD
  	  dbg_printf("(%X) %d\n", lpString[0], wCount);
   }*/
 	
+	switch_draw(lpDestDev);
 	return DIB_ExtTextOut(lpDestDev, wDestXOrg, wDestYOrg, lpClipRect, lpString, wCount, lpFontInfo, lpDrawMode, lpTextXForm, lpCharWidths, lpOpaqueRect, wOptions);
 }
+
+/* Lines, rectangles and pixels only for lost drawing tracking */
+WORD WINAPI __loadds Output( LPPDEVICE lpDestDev, WORD wStyle, WORD wCount,
+                             LPPOINT lpPoints, LPPPEN lpPPen, LPPBRUSH lpPBrush,
+                             LPDRAWMODE lpDrawMode, LPRECT lpClipRect )
+{
+	switch_draw(lpDestDev);
+	return DIB_Output(lpDestDev, wStyle, wCount, lpPoints, lpPPen, lpPBrush, lpDrawMode, lpClipRect);
+}
+
+DWORD WINAPI __loadds Pixel( LPPDEVICE lpDestDev, WORD X, WORD Y, DWORD dwPhysColor, LPDRAWMODE lpDrawMode )
+{
+	switch_draw(lpDestDev);
+	return DIB_Pixel(lpDestDev, X, Y, dwPhysColor, lpDrawMode);
+}
+
+#ifdef HWBLT
+
+#if defined(SVGA)
+/* pixel format of DIB which host can read directly, FALSE if can't */
+static BOOL dib_guest_format(LPBITMAPINFO lpInfo, WORD __far *lpDepth)
+{
+	LPBITMAPINFOHEADER bmi = &lpInfo->bmiHeader;
+	
+	if(bmi->biPlanes != 1)
+		return FALSE;
+	
+	if(bmi->biBitCount == 32 && bmi->biCompression == BI_RGB)
+	{
+		*lpDepth = 24;
+		return TRUE;
+	}
+	
+	if(bmi->biBitCount == 16)
+	{
+		if(bmi->biCompression == BI_RGB)
+		{
+			*lpDepth = 15;
+			return TRUE;
+		}
+		
+		if(bmi->biCompression == BI_BITFIELDS)
+		{
+			DWORD __far *masks = (DWORD __far *)&lpInfo->bmiColors[0];
+			if(masks[0] == 0xF800UL && masks[1] == 0x07E0UL && masks[2] == 0x001FUL)
+			{
+				*lpDepth = 16;
+				return TRUE;
+			}
+		}
+	}
+	
+	return FALSE;
+}
+
+/*
+ * Send 'lines' long DIB image on lpBits directly to screen by host. Image
+ * top row is on screen row dstTop and left column on dstLeft, result is
+ * clipped by screen and lpClipRect.
+ */
+static BOOL dib_guest_blit(LPDIBENGINE lpDestDev, LPBITMAPINFO lpInfo, LPVOID lpBits, DWORD lines, BOOL bottomUp,
+	LONG dstLeft, LONG dstTop, LPRECT lpClipRect)
+{
+	LPBITMAPINFOHEADER bmi = &lpInfo->bmiHeader;
+	WORD  depth;
+	DWORD pitch;
+	DWORD lAddr;
+	RECT  clip;
+	RECT  r;
+	svga_blit_t blit;
+	BOOL  rc;
+	
+	if(lpDestDev != lpDriverPDevice || (lpDestDev->deFlags & BUSY) || !SVGA_CanBlitOffscreen())
+		return FALSE;
+	
+	if(lines == 0 || !dib_guest_format(lpInfo, &depth))
+		return FALSE;
+	
+	/* coordinates must fit into RECT */
+	if(dstLeft < -32767L || dstTop < -32767L || dstLeft + (LONG)bmi->biWidth > 32767L || dstTop + (LONG)lines > 32767L)
+		return FALSE;
+	
+	clip.left   = 0;
+	clip.top    = 0;
+	clip.right  = wScreenX;
+	clip.bottom = wScreenY;
+	if(lpClipRect != NULL && !glyph_clip(&clip, lpClipRect))
+		return TRUE; /* nothing visible */
+	
+	r.left   = (int)dstLeft;
+	r.top    = (int)dstTop;
+	r.right  = (int)(dstLeft + bmi->biWidth);
+	r.bottom = (int)(dstTop + lines);
+	if(!glyph_clip(&r, &clip))
+		return TRUE;
+	
+	blit.sx = (WORD)(r.left - dstLeft);
+	blit.sy = (WORD)(r.top - dstTop);
+	blit.dx = r.left;
+	blit.dy = r.top;
+	blit.w  = r.right - r.left;
+	blit.h  = r.bottom - r.top;
+	
+	pitch = ((bmi->biWidth * bmi->biBitCount + 31) / 32) * 4;
+	lAddr = DPMI_GetSegBase((WORD)((DWORD)lpBits >> 16)) + (WORD)((DWORD)lpBits);
+	
+	DIB_BeginAccess(lpDestDev, r.left, r.top, r.right, r.bottom, CURSOREXCLUDE);
+	rc = SVGA_BlitGuestImage(lAddr, pitch * lines, pitch, bmi->biBitCount, depth, bottomUp, &blit);
+	DIB_EndAccess(lpDestDev, CURSOREXCLUDE);
+	
+	return rc;
+}
+#endif /* SVGA */
+
+WORD WINAPI __loadds DibToDevice( LPDIBENGINE lpDestDev, WORD X, WORD Y, WORD iScan, WORD cScans,
+                                  LPRECT lpClipRect, LPDRAWMODE lpDrawMode, LPSTR lpDIBits,
+                                  LPBITMAPINFO lpBitmapInfo, LPINT lpTranslate )
+{
+#if defined(SVGA)
+	LONG height = (LONG)lpBitmapInfo->bmiHeader.biHeight;
+	
+	/*
+	 * Only bottom-up DIB: buffer begins with scan iScan which is counted from
+	 * bottom of DIB placed with upper-left corner on X, Y.
+	 */
+	if(height > 0 && cScans > 0 && (LONG)iScan + cScans <= height)
+	{
+		LONG top = (LONG)(short)Y + height - iScan - cScans;
+		
+		if(dib_guest_blit(lpDestDev, lpBitmapInfo, lpDIBits, cScans, TRUE, (short)X, top, lpClipRect))
+		{
+			return cScans;
+		}
+	}
+#endif
+	
+	switch_draw(lpDestDev);
+	return DIB_DibToDevice(lpDestDev, X, Y, iScan, cScans, lpClipRect, lpDrawMode, lpDIBits, lpBitmapInfo, lpTranslate);
+}
+
+BOOL WINAPI __loadds StretchDIBits( LPDIBENGINE lpDestDev, WORD fGet, WORD wDestX, WORD wDestY, WORD wDestWidth,
+                                    WORD wDestHeight, WORD wSrcX, WORD wSrcY, WORD wSrcWidth, WORD wSrcHeight,
+                                    LPVOID lpBits, LPBITMAPINFO lpInfo, LPINT lpTranslate, DWORD dwRop3,
+                                    LPBRUSH lpPBrush, LPDRAWMODE lpDrawMode, LPRECT lpClipRect )
+{
+#if defined(SVGA)
+	LONG height = (LONG)lpInfo->bmiHeader.biHeight;
+	DWORD lines = height < 0 ? -height : height;
+	
+	/* whole DIB 1:1, scaling and partial source is done by DIB engine */
+	if(!fGet && dwRop3 == SRCCOPY && wSrcX == 0 && wSrcY == 0 &&
+		wSrcWidth == wDestWidth && wSrcHeight == wDestHeight &&
+		(DWORD)wSrcWidth == lpInfo->bmiHeader.biWidth && (DWORD)wSrcHeight == lines)
+	{
+		if(dib_guest_blit(lpDestDev, lpInfo, lpBits, lines, height > 0, (short)wDestX, (short)wDestY, lpClipRect))
+		{
+			return TRUE;
+		}
+	}
+#endif
+	
+	switch_draw(lpDestDev);
+	return DIB_StretchDIBits(lpDestDev, fGet, wDestX, wDestY, wDestWidth, wDestHeight, wSrcX, wSrcY, wSrcWidth, wSrcHeight,
+		lpBits, lpInfo, lpTranslate, dwRop3, lpPBrush, lpDrawMode, lpClipRect);
+}
+
+#ifndef COLORONCOLOR
+#define COLORONCOLOR 3
+#endif
+#ifndef HALFTONE
+#define HALFTONE 4
+#endif
+
+/*
+ * Screen to screen SRCCOPY stretch by SVGA3D surfaces when host supports
+ * 3D, everything else by DIB engine.
+ */
+BOOL WINAPI __loadds StretchBlt( LPDIBENGINE lpDestDev, WORD wDestX, WORD wDestY, WORD wDestWidth,
+                                 WORD wDestHeight, LPPDEVICE lpSrcDev, WORD wSrcX, WORD wSrcY,
+                                 WORD wSrcWidth, WORD wSrcHeight, DWORD dwRop3, LPBRUSH lpPBrush,
+                                 LPDRAWMODE lpDrawMode, LPRECT lpClipRect )
+{
+#if defined(SVGA)
+	LPDIBENGINE lpSrc = (LPDIBENGINE)lpSrcDev;
+	
+	/* negative extents (mirroring) are done by DIB engine */
+	if(dwRop3 == SRCCOPY && lpSrc != NULL && lpDestDev == lpDriverPDevice && !(lpDestDev->deFlags & BUSY) &&
+		(lpSrc->deFlags & VRAM) &&
+		lpSrc->deBitsSelector == lpDestDev->deBitsSelector &&
+		lpSrc->deBitsOffset   == lpDestDev->deBitsOffset &&
+		(short)wDestWidth > 0 && (short)wDestHeight > 0 && (short)wSrcWidth > 0 && (short)wSrcHeight > 0 &&
+		SVGA_CanStretch3D())
+	{
+		BOOL shrink = wSrcWidth > wDestWidth || wSrcHeight > wDestHeight;
+		short mode = lpDrawMode != NULL ? lpDrawMode->StretchBltMode : COLORONCOLOR;
+		
+		/* BLACKONWHITE and WHITEONBLACK combine eliminated pixels, host can't do it */
+		if(!shrink || mode == COLORONCOLOR || mode == HALFTONE)
+		{
+			RECT clip;
+			RECT r;
+			BOOL rc;
+			
+			clip.left   = 0;
+			clip.top    = 0;
+			clip.right  = wScreenX;
+			clip.bottom = wScreenY;
+			r.left   = (short)wDestX;
+			r.top    = (short)wDestY;
+			r.right  = (short)wDestX + wDestWidth;
+			r.bottom = (short)wDestY + wDestHeight;
+			
+			if((lpClipRect != NULL && !glyph_clip(&clip, lpClipRect)) || !glyph_clip(&r, &clip))
+			{
+				return TRUE; /* nothing visible */
+			}
+			
+			DIB_BeginAccess(lpDestDev, r.left, r.top, r.right, r.bottom, CURSOREXCLUDE);
+			rc = SVGA_StretchScreen(wSrcX, wSrcY, wSrcWidth, wSrcHeight, (short)wDestX, (short)wDestY, wDestWidth, wDestHeight,
+				&r, mode == HALFTONE);
+# ifndef HWCURSOR
+			/* DIB engine draws cursor back to frame buffer */
+			SVGA_HWSync();
+# endif
+			DIB_EndAccess(lpDestDev, CURSOREXCLUDE);
+			
+			if(rc)
+			{
+				return TRUE;
+			}
+		}
+	}
+#endif
+	
+	switch_draw(lpDestDev);
+	return DIB_StretchBlt(lpDestDev, wDestX, wDestY, wDestWidth, wDestHeight, lpSrcDev, wSrcX, wSrcY,
+		wSrcWidth, wSrcHeight, dwRop3, lpPBrush, lpDrawMode, lpClipRect);
+}
+
+#endif /* HWBLT */
@@ -72,7 +72,9 @@ assume	ds:nothing, es:nothing
 ;; Sorted by ordinal number.
 DIBTHK	EnumObj, 		_lpDriverPDevice
 DIBTHK	RealizeObject,		_lpDriverPDevice
+ifndef HWBLT
 DIBTHK	DibBlt,			_wPalettized
+endif
 DIBTHK	GetPalette,		_lpDriverPDevice
 DIBTHK	SetPaletteTranslate,	_lpDriverPDevice
 DIBTHK	GetPaletteTranslate,	_lpDriverPDevice
@@ -95,8 +97,8 @@ endif
 DIBFWD	ColorInfo
 ;DIBFWD	Control
 DIBFWD	EnumDFonts
-DIBFWD	Output
-DIBFWD	Pixel
+;DIBFWD	Output
+;DIBFWD	Pixel
 DIBFWD	Strblt
 DIBFWD	ScanLR
 DIBFWD	DeviceMode
@@ -106,11 +108,15 @@ DIBFWD	DeviceBitmap
 DIBFWD	FastBorder
 DIBFWD	SetAttribute
 DIBFWD	CreateDIBitmap
+ifndef HWBLT
 DIBFWD	DibToDevice
 DIBFWD	StretchBlt
 DIBFWD	StretchDIBits
 DIBFWD	SelectBitmap
+endif
+ifndef HWBLT
 DIBFWD	BitmapBits
+endif
 DIBFWD	Inquire
 
 
@@ -47,9 +47,9 @@ void __far *drv_malloc(DWORD dwSize, DWORD __far *lpLinear)
 }
 
 /**
- * MEMSET for area larger than one segment. This function is not very effective,
- * I assume it will be called only in few speed non critical situation
- * (driver/screen inicialization or reset).
+ * MEMSET for area larger than one segment, used when there is no VXD
+ * to do it in PM32. Memory is filled by 32K blocks through
+ * one re-based selector.
  *
  * @param dwLinearBase: linear address
  * @param dwOffset: offset to linear address
@@ -62,11 +62,7 @@ void drv_memset_large(DWORD dwLinearBase, DWORD dwOffset, UINT value, DWORD dwNu
 	WORD  wSel;
 	DWORD dwLinPtr;
 	DWORD dwLinPtrMax;
-	WORD  wAddr;
-	BYTE __far *lpPM16Ptr;
-	
-	wSel = DPMI_AllocLDTDesc(1);
-	if(!wSel) return;
+	WORD  wBlock;
 	
 	dwLinPtr = dwLinearBase + dwOffset;
 	dwLinPtrMax = dwLinPtr + dwNum;
@@ -74,23 +70,74 @@ void drv_memset_large(DWORD dwLinearBase, DWORD dwOffset, UINT value, DWORD dwNu
 	/* overflow or nothing to do */
 	if(dwLinPtrMax <= dwLinPtr) return;
 	
-	DPMI_SetSegBase(wSel, dwLinPtr);
+	wSel = DPMI_AllocLDTDesc(1);
+	if(!wSel) return;
+	
 	DPMI_SetSegLimit(wSel, 0xFFFF);
 	
-	for(; dwLinPtr < dwLinPtrMax; dwLinPtr++)
+	while(dwLinPtr < dwLinPtrMax)
 	{
-		wAddr = dwLinPtr & 0xFFFF;
-		
-		/* move to new segment */
-		if(wAddr == 0x0000)
+		wBlock = 0x8000;
+		if(dwLinPtrMax - dwLinPtr < wBlock)
 		{
-			DPMI_SetSegBase(wSel, dwLinPtr);
+			wBlock = (WORD)(dwLinPtrMax - dwLinPtr);
 		}
 		
-		lpPM16Ptr = (BYTE __far *)(wSel :> wAddr);
+		DPMI_SetSegBase(wSel, dwLinPtr);
+		_fmemset(wSel :> 0, value, wBlock);
 		
-		*lpPM16Ptr = value;
+		dwLinPtr += wBlock;
 	}
 	
 	DPMI_FreeLDTDesc(wSel);
 }
+
+/**
+ * MEMCPY for area larger than one segment, used when there is no VXD.
+ * Same as drv_memset_large, memory is copied by 32K blocks.
+ *
+ * @param dwDstLinear: destination linear address
+ * @param dwSrcLinear: source linear address
+ * @param dwNum: number of bytes to copy (areas must not overlap)
+ *
+ **/
+void drv_memcpy_large(DWORD dwDstLinear, DWORD dwSrcLinear, DWORD dwNum)
+{
+	WORD  wSelDst;
+	WORD  wSelSrc;
+	DWORD dwDone = 0;
+	WORD  wBlock;
+	
+	if(dwNum == 0) return;
+	
+	wSelDst = DPMI_AllocLDTDesc(1);
+	if(!wSelDst) return;
+	
+	wSelSrc = DPMI_AllocLDTDesc(1);
+	if(!wSelSrc)
+	{
+		DPMI_FreeLDTDesc(wSelDst);
+		return;
+	}
+	
+	DPMI_SetSegLimit(wSelDst, 0xFFFF);
+	DPMI_SetSegLimit(wSelSrc, 0xFFFF);
+	
+	while(dwDone < dwNum)
+	{
+		wBlock = 0x8000;
+		if(dwNum - dwDone < wBlock)
+		{
+			wBlock = (WORD)(dwNum - dwDone);
+		}
+		
+		DPMI_SetSegBase(wSelDst, dwDstLinear + dwDone);
+		DPMI_SetSegBase(wSelSrc, dwSrcLinear + dwDone);
+		_fmemcpy(wSelDst :> 0, wSelSrc :> 0, wBlock);
+		
+		dwDone += wBlock;
+	}
+	
+	DPMI_FreeLDTDesc(wSelSrc);
+	DPMI_FreeLDTDesc(wSelDst);
+}
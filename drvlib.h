@@ -4,5 +4,6 @@
 void drv_memcpy(void __far *dst, void __far *src, long size);
 void __far *drv_malloc(DWORD dwSize, DWORD __far *lpLinear);
 void drv_memset_large(DWORD dwLinearBase, DWORD dwOffset, UINT value, DWORD dwNum);
+void drv_memcpy_large(DWORD dwDstLinear, DWORD dwSrcLinear, DWORD dwNum);
 
 #endif /* __DRVLIB_H__INCLUDED__ */
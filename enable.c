@@ -34,6 +34,8 @@ THE SOFTWARE.
 
 #ifdef SVGA
 # include "svga_all.h"
+#else
+# include "vbva.h"
 #endif
 
 /* Pretend we have a 208 by 156 mm screen. */
@@ -148,6 +150,11 @@ static uint32 updateX = 0;
 static uint32 updateY = 0;
 static uint32 updateW = 0;
 static uint32 updateH = 0;
+#else
+static WORD updateX = 0;
+static WORD updateY = 0;
+static WORD updateW = 0;
+static WORD updateH = 0;
 #endif
 
 #pragma code_seg( _INIT )
@@ -160,6 +167,18 @@ VOID WINAPI __loadds SVGA_DIB_BeginAccess( LPPDEVICE lpDevice, WORD wLeft, WORD
 	updateW = wRight - wLeft;
 	updateH = wBottom - wTop;
 	
+	/* wait for HW blits, CPU is going to touch frame buffer */
+	SVGA_HWSync();
+	
+	/* pixels from 3D present may be only on host */
+	SVGAHDA_readback(wLeft, wTop, wRight, wBottom);
+	
+	/* excluded cursor is drawn back by CheckCursor */
+	if(wFlags & CURSOREXCLUDE)
+	{
+		cursorDirty = TRUE;
+	}
+	
 	DIB_BeginAccess(lpDevice, wLeft, wTop, wRight, wBottom, wFlags);
 }
 
@@ -168,6 +187,23 @@ VOID WINAPI __loadds SVGA_DIB_EndAccess( LPPDEVICE lpDevice, WORD wFlags )
 	DIB_EndAccess(lpDevice, wFlags);
 	SVGA_UpdateRect(updateX, updateY, updateW, updateH);
 }
+#else
+/* same as SVGA, but dirty rects goes to VBVA ring */
+VOID WINAPI __loadds VBVA_DIB_BeginAccess( LPPDEVICE lpDevice, WORD wLeft, WORD wTop, WORD wRight, WORD wBottom, WORD wFlags )
+{
+	updateX = wLeft;
+	updateY = wTop;
+	updateW = wRight - wLeft;
+	updateH = wBottom - wTop;
+	
+	DIB_BeginAccess(lpDevice, wLeft, wTop, wRight, wBottom, wFlags);
+}
+
+VOID WINAPI __loadds VBVA_DIB_EndAccess( LPPDEVICE lpDevice, WORD wFlags )
+{
+	DIB_EndAccess(lpDevice, wFlags);
+	VBVA_UpdateRect(updateX, updateY, updateW, updateH);
+}
 #endif
 
 
@@ -271,8 +307,9 @@ UINT WINAPI __loadds Enable( LPVOID lpDevice, UINT style, LPSTR lpDeviceType,
         lpEng->deBeginAccess = SVGA_DIB_BeginAccess;
         lpEng->deEndAccess   = SVGA_DIB_EndAccess;
 #else
-        lpEng->deBeginAccess = DIB_BeginAccess;
-        lpEng->deEndAccess   = DIB_EndAccess;
+        /* without VBVA these are only passing to DIB engine */
+        lpEng->deBeginAccess = VBVA_DIB_BeginAccess;
+        lpEng->deEndAccess   = VBVA_DIB_EndAccess;
 #endif
 
         /* Program the DAC in non-direct color modes. */
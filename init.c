@@ -32,7 +32,7 @@ THE SOFTWARE.
 #include "minidrv.h"
 #include <configmg.h>
 
-#ifdef SVGA
+#if defined(SVGA) || defined(QEMU)
 #include <stdint.h>
 #include "control_vxd.h"
 #endif
@@ -52,6 +52,7 @@ DWORD   VDDEntryPoint = 0;  /* The VDD entry point. */
 #ifdef QEMU
 DWORD   ConfigMGEntryPoint = 0;     /* The configuration manager entry point. */
 DWORD   LfbBase = 0;                /* The physical base address of the linear framebuffer. */
+DWORD   MmioBase = 0;               /* The physical base address of the std-vga MMIO BAR, or 0. */
 #endif
 
 /* On Entry:
@@ -279,6 +280,7 @@ UINT FAR DriverInit( UINT cbHeap, UINT hModule, LPSTR lpCmdLine )
  
     /* Read the display configuration before doing anything else. */
     LfbBase = 0;
+    MmioBase = 0;
     devNode = ReadDisplayConfig();
 
     /* Use the Configuration Manager to locate the base address of the linear framebuffer. */
@@ -291,7 +293,8 @@ UINT FAR DriverInit( UINT cbHeap, UINT hModule, LPSTR lpCmdLine )
            ULONG cbAllocMax = 0;
 
             /* Take the largest physical memory range in use by this device
-             * and store it into LfbBase. */
+             * and store it into LfbBase. The 4K range is the MMIO register
+             * BAR (DISPI and VGA registers), store it into MmioBase. */
             while( CM_Get_Next_Res_Des( &rd, rd, ResType_Mem, NULL, 0 ) == CR_SUCCESS ) {
 
                 /* Experimentally, no MEM_RES was found to be larger than 0x28 bytes
@@ -308,12 +311,14 @@ UINT FAR DriverInit( UINT cbHeap, UINT hModule, LPSTR lpCmdLine )
                         cbAllocMax = cbAlloc;
                         LfbBase = pMemDes->MD_Alloc_Base;
                     }
+                    if( cbAlloc == QEMU_MMIO_SIZE )
+                        MmioBase = pMemDes->MD_Alloc_Base;
                 }
             }
         }
     }
 
-    dbg_printf("DriverInit: LfbBase is %lX\n", LfbBase);
+    dbg_printf("DriverInit: LfbBase is %lX, MmioBase is %lX\n", LfbBase, MmioBase);
  
     /* Return 1 (success) iff we located the physical address of the linear framebuffer. */
     return ( !!LfbBase );
@@ -346,6 +351,14 @@ UINT FAR DriverInit( UINT cbHeap, UINT hModule, LPSTR lpCmdLine )
 		 dbg_printf("VXD load success\n");
 #endif
 
+#ifdef QEMU
+		/* VXD is optional here, it's only used to speed up large memory operations */
+		if(!VXD_load())
+		{
+			dbg_printf("VXD not found, using PM16 memory functions\n");
+		}
+#endif
+
     return( 1 );    /* Success. */
 }
 #endif
@@ -79,6 +79,11 @@ static unsigned long vid_ind( void *cx, unsigned port )
 {
     return( inpd_asm( port ) );
 }
+
+static void vid_outd( void *cx, unsigned port, unsigned long val )
+{
+    outpd_asm( port, val );
+}
 #endif
 
 #else
@@ -87,6 +87,9 @@ extern DWORD    VDDEntryPoint;
 extern WORD     OurVMHandle;
 #ifdef QEMU
 extern DWORD    LfbBase;
+extern DWORD    MmioBase;
+
+#define QEMU_MMIO_SIZE  0x1000      /* Size of the std-vga MMIO BAR. */
 #endif
 
 extern WORD wMesa3DEnabled;         /* Is possible to accelerate though Mesa3D SVGA */
@@ -96,6 +99,10 @@ WORD CalcPitch(WORD x, WORD bpp);
 typedef void (__far * FastBitBlt_t) (unsigned dx, unsigned dy, unsigned sx, unsigned sy, unsigned w, unsigned h);
 extern FastBitBlt_t FastBitBlt;
 
+typedef BOOL (WINAPI * BitBltDevProc_t)( LPDIBENGINE, WORD, WORD, LPPDEVICE, WORD, WORD,
+                                         WORD, WORD, DWORD, LPBRUSH, LPDRAWMODE );
+extern BitBltDevProc_t BitBltDevProc; /* HW BitBlt, NULL if not accelerated */
+
 /*
  * frame buffer direct hadrware access, allow user space programs/drivers write
  * to device frame buffer directly
@@ -111,6 +118,7 @@ typedef struct _FBHDA
 	DWORD        fb_pm32; /* eq. linear address, mapped to shared or kernel space*/
 	void __far * fb_pm16; /* usable in this driver */
 	DWORD flags;
+	DWORD pages; /* screen pages from fb_pm32 reserved for flipping by FBHDA_FLIP */
 } FBHDA;
 #pragma pack(pop)
 
@@ -142,6 +150,28 @@ extern void CallVDD( unsigned Function );
 /* DirectDraw support */
 BOOL DDCreateDriverObject(int bReset);
 
+/* Page flipping: scanout from other (aligned) offset in VRAM */
+extern DWORD dwDisplayStart;        /* Current scanout offset in VRAM. */
+extern WORD  wScreenPages;          /* Screen pages reserved for flipping. */
+BOOL CanSetDisplayStart( void );
+BOOL SetDisplayStart( DWORD dwOffset );
+BOOL IsDisplayStartDone( void );
+
+/* Screen switch snapshot (skip USER repaint on return from DOS) */
+extern BOOL bSwitchDrawLost;        /* drawing to busy screen was lost */
+BOOL SaveScreenSnapshot( void );
+BOOL RestoreScreenSnapshot( void );
+
+/* TRUE if DirectDraw Blt can be done by host (SVGA_DDBLT escape). */
+BOOL CanAccelDDBlt( void );
+
+/* TRUE if DirectDraw overlay can be shown by host video stream (SVGA_OVERLAY escape). */
+BOOL CanOverlay( void );
+BOOL CanVBlank( void );
+
+/* Non-zero if adapter and VRAM can do the mode (ValidateMode, DirectDraw mode list). */
+int IsModeOK( WORD wXRes, WORD wYRes, WORD wBpp );
+
 /* 9x VRAM limit */
 #ifdef VRAM256MB
 # define MAX_VRAM 0x10000000UL /* 256 MB */
@@ -150,6 +180,93 @@ BOOL DDCreateDriverObject(int bReset);
 #endif
 
 #ifdef SVGA
-#define SVGA_PARTIAL_UPDATE_MAX 16
+/* flush damage immediately when it is larger than 1/N of screen */
+#define SVGA_DAMAGE_FLUSH_AREA 4
 extern void SVGA_UpdateRect(LONG x, LONG y, LONG w, LONG h);
+extern void SVGA_UpdateFlush();
+extern BOOL SVGA_UpdatePace();
+extern BOOL SVGA_CanUpdate();
+extern BOOL SVGA_CanHWCursor();
+extern BOOL cursorDirty;
+# ifdef HWCURSOR
+extern void SVGA_CursorReset();
+# endif
+# ifdef SCREENTARGET
+extern BOOL SVGA_GetScreenTarget(DWORD __far *lpOut);
+# endif
+extern void SVGA_Pal8Update(UINT wStart, UINT wEnd, RGBQUAD FAR *lpPal);
+extern BOOL SVGA_CopyRect(LONG sx, LONG sy, LONG dx, LONG dy, LONG w, LONG h);
+extern BOOL SVGA_FillRect(LONG x, LONG y, LONG w, LONG h, DWORD color);
+extern void SVGA_HWSync();
+extern void SVGAHDA_readback(LONG left, LONG top, LONG right, LONG bottom);
+extern volatile DWORD __far *SVGAHDA_enabled;
+extern DWORD SVGA_DDFill(DWORD dstOffset, DWORD dstPitch, LONG x, LONG y, LONG w, LONG h, DWORD color);
+extern DWORD SVGA_DDCopy(DWORD srcOffset, DWORD srcPitch, LONG sx, LONG sy,
+                         DWORD dstOffset, DWORD dstPitch, LONG dx, LONG dy, LONG w, LONG h);
+extern BOOL SVGA_DDLock(DWORD offset, DWORD pitch, LONG left, LONG top, LONG right, LONG bottom);
+extern BOOL SVGA_DDUnlock(DWORD offset);
+
+/*
+ * Surface IDs used by driver, reserved in user list ID map. They are
+ * at the beginning of ID space, so surface OTable can stay small
+ * (user space 3D driver allocates IDs from the bottom too).
+ */
+#define SVGA_SCRATCH_SRC_SID 1
+#define SVGA_SCRATCH_DST_SID 2
+#define SVGA_PRIMARY_SID     3 /* screen target primary */
+
+/* SVGA_OVERLAY input, surface is addressed by linear address in VRAM */
+#define SVGA_OVERLAY_STREAMS 2
+#define SVGA_OVERLAY_KEY     0x1 /* show video only where screen pixel is 'colorkey' */
+
+typedef struct _svga_overlay_t
+{
+	DWORD stream;    /* 0 .. SVGA_OVERLAY_STREAMS-1 */
+	DWORD enabled;   /* 0 = hide */
+	DWORD flags;
+	DWORD src;       /* YUY2 or UYVY surface */
+	DWORD srcPitch;
+	DWORD fourcc;
+	DWORD width;     /* surface size */
+	DWORD height;
+	LONG  srcX;      /* visible part of surface */
+	LONG  srcY;
+	DWORD srcW;
+	DWORD srcH;
+	LONG  dstX;      /* screen rect, host scales */
+	LONG  dstY;
+	DWORD dstW;
+	DWORD dstH;
+	DWORD colorkey;  /* destination key in screen format */
+} svga_overlay_t;
+
+extern BOOL SVGA_OverlayUpdate(svga_overlay_t __far *ov);
+extern BOOL SVGA_OverlayPosition(DWORD stream, LONG x, LONG y);
+
+/* one rect of SVGA_BlitOffscreen */
+typedef struct _svga_blit_t
+{
+	WORD sx;
+	WORD sy;
+	WORD dx;
+	WORD dy;
+	WORD w;
+	WORD h;
+} svga_blit_t;
+
+extern BOOL SVGA_CanBlitOffscreen();
+extern BOOL SVGA_BlitOffscreen(DWORD srcOffset, DWORD srcPitch, svga_blit_t __far *lpBlits, WORD cnt);
+extern DWORD SVGA_BlitGMR(DWORD gmrId, DWORD srcPitch, svga_blit_t __far *lpBlits, WORD cnt);
+extern BOOL SVGA_CanStretch3D();
+extern BOOL SVGA_StretchScreen(WORD sx, WORD sy, WORD sw, WORD sh, int dx, int dy, WORD dw, WORD dh,
+	RECT __far *lpClip, BOOL filter);
+# ifdef HWBLT
+extern void SVGA_BitmapsDrop();
+# endif
+extern BOOL SVGA_BlitGuestImage(DWORD lAddr, DWORD size, DWORD pitch, WORD bpp, WORD depth, BOOL bottomUp, svga_blit_t __far *lpBlit);
+# ifdef HWBLT
+extern BOOL WINAPI __loadds SVGA_BitBltDev( LPDIBENGINE lpDestDev, WORD wDestX, WORD wDestY, LPPDEVICE lpSrcDev,
+                    WORD wSrcX, WORD wSrcY, WORD wXext, WORD wYext, DWORD dwRop3,
+                    LPBRUSH lpPBrush, LPDRAWMODE lpDrawMode );
+# endif
 #endif
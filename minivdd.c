@@ -162,9 +162,30 @@ Remarks
 This routine is called during the save process of a VESA hi-res screen. It tells the Main VDD how large each bank is (so that during the save and restore process, it will know how many bytes to process per pass of the save/restore loop). It also informs the Main VDD where to access the VRAM. Most VESA programs currently set their VRAM at A000:0h. However, VESA version 2 does allow for flat linear apertures. The mini-VDD should determine if the VESA program is using an aperture and return the correct data to the Main VDD. 
 
 **/
-VDDPROC(GET_BANK_SIZE, get_bank_size)
+/* VESA save/restore through whole LFB, set by MiniVDD_HiresInit */
+static DWORD hires_fb_phys = 0;
+static DWORD hires_fb_size = 0;
+
+/*
+ * GET_BANK_SIZE and GET_TOTAL_VRAM_SIZE return values in registers and CY,
+ * not in client registers, so they have own entries instead of VDDPROC.
+ * One bank covers whole LFB, so main VDD saves/restores screen in one pass
+ * instead of 64K banks at A000h.
+ */
+void __declspec(naked) get_bank_size_entry()
 {
-	
+	_asm
+	{
+		cmp [hires_fb_size], 0
+		je bank_size_nc
+		mov eax, [hires_fb_phys]
+		mov edx, [hires_fb_size]
+		stc
+		ret
+		bank_size_nc:
+		clc
+		ret
+	}
 }
 
 /**
@@ -212,21 +233,37 @@ VESA BIOS function 4F00h to obtain this information.
 For performance reasons, you should implement this function. 
 
 **/
-VDDPROC(GET_TOTAL_VRAM_SIZE, get_total_vram_size)
+void __declspec(naked) get_total_vram_size_entry()
 {
-#ifdef SVGA
-	if(svga_init_success)
+	_asm
+	{
+		cmp [hires_fb_size], 0
+		je total_vram_nc
+		mov ecx, [hires_fb_size]
+		stc
+		ret
+		total_vram_nc:
+		clc
+		ret
+	}
+}
+
+/*
+ * Register LFB for VESA save/restore, size is whole VRAM which can be
+ * accessed through LFB. Called after dispatch table is filled.
+ */
+void MiniVDD_HiresInit(DWORD *table, DWORD fb_phys, DWORD fb_size)
+{
+	if(fb_phys == 0 || fb_size == 0)
 	{
-		uint32 vram_size = SVGA_ReadReg(SVGA_REG_VRAM_SIZE);
-		state->Client_ECX = vram_size;
-		
-		VDD_CY;
 		return;
 	}
-	
-	state->Client_ECX = 0;
-	VDD_NC;
-#endif
+
+	hires_fb_phys = fb_phys;
+	hires_fb_size = fb_size;
+
+	table[GET_BANK_SIZE]       = (DWORD)get_bank_size_entry;
+	table[GET_TOTAL_VRAM_SIZE] = (DWORD)get_total_vram_size_entry;
 }
 
 /**
@@ -242,7 +279,11 @@ This call is very similar to PRE_HIRES_TO_VGA in that it allows the mini-VDD to
 **/
 VDDPROC(PRE_HIRES_SAVE_RESTORE, pre_hires_save_restore)
 {
-	
+#ifdef QEMU
+	/* same as PRE_HIRES_TO_VGA, main VDD is accessing DISPI during save/restore */
+	Disable_Global_Trapping(0x1CE);
+	Disable_Global_Trapping(0x1CF);
+#endif
 }
 
 /**
@@ -258,7 +299,11 @@ This function is very similar to POST_HIRES_TO_VGA in that it allows the mini-VD
 **/
 VDDPROC(POST_HIRES_SAVE_RESTORE, post_hires_save_restore)
 {
-	
+#ifdef QEMU
+	DISPI_Invalidate();
+	Enable_Global_Trapping(0x1CE);
+	Enable_Global_Trapping(0x1CF);
+#endif
 }
 
 /**
@@ -329,7 +374,15 @@ This routine could also be used to setup a VESA call while still letting the Rin
 **/
 VDDPROC(VESA_SUPPORT, vesa_support)
 {
-	
+#ifdef QEMU
+	/* display start and palette (page flipping DOS games) */
+	if(DISPI_VBECall(state))
+	{
+		VDD_CY;
+		return;
+	}
+#endif
+	VDD_NC;
 }
 
 void Enable_Global_Trapping(DWORD port)
@@ -364,12 +417,14 @@ VDDPROC(PRE_HIRES_TO_VGA, pre_hires_to_vga)
 
 VDDPROC(POST_HIRES_TO_VGA, post_hires_to_vga)
 {
+	DISPI_Invalidate();
 	Enable_Global_Trapping(0x1CE);
 	Enable_Global_Trapping(0x1CF);
 }
 
 VDDPROC(ENABLE_TRAPS, enable_traps)
 {
+	DISPI_Invalidate();
 	Enable_Global_Trapping(0x1CE);
 	Enable_Global_Trapping(0x1CF);
 }
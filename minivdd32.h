@@ -106,6 +106,15 @@ void dbg_printf( const char *s, ... );
 
 #define VDDPROC(_fnname, _procname) void __stdcall _procname ## _proc(PCRS_32 state)
 
+void MiniVDD_HiresInit(DWORD *table, DWORD fb_phys, DWORD fb_size);
+
+#ifdef QEMU
+/* drop cached DISPI registers (qemuvxd.c) */
+void DISPI_Invalidate();
+/* VBE call done in ring 0 (qemuvxd.c), FALSE = BIOS has to do it */
+BOOL DISPI_VBECall(PCRS_32 state);
+#endif
+
 #define VDD_CY state->Client_EFlags |= 0x1
 #define VDD_NC state->Client_EFlags &= 0xFFFFFFFEUL
 
@@ -46,14 +46,16 @@ VDDFUNC(DISPLAY_DRIVER_DISABLING, display_driver_disabling)
 //VDDFUNC(GET_CURRENT_BANK_READ, get_current_bank_read)
 ///! VDDFUNC(SET_BANK, set_bank)
 //VDDFUNC(CHECK_HIRES_MODE, check_hires_mode)
-#ifdef SVGA
-VDDFUNC(GET_TOTAL_VRAM_SIZE, get_total_vram_size)
-#endif
+/* GET_TOTAL_VRAM_SIZE, GET_BANK_SIZE: MiniVDD_HiresInit */
 ///! VDDFUNC(GET_BANK_SIZE, get_bank_size)
 ///! VDDFUNC(SET_HIRES_MODE, set_hires_mode)
-///! VDDFUNC(PRE_HIRES_SAVE_RESTORE, pre_hires_save_restore)
-///! VDDFUNC(POST_HIRES_SAVE_RESTORE, post_hires_save_restore)
-///! VDDFUNC(VESA_SUPPORT, vesa_support)
+#ifdef QEMU
+VDDFUNC(PRE_HIRES_SAVE_RESTORE, pre_hires_save_restore)
+VDDFUNC(POST_HIRES_SAVE_RESTORE, post_hires_save_restore)
+#endif
+#ifdef QEMU
+VDDFUNC(VESA_SUPPORT, vesa_support)
+#endif
 #ifdef SVGA
 VDDFUNC(GET_CHIP_ID, get_chip_id)
 #endif
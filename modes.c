@@ -37,11 +37,22 @@ THE SOFTWARE.
 
 #ifdef SVGA
 # include "svga_all.h"
+# include "svga_overlay.h"
+# include "vmwsvxd.h"
+#endif
+
+#if defined(SVGA) || defined(QEMU)
 # include "control_vxd.h"
 #endif
 
 #include "drvlib.h"
 #include "dpmi.h"
+#include "vramheap.h"
+#include "damage.h"
+
+#if !defined(SVGA) && !defined(QEMU)
+#include "vbva.h"
+#endif
 
 #include <string.h> /* _fmemset */
 #include <stdlib.h> /* abs */
@@ -60,7 +71,7 @@ THE SOFTWARE.
 
 WORD wScreenX       = 0;
 WORD wScreenY       = 0;
-WORD BitBltDevProc  = 0;
+BitBltDevProc_t BitBltDevProc = NULL;
 WORD ScreenSelector = 0;
 WORD wPDeviceFlags  = 0;
 
@@ -76,6 +87,14 @@ DWORD FBHDA_linear = 0;
        DWORD    dwVideoMemorySize = 0;  /* Installed VRAM in bytes. */
 static WORD     wScreenPitchBytes = 0;  /* Current scanline pitch. */
 static DWORD    dwPhysVRAM = 0;         /* Physical LFB base address. */
+       DWORD    dwDisplayStart = 0;     /* Scanout offset in VRAM (page flip). */
+       WORD     wScreenPages = 1;       /* Screen pages reserved for flipping (FBHDA). */
+#ifndef SVGA
+static WORD     wVirtHeight = 0;        /* VBE virtual height, limit of display start. */
+#endif
+#ifdef QEMU
+static WORD     MmioSelector = 0;       /* Selector of the std-vga MMIO BAR. */
+#endif
 
 /* These are currently calculated not needed in the absence of
  * offscreen video memory.
@@ -115,13 +134,98 @@ extern DWORD CallVDDRegister( WORD Function, WORD wPitch, WORD wHeight, void _fa
 #ifdef SVGA
 void SVGAHDA_init();
 void SVGAHDA_setmode();
-WORD SVGA_3DSupport();
+void SVGA_3DProbe();
 void SVGAHDA_update(DWORD width, DWORD height, DWORD bpp, DWORD pitch);
 BOOL SVGAHDA_lock(DWORD lockid);
+BOOL SVGAHDA_lockBounded(DWORD lockid, DWORD ms);
 BOOL SVGAHDA_trylock(DWORD lockid);
 void SVGAHDA_unlock(DWORD lockid);
+void SVGAHDA_readbackLocked(LONG left, LONG top, LONG right, LONG bottom);
+BOOL SVGAHDA_pendingPush(LONG left, LONG top, LONG right, LONG bottom);
+BOOL SVGAHDA_presentPush(LONG left, LONG top, LONG right, LONG bottom);
+void SVGAHDA_pendingDrainLocked();
 
 #define LOCK_FIFO 6
+#define SVGA_MODE_LOCK_TIMEOUT 2000 /* ms, FIFO owner is considered dead after it */
+
+static BOOL SVGA_hasAccelScreen();
+static BOOL SVGA_shadowClear();
+
+/*
+ * Shadow surface: SVGA commands works only with 32 bpp, so in 8 and 16 bpp
+ * the hardware is set to 32 bpp, GDI draws to shadow surface on VRAM begin
+ * and the dirty rects are converted to 32bpp screen object which is placed
+ * after it. 8 bpp is expanded by palette and send by SVGA_CMD_UPDATE,
+ * 16 bpp is converted by host with SVGA_CMD_BLIT_GMRFB_TO_SCREEN.
+ */
+static WORD  SVGA_shadow_bpp    = 0; /* 8 or 16 when shadow surface is used */
+static DWORD SVGA_screen_offset = 0; /* 32bpp screen offset in VRAM */
+static DWORD SVGA_screen_pitch  = 0; /* 32bpp screen pitch */
+static DWORD SVGA_pal8_lut[256];     /* palette index -> X8R8G8B8 */
+
+/*
+ * Host frame buffer tracing (SVGA_REG_TRACES), [display] svga_traces
+ * in SYSTEM.INI: 0 = never, only explicit updates are used (low bpp
+ * modes without shadow surface need host with working SVGA_CMD_UPDATE),
+ * 1 = always, 2 = only when explicit updates cannot be used (default).
+ */
+#define SVGA_TRACES_OFF  0
+#define SVGA_TRACES_ON   1
+#define SVGA_TRACES_AUTO 2
+
+static WORD SVGA_traces_cfg = SVGA_TRACES_AUTO;
+static BOOL SVGA_traces_on  = FALSE;
+
+/*
+ * Frame buffer dirty scan, [display] dirty_scan in SYSTEM.INI (1 = on,
+ * default 0): without traces VxD derives damage from dirty bits of screen
+ * PTEs, so applications writing the primary directly are shown too. Only
+ * when the screen is direct view of VRAM (32 bpp, no shadow, no screen
+ * target). Off by default, GDI drawing is already presented and bands
+ * would send it once more.
+ */
+static WORD SVGA_dirty_cfg = 0;
+
+/*
+ * 2D submission path of VxD updates, [display] present_path in SYSTEM.INI
+ * (PRESENT_PATH_*): 0 = VxD times FIFO and CB on first mode set and keeps
+ * the faster one (default), 1 = FIFO, 2 = command buffers. Measured path
+ * is written to [display] present_path_measured and to perf counters.
+ */
+static WORD SVGA_present_path_cfg = PRESENT_PATH_AUTO;
+static BOOL SVGA_present_path_set = FALSE;
+
+/*
+ * Screen object layout, [display] screens in SYSTEM.INI: desktop is split
+ * to N screen objects side by side (N monitors on host, one wide desktop
+ * in Windows). Damage is tracked per screen. Screen target primary is
+ * always single screen.
+ */
+#define SVGA_SCREENS_MAX 4
+
+static WORD SVGA_screens_cfg     = 1;
+static WORD SVGA_screens         = 1; /* screens in current mode */
+static WORD SVGA_screens_defined = 0; /* screen object IDs defined on host */
+static LONG SVGA_screen_w        = 0; /* width of one screen, last one takes the rest */
+
+#define SCREEN_LEFT(_s)  ((LONG)(_s)*SVGA_screen_w)
+#define SCREEN_RIGHT(_s) ((_s)+1 >= SVGA_screens ? (LONG)wScreenX : SCREEN_LEFT((_s)+1))
+
+#ifdef SCREENTARGET
+/*
+ * Screen target: on hosts with GB objects the primary is GB surface
+ * bound to screen target 0. GDI still draws to VRAM, damage is copied
+ * (SURFACE_DMA) to the surface and shown by UPDATE_GB_SCREENTARGET.
+ * Legacy screen object commands (RECT_*, BLIT_GMRFB_TO_SCREEN) are not
+ * used in this mode.
+ */
+static BOOL  SVGA_stdu        = FALSE; /* primary is screen target */
+static BOOL  SVGA_stdu_def    = FALSE; /* surface and target are defined on host */
+static DWORD SVGA_stdu_offset = 0;     /* source of presented image in VRAM */
+static DWORD SVGA_stdu_pitch  = 0;
+#else
+# define SVGA_stdu FALSE
+#endif
 
 #endif
 
@@ -187,9 +291,79 @@ WORD CalcPitch( WORD x, WORD bpp )
     return( wPitch );
 }
 
+#ifndef SVGA
+/* Max. number of screen pages reserved for FBHDA flipping (triple buffering). */
+#define SCREEN_PAGES_MAX 3
+
+/*
+ * Number of pages which can be reserved in VRAM, at least space of one
+ * screen is left for DirectDraw and GDI cache.
+ */
+static WORD CalcScreenPages( WORD wXRes, WORD wYRes, WORD wBpp )
+{
+    DWORD   dwScreen = (DWORD)CalcPitch( wXRes, wBpp ) * wYRes;
+    WORD    wPages;
+
+    for( wPages = SCREEN_PAGES_MAX; wPages > 1; --wPages ) {
+        if( dwScreen * (wPages + 1) <= dwVideoMemorySize )
+            break;
+    }
+
+    return( wPages );
+}
+
+/*
+ * Virtual height covers all VRAM, so scanout can be moved to any page
+ * or DirectDraw surface. VBE registers are 16-bit (BOXV_ext_mode_set
+ * takes int).
+ */
+static WORD CalcVirtHeight( WORD wXRes, WORD wYRes, WORD wBpp )
+{
+    DWORD   dwLines = dwVideoMemorySize / CalcPitch( wXRes, wBpp );
+
+    if( dwLines > 0x7FFF )
+        dwLines = 0x7FFF;
+
+    if( dwLines < wYRes )
+        dwLines = wYRes;
+
+    return( (WORD)dwLines );
+}
+#endif
+
+
+#ifdef SVGA
+/* shadow surface needs mapped FIFO and screen object (placed out of VRAM begin) */
+static BOOL SVGA_shadowPossible(WORD wBpp)
+{
+  if(wBpp != 8 && wBpp != 16)
+  {
+    return FALSE;
+  }
+  
+  return gSVGA.fifoLinear != 0 && SVGA_hasAccelScreen();
+}
+
+/* 32bpp screen is after shadow surface, page aligned */
+static DWORD SVGA_shadowOffset(WORD wXRes, WORD wYRes, WORD wBpp)
+{
+  return ((DWORD)CalcPitch(wXRes, wBpp) * wYRes + 0xFFFUL) & ~0xFFFUL;
+}
+
+/* pitch of surface which GDI draws to */
+static WORD SVGA_surfacePitch(WORD wXRes)
+{
+  if(SVGA_shadow_bpp)
+  {
+    return CalcPitch(wXRes, SVGA_shadow_bpp);
+  }
+  
+  return SVGA_ReadRegCached(SVGA_REG_BYTES_PER_LINE);
+}
+#endif
 
 /* Return non-zero if given mode is supported. */
-static int IsModeOK( WORD wXRes, WORD wYRes, WORD wBpp )
+int IsModeOK( WORD wXRes, WORD wYRes, WORD wBpp )
 {
     MODEDESC    mode;
     DWORD       dwModeMem;
@@ -211,6 +385,16 @@ static int IsModeOK( WORD wXRes, WORD wYRes, WORD wBpp )
 #endif
     
 #ifdef SVGA
+    if(SVGA_shadowPossible(wBpp))
+    {
+      /* shadow surface + 32bpp screen */
+      dwModeMem = SVGA_shadowOffset(wXRes, wYRes, wBpp) + (DWORD)CalcPitch(wXRes, 32) * wYRes;
+      if(dwModeMem > dwVideoMemorySize)
+        return 0;
+      
+      return 1;
+    }
+    
     /* some implementations not support 8 and 16 bpp */
     if(gSVGA.only32bit && wBpp != 32)
     {
@@ -251,144 +435,1608 @@ static void ClearVisibleScreen( void )
   while( wLines-- ) {
     for( i = 0; i < wScreenPitchBytes / 4; ++i )
     {
-      lpScr[i] = 0;
+      lpScr[i] = 0;
+    }
+    lpScr += wScreenPitchBytes; // Scanline pitch.
+  }
+#endif
+	DWORD dwLinestart = 0;
+	DWORD dwLineSize = (DWORD)wScreenX*((wBpp+7) >> 3);
+	WORD wLines = wScreenY;
+	
+#ifdef SVGA
+	/* host fill is much faster than touching whole frame by CPU, screen is updated by it too */
+	if(SVGA_FillRect(0, 0, wScreenX, wScreenY, 0))
+	{
+		return;
+	}
+#endif
+	
+#if defined(SVGA) || defined(QEMU)
+	/* VXD fills by dwords, when there is no off-screen area on right, clear all in one call */
+	if(dwLineSize == wScreenPitchBytes)
+	{
+		if(VXD_memset(dwScreenFlatAddr, 0, dwLineSize*wScreenY))
+		{
+			wLines = 0;
+		}
+	}
+	
+	while(wLines > 0 && VXD_memset(dwScreenFlatAddr + dwLinestart, 0, dwLineSize))
+	{
+		dwLinestart += (DWORD)wScreenPitchBytes;
+		wLines--;
+	}
+#endif
+	
+	/* no VXD */
+	while(wLines--)
+	{
+		drv_memset_large(dwScreenFlatAddr, dwLinestart, 0, dwLineSize);
+		
+		dwLinestart += (DWORD)wScreenPitchBytes;
+	}
+	
+#ifdef SVGA
+	/* expanded screen is cleared by host too, no need to convert whole frame */
+	if(!SVGA_shadowClear())
+	{
+		SVGA_UpdateRect(0, 0, wScreenX, wScreenY);
+	}
+#elif !defined(QEMU)
+	VBVA_UpdateRect(0, 0, wScreenX, wScreenY);
+	VBVA_UpdateFlush();
+#endif
+}
+
+/* Map physical memory to memory space, lpLinAddress is option pointer to store
+ * mapped linear address
+ */
+static DWORD AllocLinearSelector(DWORD dwPhysAddr, DWORD dwSize, DWORD __far * lpLinAddress)
+{
+    WORD    wSel;
+    DWORD   dwLinear;
+
+    wSel = DPMI_AllocLDTDesc( 1 );  /* One descriptor, please. */
+    if( !wSel )
+        return( 0 );
+
+    /* Map the framebuffer physical memory. */
+    dwLinear = DPMI_MapPhys( dwPhysAddr, dwSize );
+
+    /* Now set the allocated selector to point to VRAM. */
+    DPMI_SetSegBase( wSel, dwLinear );
+    DPMI_SetSegLimit( wSel, dwSize - 1 );
+    
+    if(lpLinAddress != NULL)
+    {
+      *lpLinAddress = dwLinear;
+    }
+
+    return( wSel );
+}
+
+#ifdef SVGA
+/*
+ * Destroy screen objects from 'first' which remain from previous layout,
+ * screens below 'first' are defined by caller
+ */
+static void SVGA_destroyScreens(WORD first)
+{
+  SVGAFifoCmdDestroyScreen __far *cmd;
+  WORD s;
+  
+  for(s = first; s < SVGA_screens_defined; s++)
+  {
+    cmd = SVGA_FIFOReserveCmd(SVGA_CMD_DESTROY_SCREEN, sizeof(SVGAFifoCmdDestroyScreen));
+    if(cmd)
+    {
+      cmd->screenId = s;
+      SVGA_FIFOCommitAll();
+    }
+  }
+  
+  SVGA_screens_defined = first;
+}
+
+/*
+ * Choose number of screen objects for mode, desktop is split only when
+ * every screen is at least 320 pixels wide.
+ */
+static void SVGA_screensLayout(unsigned wXRes)
+{
+  SVGA_screens = 1;
+  if(SVGA_screens_cfg > 1 && SVGA_hasAccelScreen() && wXRes / SVGA_screens_cfg >= 320)
+  {
+    SVGA_screens = SVGA_screens_cfg;
+  }
+  SVGA_screen_w = wXRes / SVGA_screens;
+}
+
+/*
+ * Define the screen for accelerated rendering.
+ * Color depth can by select by set: screen.backingStore.pitch
+ * dwOffset is start of screen in VRAM (non zero for flipped surface)
+ */
+static void SVGA_defineScreen(unsigned wXRes, unsigned wYRes, unsigned wBpp, DWORD dwOffset)
+{
+  SVGAFifoCmdDefineScreen __far *screen;
+  DWORD pitch = CalcPitch(wXRes, wBpp);
+  WORD s;
+  
+  /* screens share one frame, every one starts on its column */
+  for(s = 0; s < SVGA_screens; s++)
+  {
+    LONG x = SCREEN_LEFT(s);
+    LONG w = (s + 1 == SVGA_screens) ? (LONG)wXRes - x : SVGA_screen_w;
+    
+    screen = SVGA_FIFOReserveCmd(SVGA_CMD_DEFINE_SCREEN, sizeof(SVGAFifoCmdDefineScreen));
+    if(!screen)
+    {
+      break;
+    }
+    
+    _fmemset(screen, 0, sizeof(SVGAFifoCmdDefineScreen));
+    screen->screen.structSize = sizeof(SVGAScreenObject);
+    screen->screen.id = s;
+    screen->screen.flags = SVGA_SCREEN_MUST_BE_SET | (s == 0 ? SVGA_SCREEN_IS_PRIMARY : 0);
+    screen->screen.size.width = w;
+    screen->screen.size.height = wYRes;
+    screen->screen.root.x = x;
+    screen->screen.root.y = 0;
+    screen->screen.cloneCount = 0;
+    
+    screen->screen.backingStore.pitch = pitch;
+    if(dwOffset != 0 || s != 0)
+    {
+      screen->screen.backingStore.ptr.gmrId  = SVGA_GMR_FRAMEBUFFER;
+      screen->screen.backingStore.ptr.offset = dwOffset + x * ((wBpp + 7) >> 3);
+    }
+    
+    SVGA_FIFOCommitAll();
+  }
+  
+  SVGA_destroyScreens(s);
+}
+
+/* Check if screen acceleration is available */
+static BOOL SVGA_hasAccelScreen()
+{
+  if(SVGA_stdu)
+  {
+    return FALSE;
+  }
+  
+  if(SVGA_HasFIFOCap(SVGA_FIFO_CAP_SCREEN_OBJECT | SVGA_FIFO_CAP_SCREEN_OBJECT_2))
+  {
+    return TRUE;
+  }
+  
+  return FALSE;
+}
+
+#ifdef SCREENTARGET
+#define SVGA_PRIMARY_STID 0
+
+#ifndef SVGA3D_SURFACE_SCREENTARGET
+#define SVGA3D_SURFACE_SCREENTARGET (1UL << 16)
+#endif
+
+/* object tables needed by screen target, ones already set by user space are kept */
+static BOOL SVGA_gbInit()
+{
+  static const DWORD tables[] = {SVGA_OTABLE_MOB, SVGA_OTABLE_SURFACE, SVGA_OTABLE_SCREENTARGET};
+  WORD i;
+  
+  if(!(gSVGA.capabilities & SVGA_CAP_GBOBJECTS) || gSVGA.fifoLinear == 0)
+  {
+    return FALSE;
+  }
+  
+  for(i = 0; i < sizeof(tables)/sizeof(tables[0]); i++)
+  {
+    DWORD phy;
+    DWORD size;
+    
+    switch(VXD_OTableActivate(tables[i], &phy, &size))
+    {
+      case 1:
+      {
+        SVGA3dCmdSetOTableBase64 __far *cmd;
+        cmd = SVGA3D_FIFOReserve(SVGA_3D_CMD_SET_OTABLE_BASE64, sizeof(SVGA3dCmdSetOTableBase64));
+        cmd->type = tables[i];
+        cmd->baseAddress.low = phy / 4096;
+        cmd->baseAddress.hi  = 0;
+        cmd->sizeInBytes = size;
+        cmd->validSizeInBytes = 0;
+        cmd->ptDepth = SVGA3D_MOBFMT_RANGE;
+        SVGA3D_FIFOCommitAll();
+        break;
+      }
+      case 2:
+        break;
+      default:
+        return FALSE;
+    }
+  }
+  
+  return TRUE;
+}
+
+static void SVGA_stduDestroy()
+{
+  SVGA3dCmdDestroyGBScreenTarget __far *st;
+  SVGA3dCmdDestroyGBSurface __far *surf;
+  
+  if(!SVGA_stdu_def)
+  {
+    return;
+  }
+  
+  st = SVGA3D_FIFOReserve(SVGA_3D_CMD_DESTROY_GB_SCREENTARGET, sizeof(SVGA3dCmdDestroyGBScreenTarget));
+  st->stid = SVGA_PRIMARY_STID;
+  SVGA3D_FIFOCommitAll();
+  
+  surf = SVGA3D_FIFOReserve(SVGA_3D_CMD_DESTROY_GB_SURFACE, sizeof(SVGA3dCmdDestroyGBSurface));
+  surf->sid = SVGA_PRIMARY_SID;
+  SVGA3D_FIFOCommitAll();
+  
+  SVGA_stdu_def = FALSE;
+}
+
+/* define primary surface and bind it to screen target */
+static void SVGA_stduDefine(WORD wXRes, WORD wYRes)
+{
+  SVGA3dCmdDefineGBSurface __far *surf;
+  SVGA3dCmdDefineGBScreenTarget __far *st;
+  SVGA3dCmdBindGBScreenTarget __far *bind;
+  
+  SVGA3D_BeginBatch();
+  SVGA_stduDestroy();
+  
+  surf = SVGA3D_FIFOReserve(SVGA_3D_CMD_DEFINE_GB_SURFACE, sizeof(SVGA3dCmdDefineGBSurface));
+  _fmemset(surf, 0, sizeof(SVGA3dCmdDefineGBSurface));
+  surf->sid = SVGA_PRIMARY_SID;
+  surf->surfaceFlags = SVGA3D_SURFACE_SCREENTARGET | SVGA3D_SURFACE_HINT_RENDERTARGET;
+  surf->format = SVGA3D_X8R8G8B8;
+  surf->numMipLevels = 1;
+  surf->size.width  = wXRes;
+  surf->size.height = wYRes;
+  surf->size.depth  = 1;
+  SVGA3D_FIFOCommitAll();
+  
+  st = SVGA3D_FIFOReserve(SVGA_3D_CMD_DEFINE_GB_SCREENTARGET, sizeof(SVGA3dCmdDefineGBScreenTarget));
+  _fmemset(st, 0, sizeof(SVGA3dCmdDefineGBScreenTarget));
+  st->stid   = SVGA_PRIMARY_STID;
+  st->width  = wXRes;
+  st->height = wYRes;
+  st->flags  = SVGA_STFLAG_PRIMARY;
+  SVGA3D_FIFOCommitAll();
+  
+  bind = SVGA3D_FIFOReserve(SVGA_3D_CMD_BIND_GB_SCREENTARGET, sizeof(SVGA3dCmdBindGBScreenTarget));
+  _fmemset(bind, 0, sizeof(SVGA3dCmdBindGBScreenTarget));
+  bind->stid = SVGA_PRIMARY_STID;
+  bind->image.sid = SVGA_PRIMARY_SID;
+  SVGA3D_FIFOCommitAll();
+  SVGA3D_EndBatch();
+  
+  SVGA_stdu_def = TRUE;
+}
+
+/* copy VRAM rect to primary surface and show it, FIFO must be locked */
+static void SVGA_stduPresent(LONG x, LONG y, LONG w, LONG h)
+{
+  SVGA3dGuestImage     guest;
+  SVGA3dSurfaceImageId host;
+  SVGA3dCopyBox __far *box;
+  SVGA3dCmdUpdateGBScreenTarget __far *upd;
+  
+  guest.ptr.gmrId  = SVGA_GMR_FRAMEBUFFER;
+  guest.ptr.offset = SVGA_stdu_offset;
+  guest.pitch      = SVGA_stdu_pitch;
+  _fmemset(&host, 0, sizeof(host));
+  host.sid = SVGA_PRIMARY_SID;
+  
+  SVGA3D_BeginBatch();
+  SVGA3D_BeginSurfaceDMA(&guest, &host, SVGA3D_WRITE_HOST_VRAM, &box, 1);
+  box->x = x;
+  box->y = y;
+  box->w = w;
+  box->h = h;
+  box->d = 1;
+  box->srcx = x;
+  box->srcy = y;
+  SVGA3D_FIFOCommitAll();
+  
+  upd = SVGA3D_FIFOReserve(SVGA_3D_CMD_UPDATE_GB_SCREENTARGET, sizeof(SVGA3dCmdUpdateGBScreenTarget));
+  upd->stid = SVGA_PRIMARY_STID;
+  upd->rect.x = x;
+  upd->rect.y = y;
+  upd->rect.w = w;
+  upd->rect.h = h;
+  SVGA3D_FIFOCommitAll();
+  SVGA3D_EndBatch();
+}
+
+/*
+ * Primary screen target for user space (3D present can draw to it
+ * directly): stid, sid, width, height. FALSE when not in this mode.
+ */
+BOOL SVGA_GetScreenTarget(DWORD __far *lpOut)
+{
+  if(!SVGA_stdu)
+  {
+    return FALSE;
+  }
+  
+  lpOut[0] = SVGA_PRIMARY_STID;
+  lpOut[1] = SVGA_PRIMARY_SID;
+  lpOut[2] = wScreenX;
+  lpOut[3] = wScreenY;
+  
+  return TRUE;
+}
+#endif /* SCREENTARGET */
+
+/*
+ * Dirty rectangle accumulator: SVGA_UpdateRect only collects damage
+ * (see damage.c) and SVGA_CMD_UPDATE is send on SVGA_UpdateFlush. Flush
+ * is called from CheckCursor (periodically by USER) or immediately when
+ * the damage area is larger than SVGA_DAMAGE_FLUSH_AREA (fraction of screen).
+ * Every screen object has own list, rects are clipped by screens, so damage
+ * on one screen never grows update of another.
+ */
+static damage_t SVGA_damage[SVGA_SCREENS_MAX];
+static volatile WORD SVGA_damage_busy = 0; /* set when the damage list is modified */
+static volatile WORD SVGA_damage_full = 0; /* bit per screen, update full screen on next flush */
+static WORD SVGA_damage_queued = 0;        /* rects are in userlist pending ring */
+
+#define SVGA_DAMAGE_ALL ((WORD)((1U << SVGA_screens) - 1))
+
+static void SVGA_damageClear()
+{
+  WORD s;
+  
+  for(s = 0; s < SVGA_SCREENS_MAX; s++)
+  {
+    Damage_Clear(&SVGA_damage[s]);
+  }
+  SVGA_damage_full = 0;
+}
+
+/*
+ * Blit from GMRFB to desktop rect, split by screen objects
+ * (BLIT_GMRFB_TO_SCREEN destination is relative to the screen)
+ */
+static void SVGA_blitScreens(LONG sx, LONG sy, LONG dx, LONG dy, LONG w, LONG h)
+{
+  WORD s;
+  
+  for(s = 0; s < SVGA_screens; s++)
+  {
+    LONG l = dx;
+    LONG r = dx + w;
+    
+    if(l < SCREEN_LEFT(s))  l = SCREEN_LEFT(s);
+    if(r > SCREEN_RIGHT(s)) r = SCREEN_RIGHT(s);
+    
+    if(l < r)
+    {
+      SVGA_BlitGMRFBToScreen(sx + (l - dx), sy, l - SCREEN_LEFT(s), dy, r - l, h, s);
+    }
+  }
+}
+
+/* TRUE when screen changes are send to host by SVGA_UpdateRect */
+BOOL SVGA_CanUpdate()
+{
+  return wBpp == 32 || SVGA_shadow_bpp != 0;
+}
+
+/*
+ * TRUE when device cursor can be used, host composes it over screen of
+ * any depth, so 8 and 16 bpp modes with traces need only cursor caps
+ */
+BOOL SVGA_CanHWCursor()
+{
+  if(SVGA_CanUpdate())
+  {
+    return TRUE;
+  }
+  
+  return (gSVGA.capabilities & SVGA_CAP_CURSOR) && SVGA_HasFIFOCap(SVGA_FIFO_CAP_CURSOR_BYPASS_3);
+}
+
+/* Convert rect from 8bpp GDI surface to 32bpp screen */
+static void pal8_expand(LONG x, LONG y, LONG w, LONG h)
+{
+  DWORD src = (DWORD)y * wScreenPitchBytes + x;
+  DWORD dst = SVGA_screen_offset + (DWORD)y * SVGA_screen_pitch + x * 4;
+  WORD  sel = ScreenSelector;
+  WORD  cnt = (WORD)w;
+  
+  if(sel == 0 || w <= 0)
+  {
+    return;
+  }
+  
+  for(; h > 0; h--)
+  {
+    _asm
+    {
+      .386
+      push eax
+      push ebx
+      push ecx
+      push esi
+      push edi
+      push es
+      
+      mov   es, sel
+      mov   esi, src
+      mov   edi, dst
+      movzx ecx, cnt
+      
+      pal8_next:
+        movzx ebx, byte ptr es:[esi]
+        mov   eax, dword ptr SVGA_pal8_lut[ebx*4]
+        mov   es:[edi], eax
+        inc   esi
+        add   edi, 4
+        dec   ecx
+        jnz   pal8_next
+      
+      pop es
+      pop edi
+      pop esi
+      pop ecx
+      pop ebx
+      pop eax
+    };
+    
+    src += wScreenPitchBytes;
+    dst += SVGA_screen_pitch;
+  }
+}
+
+/*
+ * Palette entries changed, in expanded 8bpp mode whole screen must be
+ * converted again.
+ */
+void SVGA_Pal8Update(UINT wStart, UINT wEnd, RGBQUAD FAR *lpPal)
+{
+  UINT i;
+  
+  for(i = wStart; i < wEnd && i < 256; i++)
+  {
+    SVGA_pal8_lut[i] = ((DWORD)lpPal[i].rgbRed << 16) |
+                       ((DWORD)lpPal[i].rgbGreen << 8) |
+                        (DWORD)lpPal[i].rgbBlue;
+  }
+  
+  if(SVGA_shadow_bpp == 8)
+  {
+    SVGA_damage_full = SVGA_DAMAGE_ALL;
+    SVGA_UpdateFlush();
+  }
+}
+
+/* Send rect of screen 's' to the host, shadow surface is converted first */
+static void shadow_present(WORD s, LONG x, LONG y, LONG w, LONG h)
+{
+  switch(SVGA_shadow_bpp)
+  {
+    case 8:
+      pal8_expand(x, y, w, h);
+#ifdef SCREENTARGET
+      if(SVGA_stdu)
+      {
+        SVGA_stduPresent(x, y, w, h);
+        break;
+      }
+#endif
+      SVGA_Update(x, y, w, h);
+      break;
+    case 16:
+      /* host convert R5G6B5 to screen, GMRFB can be changed by others (DD, user space) */
+      SVGA_DefineGMRFB(0, wScreenPitchBytes, 16, 16);
+      SVGA_BlitGMRFBToScreen(x, y, x - SCREEN_LEFT(s), y, w, h, s);
+      break;
+    default:
+#ifdef SCREENTARGET
+      if(SVGA_stdu)
+      {
+        SVGA_stduPresent(x, y, w, h);
+        break;
+      }
+#endif
+      SVGA_Update(x, y, w, h);
+      break;
+  }
+}
+
+/*
+ * Queue damage to VxD present worker (only screens presented by
+ * SVGA_CMD_UPDATE), TRUE when all of it was queued. Damage list
+ * must be marked busy.
+ */
+static BOOL SVGA_presentQueue(WORD s)
+{
+  damage_t *d = &SVGA_damage[s];
+  
+  if(SVGA_shadow_bpp != 0 || SVGA_stdu)
+  {
+    return FALSE;
+  }
+  
+  if(SVGA_damage_full & (1 << s))
+  {
+    if(!SVGAHDA_presentPush(SCREEN_LEFT(s), 0, SCREEN_RIGHT(s), wScreenY))
+    {
+      return FALSE;
+    }
+    Damage_Clear(d);
+    SVGA_damage_full &= ~(1 << s);
+    gSVGAPerf.updates++;
+    gSVGAPerf.fullUpdates++;
+    return TRUE;
+  }
+  
+  while(d->cnt > 0)
+  {
+    damage_rect_t __far *r = &d->rects[d->cnt-1];
+    if(!SVGAHDA_presentPush(r->left, r->top, r->right, r->bottom))
+    {
+      Damage_Recount(d);
+      return FALSE;
+    }
+    d->cnt--;
+    gSVGAPerf.updates++;
+  }
+  
+  Damage_Clear(d);
+  return TRUE;
+}
+
+/*
+ * More rects are sent by one VxD call (flat code, command buffer on CB
+ * hosts) instead of FIFO writes through 64K selector window, for one rect
+ * the call costs more than it saves.
+ */
+#define SVGA_UPDATE_VXD_MIN 2
+
+static DWORD SVGA_damage_linear = 0;
+
+/* send all damage rects of screen 's' by VxD, FIFO must be locked */
+static BOOL SVGA_damageVXD(WORD s)
+{
+  if(SVGA_shadow_bpp != 0 || SVGA_stdu || SVGA_damage[s].cnt < SVGA_UPDATE_VXD_MIN)
+  {
+    return FALSE;
+  }
+  
+  if(SVGA_damage_linear == 0)
+  {
+    void __far *ptr = SVGA_damage;
+    SVGA_damage_linear = DPMI_GetSegBase((WORD)((DWORD)ptr >> 16)) + (WORD)((DWORD)ptr);
+  }
+  
+  /* rects are first member of damage_t */
+  return VXD_UpdateRects(SVGA_damage_linear + s * sizeof(damage_t), SVGA_damage[s].cnt);
+}
+
+/*
+ * Present latency sampling (see SVGAPerfCounters), only one batch is
+ * measured at a time, so there is at most one extra fence in FIFO.
+ * Batches sent by VxD worker aren't measured (no fence behind them).
+ */
+static DWORD SVGA_latency_start = 0; /* time of first damage, 0 = not sampled */
+static DWORD SVGA_latency_fence = 0; /* fence behind the sampled batch */
+
+static void SVGA_latencyBegin()
+{
+  if(SVGA_latency_start == 0 && SVGA_latency_fence == 0)
+  {
+    SVGA_latency_start = VXD_GetTime();
+  }
+}
+
+static void SVGA_latencyCheck()
+{
+  DWORD ms;
+  WORD b;
+  
+  if(SVGA_latency_fence == 0 || !SVGA_HasFencePassed(SVGA_latency_fence))
+  {
+    return;
+  }
+  
+  ms = VXD_GetTime() - SVGA_latency_start;
+  for(b = 0; b < SVGA_LATENCY_BUCKETS-1 && ms >= (1UL << b); b++);
+  gSVGAPerf.latency[b]++;
+  
+  SVGA_latency_fence = 0;
+  SVGA_latency_start = 0;
+}
+
+/* Send accumulated damage of screen 's' to the host, damage list must not be busy */
+static void SVGA_screenFlush(WORD s)
+{
+  damage_t *d = &SVGA_damage[s];
+  WORD bit = 1 << s;
+  WORD i;
+  
+  if(d->cnt == 0 && !(SVGA_damage_full & bit) && !SVGA_damage_queued)
+  {
+    return;
+  }
+  
+  SVGA_damage_busy = 1;
+  if(SVGA_presentQueue(s))
+  {
+    /* VxD sends it together with rects queued before, GDI doesn't wait for FIFO */
+    SVGA_damage_queued = 0;
+    SVGA_latency_start = 0;
+  }
+  else if(SVGAHDA_trylock(LOCK_FIFO))
+  {
+    /* queued while FIFO was busy and lock owner didn't send them */
+    SVGAHDA_pendingDrainLocked();
+    SVGA_damage_queued = 0;
+    
+    /* merged damage can cover presented pixels which aren't in frame buffer yet */
+    if(SVGA_damage_full & bit)
+    {
+      SVGAHDA_readbackLocked(SCREEN_LEFT(s), 0, SCREEN_RIGHT(s), wScreenY);
+      shadow_present(s, SCREEN_LEFT(s), 0, SCREEN_RIGHT(s) - SCREEN_LEFT(s), wScreenY);
+      gSVGAPerf.updates++;
+      gSVGAPerf.fullUpdates++;
+    }
+    else
+    {
+      gSVGAPerf.updates += d->cnt;
+
+      for(i = 0; i < d->cnt; i++)
+      {
+        damage_rect_t __far *r = &d->rects[i];
+        SVGAHDA_readbackLocked(r->left, r->top, r->right, r->bottom);
+      }
+      
+      if(!SVGA_damageVXD(s))
+      {
+        for(i = 0; i < d->cnt; i++)
+        {
+          damage_rect_t __far *r = &d->rects[i];
+          shadow_present(s, r->left, r->top, r->right - r->left, r->bottom - r->top);
+        }
+      }
+    }
+    
+    if(SVGA_latency_start != 0 && SVGA_latency_fence == 0)
+    {
+      SVGA_latency_fence = SVGA_InsertFence();
+    }
+    SVGAHDA_unlock(LOCK_FIFO);
+    
+    Damage_Clear(d);
+    SVGA_damage_full &= ~bit;
+  }
+  else if(SVGA_shadow_bpp == 0 && !SVGA_stdu)
+  {
+    /* FIFO is busy, let the lock owner send it, the rest on next flush */
+    gSVGAPerf.lockFails++;
+    if(SVGA_damage_full & bit)
+    {
+      if(SVGAHDA_pendingPush(SCREEN_LEFT(s), 0, SCREEN_RIGHT(s), wScreenY))
+      {
+        d->cnt             = 0;
+        SVGA_damage_full  &= ~bit;
+        SVGA_damage_queued = 1;
+      }
+    }
+    else
+    {
+      while(d->cnt > 0)
+      {
+        damage_rect_t __far *r = &d->rects[d->cnt-1];
+        if(!SVGAHDA_pendingPush(r->left, r->top, r->right, r->bottom))
+        {
+          break;
+        }
+        d->cnt--;
+        SVGA_damage_queued = 1;
+      }
+    }
+    
+    Damage_Recount(d);
+  }
+  else
+  {
+    /* FIFO is busy, try it on next flush */
+    gSVGAPerf.lockFails++;
+  }
+  SVGA_damage_busy = 0;
+}
+
+/* Send accumulated damage of all screens to the host */
+void SVGA_UpdateFlush()
+{
+  WORD s;
+  
+  if(SVGA_damage_busy)
+  {
+    /* called from interrupt when damage list is modified */
+    return;
+  }
+  
+  SVGA_latencyCheck();
+  
+  if(!SVGA_CanUpdate())
+  {
+    /* mode changed, nothing to update */
+    SVGA_damageClear();
+    SVGA_damage_queued = 0;
+    return;
+  }
+  
+  for(s = 0; s < SVGA_screens; s++)
+  {
+    SVGA_screenFlush(s);
+  }
+}
+
+/* Update screen rect if its relevant */
+extern void __loadds SVGA_UpdateRect(LONG x, LONG y, LONG w, LONG h)
+{
+  damage_rect_t r;
+  WORD cnt;
+  WORD s;
+  WORD flush = 0;
+  
+  /* SVGA commands works only for 32 bpp surfaces (or expanded 8 bpp) */
+  if(!SVGA_CanUpdate())
+  {
+    return;
+  }
+  
+  if(x < 0)
+  {
+    w += x;
+    x = 0;
+  }
+  if(y < 0)
+  {
+    h += y;
+    y = 0;
+  }
+  if(x+w > wScreenX) w = wScreenX - x;
+  if(y+h > wScreenY) h = wScreenY - y;
+  
+  if(w <= 0 || h <= 0)
+  {
+    return;
+  }
+  
+  if(SVGA_damage_busy)
+  {
+    /* interrupted damage list manipulation, give up and refresh everything */
+    SVGA_damage_full = SVGA_DAMAGE_ALL;
+    return;
+  }
+  
+  SVGA_latencyCheck();
+  SVGA_latencyBegin();
+  
+  SVGA_damage_busy = 1;
+  r.top    = y;
+  r.bottom = y + h;
+  for(s = 0; s < SVGA_screens; s++)
+  {
+    damage_t *d = &SVGA_damage[s];
+    LONG sl = SCREEN_LEFT(s);
+    LONG sr = SCREEN_RIGHT(s);
+    
+    r.left  = x < sl ? sl : x;
+    r.right = x + w > sr ? sr : x + w;
+    if(r.left >= r.right)
+    {
+      continue;
+    }
+    
+    cnt = d->cnt;
+    Damage_Add(d, &r);
+    if(d->cnt <= cnt)
+    {
+      gSVGAPerf.coalesced++;
+    }
+    
+    if(d->area >= ((DWORD)(sr - sl) * wScreenY) / SVGA_DAMAGE_FLUSH_AREA)
+    {
+      flush |= 1 << s;
+    }
+  }
+  SVGA_damage_busy = 0;
+  
+  flush |= SVGA_damage_full;
+  if(flush != 0 && SVGA_UpdatePace())
+  {
+    for(s = 0; s < SVGA_screens; s++)
+    {
+      if(flush & (1 << s))
+      {
+        SVGA_screenFlush(s);
+      }
+    }
+  }
+}
+
+/*
+ * Present pacing, [display] present_hz in SYSTEM.INI: 0 = off (default),
+ * otherwise immediate flushes (large damage, FBHDA_UPDATE) are limited to
+ * one per refresh period. Deferred damage is merged and sent by the
+ * periodic flush from CheckCursor or by the next allowed flush.
+ */
+static DWORD SVGA_present_period = 0; /* ms */
+static DWORD SVGA_present_last   = 0;
+
+/*
+ * Virtual vertical blank in VXD for DirectDraw WaitForVerticalBlank and
+ * GetScanLine, [display] vblank_hz in SYSTEM.INI: 0 = off, default is
+ * present_hz or 60 when present pacing is off.
+ */
+static DWORD SVGA_vblank_hz = 0;
+static BOOL  SVGA_vblank_on = FALSE;
+
+/* TRUE when damage may be flushed now */
+BOOL SVGA_UpdatePace()
+{
+  DWORD now;
+  
+  if(SVGA_present_period == 0)
+  {
+    return TRUE;
+  }
+  
+  now = VXD_GetTime();
+  if(now == 0)
+  {
+    /* no VXD, no clock */
+    return TRUE;
+  }
+  
+  if(now - SVGA_present_last < SVGA_present_period)
+  {
+    return FALSE;
+  }
+  
+  SVGA_present_last = now;
+  return TRUE;
+}
+
+/*
+ * HW operations on frame buffer are asynchronous, fence of the last one
+ * is kept here and SVGA_HWSync waits for it before CPU access.
+ */
+static volatile DWORD SVGA_hw_fence = 0;
+
+void SVGA_HWSync()
+{
+  DWORD fence = SVGA_hw_fence;
+  
+  if(fence != 0)
+  {
+    SVGA_hw_fence = 0;
+    if(!SVGA_HasFencePassed(fence))
+    {
+      SVGA_SyncToFence(fence);
+    }
+  }
+}
+
+/* TRUE if rect is non empty and whole on screen */
+static BOOL hw_rect_valid(LONG x, LONG y, LONG w, LONG h)
+{
+  return x >= 0 && y >= 0 && w > 0 && h > 0 &&
+    x+w <= wScreenX && y+h <= wScreenY;
+}
+
+/*
+ * Screen to screen copy by SVGA_CMD_RECT_COPY, rects may overlap.
+ * Return FALSE if it isn't possible (caller have to do it by CPU).
+ */
+BOOL SVGA_CopyRect(LONG sx, LONG sy, LONG dx, LONG dy, LONG w, LONG h)
+{
+  if(wBpp != 32 || SVGA_stdu || !(gSVGA.capabilities & SVGA_CAP_RECT_COPY))
+  {
+    return FALSE;
+  }
+  
+  if(!hw_rect_valid(sx, sy, w, h) || !hw_rect_valid(dx, dy, w, h))
+  {
+    return FALSE;
+  }
+  
+  if(SVGAHDA_trylock(LOCK_FIFO))
+  {
+    SVGA_RectCopy(sx, sy, dx, dy, w, h);
+    SVGA_hw_fence = SVGA_InsertFence();
+    SVGAHDA_unlock(LOCK_FIFO);
+    
+    return TRUE;
+  }
+  
+  return FALSE;
+}
+
+/*
+ * Solid fill by SVGA_CMD_RECT_FILL, color is in frame buffer format.
+ * Return FALSE if it isn't possible (caller have to do it by CPU).
+ */
+BOOL SVGA_FillRect(LONG x, LONG y, LONG w, LONG h, DWORD color)
+{
+  if(wBpp != 32 || SVGA_stdu || !(gSVGA.capabilities & SVGA_CAP_RECT_FILL))
+  {
+    return FALSE;
+  }
+  
+  if(!hw_rect_valid(x, y, w, h))
+  {
+    return FALSE;
+  }
+  
+  if(SVGAHDA_trylock(LOCK_FIFO))
+  {
+    SVGA_RectFill(color, x, y, w, h);
+    SVGA_hw_fence = SVGA_InsertFence();
+    SVGAHDA_unlock(LOCK_FIFO);
+    
+    return TRUE;
+  }
+  
+  return FALSE;
+}
+
+/*
+ * Clear 32 bpp screen of 8/16 bpp shadow surface by SVGA_CMD_RECT_FILL,
+ * shadow surface itself must be cleared by caller. In screen target mode
+ * VRAM is source of the surface DMA, so there isn't anything to fill on host.
+ */
+static BOOL SVGA_shadowClear()
+{
+  DWORD color = 0;
+  
+  if(SVGA_shadow_bpp == 0 || SVGA_stdu || !(gSVGA.capabilities & SVGA_CAP_RECT_FILL))
+  {
+    return FALSE;
+  }
+  
+  if(SVGA_shadow_bpp == 8)
+  {
+    color = SVGA_pal8_lut[0];
+  }
+  
+  if(SVGAHDA_trylock(LOCK_FIFO))
+  {
+    SVGA_RectFill(color, 0, 0, wScreenX, wScreenY);
+    SVGA_hw_fence = SVGA_InsertFence();
+    SVGAHDA_unlock(LOCK_FIFO);
+    
+    return TRUE;
+  }
+  
+  return FALSE;
+}
+
+/*
+ * DirectDraw Lock/Unlock (SVGA_DDLOCK/SVGA_DDUNLOCK escapes). Lock waits
+ * for the last blit only when the surface is its source or destination.
+ * Rects locked on visible screen are joined and sent as damage after
+ * last unlock, so applications writing the primary don't need traces.
+ */
+static DWORD SVGA_dd_fence = 0;  /* last DirectDraw blit */
+static DWORD SVGA_dd_src   = 0;
+static DWORD SVGA_dd_dst   = 0;
+static WORD  SVGA_dd_locks = 0;  /* locks of visible screen */
+static LONG  SVGA_dd_lock_left;
+static LONG  SVGA_dd_lock_top;
+static LONG  SVGA_dd_lock_right;
+static LONG  SVGA_dd_lock_bottom;
+
+static void dd_busy(DWORD fence, DWORD srcOffset, DWORD dstOffset)
+{
+  SVGA_dd_fence = fence;
+  SVGA_dd_src   = srcOffset;
+  SVGA_dd_dst   = dstOffset;
+}
+
+/* Return TRUE if surface is visible screen and rect will be reported on unlock. */
+BOOL SVGA_DDLock(DWORD offset, DWORD pitch, LONG left, LONG top, LONG right, LONG bottom)
+{
+  if(SVGA_dd_fence != 0 && (offset == SVGA_dd_src || offset == SVGA_dd_dst))
+  {
+    if(!SVGA_HasFencePassed(SVGA_dd_fence))
+    {
+      SVGA_SyncToFence(SVGA_dd_fence);
+    }
+    SVGA_dd_fence = 0;
+  }
+  
+  if(offset != dwDisplayStart || pitch != wScreenPitchBytes)
+  {
+    return FALSE;
+  }
+  
+  if(left < 0) left = 0;
+  if(top < 0)  top = 0;
+  if(right > wScreenX)  right = wScreenX;
+  if(bottom > wScreenY) bottom = wScreenY;
+  
+  if(SVGA_dd_locks == 0)
+  {
+    SVGA_dd_lock_left   = left;
+    SVGA_dd_lock_top    = top;
+    SVGA_dd_lock_right  = right;
+    SVGA_dd_lock_bottom = bottom;
+  }
+  else
+  {
+    if(left < SVGA_dd_lock_left)     SVGA_dd_lock_left   = left;
+    if(top < SVGA_dd_lock_top)       SVGA_dd_lock_top    = top;
+    if(right > SVGA_dd_lock_right)   SVGA_dd_lock_right  = right;
+    if(bottom > SVGA_dd_lock_bottom) SVGA_dd_lock_bottom = bottom;
+  }
+  SVGA_dd_locks++;
+  
+  return TRUE;
+}
+
+/* Return TRUE when damage was added (caller flushes it). */
+BOOL SVGA_DDUnlock(DWORD offset)
+{
+  if(SVGA_dd_locks == 0 || offset != dwDisplayStart)
+  {
+    return FALSE;
+  }
+  
+  if(--SVGA_dd_locks > 0)
+  {
+    return FALSE;
+  }
+  
+  if(SVGA_dd_lock_left >= SVGA_dd_lock_right || SVGA_dd_lock_top >= SVGA_dd_lock_bottom)
+  {
+    return FALSE;
+  }
+  
+  SVGA_UpdateRect(SVGA_dd_lock_left, SVGA_dd_lock_top,
+    SVGA_dd_lock_right - SVGA_dd_lock_left, SVGA_dd_lock_bottom - SVGA_dd_lock_top);
+  
+  return TRUE;
+}
+
+/* TRUE if surface in VRAM is the GDI screen and scanout isn't moved (legacy RECT commands) */
+static BOOL dd_is_gdi_screen(DWORD offset, DWORD pitch)
+{
+  return offset == 0 && pitch == wScreenPitchBytes && dwDisplayStart == 0;
+}
+
+/*
+ * DirectDraw solid fill of VRAM surface. Only the screen is possible
+ * (SVGA_CMD_RECT_FILL). Return fence or 0 if CPU have to do it.
+ */
+DWORD SVGA_DDFill(DWORD dstOffset, DWORD dstPitch, LONG x, LONG y, LONG w, LONG h, DWORD color)
+{
+  if(!dd_is_gdi_screen(dstOffset, dstPitch))
+  {
+    return 0;
+  }
+  
+  if(!SVGA_FillRect(x, y, w, h, color))
+  {
+    return 0;
+  }
+  
+  dd_busy(SVGA_hw_fence, dstOffset, dstOffset);
+  return SVGA_hw_fence;
+}
+
+/*
+ * DirectDraw copy from any VRAM surface to visible screen. Screen to
+ * screen is done by SVGA_CMD_RECT_COPY, other surfaces are attached as
+ * GMRFB and blitted to screen object. Return fence or 0 if CPU have
+ * to do it.
+ */
+DWORD SVGA_DDCopy(DWORD srcOffset, DWORD srcPitch, LONG sx, LONG sy,
+  DWORD dstOffset, DWORD dstPitch, LONG dx, LONG dy, LONG w, LONG h)
+{
+  DWORD fence;
+  DWORD srcEnd;
+  
+  if(dd_is_gdi_screen(srcOffset, srcPitch) && dd_is_gdi_screen(dstOffset, dstPitch))
+  {
+    if(!SVGA_CopyRect(sx, sy, dx, dy, w, h))
+    {
+      return 0;
+    }
+    dd_busy(SVGA_hw_fence, srcOffset, dstOffset);
+    return SVGA_hw_fence;
+  }
+  
+  if(wBpp != 32 || !SVGA_hasAccelScreen())
+  {
+    return 0;
+  }
+  
+  /* destination must be visible screen */
+  if(dstOffset != dwDisplayStart || dstPitch != wScreenPitchBytes || !hw_rect_valid(dx, dy, w, h))
+  {
+    return 0;
+  }
+  
+  /* whole source must be in VRAM */
+  if(sx < 0 || sy < 0 || srcPitch < (DWORD)(sx + w) * 4)
+  {
+    return 0;
+  }
+  srcEnd = srcOffset + (DWORD)(sy + h - 1) * srcPitch + (DWORD)(sx + w) * 4;
+  if(srcEnd > dwVideoMemorySize || srcEnd < srcOffset)
+  {
+    return 0;
+  }
+  
+  /* blit from GMRFB to the same surface may not overlap */
+  if(srcOffset == dstOffset && sx < dx + w && dx < sx + w && sy < dy + h && dy < sy + h)
+  {
+    return 0;
+  }
+  
+  if(!SVGAHDA_trylock(LOCK_FIFO))
+  {
+    return 0;
+  }
+  
+  SVGA_DefineGMRFB(srcOffset, srcPitch, 32, 24);
+  SVGA_blitScreens(sx, sy, dx, dy, w, h);
+  fence = SVGA_InsertFence();
+  SVGA_hw_fence = fence;
+  dd_busy(fence, srcOffset, dstOffset);
+  
+  SVGAHDA_unlock(LOCK_FIFO);
+  
+  return fence;
+}
+
+/*
+ * DirectDraw overlays (SVGA_OVERLAY escape) are SVGA video streams,
+ * host converts YUV surface in VRAM and scales it to the screen rect.
+ */
+static BYTE SVGA_overlay_on[SVGA_OVERLAY_STREAMS] = {0};
+
+/* hide all streams, FIFO must be locked */
+static void SVGA_overlayStopLocked()
+{
+  WORD i;
+  
+  for(i = 0; i < SVGA_OVERLAY_STREAMS; i++)
+  {
+    if(SVGA_overlay_on[i])
+    {
+      SVGA_VideoSetReg(i, SVGA_VIDEO_ENABLED, 0);
+      SVGA_VideoFlush(i);
+      SVGA_overlay_on[i] = 0;
+    }
+  }
+}
+
+/* show, move or hide overlay stream, FALSE if surface can't be shown by host */
+BOOL SVGA_OverlayUpdate(svga_overlay_t __far *ov)
+{
+  SVGAOverlayUnit unit;
+  DWORD offset;
+  DWORD srcEnd;
+  
+  if(ov->stream >= SVGA_OVERLAY_STREAMS || !CanOverlay())
+  {
+    return FALSE;
+  }
+  
+  if(!ov->enabled)
+  {
+    if(SVGA_overlay_on[ov->stream] && SVGAHDA_lock(LOCK_FIFO))
+    {
+      SVGA_VideoSetReg(ov->stream, SVGA_VIDEO_ENABLED, 0);
+      SVGA_VideoFlush(ov->stream);
+      SVGAHDA_unlock(LOCK_FIFO);
+      SVGA_overlay_on[ov->stream] = 0;
+    }
+    return TRUE;
+  }
+  
+  if(ov->fourcc != VMWARE_FOURCC_YUY2 && ov->fourcc != VMWARE_FOURCC_UYVY)
+  {
+    return FALSE;
+  }
+  
+  /* packed 4:2:2, whole surface must be in VRAM */
+  if(ov->src < dwScreenFlatAddr || ov->width == 0 || ov->height == 0 ||
+    (ov->width & 1) != 0 || ov->srcPitch < ov->width * 2)
+  {
+    return FALSE;
+  }
+  offset = ov->src - dwScreenFlatAddr;
+  srcEnd = offset + ov->srcPitch * ov->height;
+  if(srcEnd > dwVideoMemorySize || srcEnd < offset)
+  {
+    return FALSE;
+  }
+  
+  if(ov->srcX < 0 || ov->srcY < 0 || ov->srcW == 0 || ov->srcH == 0 ||
+    ov->srcX + ov->srcW > ov->width || ov->srcY + ov->srcH > ov->height)
+  {
+    return FALSE;
+  }
+  
+  _fmemset(&unit, 0, sizeof(unit));
+  unit.enabled     = 1;
+  unit.flags       = (ov->flags & SVGA_OVERLAY_KEY) ? SVGA_VIDEO_FLAG_COLORKEY : 0;
+  unit.dataOffset  = offset;
+  unit.format      = ov->fourcc;
+  unit.colorKey    = ov->colorkey & SVGA_VIDEO_COLORKEY_MASK;
+  unit.size        = ov->srcPitch * ov->height;
+  unit.width       = ov->width;
+  unit.height      = ov->height;
+  unit.srcX        = ov->srcX;
+  unit.srcY        = ov->srcY;
+  unit.srcWidth    = ov->srcW;
+  unit.srcHeight   = ov->srcH;
+  unit.dstX        = ov->dstX;
+  unit.dstY        = ov->dstY;
+  unit.dstWidth    = ov->dstW;
+  unit.dstHeight   = ov->dstH;
+  unit.pitches[0]  = ov->srcPitch;
+  unit.dataGMRId   = SVGA_GMR_FRAMEBUFFER;
+  unit.dstScreenId = SVGA_ID_INVALID;
+  
+  /* overlay update must not be lost, wait for FIFO */
+  if(!SVGAHDA_lock(LOCK_FIFO))
+  {
+    return FALSE;
+  }
+  SVGA_VideoSetAllRegs(ov->stream, &unit, SVGA_VIDEO_DST_SCREEN_ID);
+  SVGA_VideoFlush(ov->stream);
+  SVGAHDA_unlock(LOCK_FIFO);
+  
+  SVGA_overlay_on[ov->stream] = 1;
+  
+  return TRUE;
+}
+
+/* move visible overlay (SetOverlayPosition), size and source stay */
+BOOL SVGA_OverlayPosition(DWORD stream, LONG x, LONG y)
+{
+  if(stream >= SVGA_OVERLAY_STREAMS || !SVGA_overlay_on[stream])
+  {
+    return FALSE;
+  }
+  
+  if(!SVGAHDA_lock(LOCK_FIFO))
+  {
+    return FALSE;
+  }
+  SVGA_VideoSetReg(stream, SVGA_VIDEO_DST_X, x);
+  SVGA_VideoSetReg(stream, SVGA_VIDEO_DST_Y, y);
+  SVGA_VideoFlush(stream);
+  SVGAHDA_unlock(LOCK_FIFO);
+  
+  return TRUE;
+}
+
+/* TRUE if offscreen VRAM can be blitted to GDI screen by host */
+BOOL SVGA_CanBlitOffscreen()
+{
+  return wBpp == 32 && dwDisplayStart == 0 && SVGA_hasAccelScreen();
+}
+
+/*
+ * Blit list of rects from offscreen 32bpp surface (srcOffset, srcPitch) to
+ * GDI screen by SVGA_CMD_BLIT_GMRFB_TO_SCREEN, all by one lock and fence.
+ * Rects must be already clipped to screen. Return FALSE when not possible.
+ */
+BOOL SVGA_BlitOffscreen(DWORD srcOffset, DWORD srcPitch, svga_blit_t __far *lpBlits, WORD cnt)
+{
+  WORD i;
+  
+  if(!SVGA_CanBlitOffscreen())
+  {
+    return FALSE;
+  }
+  
+  if(!SVGAHDA_trylock(LOCK_FIFO))
+  {
+    return FALSE;
+  }
+  
+  SVGA_DefineGMRFB(srcOffset, srcPitch, 32, 24);
+  for(i = 0; i < cnt; i++)
+  {
+    svga_blit_t __far *b = &lpBlits[i];
+    SVGA_blitScreens(b->sx, b->sy, b->dx, b->dy, b->w, b->h);
+  }
+  SVGA_hw_fence = SVGA_InsertFence();
+  
+  SVGAHDA_unlock(LOCK_FIFO);
+  
+  return TRUE;
+}
+
+/*
+ * Same as SVGA_BlitOffscreen, but source is 32bpp image at start of
+ * bound GMR 'gmrId' (FBHDA back buffers). Returns fence of the blits or 0
+ * when not possible.
+ */
+DWORD SVGA_BlitGMR(DWORD gmrId, DWORD srcPitch, svga_blit_t __far *lpBlits, WORD cnt)
+{
+  WORD i;
+  
+  if(!SVGA_CanBlitOffscreen())
+  {
+    return 0;
+  }
+  
+  if(!SVGAHDA_trylock(LOCK_FIFO))
+  {
+    return 0;
+  }
+  
+  SVGA_DefineGMRFBRegion(gmrId, 0, srcPitch, 32, 24);
+  for(i = 0; i < cnt; i++)
+  {
+    svga_blit_t __far *b = &lpBlits[i];
+    SVGA_blitScreens(b->sx, b->sy, b->dx, b->dy, b->w, b->h);
+  }
+  SVGA_hw_fence = SVGA_InsertFence();
+  
+  SVGAHDA_unlock(LOCK_FIFO);
+  
+  return SVGA_hw_fence;
+}
+
+/*
+ * Blit rect from application memory (lAddr, size bytes with 'pitch') to GDI
+ * screen without copying it to VRAM first. Memory is locked by VXD and
+ * temporary bound as the last GMR id, host reads it directly. Source
+ * coordinates are top-down, when image is bottomUp, it is blitted line by
+ * line. Returns after host finished reading, so caller can release memory.
+ */
+BOOL SVGA_BlitGuestImage(DWORD lAddr, DWORD size, DWORD pitch, WORD bpp, WORD depth, BOOL bottomUp, svga_blit_t __far *lpBlit)
+{
+  DWORD ppn;
+  DWORD pgblk;
+  DWORD gmrId;
+  DWORD lines;
+  DWORD fence;
+  WORD  i;
+  
+  if(!SVGA_CanBlitOffscreen() || !(gSVGA.capabilities & SVGA_CAP_GMR))
+  {
+    return FALSE;
+  }
+  
+  if(pitch == 0 || (bpp != 32 && bpp != 16))
+  {
+    return FALSE;
+  }
+  
+  lines = size / pitch;
+  if((DWORD)lpBlit->sy + lpBlit->h > lines)
+  {
+    return FALSE;
+  }
+  
+  gmrId = SVGA_ReadRegCached(SVGA_REG_GMR_MAX_IDS);
+  if(gmrId == 0)
+  {
+    return FALSE;
+  }
+  gmrId--;
+  
+  if(!SVGAHDA_trylock(LOCK_FIFO))
+  {
+    return FALSE;
+  }
+  
+  if(!VXD_LockRegion(lAddr, size, &ppn, &pgblk))
+  {
+    SVGAHDA_unlock(LOCK_FIFO);
+    return FALSE;
+  }
+  
+  SVGA_WriteReg(SVGA_REG_GMR_ID, gmrId);
+  SVGA_WriteReg(SVGA_REG_GMR_DESCRIPTOR, ppn);
+  
+  /* region starts on page, GMRFB on image */
+  SVGA_DefineGMRFBRegion(gmrId, lAddr & 0xFFF, pitch, bpp, depth);
+  if(!bottomUp)
+  {
+    SVGA_blitScreens(lpBlit->sx, lpBlit->sy, lpBlit->dx, lpBlit->dy, lpBlit->w, lpBlit->h);
+  }
+  else
+  {
+    for(i = 0; i < lpBlit->h; i++)
+    {
+      SVGA_blitScreens(lpBlit->sx, lines - 1 - lpBlit->sy - i, lpBlit->dx, lpBlit->dy + i, lpBlit->w, 1);
     }
-    lpScr += wScreenPitchBytes; // Scanline pitch.
   }
-#endif
-#ifdef SVGA
-	DWORD dwPS = ((wBpp+7) >> 3);
-	DWORD cb = ((DWORD)wScreenY)*((DWORD)wScreenX)*dwPS;
-	VXD_zeromem(dwScreenFlatAddr, cb);
-	SVGA_UpdateRect(0, 0, wScreenX, wScreenY);
-#else
-	DWORD dwLinestart = 0;
-	WORD wLines = wScreenY;
-	WORD wPS = ((wBpp+7) >> 3);
-	
-	while(wLines--)
-	{
-		drv_memset_large(dwScreenFlatAddr, dwLinestart, 0, (DWORD)wScreenX*wPS);
-		
-		dwLinestart += (DWORD)wScreenPitchBytes;
-	}
-#endif
+  
+  /* memory can be unlocked only after host read it */
+  fence = SVGA_InsertFence();
+  SVGA_SyncToFence(fence);
+  
+  SVGA_WriteReg(SVGA_REG_GMR_ID, gmrId);
+  SVGA_WriteReg(SVGA_REG_GMR_DESCRIPTOR, 0);
+  
+  VXD_UnlockRegion(lAddr, size, pgblk);
+  
+  SVGAHDA_unlock(LOCK_FIFO);
+  
+  return TRUE;
 }
 
-/* Map physical memory to memory space, lpLinAddress is option pointer to store
- * mapped linear address
+/*
+ * Scaling by SVGA3D: screen rect is copied (DMA) to scratch surface,
+ * stretched by host to second scratch surface and visible part is copied
+ * back to frame buffer.
  */
-static DWORD AllocLinearSelector(DWORD dwPhysAddr, DWORD dwSize, DWORD __far * lpLinAddress)
-{
-    WORD    wSel;
-    DWORD   dwLinear;
-
-    wSel = DPMI_AllocLDTDesc( 1 );  /* One descriptor, please. */
-    if( !wSel )
-        return( 0 );
 
-    /* Map the framebuffer physical memory. */
-    dwLinear = DPMI_MapPhys( dwPhysAddr, dwSize );
+static WORD SVGA_scratch_w = 0; /* size of scratch surfaces, 0 = has to be (re)defined */
+static WORD SVGA_scratch_h = 0;
+static BOOL SVGA_scratch_defined = FALSE; /* host has the SIDs, destroy them before define */
 
-    /* Now set the allocated selector to point to VRAM. */
-    DPMI_SetSegBase( wSel, dwLinear );
-    DPMI_SetSegLimit( wSel, dwSize - 1 );
-    
-    if(lpLinAddress != NULL)
-    {
-      *lpLinAddress = dwLinear;
-    }
+static void SVGA_scratchDefine(uint32 sid, WORD w, WORD h)
+{
+  SVGA3dSurfaceFace __far *faces;
+  SVGA3dSize __far *mips;
+  
+  SVGA3D_BeginDefineSurface(sid, 0, SVGA3D_X8R8G8B8, &faces, &mips, 1);
+  faces[0].numMipLevels = 1;
+  mips[0].width  = w;
+  mips[0].height = h;
+  mips[0].depth  = 1;
+  SVGA3D_FIFOCommitAll();
+}
 
-    return( wSel );
+BOOL SVGA_CanStretch3D()
+{
+  SVGA_3DProbe();
+  return wMesa3DEnabled && SVGA_CanBlitOffscreen();
 }
 
-#ifdef SVGA
 /*
- * Define the screen for accelerated rendering.
- * Color depth can by select by set: screen.backingStore.pitch
+ * Stretch screen rect (sx, sy, sw, sh) to (dx, dy, dw, dh), only part in
+ * lpClip (must be inside destination and screen) is written. Linear
+ * filter if 'filter' is set, otherwise nearest point.
  */
-static void SVGA_defineScreen(unsigned wXRes, unsigned wYRes, unsigned wBpp)
+BOOL SVGA_StretchScreen(WORD sx, WORD sy, WORD sw, WORD sh, int dx, int dy, WORD dw, WORD dh,
+  RECT __far *lpClip, BOOL filter)
 {
-  SVGAFifoCmdDefineScreen __far *screen;
-   
-  /* create screen 0 */
-  screen = SVGA_FIFOReserveCmd(SVGA_CMD_DEFINE_SCREEN, sizeof(SVGAFifoCmdDefineScreen));
+  SVGA3dGuestImage     guest;
+  SVGA3dSurfaceImageId src;
+  SVGA3dSurfaceImageId dst;
+  SVGA3dCopyBox __far *box;
+  SVGA3dBox            boxSrc;
+  SVGA3dBox            boxDst;
   
-  if(screen)
+  if(!SVGA_CanStretch3D())
   {
-    _fmemset(screen, 0, sizeof(SVGAFifoCmdDefineScreen));
-    screen->screen.structSize = sizeof(SVGAScreenObject);
-    screen->screen.id = 0;
-    screen->screen.flags = SVGA_SCREEN_MUST_BE_SET | SVGA_SCREEN_IS_PRIMARY;
-    screen->screen.size.width = wXRes;
-    screen->screen.size.height = wYRes;
-    screen->screen.root.x = 0;
-    screen->screen.root.y = 0;
-    screen->screen.cloneCount = 0;
-    
-    screen->screen.backingStore.pitch = CalcPitch(wXRes, wBpp);
-    
-    SVGA_FIFOCommitAll();
+    return FALSE;
   }
-}
-
-/* Check if screen acceleration is available */
-static BOOL SVGA_hasAccelScreen()
-{
-  if(SVGA_HasFIFOCap(SVGA_FIFO_CAP_SCREEN_OBJECT | SVGA_FIFO_CAP_SCREEN_OBJECT_2))
+  
+  if(sw == 0 || sh == 0 || dw == 0 || dh == 0 || dw > wScreenX || dh > wScreenY ||
+    (DWORD)sx + sw > wScreenX || (DWORD)sy + sh > wScreenY)
   {
-    return TRUE;
+    return FALSE;
   }
   
-  return FALSE;
-}
-
-static DWORD SVGA_partial_update_cnt = 0;
-
-/* Update screen rect if its relevant */
-extern void __loadds SVGA_UpdateRect(LONG x, LONG y, LONG w, LONG h)
-{
-  /* SVGA commands works only for 32 bpp surfaces */
-  if(wBpp != 32)
+  if(!SVGAHDA_trylock(LOCK_FIFO))
   {
-    return;
+    return FALSE;
   }
   
-  if(SVGA_partial_update_cnt++ > SVGA_PARTIAL_UPDATE_MAX)
+  /* whole operation is single FIFO commit */
+  SVGA3D_BeginBatch();
+  
+  if(SVGA_scratch_w != wScreenX || SVGA_scratch_h != wScreenY)
   {
-    if(SVGAHDA_trylock(LOCK_FIFO))
+    if(SVGA_scratch_defined)
     {
-      SVGA_Update(0, 0, wScreenX, wScreenY);
-      SVGAHDA_unlock(LOCK_FIFO);
-      SVGA_partial_update_cnt = 0;
+      SVGA3D_DestroySurface(SVGA_SCRATCH_SRC_SID);
+      SVGA3D_DestroySurface(SVGA_SCRATCH_DST_SID);
     }
-    return;
+    SVGA_scratchDefine(SVGA_SCRATCH_SRC_SID, wScreenX, wScreenY);
+    SVGA_scratchDefine(SVGA_SCRATCH_DST_SID, wScreenX, wScreenY);
+    SVGA_scratch_w = wScreenX;
+    SVGA_scratch_h = wScreenY;
+    SVGA_scratch_defined = TRUE;
   }
   
-  if(x < 0) x = 0;
-  if(y < 0) y = 0;
-  if(x+w > wScreenX) w = wScreenX - x;
-  if(y+h > wScreenY) y = wScreenY - h;
-    
-  if(w > 0 && h > 0)
+  _fmemset(&src, 0, sizeof(src));
+  _fmemset(&dst, 0, sizeof(dst));
+  src.sid = SVGA_SCRATCH_SRC_SID;
+  dst.sid = SVGA_SCRATCH_DST_SID;
+  
+  guest.ptr.gmrId  = SVGA_GMR_FRAMEBUFFER;
+  guest.ptr.offset = 0;
+  guest.pitch      = wScreenPitchBytes;
+  
+  /* screen -> source surface */
+  SVGA3D_BeginSurfaceDMA(&guest, &src, SVGA3D_WRITE_HOST_VRAM, &box, 1);
+  box->w = sw;
+  box->h = sh;
+  box->d = 1;
+  box->srcx = sx;
+  box->srcy = sy;
+  SVGA3D_FIFOCommitAll();
+  
+  _fmemset(&boxSrc, 0, sizeof(boxSrc));
+  _fmemset(&boxDst, 0, sizeof(boxDst));
+  boxSrc.w = sw;
+  boxSrc.h = sh;
+  boxSrc.d = 1;
+  boxDst.w = dw;
+  boxDst.h = dh;
+  boxDst.d = 1;
+  SVGA3D_SurfaceStretchBlt(&src, &dst, &boxSrc, &boxDst,
+    filter ? SVGA3D_STRETCH_BLT_LINEAR : SVGA3D_STRETCH_BLT_POINT);
+  
+  /* visible part of destination surface -> screen */
+  SVGA3D_BeginSurfaceDMA(&guest, &dst, SVGA3D_READ_HOST_VRAM, &box, 1);
+  box->x = lpClip->left - dx;
+  box->y = lpClip->top  - dy;
+  box->w = lpClip->right  - lpClip->left;
+  box->h = lpClip->bottom - lpClip->top;
+  box->d = 1;
+  box->srcx = lpClip->left;
+  box->srcy = lpClip->top;
+  SVGA3D_FIFOCommitAll();
+  
+  SVGA3D_EndBatch();
+  SVGA_hw_fence = SVGA_InsertFence();
+  
+  SVGAHDA_unlock(LOCK_FIFO);
+  
+  /* DMA changed only VRAM */
+  SVGA_UpdateRect(lpClip->left, lpClip->top, lpClip->right - lpClip->left, lpClip->bottom - lpClip->top);
+  
+  return TRUE;
+}
+
+/* 0 = probe 3D on mode set instead of first 3D use */
+static BOOL SVGA_defer_3d = TRUE;
+
+/* select present path once, host doesn't change under us, FIFO must be locked */
+static void SVGA_presentPathSelect()
+{
+  DWORD fifo_cost = 0;
+  DWORD cb_cost = 0;
+  DWORD path;
+  
+  if(SVGA_present_path_set)
   {
-    if(SVGAHDA_trylock(LOCK_FIFO))
-    {
-      SVGA_Update(x, y, w, h);
-      SVGAHDA_unlock(LOCK_FIFO);
-    }
-    else
-    {
-      /* update full screen next time! */
-      SVGA_partial_update_cnt = SVGA_PARTIAL_UPDATE_MAX+1;
-      return;
-    }
+    return;
   }
+  SVGA_present_path_set = TRUE;
+  
+  path = VXD_PresentPath(SVGA_present_path_cfg, &fifo_cost, &cb_cost);
+  gSVGAPerf.presentPath = path;
+  gSVGAPerf.fifoCost    = fifo_cost;
+  gSVGAPerf.cbCost      = cb_cost;
   
-  /* test if it's full update */
-  if(x == 0 && y == 0 && w == wScreenX && h == wScreenY)
+  /* INI is written only when result differs from last boot */
+  if(path != 0 && SVGA_present_path_cfg == PRESENT_PATH_AUTO &&
+    GetPrivateProfileInt("display", "present_path_measured", 0, "system.ini") != path)
   {
-    SVGA_partial_update_cnt = 0;
+    WritePrivateProfileString("display", "present_path_measured",
+      path == PRESENT_PATH_CB ? "2" : "1", "system.ini");
   }
 }
 
@@ -397,6 +2045,7 @@ static int __loadds SVGA_full_init()
 {
   int rc = 0;
   DWORD fifosel = 0; 
+  WORD present_hz;
   
   dbg_printf("VMWare SVGA-II init\n");
   
@@ -432,10 +2081,42 @@ static int __loadds SVGA_full_init()
   /* sets FIFO */
   SVGA_Enable();
   
+  SVGA_traces_cfg = GetPrivateProfileInt("display", "svga_traces", SVGA_TRACES_AUTO, "system.ini");
+  SVGA_dirty_cfg  = GetPrivateProfileInt("display", "dirty_scan", 0, "system.ini");
+  SVGA_defer_3d   = GetPrivateProfileInt("display", "defer_3d", 1, "system.ini");
+  SVGA_present_path_cfg = GetPrivateProfileInt("display", "present_path", PRESENT_PATH_AUTO, "system.ini");
+  
+  present_hz = GetPrivateProfileInt("display", "present_hz", 0, "system.ini");
+  SVGA_present_period = present_hz ? 1000 / present_hz : 0;
+  
+  SVGA_vblank_hz = GetPrivateProfileInt("display", "vblank_hz", present_hz ? present_hz : 60, "system.ini");
+  
+  SVGA_screens_cfg = GetPrivateProfileInt("display", "screens", 1, "system.ini");
+  if(SVGA_screens_cfg < 1 || SVGA_screens_cfg > SVGA_SCREENS_MAX)
+  {
+    SVGA_screens_cfg = 1;
+  }
+  
   return 0;
 }
 #endif
 
+#ifdef SVGA
+/* Register visible screen at VRAM offset for dirty scan (or stop it). */
+static void SVGA_dirtyScanSet(DWORD dwOffset)
+{
+  DWORD lin = 0;
+  
+  if(SVGA_dirty_cfg && !SVGA_traces_on && dwScreenFlatAddr != 0 &&
+    wBpp == 32 && SVGA_shadow_bpp == 0 && !SVGA_stdu)
+  {
+    lin = dwScreenFlatAddr + dwOffset;
+  }
+  
+  VXD_DirtyScan(lin, (DWORD)wScreenPitchBytes * wScreenY);
+}
+#endif
+
 /* Set the currently configured mode (wXRes/wYRes) in hardware.
  * If bFullSet is non-zero, then also reinitialize globals.
  * When re-establishing a previously set mode (e.g. coming
@@ -450,8 +2131,20 @@ static int SetDisplayMode( WORD wXRes, WORD wYRes, int bFullSet )
     CallVDD( VDD_PRE_MODE_CHANGE );
 
 #ifdef SVGA
-    /* lock FIFO to make sure, no one is filling it during mode change */
-    if(SVGAHDA_trylock(LOCK_FIFO))
+#ifdef SCREENTARGET
+    /* decided again below, screen object is needed for shadow check */
+    SVGA_stdu = FALSE;
+#endif
+    /* 8 and 16 bpp are converted to 32 bpp screen when possible */
+    SVGA_shadow_bpp = SVGA_shadowPossible(wBpp) ? wBpp : 0;
+    
+#ifdef HWBLT
+    /* new screen can overwrite copies before VRAM heap is reset */
+    SVGA_BitmapsDrop();
+#endif
+    
+    /* lock FIFO to make sure, no one is filling it during mode change, mode set must not be skipped, so wait for it (but not forever) */
+    if(SVGAHDA_lockBounded(LOCK_FIFO, SVGA_MODE_LOCK_TIMEOUT))
     {
       /* Make sure, that we drain full FIFO */
       SVGA_Flush(); 
@@ -459,17 +2152,73 @@ static int SetDisplayMode( WORD wXRes, WORD wYRes, int bFullSet )
       /* stop command buffer context 0 */
       CB_stop();
       
-      SVGA_SetMode(wXRes, wYRes, wBpp); /* setup by legacy registry */
-      wMesa3DEnabled = 0;
-      if(SVGA3D_Init())
+#ifdef HWCURSOR
+      /* host cursor must be defined again */
+      SVGA_CursorReset();
+#endif
+      
+      /* scratch surfaces are sized by screen */
+      SVGA_scratch_w = 0;
+      
+      /* drop damage from previous mode */
+      SVGA_damageClear();
+      
+      /* overlay surfaces are in VRAM heap which is reset */
+      SVGA_overlayStopLocked();
+      
+      /* DirectDraw surfaces are lost */
+      SVGA_dd_locks = 0;
+      SVGA_dd_fence = 0;
+      
+      SVGA_SetMode(wXRes, wYRes, SVGA_shadow_bpp ? 32 : wBpp); /* setup by legacy registry */
+      
+      /* 3D version is negotiated once, by default on first 3D escape */
+      if(!SVGA_defer_3d)
       {
-        wMesa3DEnabled = SVGA_3DSupport();
+        SVGA_3DProbe();
       }
       
+      SVGA_screensLayout(wXRes);
+      
+#ifdef SCREENTARGET
+      SVGA_stduDestroy();
+      
+      /* 16 bpp shadow is converted by screen object blit, not possible here */
+      if((wBpp == 32 || SVGA_shadow_bpp == 8) && SVGA_gbInit())
+      {
+         SVGA_stdu = TRUE;
+         if(SVGA_shadow_bpp)
+         {
+            SVGA_screen_offset = SVGA_shadowOffset(wXRes, wYRes, wBpp);
+            SVGA_screen_pitch  = CalcPitch(wXRes, 32);
+            SVGA_stdu_offset   = SVGA_screen_offset;
+            SVGA_stdu_pitch    = SVGA_screen_pitch;
+         }
+         else
+         {
+            SVGA_stdu_offset   = 0;
+            SVGA_stdu_pitch    = SVGA_surfacePitch(wXRes);
+         }
+         SVGA_stduDefine(wXRes, wYRes);
+         /* screen target is single screen */
+         SVGA_screens  = 1;
+         SVGA_screen_w = wXRes;
+         SVGA_destroyScreens(1);
+         SVGA_Flush();
+      }
+      else
+#endif
       /* setting screen by fifo, this method is required in VB 6.1 */
-      if(SVGA_hasAccelScreen())
+      if(SVGA_shadow_bpp)
+      {
+         SVGA_screen_offset = SVGA_shadowOffset(wXRes, wYRes, wBpp);
+         SVGA_screen_pitch  = CalcPitch(wXRes, 32);
+         SVGA_defineScreen(wXRes, wYRes, 32, SVGA_screen_offset);
+         SVGA_Flush();
+      }
+      else if(SVGA_hasAccelScreen())
       {
-         SVGA_defineScreen(wXRes, wYRes, wBpp);
+         SVGA_defineScreen(wXRes, wYRes, wBpp, 0);
          SVGA_Flush();
       }
       
@@ -485,28 +2234,49 @@ static int SetDisplayMode( WORD wXRes, WORD wYRes, int bFullSet )
        * QEMU hasn't SVGA_REG_TRACES register and framebuffer cannot be se to
        * 16 or 8 bpp = we supporting only 32 bpp moders if we're running under it.
        */
-      if(wBpp == 32)
+      if(SVGA_traces_cfg == SVGA_TRACES_AUTO)
       {
-        SVGA_WriteReg(SVGA_REG_TRACES, FALSE);
+        SVGA_traces_on = (wBpp == 32 || SVGA_shadow_bpp) ? FALSE : TRUE;
       }
       else
       {
-        SVGA_WriteReg(SVGA_REG_TRACES, TRUE);
+        SVGA_traces_on = SVGA_traces_cfg == SVGA_TRACES_ON;
       }
+      SVGA_WriteReg(SVGA_REG_TRACES, SVGA_traces_on);
       
       SVGA_WriteReg(SVGA_REG_ENABLE, TRUE);
       SVGA_Flush();
+      if(SVGAHDA_enabled)
+      {
+        *SVGAHDA_enabled = TRUE;
+      }
+      
+      /* needs running CB context and enabled device */
+      SVGA_presentPathSelect();
  
       SVGAHDA_unlock(LOCK_FIFO);
     }
     
-    dbg_printf("Pitch: %lu\n", SVGA_ReadReg(SVGA_REG_BYTES_PER_LINE));
+    dbg_printf("Pitch: %lu\n", SVGA_ReadRegCached(SVGA_REG_BYTES_PER_LINE));
+    
+    SVGAHDA_update(wScrX, wScrY, wBpp, SVGA_surfacePitch(wScrX));
     
-    SVGAHDA_update(wScrX, wScrY, wBpp, SVGA_ReadReg(SVGA_REG_BYTES_PER_LINE));
+    /* new height for virtual beam, also releases vblank waiters */
+    SVGA_vblank_on = SVGA_vblank_hz != 0 && VXD_VBlankSet(SVGA_vblank_hz, wYRes);
+    
+    /* mode set resets display start */
+    SVGA_dirtyScanSet(0);
 #else
-    BOXV_ext_mode_set( 0, wXRes, wYRes, wBpp, wXRes, wYRes );
+    wVirtHeight = CalcVirtHeight( wXRes, wYRes, wBpp );
+    BOXV_ext_mode_set( 0, wXRes, wYRes, wBpp, wXRes, wVirtHeight );
+# ifndef QEMU
+    /* mode set resets host VBVA state */
+    VBVA_Enable();
+# endif
 
 #endif
+    /* Mode set always scans out from start of VRAM. */
+    dwDisplayStart = 0;
 
     if(FBHDA_ptr)
     {
@@ -514,11 +2284,15 @@ static int SetDisplayMode( WORD wXRes, WORD wYRes, int bFullSet )
         FBHDA_ptr->height = wScrY;
         FBHDA_ptr->bpp    = wBpp;
 #ifdef SVGA
-        FBHDA_ptr->pitch = SVGA_ReadReg(SVGA_REG_BYTES_PER_LINE);
+        FBHDA_ptr->pitch = SVGA_surfacePitch(wScrX);
         FBHDA_ptr->flags = FBHDA_NEED_UPDATE;
 #else
         FBHDA_ptr->pitch  = CalcPitch( wScrX, wBpp );
+# ifndef QEMU
+        FBHDA_ptr->flags = VBVA_Active() ? FBHDA_NEED_UPDATE : 0;
+# else
         FBHDA_ptr->flags = 0;
+# endif
 #endif
     }
     
@@ -526,12 +2300,17 @@ static int SetDisplayMode( WORD wXRes, WORD wYRes, int bFullSet )
         wScreenX = wXRes;
         wScreenY = wYRes;
 #ifdef SVGA
-        wScreenPitchBytes = SVGA_ReadReg(SVGA_REG_BYTES_PER_LINE);
+        wScreenPitchBytes = SVGA_surfacePitch(wXRes);
 #else
         wScreenPitchBytes = CalcPitch( wXRes, wBpp );
 #endif
 
         BitBltDevProc     = NULL;       /* No acceleration implemented. */
+#if defined(SVGA) && defined(HWBLT)
+        if( wBpp == 32 && (gSVGA.capabilities & (SVGA_CAP_RECT_COPY | SVGA_CAP_RECT_FILL)) ) {
+            BitBltDevProc = SVGA_BitBltDev;
+        }
+#endif
 
         wPDeviceFlags     = MINIDRIVER | VRAM | OFFSCREEN;
         if( wBpp == 16 ) {
@@ -541,12 +2320,217 @@ static int SetDisplayMode( WORD wXRes, WORD wYRes, int bFullSet )
         wMaxWidth  = wScreenPitchBytes / (wBpp / 8);    /* We know bpp is a multiple of 8. */
         wMaxHeight = dwVideoMemorySize / wScreenPitchBytes;
 
-        /* Offscreen regions could be calculated here. We do not use those. */
+#ifndef SVGA
+        /* back pages follow visible screen, FBHDA users render there and flip */
+        wScreenPages = CalcScreenPages( wXRes, wYRes, wBpp );
+#endif
+        if( FBHDA_ptr )
+            FBHDA_ptr->pages = wScreenPages;
+
+        /* Everything behind the visible screen (and back pages) is offscreen heap (DirectDraw, GDI cache). */
+#ifdef SVGA
+        if( SVGA_shadow_bpp ) {
+            /* 32bpp screen is behind shadow surface */
+            wMaxHeight = SVGA_screen_offset / wScreenPitchBytes;
+            VRAMHeap_Init( SVGA_screen_offset + SVGA_screen_pitch * wScreenY, dwVideoMemorySize, VRAMHEAP_ALIGN );
+        } else
+#endif
+        VRAMHeap_Init( (DWORD)wScreenPitchBytes * wScreenY * wScreenPages, dwVideoMemorySize, VRAMHEAP_ALIGN );
     }
     return( 1 );
 }
 
 
+#ifdef SVGA
+static DWORD dwDisplayFence = 0;  /* fence of last display start change */
+#endif
+
+/* TRUE if scanout can be moved in current mode (page flipping). */
+BOOL CanSetDisplayStart( void )
+{
+#ifdef SVGA
+    /* moving screen is possible only by screen object or screen target */
+    return( wBpp == 32 && (SVGA_hasAccelScreen() || SVGA_stdu) );
+#else
+    return( wBpp >= 8 );
+#endif
+}
+
+/*
+ * Scan out visible screen from dwOffset bytes after VRAM begin,
+ * used as DirectDraw flip. Return FALSE when not possible.
+ */
+BOOL SetDisplayStart( DWORD dwOffset )
+{
+    if( !CanSetDisplayStart() || wScreenPitchBytes == 0 )
+        return( FALSE );
+
+    /* whole screen must fit in VRAM and start must be on pixel boundary */
+    if( dwOffset % (wBpp / 8) != 0 ||
+        dwOffset + (DWORD)wScreenPitchBytes * wScreenY > dwVideoMemorySize )
+        return( FALSE );
+
+#ifdef SVGA
+    if( !SVGAHDA_trylock( LOCK_FIFO ) )
+        return( FALSE );
+
+#ifdef SCREENTARGET
+    if( SVGA_stdu ) {
+        SVGA_stdu_offset = dwOffset;
+        SVGA_stduPresent( 0, 0, wScreenX, wScreenY );
+    } else
+#endif
+    SVGA_defineScreen( wScreenX, wScreenY, wBpp, dwOffset );
+    dwDisplayFence = SVGA_InsertFence();
+    /* all pending damage belongs to the old surface */
+    SVGA_damage_full = SVGA_DAMAGE_ALL;
+
+    SVGAHDA_unlock( LOCK_FIFO );
+    SVGA_dirtyScanSet( dwOffset );
+#else
+    /* VBE clamps Y offset by virtual height */
+    if( dwOffset / wScreenPitchBytes + wScreenY > wVirtHeight )
+        return( FALSE );
+
+    if( BOXV_set_display_start( 0, (dwOffset % wScreenPitchBytes) / (wBpp / 8),
+                                dwOffset / wScreenPitchBytes ) != 0 )
+        return( FALSE );
+# ifndef QEMU
+    VBVA_UpdateRect( 0, 0, wScreenX, wScreenY );
+    VBVA_UpdateFlush();
+# endif
+#endif
+
+    dwDisplayStart = dwOffset;
+    return( TRUE );
+}
+
+/* TRUE if DirectDraw Blt can be done by host (SVGA_DDBLT escape). */
+BOOL CanAccelDDBlt( void )
+{
+#ifdef SVGA
+    return( wBpp == 32 && !SVGA_stdu &&
+            ((gSVGA.capabilities & (SVGA_CAP_RECT_COPY | SVGA_CAP_RECT_FILL)) || SVGA_hasAccelScreen()) );
+#else
+    return( FALSE );
+#endif
+}
+
+/* TRUE if DirectDraw overlay can be shown by host video stream (SVGA_OVERLAY escape). */
+BOOL CanOverlay( void )
+{
+#ifdef SVGA
+    return( wBpp == 32 && SVGA_HasFIFOCap( SVGA_FIFO_CAP_VIDEO ) );
+#else
+    return( FALSE );
+#endif
+}
+
+/* TRUE if VXD emulates vertical blank (DirectDraw WaitForVerticalBlank/GetScanLine). */
+BOOL CanVBlank( void )
+{
+#ifdef SVGA
+    return( SVGA_vblank_on );
+#else
+    return( FALSE );
+#endif
+}
+
+/* TRUE when last display start change is visible (flip is done). */
+BOOL IsDisplayStartDone( void )
+{
+#ifdef SVGA
+    if( dwDisplayFence != 0 ) {
+        if( !SVGA_HasFencePassed( dwDisplayFence ) )
+            return( FALSE );
+        dwDisplayFence = 0;
+    }
+#endif
+    return( TRUE );
+}
+
+/*
+ * Screen switch snapshot: visible desktop is copied to system memory
+ * before switch to full screen DOS and copied back on return, so USER
+ * doesn't need to repaint all windows. Offscreen VRAM isn't used,
+ * VESA programs in DOS VM can overwrite all VRAM. Buffer is kept for
+ * next switches.
+ */
+static DWORD dwSnapLinear  = 0;  /* snapshot buffer */
+static DWORD dwSnapMemSize = 0;  /* size of buffer */
+static DWORD dwSnapSize    = 0;  /* size of valid snapshot, 0 = none */
+static WORD  wSnapBpp      = 0;
+
+static void SnapshotCopy( DWORD dwDst, DWORD dwSrc, DWORD dwSize )
+{
+#if defined(SVGA) || defined(QEMU)
+    if( VXD_memcpy( dwDst, dwSrc, dwSize ) )
+        return;
+#endif
+    drv_memcpy_large( dwDst, dwSrc, dwSize );
+}
+
+/* Save visible screen (without cursor), FALSE if not possible. */
+BOOL SaveScreenSnapshot( void )
+{
+    DWORD dwSize = (DWORD)wScreenPitchBytes * wScreenY;
+
+    dwSnapSize = 0;
+
+    /* palette isn't part of snapshot, flipped screen belongs to DirectDraw */
+    if( dwSize == 0 || wBpp <= 8 || dwDisplayStart != 0 || !lpDriverPDevice )
+        return( FALSE );
+
+    if( dwSnapMemSize < dwSize ) {
+        /* DPMI_AllocMemBlk has no free, old smaller buffer is lost */
+        dwSnapLinear = DPMI_AllocMemBlk( dwSize );
+        if( !dwSnapLinear ) {
+            dwSnapMemSize = 0;
+            return( FALSE );
+        }
+        dwSnapMemSize = dwSize;
+    }
+
+#ifdef SVGA
+    /* HW blits must be done, 3D present can be only on host */
+    SVGA_HWSync();
+    SVGAHDA_readback( 0, 0, wScreenX, wScreenY );
+#endif
+    DIB_BeginAccess( lpDriverPDevice, 0, 0, wScreenX, wScreenY, CURSOREXCLUDE );
+    SnapshotCopy( dwSnapLinear, dwScreenFlatAddr, dwSize );
+    DIB_EndAccess( lpDriverPDevice, CURSOREXCLUDE );
+
+    dwSnapSize = dwSize;
+    wSnapBpp   = wBpp;
+    return( TRUE );
+}
+
+/* Restore saved screen after mode set, FALSE if there is no valid snapshot. */
+BOOL RestoreScreenSnapshot( void )
+{
+    DWORD dwSize = (DWORD)wScreenPitchBytes * wScreenY;
+
+    if( dwSnapSize == 0 || dwSnapSize != dwSize || wSnapBpp != wBpp || !lpDriverPDevice ) {
+        dwSnapSize = 0;
+        return( FALSE );
+    }
+
+    DIB_BeginAccess( lpDriverPDevice, 0, 0, wScreenX, wScreenY, CURSOREXCLUDE );
+    SnapshotCopy( dwScreenFlatAddr, dwSnapLinear, dwSize );
+    DIB_EndAccess( lpDriverPDevice, CURSOREXCLUDE );
+    dwSnapSize = 0;
+
+#ifdef SVGA
+    SVGA_UpdateRect( 0, 0, wScreenX, wScreenY );
+    SVGA_UpdateFlush();
+#elif !defined(QEMU)
+    VBVA_UpdateRect( 0, 0, wScreenX, wScreenY );
+    VBVA_UpdateFlush();
+#endif
+
+    return( TRUE );
+}
+
 /* Forward declaration. */
 void __far RestoreDesktopMode( void );
 
@@ -572,6 +2556,16 @@ int PhysicalEnable( void )
 #else
         int     iChipID;
 
+# ifdef QEMU
+        /* Program DISPI registers by single MMIO accesses instead of
+         * index/data port pairs, if the device has the MMIO BAR. */
+        if( MmioBase && !MmioSelector ) {
+            MmioSelector = AllocLinearSelector( MmioBase, QEMU_MMIO_SIZE, NULL );
+            if( MmioSelector && BOXV_mmio_set( 0, MmioSelector :> 0 ) != 0 ) {
+                dbg_printf( "PhysicalEnable: MMIO BAR at %lX not usable\n", MmioBase );
+            }
+        }
+# endif
         /* Extra work if driver hasn't yet been initialized. */
         iChipID = BOXV_detect( 0, &dwVideoMemorySize );
         if( !iChipID ) {
@@ -589,6 +2583,14 @@ int PhysicalEnable( void )
           dwVideoMemorySize = MAX_VRAM;
         }
 
+#if !defined(SVGA) && !defined(QEMU)
+        /* top of VRAM is reserved for VBVA ring and HGSMI commands */
+        if(VBVA_Detect())
+        {
+          dwVideoMemorySize -= VBVA_VRAM_SIZE;
+        }
+#endif
+
         dbg_printf( "PhysicalEnable: Hardware detected, dwVideoMemorySize=%lX dwPhysVRAM=%lX\n", dwVideoMemorySize, dwPhysVRAM );
         
         
@@ -620,6 +2622,29 @@ int PhysicalEnable( void )
             return( 0 );
         }
 
+#if defined(SVGA) || defined(QEMU)
+        /* write combining for CPU writes to framebuffer, fb_wc=0 in [display] disables it */
+        if(GetPrivateProfileInt("display", "fb_wc", 1, "system.ini"))
+        {
+            if(!VXD_FBWriteCombine(dwScreenFlatAddr, dwPhysVRAM, dwVideoMemorySize))
+            {
+                dbg_printf( "PhysicalEnable: write combining not available\n" );
+            }
+        }
+#endif
+
+#if !defined(SVGA) && !defined(QEMU)
+        /* mode is already set, but VBVA block wasn't mapped yet */
+        if(VBVA_Init(dwPhysVRAM + dwVideoMemorySize, dwVideoMemorySize))
+        {
+            VBVA_Enable();
+            if(FBHDA_ptr && VBVA_Active())
+            {
+                FBHDA_ptr->flags |= FBHDA_NEED_UPDATE;
+            }
+        }
+#endif
+
 #ifdef SVGA   
         gSVGA.fbLinear = dwScreenFlatAddr;
         gSVGA.fbPhy = dwPhysVRAM;
@@ -627,6 +2652,7 @@ int PhysicalEnable( void )
           
         /* update userspace hardware access */
         SVGAHDA_setmode();
+        SVGA_dirtyScanSet(dwDisplayStart);
 #endif
     }
     
@@ -654,6 +2680,7 @@ int PhysicalEnable( void )
         
         FBHDA_ptr->fb_pm32 = dwScreenFlatAddr;
         FBHDA_ptr->fb_pm16 = ScreenSelector :> 0;
+        FBHDA_ptr->pages   = wScreenPages;
       }
       else
       {
@@ -714,6 +2741,9 @@ UINT WINAPI __loadds ValidateMode( DISPVALMODE FAR *lpValMode )
             dwPhysVRAM = LfbBase;
 # else
             dwPhysVRAM = BOXV_get_lfb_base( 0 );
+            if( VBVA_Detect() ) {
+                dwVideoMemorySize -= VBVA_VRAM_SIZE;
+            }
 # endif
 #endif
             dbg_printf( "ValidateMode: Hardware detected, dwVideoMemorySize=%lX dwPhysVRAM=%lX\n", dwVideoMemorySize, dwPhysVRAM );
@@ -732,7 +2762,17 @@ void PhysicalDisable(void)
 {
 #ifdef SVGA
 	CB_stop();
+  if(SVGAHDA_enabled)
+  {
+    *SVGAHDA_enabled = FALSE;
+  }
   SVGA_Disable();
+  
+  /* disabled device forgets all surfaces */
+  SVGA_scratch_w = 0;
+  SVGA_scratch_defined = FALSE;
+#elif !defined(QEMU)
+  VBVA_Disable();
 #endif
 }
 
@@ -36,13 +36,38 @@ THE SOFTWARE.
 
 #pragma code_seg( _INIT )
 
+/*
+ * Copy of device palette, every SVGA palette component is separate
+ * register (index + value port write = VM exit each), so only changed
+ * components are written.
+ */
+static RGBQUAD palShadow[256];
+static BOOL    palShadowValid = FALSE;
+
 static void __loadds __far SetColor(unsigned index, unsigned char r, unsigned char g, unsigned char b)
 {
 	UINT sIndex = SVGA_PALETTE_BASE + index*3;
+	RGBQUAD __far *s = &palShadow[index];
+	
+	if(!palShadowValid || s->rgbRed != r)
+	{
+		SVGA_WriteReg(sIndex+0, r);
+		gSVGAPerf.paletteWrites++;
+	}
+	if(!palShadowValid || s->rgbGreen != g)
+	{
+		SVGA_WriteReg(sIndex+1, g);
+		gSVGAPerf.paletteWrites++;
+	}
+	if(!palShadowValid || s->rgbBlue != b)
+	{
+		SVGA_WriteReg(sIndex+2, b);
+		gSVGAPerf.paletteWrites++;
+	}
 	
-  SVGA_WriteReg(sIndex+0, r);
-  SVGA_WriteReg(sIndex+1, g);
-  SVGA_WriteReg(sIndex+2, b);
+	s->rgbRed   = r;
+	s->rgbGreen = g;
+	s->rgbBlue  = b;
 }
 #endif
 
@@ -52,11 +77,21 @@ static void __loadds __far SetColor(unsigned index, unsigned char r, unsigned ch
 static void SetRAMDAC( UINT bStart, UINT bCount, RGBQUAD FAR *lpPal )
 {
 #ifdef SVGA
-	  BYTE    bIndex = bStart;
+    UINT    wIndex = bStart;
+    UINT    wEnd   = bStart + bCount;
 
-    while( bCount-- ) {
-       SetColor(bIndex++, lpPal[bIndex].rgbRed, lpPal[bIndex].rgbGreen, lpPal[bIndex].rgbBlue);
+    if( wEnd > 256 )
+        wEnd = 256;
+
+    for( ; wIndex < wEnd; ++wIndex ) {
+        SetColor( wIndex, lpPal[wIndex].rgbRed, lpPal[wIndex].rgbGreen, lpPal[wIndex].rgbBlue );
     }
+    /* shadow is valid only when whole palette was written at least once */
+    if( bStart == 0 && wEnd == 256 )
+        palShadowValid = TRUE;
+
+    /* expanded 8bpp surface needs new conversion table */
+    SVGA_Pal8Update( bStart, wEnd, lpPal );
 #else
     BYTE    bIndex = bStart;
 
@@ -74,6 +109,10 @@ static void SetRAMDAC( UINT bStart, UINT bCount, RGBQUAD FAR *lpPal )
 /* Allow calls from the _INIT segment. */
 void __far SetRAMDAC_far( UINT bStart, UINT bCount, RGBQUAD FAR *lpPal )
 {
+#ifdef SVGA
+    /* called after mode set, device palette is unknown */
+    palShadowValid = FALSE;
+#endif
     SetRAMDAC( bStart, bCount, lpPal );
 }
 
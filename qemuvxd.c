@@ -35,8 +35,11 @@ THE SOFTWARE.
 #include "svga_all.h"
 
 #include "minivdd32.h"
+#include "boxvint.h"
 
 #include "version.h"
+#include "crt32.h"
+#include "wc32.h"
 
 #include "code32.h"
 
@@ -148,6 +151,11 @@ ULONG __declspec(naked) __cdecl _PageFree(PVOID hMem, DWORD flags)
 	VMMJmp(_PageFree);
 }
 
+ULONG __declspec(naked) __cdecl _MapPhysToLinear(ULONG PhysAddr, ULONG nBytes, ULONG flags)
+{
+	VMMJmp(_MapPhysToLinear);
+}
+
 /* from minivdd.c */
 void Enable_Global_Trapping(DWORD port);
 void Disable_Global_Trapping(DWORD port);
@@ -272,16 +280,28 @@ WORD __stdcall QEMU_API_Proc(PCRS_32 state)
 			break;
 		/* create region = input: ECX - num_pages; output: EDX - lin. address of descriptor, ECX - PPN of descriptor */
 		case VMWSVXD_PM16_ZEROMEM:
-		{
-			ULONG i = 0;
-			unsigned char *ptr = (unsigned char *)state->Client_ESI;
-			for(i = 0; i < state->Client_ECX; i++)
-			{
-				ptr[i] = 0;
-			}
+			memset((void*)state->Client_ESI, 0, state->Client_ECX);
 			rc = 1;
 			break;
-		}
+		/* fill memory on linear address (EDI) by value (BL), size is in ECX */
+		case VMWSVXD_PM16_MEMSET:
+			memset((void*)state->Client_EDI, state->Client_EBX & 0xFF, state->Client_ECX);
+			rc = 1;
+			break;
+		/* copy ECX bytes from ESI to EDI, both are linear addresses */
+		case VMWSVXD_PM16_MEMCPY:
+			memcpy((void*)state->Client_EDI, (void*)state->Client_ESI, state->Client_ECX);
+			rc = 1;
+			break;
+		/* same as MEMCPY but areas can overlap */
+		case VMWSVXD_PM16_MEMMOVE:
+			memmove((void*)state->Client_EDI, (void*)state->Client_ESI, state->Client_ECX);
+			rc = 1;
+			break;
+		/* set write combining for framebuffer: ESI = linear, EDI = physical address, ECX = size */
+		case VMWSVXD_PM16_FB_WC:
+			rc = WC_Enable(state->Client_ESI, state->Client_EDI, state->Client_ECX) ? 1 : 0;
+			break;
 	}
 	
 	if(rc == 0xFFFF)
@@ -315,6 +335,286 @@ void __declspec(naked) QEMU_API_Entry()
 
 static DWORD dwWindowsVMHandle = NULL;
 
+/*
+ * DISPI register shadow
+ *
+ * Every trapped access to 1CEh/1CFh is ring 0 fault and (mostly) exit to
+ * the host, VESA programs poll these registers in loops. Index is kept per
+ * VM and written to device only when data register is really accessed,
+ * device registers are cached until next write which may change them.
+ * Cache is dropped when trapping is enabled again (DOS had direct access
+ * to ports in between) - DISPI_Invalidate() from minivdd.c.
+ *
+ * When std-vga MMIO BAR (BAR 2) is present, device registers are accessed
+ * by single MMIO access instead of index/data port pair. Display driver
+ * uses same window (boxv.c) without trapping, so Windows VM registers can
+ * change behind shadow: cache is dropped on every Windows VM access and
+ * when physical access moves to other VM.
+ */
+#define DISPI_REGS     (VBE_DISPI_INDEX_VIDEO_MEMORY_64K + 1)
+#define DISPI_VMS      8
+#define DISPI_PHYSICAL 0x80000000UL /* pass I/O to Do_Physical_IO */
+
+#define QEMU_MMIO_SIZE  0x1000
+#define QEMU_MMIO_DISPI 0x500       /* DISPI register n is word at 0x500 + n*2 */
+#define MAPPING_FAILED  0xFFFFFFFFUL
+
+/* VMM I/O types (ECX) */
+#define IO_TYPE_WORD_INPUT  0x08
+#define IO_TYPE_WORD_OUTPUT 0x0C
+
+typedef struct _dispi_vm_t
+{
+	DWORD vm;
+	WORD  index;
+	DWORD age;
+} dispi_vm_t;
+
+static WORD  dispi_regs[DISPI_REGS];
+static WORD  dispi_valid = 0;         /* bit mask of cached registers */
+static WORD  dispi_dev_index = 0;     /* index set on device */
+static BOOL  dispi_dev_index_valid = FALSE;
+static dispi_vm_t dispi_vms[DISPI_VMS];
+static DWORD dispi_age = 0;
+static volatile WORD *dispi_mmio = NULL;
+static DWORD dispi_phys_vm = 0;      /* last VM with physical access */
+
+void DISPI_Invalidate()
+{
+	dispi_valid = 0;
+	dispi_dev_index_valid = FALSE;
+}
+
+static WORD dispi_inpw(WORD port)
+{
+	static WORD sPort;
+	static WORD sVal;
+
+	sPort = port;
+	_asm
+	{
+		push eax
+		push edx
+		mov dx, [sPort]
+		in ax, dx
+		mov [sVal], ax
+		pop edx
+		pop eax
+	}
+	return sVal;
+}
+
+static void dispi_outpw(WORD port, WORD val)
+{
+	static WORD sPort;
+	static WORD sVal;
+
+	sPort = port;
+	sVal = val;
+	_asm
+	{
+		push eax
+		push edx
+		mov dx, [sPort]
+		mov ax, [sVal]
+		out dx, ax
+		pop edx
+		pop eax
+	}
+}
+
+/*
+ * Device register access, both ways leave device index on register
+ * (QEMU MMIO read/write sets it too).
+ */
+static WORD dispi_read(WORD index)
+{
+	dispi_dev_index = index;
+	dispi_dev_index_valid = TRUE;
+
+	if(dispi_mmio != NULL && index < DISPI_REGS)
+	{
+		return dispi_mmio[index];
+	}
+
+	dispi_outpw(VBE_DISPI_IOPORT_INDEX, index);
+	return dispi_inpw(VBE_DISPI_IOPORT_DATA);
+}
+
+static void dispi_write(WORD index, WORD val)
+{
+	dispi_dev_index = index;
+	dispi_dev_index_valid = TRUE;
+
+	if(dispi_mmio != NULL && index < DISPI_REGS)
+	{
+		dispi_mmio[index] = val;
+		return;
+	}
+
+	dispi_outpw(VBE_DISPI_IOPORT_INDEX, index);
+	dispi_outpw(VBE_DISPI_IOPORT_DATA, val);
+}
+
+/* index slot of VM, oldest slot is reused for new VM */
+static dispi_vm_t *dispi_vm(DWORD vm)
+{
+	int i;
+	dispi_vm_t *oldest = &dispi_vms[0];
+
+	for(i = 0; i < DISPI_VMS; i++)
+	{
+		if(dispi_vms[i].vm == vm)
+		{
+			dispi_vms[i].age = dispi_age++;
+			return &dispi_vms[i];
+		}
+
+		if(dispi_vms[i].age < oldest->age)
+		{
+			oldest = &dispi_vms[i];
+		}
+	}
+
+	oldest->vm    = vm;
+	oldest->index = 0;
+	oldest->age   = dispi_age++;
+	return oldest;
+}
+
+static void dispi_sync_index(WORD index)
+{
+	/* driver moves device index by its MMIO accesses */
+	if(!dispi_dev_index_valid || dispi_dev_index != index || dispi_mmio != NULL)
+	{
+		dispi_outpw(VBE_DISPI_IOPORT_INDEX, index);
+		dispi_dev_index = index;
+		dispi_dev_index_valid = TRUE;
+	}
+}
+
+/*
+ * Access from VM which owns CRTC. Returns value for IN (or original value
+ * for OUT) or DISPI_PHYSICAL.
+ */
+static DWORD dispi_physical(dispi_vm_t *cvm, DWORD type, DWORD port, WORD value)
+{
+	WORD index = cvm->index;
+	WORD mask;
+
+	if(type != IO_TYPE_WORD_INPUT && type != IO_TYPE_WORD_OUTPUT)
+	{
+		/* byte, dword or string I/O: device state is unknown after it */
+		if(port == VBE_DISPI_IOPORT_DATA)
+		{
+			dispi_sync_index(index);
+		}
+		DISPI_Invalidate();
+		return DISPI_PHYSICAL;
+	}
+
+	if(port == VBE_DISPI_IOPORT_INDEX)
+	{
+		if(type == IO_TYPE_WORD_OUTPUT)
+		{
+			cvm->index = value;
+			return value;
+		}
+		return index;
+	}
+
+	mask = (index < DISPI_REGS) ? (1 << index) : 0;
+
+	if(type == IO_TYPE_WORD_INPUT)
+	{
+		if(dispi_valid & mask)
+		{
+			return dispi_regs[index];
+		}
+
+		value = dispi_read(index);
+		if(mask)
+		{
+			dispi_regs[index] = value;
+			dispi_valid |= mask;
+		}
+		return value;
+	}
+
+	/* write of same value to register without side effect */
+	if((dispi_valid & mask) && dispi_regs[index] == value &&
+		index != VBE_DISPI_INDEX_ID && index != VBE_DISPI_INDEX_ENABLE)
+	{
+		return value;
+	}
+
+	dispi_write(index, value);
+
+	switch(index)
+	{
+		case VBE_DISPI_INDEX_BANK:
+		case VBE_DISPI_INDEX_X_OFFSET:
+		case VBE_DISPI_INDEX_Y_OFFSET:
+			/* device can clamp value, read it on next access */
+			dispi_valid &= ~mask;
+			break;
+		default:
+			/* mode change (or GETCAPS), other registers can change too */
+			dispi_valid = 0;
+			break;
+	}
+
+	return value;
+}
+
+/*
+ * Access from VM which doesn't own CRTC: I/O is eaten, but index and
+ * read only registers are answered from shadow.
+ */
+static DWORD dispi_virtual(dispi_vm_t *cvm, DWORD type, DWORD port, WORD value)
+{
+	WORD index = cvm->index;
+
+	if(port == VBE_DISPI_IOPORT_INDEX)
+	{
+		if(type == IO_TYPE_WORD_OUTPUT)
+		{
+			cvm->index = value;
+		}
+		else if(type == IO_TYPE_WORD_INPUT)
+		{
+			return index;
+		}
+		return value;
+	}
+
+	if(type == IO_TYPE_WORD_INPUT &&
+		(index == VBE_DISPI_INDEX_ID || index == VBE_DISPI_INDEX_VIDEO_MEMORY_64K) &&
+		(dispi_valid & (1 << index)))
+	{
+		return dispi_regs[index];
+	}
+
+	return value;
+}
+
+DWORD __cdecl dispi_io(DWORD vm, DWORD type, DWORD port, DWORD value, DWORD crtc_owner)
+{
+	dispi_vm_t *cvm = dispi_vm(vm);
+
+	if(crtc_owner != dwWindowsVMHandle || vm == crtc_owner)
+	{
+		if(dispi_mmio != NULL && (vm == dwWindowsVMHandle || vm != dispi_phys_vm))
+		{
+			DISPI_Invalidate();
+		}
+		dispi_phys_vm = vm;
+		return dispi_physical(cvm, type, port, (WORD)value);
+	}
+
+	return dispi_virtual(cvm, type, port, (WORD)value);
+}
+
 /**
  * This is fix of broken screen when open DOS window
  *
@@ -327,18 +627,296 @@ void __declspec(naked) virtual_0x1ce()
  * ECX contains the direction (in/out) and size (byte/word) of the operation.
  * EDX contains the port number, which for us will either be 1CEh or 1CFh.
  */
-	VxDCall(VDD, Get_VM_Info); // esi = result
+	VxDCall(VDD, Get_VM_Info); // edi = CRTC owner
 	_asm{
-		cmp edi, dwWindowsVMHandle  ; Is the CRTC controlled by Windows?
-    jne _Virtual1CEPhysical     ; If not, we should allow the I/O
-    cmp ebx, edi                ; Is the calling VM Windows?
-    je _Virtual1CEPhysical      ; If not, we should eat the I/O
-    	ret
+		push ecx
+		push edx
+		push eax
+		push edi          ; CRTC owner
+		push eax          ; value
+		push edx          ; port
+		push ecx          ; I/O type
+		push ebx          ; VM
+		call dispi_io
+		add esp, 20
+		test eax, 80000000h
+		jnz _Virtual1CEPhysical
+		mov edx, eax
+		pop eax
+		mov ax, dx        ; result for IN, original value for OUT
+		pop edx
+		pop ecx
+		ret
 		_Virtual1CEPhysical:
+		pop eax
+		pop edx
+		pop ecx
 	}
 	VxDJmp(VDD, Do_Physical_IO);
 }
 
+/*
+ * VBE 4F07h (display start) and 4F09h (palette) called from VESA_SUPPORT
+ * (minivdd.c). BIOS code does them by dozens of trapped port accesses per
+ * call, here it's one physical access per register. Only VM which would
+ * get physical DISPI access (see dispi_io) in enabled DISPI mode is
+ * served, everything else is left to BIOS.
+ *
+ * Trapping could be disabled while DOS VM owns the screen, so cache isn't
+ * used and it's dropped after call.
+ */
+#define VBE_RC_OK          0x004F
+#define VBE_EFLAGS_VM      0x00020000UL /* client is in V86 mode */
+#define VBE_CB_HIGH_LINEAR 4            /* cb_s.CB_High_Linear */
+
+#define VGA_DAC_READ_INDEX  0x3C7
+#define VGA_DAC_WRITE_INDEX 0x3C8
+#define VGA_DAC_DATA        0x3C9
+
+static DWORD Get_Cur_VM_Handle()
+{
+	static DWORD sVM;
+	
+	_asm push ebx
+	VMMCall(Get_Cur_VM_Handle);
+	_asm mov [sVM], ebx
+	_asm pop ebx
+	
+	return sVM;
+}
+
+static DWORD vdd_crtc_owner(DWORD vm)
+{
+	static DWORD sVM;
+	static DWORD sOwner;
+	
+	sVM = vm;
+	_asm pushad
+	_asm mov ebx, [sVM]
+	VxDCall(VDD, Get_VM_Info); // edi = CRTC owner
+	_asm mov [sOwner], edi
+	_asm popad
+	
+	return sOwner;
+}
+
+static BYTE dac_inp(WORD port)
+{
+	static WORD sPort;
+	static BYTE sVal;
+
+	sPort = port;
+	_asm
+	{
+		push eax
+		push edx
+		mov dx, [sPort]
+		in al, dx
+		mov [sVal], al
+		pop edx
+		pop eax
+	}
+	return sVal;
+}
+
+static void dac_outp(WORD port, BYTE val)
+{
+	static WORD sPort;
+	static BYTE sVal;
+
+	sPort = port;
+	sVal = val;
+	_asm
+	{
+		push eax
+		push edx
+		mov dx, [sPort]
+		mov al, [sVal]
+		out dx, al
+		pop edx
+		pop eax
+	}
+}
+
+static BOOL vbe_display_start(PCRS_32 state)
+{
+	switch((BYTE)state->Client_EBX)
+	{
+		case 0x00:
+		case 0x80: /* no retrace to wait for, device takes offset on next frame */
+			dispi_write(VBE_DISPI_INDEX_X_OFFSET, (WORD)state->Client_ECX);
+			dispi_write(VBE_DISPI_INDEX_Y_OFFSET, (WORD)state->Client_EDX);
+			return TRUE;
+		case 0x01:
+			state->Client_EBX &= 0xFFFF00FFUL; /* BH = 0 */
+			state->Client_ECX = (state->Client_ECX & 0xFFFF0000UL) | dispi_read(VBE_DISPI_INDEX_X_OFFSET);
+			state->Client_EDX = (state->Client_EDX & 0xFFFF0000UL) | dispi_read(VBE_DISPI_INDEX_Y_OFFSET);
+			return TRUE;
+	}
+	
+	/* VBE 3.0 scheduled flips */
+	return FALSE;
+}
+
+/* entries are B, G, R, pad in DAC width (6 or 8 bits, device knows) */
+static BOOL vbe_palette(PCRS_32 state, DWORD vm)
+{
+	BYTE sub   = (BYTE)state->Client_EBX;
+	WORD cnt   = (WORD)state->Client_ECX;
+	WORD start = (WORD)state->Client_EDX;
+	BYTE *pal;
+	WORD i;
+	
+	if(sub != 0x00 && sub != 0x80 && sub != 0x01)
+	{
+		/* secondary palette */
+		return FALSE;
+	}
+	
+	/* protected mode client: leave pointer translation to BIOS path */
+	if(!(state->Client_EFlags & VBE_EFLAGS_VM) || (DWORD)start + cnt > 256 ||
+		dispi_read(VBE_DISPI_INDEX_BPP) != 8)
+	{
+		return FALSE;
+	}
+	
+	pal = (BYTE *)(*((DWORD *)(vm + VBE_CB_HIGH_LINEAR)) +
+		((DWORD)state->Client_ES << 4) + (WORD)state->Client_EDI);
+	
+	if(sub == 0x01)
+	{
+		dac_outp(VGA_DAC_READ_INDEX, (BYTE)start);
+		for(i = 0; i < cnt; i++, pal += 4)
+		{
+			pal[2] = dac_inp(VGA_DAC_DATA);
+			pal[1] = dac_inp(VGA_DAC_DATA);
+			pal[0] = dac_inp(VGA_DAC_DATA);
+			pal[3] = 0;
+		}
+	}
+	else
+	{
+		dac_outp(VGA_DAC_WRITE_INDEX, (BYTE)start);
+		for(i = 0; i < cnt; i++, pal += 4)
+		{
+			dac_outp(VGA_DAC_DATA, pal[2]);
+			dac_outp(VGA_DAC_DATA, pal[1]);
+			dac_outp(VGA_DAC_DATA, pal[0]);
+		}
+	}
+	
+	return TRUE;
+}
+
+BOOL DISPI_VBECall(PCRS_32 state)
+{
+	WORD  fn = (WORD)state->Client_EAX;
+	DWORD vm;
+	DWORD owner;
+	BOOL  rc = FALSE;
+	
+	if(fn != 0x4F07 && fn != 0x4F09)
+	{
+		return FALSE;
+	}
+	
+	vm = Get_Cur_VM_Handle();
+	owner = vdd_crtc_owner(vm);
+	if(owner == dwWindowsVMHandle && vm != owner)
+	{
+		/* DOS window, its DISPI access is virtual */
+		return FALSE;
+	}
+	
+	if(dispi_read(VBE_DISPI_INDEX_ENABLE) & VBE_DISPI_ENABLED)
+	{
+		if(fn == 0x4F07)
+		{
+			rc = vbe_display_start(state);
+		}
+		else
+		{
+			rc = vbe_palette(state, vm);
+		}
+	}
+	
+	DISPI_Invalidate();
+	
+	if(rc)
+	{
+		state->Client_EAX = (state->Client_EAX & 0xFFFF0000UL) | VBE_RC_OK;
+	}
+	
+	return rc;
+}
+
+#define QEMU_PCI_VENDOR 0x1234
+#define QEMU_PCI_DEVICE 0x1111
+
+/* LFB of QEMU std VGA (BAR 0) */
+static DWORD qemu_fb_phys()
+{
+	PCIAddress addr;
+
+	if(PCI_FindDevice(QEMU_PCI_VENDOR, QEMU_PCI_DEVICE, &addr))
+	{
+		return PCI_GetBARAddr(&addr, 0);
+	}
+
+	return 0;
+}
+
+/*
+ * MMIO registers of std VGA (BAR 2), older QEMU and -vga std with
+ * mmio=off have no such BAR. Window is used only when it answers with
+ * same DISPI ID as ports.
+ */
+static void qemu_mmio_map()
+{
+	PCIAddress addr;
+	DWORD phys;
+	volatile WORD *mmio;
+	WORD id;
+
+	if(!PCI_FindDevice(QEMU_PCI_VENDOR, QEMU_PCI_DEVICE, &addr))
+	{
+		return;
+	}
+
+	phys = PCI_GetBARAddr(&addr, 2);
+	if(phys == 0)
+	{
+		return;
+	}
+
+	mmio = (volatile WORD *)_MapPhysToLinear(phys, QEMU_MMIO_SIZE, 0);
+	if((DWORD)mmio == MAPPING_FAILED)
+	{
+		return;
+	}
+
+	mmio = (volatile WORD *)((BYTE *)mmio + QEMU_MMIO_DISPI);
+	id = dispi_read(VBE_DISPI_INDEX_ID);
+	if(mmio[VBE_DISPI_INDEX_ID] == id)
+	{
+		dispi_mmio = mmio;
+	}
+	DISPI_Invalidate();
+}
+
+static DWORD qemu_vram_size()
+{
+	WORD id;
+
+	id = dispi_read(VBE_DISPI_INDEX_ID);
+	if(id < VBE_DISPI_ID0 || id > VBE_DISPI_ID6)
+	{
+		return 0;
+	}
+
+	return (DWORD)dispi_read(VBE_DISPI_INDEX_VIDEO_MEMORY_64K) << 16;
+}
+
 /* generate all entry pro VDD function */
 #define VDDFUNC(_fnname, _procname) void __declspec(naked) _procname ## _entry() { \
 	_asm { push ebp }; \
@@ -360,6 +938,9 @@ void Device_Dynamic_Init_proc(DWORD WinVMHandle)
 	if(DispatchTableLength >= 0x31)
 	{
 		#include "minivdd_func.h"
+		
+		qemu_mmio_map();
+		MiniVDD_HiresInit(DispatchTable, qemu_fb_phys(), qemu_vram_size());
 	}
 	
 	dwWindowsVMHandle = WinVMHandle;
@@ -30,6 +30,8 @@ THE SOFTWARE.
 #include "minidrv.h"
 #ifdef SVGA
 #include "svga_all.h"
+#else
+#include "vbva.h"
 #endif
 
 /* SwitchFlags bits. */
@@ -41,6 +43,8 @@ BYTE SwitchFlags = 0;           /* Screen switch flags, see above. */
 
 static BOOL bNoRepaint = 0;     /* Set when USER disables repaints. */
 static BOOL bPaintPending = 0;  /* Set when repaint was postponed.*/
+static BOOL bSnapshot = 0;      /* Restore desktop from snapshot instead of repaint. */
+BOOL bSwitchDrawLost = 0;       /* Set when drawing to busy screen was lost. */
 
 FARPROC RepaintFunc = 0;        /* Address of repaint callback. */
 
@@ -99,6 +103,9 @@ void HookInt2Fh( void )
     }
     dbg_printf( "HookInt2Fh: RepaintFunc=%WP\n", RepaintFunc );
 
+    /* switch_snapshot=1 in [display] saves desktop on switch to DOS */
+    bSnapshot = GetPrivateProfileInt( "display", "switch_snapshot", 0, "system.ini" );
+
     /* Now hook INT 2Fh. Since the address of the previous INT 2Fh handler
      * is in the code segment, we have to create a writable alias. Just
      * a little tricky.
@@ -127,12 +134,21 @@ void UnhookInt2Fh( void )
 #ifdef SVGA
 static void __far __loadds SVGA_background()
 {
+	/* VxD present worker must stop before FIFO is off */
+	if(SVGAHDA_enabled)
+	{
+		*SVGAHDA_enabled = FALSE;
+	}
 	SVGA_WriteReg(SVGA_REG_ENABLE, FALSE);
 }
 
 static void __far __loadds SVGA_foreground()
 {
 	SVGA_WriteReg(SVGA_REG_ENABLE, TRUE);
+	if(SVGAHDA_enabled)
+	{
+		*SVGAHDA_enabled = TRUE;
+	}
 }
 #endif /* SVGA */
 
@@ -177,8 +193,20 @@ VOID WINAPI __loadds UserRepaintDisable( BOOL bDisable )
 void SwitchToBgnd( void )
 {
     dbg_printf( "SwitchToBgnd\n" );
+
+    /* before DOS mode overwrites VRAM */
+    bSwitchDrawLost = FALSE;
+#if defined(SVGA) && defined(HWBLT)
+    SVGA_BitmapsDrop();
+#endif
+    if( bSnapshot )
+        SaveScreenSnapshot();
+
 #ifdef SVGA
     SVGA_background();
+#else
+    /* DOS screen isn't reported by VBVA, mode set in foreground enables it again */
+    VBVA_Disable();
 #endif
 
     lpDriverPDevice->deFlags |= BUSY;   /// @todo Does this need to be a locked op?
@@ -199,6 +227,12 @@ void SwitchToFgnd( void )
     /* If the PDevice is busy, we need to reset the display mode. */
     if( lpDriverPDevice->deFlags & BUSY )
         RestoreDesktopMode(); /* Will clear the BUSY flag. */
+
+    /* nothing was drawn in background, saved desktop is still valid */
+    if( bSnapshot && !bSwitchDrawLost && RestoreScreenSnapshot() ) {
+        dbg_printf( "SwitchToFgnd: restored from snapshot\n" );
+        return;
+    }
     RepaintScreen();
 }
 
@@ -0,0 +1,417 @@
+/*
+ * Driver microbenchmarks (Win32 console application)
+ *
+ * Measure GDI operations and driver escapes on the primary display and
+ * print results as CSV to stdout, so runs on boxvmini/vmwsmini/qemumini
+ * or on different driver versions can be compared.
+ *
+ * Usage: bench [--label <name>] [--iter <num>] [--gmr <id>]
+ */
+#include <windows.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+/* driver escapes (control.c) */
+#define QUERYESCSUPPORT      8
+#define FBHDA_UPDATE         0x110C
+#define SVGA_REGION_CREATE   0x1114
+#define SVGA_REGION_FREE     0x1115
+
+/* VXD DeviceIoControl codes (vmwsvxd.c) */
+#define SVGA_CB_LOCK         0x1204
+#define SVGA_CB_SUBMIT       0x1205
+#define CB_LOCK_WAIT         1
+
+#define CB_HEADER_SIZE       64 /* sizeof(SVGACBHeader) */
+#define CB_CONTEXT_0         0
+#define CMD_UPDATE           1  /* SVGA_CMD_UPDATE */
+
+#define REGION_PAGES         16
+
+static const char *label = "display";
+static int iterations = 200;
+static DWORD gmr_id = 200;
+
+static LARGE_INTEGER freq;
+
+static double now_ms()
+{
+	LARGE_INTEGER t;
+	QueryPerformanceCounter(&t);
+	return (double)t.QuadPart * 1000.0 / (double)freq.QuadPart;
+}
+
+static void report(const char *test, int w, int h, int cnt, double ms)
+{
+	double per_op = cnt > 0 ? (ms * 1000.0) / cnt : 0.0;
+	double ops    = ms > 0.0 ? (cnt * 1000.0) / ms : 0.0;
+
+	printf("%s,%s,%dx%d,%d,%.3f,%.3f,%.1f\n", label, test, w, h, cnt, ms, per_op, ops);
+	fflush(stdout);
+}
+
+static void report_skip(const char *test, const char *reason)
+{
+	printf("%s,%s,skipped: %s,0,0,0,0\n", label, test, reason);
+}
+
+static BOOL has_escape(HDC hdc, int code)
+{
+	return ExtEscape(hdc, QUERYESCSUPPORT, sizeof(code), (LPCSTR)&code, 0, NULL) > 0;
+}
+
+static void bench_bitblt(HDC hdc, int sw, int sh)
+{
+	static const int sizes[] = {16, 64, 256, 512};
+	int s, i;
+	double t;
+
+	for(s = 0; s < sizeof(sizes)/sizeof(sizes[0]); s++)
+	{
+		int size = sizes[s];
+		if(size*2 > sw || size > sh)
+		{
+			continue;
+		}
+
+		t = now_ms();
+		for(i = 0; i < iterations; i++)
+		{
+			BitBlt(hdc, size, 0, size, size, hdc, 0, 0, SRCCOPY);
+		}
+		GdiFlush();
+		report("bitblt_srccopy", size, size, iterations, now_ms() - t);
+	}
+
+	/* full screen scroll by one line */
+	t = now_ms();
+	for(i = 0; i < iterations; i++)
+	{
+		BitBlt(hdc, 0, 0, sw, sh-1, hdc, 0, 1, SRCCOPY);
+	}
+	GdiFlush();
+	report("bitblt_srccopy", sw, sh-1, iterations, now_ms() - t);
+
+	for(s = 0; s < sizeof(sizes)/sizeof(sizes[0]); s++)
+	{
+		int size = sizes[s];
+		HBRUSH brush = CreateSolidBrush(RGB(s*60, 128, 255 - s*60));
+		HBRUSH old   = SelectObject(hdc, brush);
+
+		if(size > sw || size > sh)
+		{
+			SelectObject(hdc, old);
+			DeleteObject(brush);
+			continue;
+		}
+
+		t = now_ms();
+		for(i = 0; i < iterations; i++)
+		{
+			PatBlt(hdc, 0, 0, size, size, PATCOPY);
+		}
+		GdiFlush();
+		report("bitblt_patcopy", size, size, iterations, now_ms() - t);
+
+		SelectObject(hdc, old);
+		DeleteObject(brush);
+	}
+}
+
+static void bench_text(HDC hdc, int sw, int sh)
+{
+	static const char text[] = "The quick brown fox jumps over the lazy dog 0123456789";
+	int len = sizeof(text) - 1;
+	int i;
+	double t;
+	SIZE ext;
+	RECT r;
+
+	GetTextExtentPoint32(hdc, text, len, &ext);
+
+	SetBkColor(hdc, RGB(255, 255, 255));
+	SetTextColor(hdc, RGB(0, 0, 0));
+
+	t = now_ms();
+	for(i = 0; i < iterations; i++)
+	{
+		int y = (i * ext.cy) % (sh - ext.cy);
+		r.left   = 0;
+		r.top    = y;
+		r.right  = ext.cx;
+		r.bottom = y + ext.cy;
+		ExtTextOut(hdc, 0, y, ETO_OPAQUE, &r, text, len, NULL);
+	}
+	GdiFlush();
+	report("exttextout_opaque", ext.cx, ext.cy, iterations, now_ms() - t);
+
+	SetBkMode(hdc, TRANSPARENT);
+	t = now_ms();
+	for(i = 0; i < iterations; i++)
+	{
+		int y = (i * ext.cy) % (sh - ext.cy);
+		ExtTextOut(hdc, 0, y, 0, NULL, text, len, NULL);
+	}
+	GdiFlush();
+	report("exttextout_transparent", ext.cx, ext.cy, iterations, now_ms() - t);
+	SetBkMode(hdc, OPAQUE);
+}
+
+static void bench_dib(HDC hdc, int sw, int sh)
+{
+	BITMAPINFO bmi;
+	DWORD *bits;
+	int i, cnt;
+	double t;
+
+	bits = malloc((size_t)sw * sh * 4);
+	if(bits == NULL)
+	{
+		report_skip("setdibitstodevice", "out of memory");
+		return;
+	}
+
+	for(i = 0; i < sw * sh; i++)
+	{
+		bits[i] = (i * 2654435761UL) & 0x00FFFFFF;
+	}
+
+	memset(&bmi, 0, sizeof(bmi));
+	bmi.bmiHeader.biSize        = sizeof(BITMAPINFOHEADER);
+	bmi.bmiHeader.biWidth       = sw;
+	bmi.bmiHeader.biHeight      = -sh;
+	bmi.bmiHeader.biPlanes      = 1;
+	bmi.bmiHeader.biBitCount    = 32;
+	bmi.bmiHeader.biCompression = BI_RGB;
+
+	cnt = iterations / 10 + 1;
+	t = now_ms();
+	for(i = 0; i < cnt; i++)
+	{
+		SetDIBitsToDevice(hdc, 0, 0, sw, sh, 0, 0, 0, sh, bits, &bmi, DIB_RGB_COLORS);
+	}
+	GdiFlush();
+	report("setdibitstodevice", sw, sh, cnt, now_ms() - t);
+
+	free(bits);
+}
+
+static void bench_cursor(int sw, int sh)
+{
+	POINT old;
+	int i;
+	double t;
+
+	GetCursorPos(&old);
+
+	t = now_ms();
+	for(i = 0; i < iterations * 5; i++)
+	{
+		SetCursorPos((i * 7) % sw, (i * 13) % sh);
+	}
+	report("cursor_move", 0, 0, iterations * 5, now_ms() - t);
+
+	SetCursorPos(old.x, old.y);
+}
+
+static void bench_update(HDC hdc, int sw, int sh)
+{
+	static const int sizes[] = {16, 256, 0};
+	int s, i;
+	double t;
+
+	if(!has_escape(hdc, FBHDA_UPDATE))
+	{
+		report_skip("fbhda_update", "escape not supported");
+		return;
+	}
+
+	for(s = 0; s < sizeof(sizes)/sizeof(sizes[0]); s++)
+	{
+		RECT r;
+		r.left   = 0;
+		r.top    = 0;
+		r.right  = sizes[s] ? sizes[s] : sw;
+		r.bottom = sizes[s] ? sizes[s] : sh;
+
+		t = now_ms();
+		for(i = 0; i < iterations; i++)
+		{
+			ExtEscape(hdc, FBHDA_UPDATE, sizeof(r), (LPCSTR)&r, 0, NULL);
+		}
+		report("fbhda_update", r.right, r.bottom, iterations, now_ms() - t);
+	}
+}
+
+static void bench_region(HDC hdc)
+{
+	DWORD in[3];
+	DWORD out[3];
+	int i, cnt = 0;
+	double t;
+
+	if(!has_escape(hdc, SVGA_REGION_CREATE))
+	{
+		report_skip("region_create_free", "escape not supported");
+		return;
+	}
+
+	t = now_ms();
+	for(i = 0; i < iterations; i++)
+	{
+		in[0] = gmr_id;
+		in[1] = REGION_PAGES;
+		out[0] = 0;
+		ExtEscape(hdc, SVGA_REGION_CREATE, 2*sizeof(DWORD), (LPCSTR)in, 3*sizeof(DWORD), (LPSTR)out);
+		if(out[0] == 0)
+		{
+			break;
+		}
+		ExtEscape(hdc, SVGA_REGION_FREE, 3*sizeof(DWORD), (LPCSTR)out, 0, NULL);
+		cnt++;
+	}
+	report("region_create_free", REGION_PAGES, 0, cnt, now_ms() - t);
+}
+
+static void bench_cb()
+{
+	HANDLE vxd;
+	DWORD flags = CB_LOCK_WAIT;
+	DWORD in[2];
+	DWORD lin;
+	DWORD ret;
+	int i, cnt = 0;
+	double total = 0.0;
+	double worst = 0.0;
+
+	vxd = CreateFile("\\\\.\\VMWSVXD", 0, 0, NULL, 0, FILE_FLAG_DELETE_ON_CLOSE, NULL);
+	if(vxd == INVALID_HANDLE_VALUE)
+	{
+		report_skip("cb_submit", "VMWSVXD not loaded");
+		return;
+	}
+
+	for(i = 0; i < iterations; i++)
+	{
+		volatile DWORD *hdr;
+		DWORD *cmd;
+		double t, dt;
+
+		lin = 0;
+		if(!DeviceIoControl(vxd, SVGA_CB_LOCK, &flags, sizeof(flags), &lin, sizeof(lin), &ret, NULL) || lin == 0)
+		{
+			break;
+		}
+
+		/* header: status, errorOffset, id (2), flags, length, ... */
+		hdr = (volatile DWORD *)lin;
+		cmd = (DWORD *)(lin + CB_HEADER_SIZE);
+		cmd[0] = CMD_UPDATE;
+		cmd[1] = 0;
+		cmd[2] = 0;
+		cmd[3] = 1;
+		cmd[4] = 1;
+		hdr[5] = 5*sizeof(DWORD);
+
+		in[0] = lin;
+		in[1] = CB_CONTEXT_0;
+
+		t = now_ms();
+		if(!DeviceIoControl(vxd, SVGA_CB_SUBMIT, in, sizeof(in), NULL, 0, &ret, NULL))
+		{
+			break;
+		}
+
+		/* wait for completion (status != NONE) */
+		while(hdr[0] == 0)
+		{
+			if(now_ms() - t > 1000.0)
+			{
+				break;
+			}
+		}
+		dt = now_ms() - t;
+
+		total += dt;
+		if(dt > worst)
+		{
+			worst = dt;
+		}
+		cnt++;
+	}
+
+	CloseHandle(vxd);
+
+	if(cnt == 0)
+	{
+		report_skip("cb_submit", "command buffers not available");
+		return;
+	}
+
+	report("cb_submit", 0, 0, cnt, total);
+	report("cb_submit_worst", 0, 0, 1, worst);
+}
+
+int main(int argc, char **argv)
+{
+	HDC hdc;
+	int sw, sh;
+	int i;
+
+	for(i = 1; i < argc; i++)
+	{
+		if(strcmp(argv[i], "--label") == 0 && i+1 < argc)
+		{
+			label = argv[++i];
+		}
+		else if(strcmp(argv[i], "--iter") == 0 && i+1 < argc)
+		{
+			iterations = atoi(argv[++i]);
+			if(iterations < 1) iterations = 1;
+		}
+		else if(strcmp(argv[i], "--gmr") == 0 && i+1 < argc)
+		{
+			gmr_id = strtoul(argv[++i], NULL, 0);
+		}
+		else
+		{
+			printf("%s [--label <name>] [--iter <num>] [--gmr <id>]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	if(!QueryPerformanceFrequency(&freq))
+	{
+		fprintf(stderr, "no performance counter\n");
+		return 1;
+	}
+
+	hdc = GetDC(NULL);
+	if(hdc == NULL)
+	{
+		fprintf(stderr, "GetDC failed\n");
+		return 1;
+	}
+
+	sw = GetDeviceCaps(hdc, HORZRES);
+	sh = GetDeviceCaps(hdc, VERTRES);
+
+	printf("label,test,size,iterations,total_ms,per_op_us,ops_per_sec\n");
+	printf("%s,mode,%dx%dx%d,0,0,0,0\n", label, sw, sh, GetDeviceCaps(hdc, BITSPIXEL));
+
+	bench_bitblt(hdc, sw, sh);
+	bench_text(hdc, sw, sh);
+	bench_dib(hdc, sw, sh);
+	bench_cursor(sw, sh);
+	bench_update(hdc, sw, sh);
+	bench_region(hdc);
+	bench_cb();
+
+	ReleaseDC(NULL, hdc);
+
+	/* repaint desktop */
+	InvalidateRect(NULL, NULL, TRUE);
+
+	return 0;
+}
@@ -0,0 +1,478 @@
+/*****************************************************************************
+
+Copyright (c) 2023 Jaroslav Hensl <emulator@emulace.cz>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+
+*****************************************************************************/
+
+/* VirtualBox VBVA dirty rect channel */
+
+#include "winhack.h"
+#include <gdidefs.h>
+#include <dibeng.h>
+#include "minidrv.h"
+#include "boxv.h"
+#include "dpmi.h"
+#include "damage.h"
+#include "vbva.h"
+
+#include <string.h> /* _fmemset */
+
+/*
+ * Layout of VBVA_VRAM_SIZE block:
+ *   VBVA_RING_OFFSET: vbva_buffer_t followed by VBVA_RING_DATA bytes of data
+ *   VBVA_CMD_OFFSET:  one HGSMI buffer for commands (host processes it
+ *                     synchronously, so one is enough)
+ *
+ * Every dirty rect is one record with VBVACMDHDR. Damage is accumulated
+ * like on SVGA (damage.c) and written on VBVA_UpdateFlush.
+ */
+#define VBVA_RING_OFFSET 0x0000
+#define VBVA_RING_DATA   0x8000
+#define VBVA_CMD_OFFSET  0xC000
+
+#define VBVA_MAX_RECORDS 64
+#define VBVA_PARTIAL_THRESHOLD 256
+
+#define HGSMI_CH_VBVA 0x02
+
+#define VBVA_INFO_VIEW 3
+#define VBVA_FLUSH     5
+#define VBVA_ENABLE    7
+
+#define VBVA_F_ENABLE  0x00000001UL
+#define VBVA_F_DISABLE 0x00000002UL
+
+#define VBVA_F_MODE_ENABLED    0x00000001UL /* host events */
+#define VBVA_F_RECORD_PARTIAL  0x80000000UL
+
+/* flush damage immediately when it is larger than 1/N of screen */
+#define VBVA_DAMAGE_FLUSH_AREA 4
+
+/* cursor is max. 32x32, hot spot is somewhere inside */
+#define VBVA_CURSOR_SIZE 32
+
+#pragma pack(push)
+#pragma pack(1)
+typedef struct _hgsmi_header_t
+{
+	DWORD u32DataSize;
+	BYTE  u8Flags;
+	BYTE  u8Channel;
+	WORD  u16ChannelInfo;
+	BYTE  au8Union[8];
+} hgsmi_header_t;
+
+typedef struct _hgsmi_tail_t
+{
+	DWORD u32Reserved;
+	DWORD u32Checksum;
+} hgsmi_tail_t;
+
+typedef struct _vbva_buffer_t
+{
+	DWORD u32HostEvents;
+	DWORD u32SupportedOrders;
+	DWORD off32Data;
+	DWORD off32Free;
+	DWORD aRecords[VBVA_MAX_RECORDS];
+	DWORD indexRecordFirst;
+	DWORD indexRecordFree;
+	DWORD cbPartialWriteThreshold;
+	DWORD cbData;
+	/* data follows */
+} vbva_buffer_t;
+
+typedef struct _vbva_cmdhdr_t
+{
+	short x;
+	short y;
+	WORD  w;
+	WORD  h;
+} vbva_cmdhdr_t;
+
+typedef struct _vbva_infoview_t
+{
+	DWORD u32ViewIndex;
+	DWORD u32ViewOffset;
+	DWORD u32ViewSize;
+	DWORD u32MaxScreenSize;
+} vbva_infoview_t;
+
+typedef struct _vbva_enable_t
+{
+	DWORD u32Flags;
+	DWORD u32Offset;
+	LONG  i32Result;
+} vbva_enable_t;
+#pragma pack(pop)
+
+static BOOL  vbva_supported = FALSE;
+static BOOL  vbva_enabled   = FALSE;
+static WORD  vbva_sel       = 0;
+static DWORD vbva_offset    = 0; /* offset of block from VRAM start */
+
+static damage_t vbva_damage;
+static volatile WORD vbva_damage_busy = 0;
+static volatile WORD vbva_damage_full = 0;
+
+static WORD vbva_cursor_x = 0;
+static WORD vbva_cursor_y = 0;
+
+#pragma code_seg( _TEXT )
+
+/* Jenkins one-at-a-time hash, used as HGSMI checksum */
+static DWORD hgsmi_hash(DWORD hash, BYTE __far *data, WORD size)
+{
+	while(size--)
+	{
+		hash += *data++;
+		hash += hash << 10;
+		hash ^= hash >> 6;
+	}
+	return hash;
+}
+
+static DWORD hgsmi_checksum(DWORD offset, hgsmi_header_t __far *header, hgsmi_tail_t __far *tail)
+{
+	DWORD hash;
+
+	hash = hgsmi_hash(0, (BYTE __far *)&offset, sizeof(DWORD));
+	hash = hgsmi_hash(hash, (BYTE __far *)header, sizeof(hgsmi_header_t));
+	hash = hgsmi_hash(hash, (BYTE __far *)tail, sizeof(DWORD));
+
+	hash += hash << 3;
+	hash ^= hash >> 11;
+	hash += hash << 15;
+
+	return hash;
+}
+
+/* Send VBVA command with 'size' bytes of data, data are updated by host result */
+static void hgsmi_send(WORD cmd, void __far *data, WORD size)
+{
+	BYTE __far *buf = vbva_sel :> VBVA_CMD_OFFSET;
+	hgsmi_header_t __far *header = (hgsmi_header_t __far *)buf;
+	hgsmi_tail_t __far *tail = (hgsmi_tail_t __far *)(buf + sizeof(hgsmi_header_t) + size);
+	DWORD offset = vbva_offset + VBVA_CMD_OFFSET;
+
+	_fmemset(header, 0, sizeof(hgsmi_header_t));
+	header->u32DataSize    = size;
+	header->u8Channel      = HGSMI_CH_VBVA;
+	header->u16ChannelInfo = cmd;
+	_fmemcpy(buf + sizeof(hgsmi_header_t), data, size);
+	tail->u32Reserved = 0;
+	tail->u32Checksum = hgsmi_checksum(offset, header, tail);
+
+	BOXV_hgsmi_submit(0, offset);
+
+	_fmemcpy(data, buf + sizeof(hgsmi_header_t), size);
+}
+
+static vbva_buffer_t __far *vbva_ring()
+{
+	return (vbva_buffer_t __far *)(vbva_sel :> VBVA_RING_OFFSET);
+}
+
+/* ask host to process records, it frees space in ring */
+static void vbva_flush_host()
+{
+	DWORD reserved = 0;
+
+	hgsmi_send(VBVA_FLUSH, &reserved, sizeof(reserved));
+}
+
+static DWORD vbva_avail(vbva_buffer_t __far *ring)
+{
+	LONG diff = (LONG)ring->off32Data - (LONG)ring->off32Free;
+
+	return diff > 0 ? (DWORD)diff : ring->cbData + diff;
+}
+
+/* write one record with rect header, FALSE if there is no space */
+static BOOL vbva_write_rect(damage_rect_t __far *r)
+{
+	vbva_buffer_t __far *ring = vbva_ring();
+	BYTE __far *ring_data = (BYTE __far *)ring + sizeof(vbva_buffer_t);
+	vbva_cmdhdr_t hdr;
+	BYTE __far *src = (BYTE __far *)&hdr;
+	DWORD rec;
+	DWORD next;
+	WORD i;
+
+	if((ring->u32HostEvents & VBVA_F_MODE_ENABLED) == 0)
+	{
+		return FALSE;
+	}
+
+	rec  = ring->indexRecordFree;
+	next = (rec + 1) % VBVA_MAX_RECORDS;
+	if(next == ring->indexRecordFirst || vbva_avail(ring) <= sizeof(hdr))
+	{
+		vbva_flush_host();
+		if(next == ring->indexRecordFirst || vbva_avail(ring) <= sizeof(hdr))
+		{
+			return FALSE;
+		}
+	}
+
+	hdr.x = (short)r->left;
+	hdr.y = (short)r->top;
+	hdr.w = (WORD)(r->right - r->left);
+	hdr.h = (WORD)(r->bottom - r->top);
+
+	ring->aRecords[rec] = VBVA_F_RECORD_PARTIAL;
+	ring->indexRecordFree = next;
+
+	/* data can wrap around end of ring */
+	for(i = 0; i < sizeof(hdr); i++)
+	{
+		ring_data[ring->off32Free] = src[i];
+		ring->off32Free = (ring->off32Free + 1) % ring->cbData;
+	}
+
+	ring->aRecords[rec] = sizeof(hdr);
+
+	return TRUE;
+}
+
+/* TRUE if adapter has HGSMI, must be called before VBVA_Init */
+BOOL VBVA_Detect(void)
+{
+	vbva_supported = BOXV_hgsmi_detect(0) != 0;
+
+	return vbva_supported;
+}
+
+/* Map VBVA block, dwPhys is its physical address and dwOffset offset from VRAM start */
+BOOL VBVA_Init(DWORD dwPhys, DWORD dwOffset)
+{
+	DWORD dwLinear;
+
+	if(!vbva_supported)
+	{
+		return FALSE;
+	}
+
+	if(vbva_sel != 0)
+	{
+		/* already mapped */
+		return TRUE;
+	}
+
+	vbva_sel = DPMI_AllocLDTDesc(1);
+	if(vbva_sel == 0)
+	{
+		vbva_supported = FALSE;
+		return FALSE;
+	}
+
+	dwLinear = DPMI_MapPhys(dwPhys, VBVA_VRAM_SIZE);
+	DPMI_SetSegBase(vbva_sel, dwLinear);
+	DPMI_SetSegLimit(vbva_sel, VBVA_VRAM_SIZE - 1);
+	vbva_offset = dwOffset;
+
+	return TRUE;
+}
+
+/* (Re)enable VBVA after mode set */
+void VBVA_Enable(void)
+{
+	vbva_buffer_t __far *ring;
+	vbva_infoview_t view;
+	vbva_enable_t en;
+
+	if(!vbva_supported || vbva_sel == 0)
+	{
+		return;
+	}
+
+	VBVA_Disable();
+
+	ring = vbva_ring();
+	_fmemset(ring, 0, sizeof(vbva_buffer_t));
+	ring->cbPartialWriteThreshold = VBVA_PARTIAL_THRESHOLD;
+	ring->cbData = VBVA_RING_DATA;
+
+	/* one view over whole usable VRAM */
+	view.u32ViewIndex     = 0;
+	view.u32ViewOffset    = 0;
+	view.u32ViewSize      = vbva_offset;
+	view.u32MaxScreenSize = vbva_offset;
+	hgsmi_send(VBVA_INFO_VIEW, &view, sizeof(view));
+
+	en.u32Flags  = VBVA_F_ENABLE;
+	en.u32Offset = vbva_offset + VBVA_RING_OFFSET;
+	en.i32Result = -1;
+	hgsmi_send(VBVA_ENABLE, &en, sizeof(en));
+
+	Damage_Clear(&vbva_damage);
+	vbva_damage_full = 0;
+	vbva_enabled = en.i32Result >= 0;
+	dbg_printf("VBVA_Enable: %ld\n", en.i32Result);
+}
+
+void VBVA_Disable(void)
+{
+	vbva_enable_t en;
+
+	if(!vbva_enabled)
+	{
+		return;
+	}
+
+	vbva_enabled = FALSE;
+
+	en.u32Flags  = VBVA_F_DISABLE;
+	en.u32Offset = 0;
+	en.i32Result = -1;
+	hgsmi_send(VBVA_ENABLE, &en, sizeof(en));
+}
+
+BOOL VBVA_Active(void)
+{
+	return vbva_enabled;
+}
+
+/* Send accumulated damage to the host */
+void VBVA_UpdateFlush(void)
+{
+	damage_rect_t full;
+	WORD i;
+
+	if(!vbva_enabled || vbva_damage_busy)
+	{
+		return;
+	}
+
+	if(vbva_damage.cnt == 0 && !vbva_damage_full)
+	{
+		return;
+	}
+
+	vbva_damage_busy = 1;
+	if(vbva_damage_full)
+	{
+		full.left   = 0;
+		full.top    = 0;
+		full.right  = wScreenX;
+		full.bottom = wScreenY;
+		if(vbva_write_rect(&full))
+		{
+			Damage_Clear(&vbva_damage);
+			vbva_damage_full = 0;
+		}
+	}
+	else
+	{
+		/* what doesn't fit stays for next flush */
+		while(vbva_damage.cnt > 0)
+		{
+			if(!vbva_write_rect(&vbva_damage.rects[vbva_damage.cnt-1]))
+			{
+				break;
+			}
+			vbva_damage.cnt--;
+		}
+		Damage_Recount(&vbva_damage);
+	}
+	vbva_damage_busy = 0;
+}
+
+void VBVA_UpdateRect(LONG x, LONG y, LONG w, LONG h)
+{
+	damage_rect_t r;
+
+	if(!vbva_enabled)
+	{
+		return;
+	}
+
+	if(x < 0)
+	{
+		w += x;
+		x = 0;
+	}
+	if(y < 0)
+	{
+		h += y;
+		y = 0;
+	}
+	if(x+w > wScreenX) w = wScreenX - x;
+	if(y+h > wScreenY) h = wScreenY - y;
+
+	if(w <= 0 || h <= 0)
+	{
+		return;
+	}
+
+	if(vbva_damage_busy)
+	{
+		/* interrupted damage list manipulation, give up and refresh everything */
+		vbva_damage_full = 1;
+		return;
+	}
+
+	vbva_damage_busy = 1;
+	r.left   = x;
+	r.top    = y;
+	r.right  = x + w;
+	r.bottom = y + h;
+	Damage_Add(&vbva_damage, &r);
+	vbva_damage_busy = 0;
+
+	if(vbva_damage_full ||
+		vbva_damage.area >= ((DWORD)wScreenX * wScreenY) / VBVA_DAMAGE_FLUSH_AREA)
+	{
+		VBVA_UpdateFlush();
+	}
+}
+
+/*
+ * Software cursor is drawn by DIB engine, hot spot isn't known here, so
+ * area around old and new position where cursor can be is updated.
+ */
+void VBVA_CursorMove(WORD x, WORD y)
+{
+	if(!vbva_enabled)
+	{
+		return;
+	}
+
+	VBVA_UpdateRect((LONG)vbva_cursor_x - VBVA_CURSOR_SIZE, (LONG)vbva_cursor_y - VBVA_CURSOR_SIZE,
+		2*VBVA_CURSOR_SIZE, 2*VBVA_CURSOR_SIZE);
+	VBVA_UpdateRect((LONG)x - VBVA_CURSOR_SIZE, (LONG)y - VBVA_CURSOR_SIZE,
+		2*VBVA_CURSOR_SIZE, 2*VBVA_CURSOR_SIZE);
+
+	vbva_cursor_x = x;
+	vbva_cursor_y = y;
+}
+
+/* cursor shape was changed */
+void VBVA_CursorUpdate(void)
+{
+	if(!vbva_enabled)
+	{
+		return;
+	}
+
+	VBVA_UpdateRect((LONG)vbva_cursor_x - VBVA_CURSOR_SIZE, (LONG)vbva_cursor_y - VBVA_CURSOR_SIZE,
+		2*VBVA_CURSOR_SIZE, 2*VBVA_CURSOR_SIZE);
+}
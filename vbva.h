@@ -0,0 +1,22 @@
+#ifndef __VBVA_H__INCLUDED__
+#define __VBVA_H__INCLUDED__
+
+/*
+ * VirtualBox Video Acceleration: dirty rects are passed to the host
+ * by ring buffer in VRAM, so host doesn't need to scan frame buffer.
+ */
+
+/* VRAM reserved on the end of usable VRAM (ring buffer + HGSMI commands) */
+#define VBVA_VRAM_SIZE 0x10000UL
+
+BOOL VBVA_Detect(void);
+BOOL VBVA_Init(DWORD dwPhys, DWORD dwOffset);
+void VBVA_Enable(void);
+void VBVA_Disable(void);
+BOOL VBVA_Active(void);
+void VBVA_UpdateRect(LONG x, LONG y, LONG w, LONG h);
+void VBVA_UpdateFlush(void);
+void VBVA_CursorMove(WORD x, WORD y);
+void VBVA_CursorUpdate(void);
+
+#endif /* __VBVA_H__INCLUDED__ */
@@ -41,6 +41,10 @@ typedef struct VMDAHAL
   
   DWORD hInstance;
   
+  /* added after cb32, older 32-bit HAL leaves them zero (VXD SVGA_VBLANK_*) */
+  LPDDHAL_WAITFORVERTICALBLANK WaitForVerticalBlank;
+  LPDDHAL_GETSCANLINE          GetScanLine;
+  
 } VMDAHAL_t;
 #pragma pack(pop)
 
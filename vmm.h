@@ -334,6 +334,16 @@ typedef struct tagVxD_Desc_Block
 
 /*ENDMACROS*/
 
+/*
+ *  Flags for Wait_Semaphore
+ */
+#define BLOCK_SVC_INTS            0x00000001
+#define BLOCK_SVC_IF_INTS_LOCKED  0x00000002
+#define BLOCK_ENABLE_INTS         0x00000004
+#define BLOCK_POLL                0x00000008
+#define BLOCK_THREAD_IDLE         0x00000010
+#define BLOCK_FORCE_SVC_INTS      0x00000020
+
 /****************************************************
  *
  *   Flags for heap allocator calls
@@ -701,6 +711,48 @@ typedef struct tagCRS_32
 #define D_ACCESSED  1           /* segment accessed bit */
 
 
+/*
+ * VPICD services
+ */
+#define VPICD__Get_Version 0
+#define VPICD__Virtualize_IRQ 1
+#define VPICD__Set_Int_Request 2
+#define VPICD__Clear_Int_Request 3
+#define VPICD__Phys_EOI 4
+#define VPICD__Get_Complete_Status 5
+#define VPICD__Get_Status 6
+#define VPICD__Test_Phys_Request 7
+#define VPICD__Physically_Mask 8
+#define VPICD__Physically_Unmask 9
+#define VPICD__Set_Auto_Masking 10
+#define VPICD__Get_IRQ_Complete_Status 11
+#define VPICD__Convert_Handle_To_IRQ 12
+#define VPICD__Convert_IRQ_To_Int 13
+#define VPICD__Convert_Int_To_IRQ 14
+#define VPICD__Call_When_Hw_Int 15
+#define VPICD__Force_Default_Owner 16
+#define VPICD__Force_Default_Behavior 17
+
+#define VPICD_OPT_READ_HW_IRR  0x0001
+#define VPICD_OPT_CAN_SHARE    0x0002
+#define VPICD_OPT_REF_DATA     0x0004
+
+#pragma pack(push)
+#pragma pack(1)
+typedef struct VPICD_IRQ_Descriptor
+{
+	WORD  VID_IRQ_Number;
+	WORD  VID_Options;
+	DWORD VID_Hw_Int_Proc;
+	DWORD VID_Virt_Int_Proc;
+	DWORD VID_EOI_Proc;
+	DWORD VID_Mask_Change_Proc;
+	DWORD VID_IRET_Proc;
+	DWORD VID_IRET_Time_Out;
+	DWORD VID_Hw_Int_Ref;
+} VPICD_IRQ_Descriptor;
+#pragma pack(pop)
+
 /* contains information that an aplication passed to VXD by calling DeviceIoControl function */
 struct DIOCParams
 {
@@ -36,6 +36,7 @@
 
 #include "svga_all.h"
 #include "pci.h"
+#include "vmwsvxd.h" /* TRACE_* */
 
 #ifdef VXD32
 #define IO_IN32
@@ -71,6 +72,23 @@ void dbg_printf( const char *s, ... );
 
 
 SVGADevice gSVGA;
+SVGAPerfCounters gSVGAPerf;
+
+/*
+ * When set, every fence value read from FIFO is copied here, so the last
+ * passed fence can be checked without FIFO access (like user space does
+ * with userlist). Writers may race, so value is only lower bound.
+ */
+volatile uint32 __far *gSVGAFenceMirror = NULL;
+
+/*
+ * Non zero while someone is between index and value port access, between
+ * FIFO reserve and commit (or VXD changes command buffer state). VXD
+ * time-outs can interrupt that, so they only take it when it's zero. Points to page shared by driver and VXD
+ * once it's known, to local counter before.
+ */
+static volatile uint32 gSVGADevBusyLocal = 0;
+volatile uint32 __far *gSVGADevBusy = &gSVGADevBusyLocal;
 
 static void SVGAFIFOFull(void);
 
@@ -173,6 +191,7 @@ SVGA_Init(Bool enableFIFO)
       gSVGA.fbMem = (void __far*) PCI_GetBARAddr(&gSVGA.pciAddr, 1);
    }
    gSVGA.fifoMem = (void __far*) PCI_GetBARAddr(&gSVGA.pciAddr, 2);
+   SVGA_ShadowInvalidate(TRUE);
 
 #ifndef VXD32 /* version negotiation is done in PM16 driver, only get addresses here */
    /*
@@ -421,6 +440,7 @@ SVGA_SetMode(uint32 width,   // IN
    gSVGA.height = height;
    gSVGA.bpp = bpp;
 
+   SVGA_ShadowInvalidate(FALSE);
    SVGA_WriteReg(SVGA_REG_WIDTH, width);
    SVGA_WriteReg(SVGA_REG_HEIGHT, height);
    SVGA_WriteReg(SVGA_REG_BITS_PER_PIXEL, bpp);
@@ -507,8 +527,14 @@ SVGA_DefaultFaultHandler(int vector)  // IN
 uint32
 SVGA_ReadReg(uint32 index)  // IN
 {
+   uint32 value;
+
+   (*gSVGADevBusy)++;
    outpd(gSVGA.ioBase + SVGA_INDEX_PORT, index);
-   return inpd(gSVGA.ioBase + SVGA_VALUE_PORT);
+   value = inpd(gSVGA.ioBase + SVGA_VALUE_PORT);
+   (*gSVGADevBusy)--;
+
+   return value;
 }
 
 
@@ -533,8 +559,140 @@ void
 SVGA_WriteReg(uint32 index,  // IN
               uint32 value)  // IN
 {
+   (*gSVGADevBusy)++;
    outpd(gSVGA.ioBase + SVGA_INDEX_PORT, index);
    outpd(gSVGA.ioBase + SVGA_VALUE_PORT, value);
+   (*gSVGADevBusy)--;
+
+   if (index < SVGA_SHADOW_REGS) {
+      switch (index) {
+      case SVGA_REG_ENABLE:
+      case SVGA_REG_WIDTH:
+      case SVGA_REG_HEIGHT:
+      case SVGA_REG_BITS_PER_PIXEL:
+      case SVGA_REG_PITCHLOCK:
+      case SVGA_REG_CONFIG_DONE:
+         SVGA_ShadowInvalidate(FALSE);
+         break;
+      default:
+         gSVGA.shadowValid[index / 32] &= ~(1UL << (index % 32));
+         break;
+      }
+   }
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * SVGAShadowKind --
+ *
+ *      Return how a register can be cached: 0 = never (side effects or
+ *      host can change it), 1 = constant for device life, 2 = changes
+ *      only on mode set.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static int
+SVGAShadowKind(uint32 index)  // IN
+{
+   switch (index) {
+   case SVGA_REG_MAX_WIDTH:
+   case SVGA_REG_MAX_HEIGHT:
+   case SVGA_REG_FB_START:
+   case SVGA_REG_VRAM_SIZE:
+   case SVGA_REG_CAPABILITIES:
+   case SVGA_REG_MEM_START:
+   case SVGA_REG_MEM_SIZE:
+   case SVGA_REG_HOST_BITS_PER_PIXEL:
+   case SVGA_REG_SCRATCH_SIZE:
+   case SVGA_REG_MEM_REGS:
+   case SVGA_REG_GMR_MAX_IDS:
+   case SVGA_REG_GMR_MAX_DESCRIPTOR_LENGTH:
+   case SVGA_REG_GMRS_MAX_PAGES:
+   case SVGA_REG_MEMORY_SIZE:
+   case SVGA_REG_MAX_PRIMARY_MEM:
+   case SVGA_REG_SUGGESTED_GBOBJECT_MEM_SIZE_KB:
+   case SVGA_REG_SCREENTARGET_MAX_WIDTH:
+   case SVGA_REG_SCREENTARGET_MAX_HEIGHT:
+   case SVGA_REG_MOB_MAX_SIZE:
+   case SVGA_REG_CAP2:
+      return 1;
+   case SVGA_REG_WIDTH:
+   case SVGA_REG_HEIGHT:
+   case SVGA_REG_DEPTH:
+   case SVGA_REG_BITS_PER_PIXEL:
+   case SVGA_REG_PSEUDOCOLOR:
+   case SVGA_REG_RED_MASK:
+   case SVGA_REG_GREEN_MASK:
+   case SVGA_REG_BLUE_MASK:
+   case SVGA_REG_BYTES_PER_LINE:
+   case SVGA_REG_FB_OFFSET:
+   case SVGA_REG_FB_SIZE:
+      return 2;
+   }
+   return 0;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * SVGA_ReadRegCached --
+ *
+ *      Same as SVGA_ReadReg but constant and mode-scoped registers are
+ *      read from device only once (each I/O is VM exit).
+ *
+ * Results:
+ *      32-bit register value.
+ *
+ * Side effects:
+ *      Value is stored in gSVGA.shadow.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+uint32
+SVGA_ReadRegCached(uint32 index)  // IN
+{
+   uint32 bit;
+
+   if (index >= SVGA_SHADOW_REGS || SVGAShadowKind(index) == 0) {
+      return SVGA_ReadReg(index);
+   }
+
+   bit = 1UL << (index % 32);
+   if ((gSVGA.shadowValid[index / 32] & bit) == 0) {
+      gSVGA.shadow[index] = SVGA_ReadReg(index);
+      gSVGA.shadowValid[index / 32] |= bit;
+   }
+
+   return gSVGA.shadow[index];
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * SVGA_ShadowInvalidate --
+ *
+ *      Drop mode-scoped registers from shadow (or all if 'all' is set).
+ *      Called on mode set.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+void
+SVGA_ShadowInvalidate(Bool all)  // IN
+{
+   uint32 i;
+
+   for (i = 0; i < SVGA_SHADOW_REGS; i++) {
+      if (all || SVGAShadowKind(i) == 2) {
+         gSVGA.shadowValid[i / 32] &= ~(1UL << (i % 32));
+      }
+   }
 }
 
 
@@ -591,6 +749,173 @@ SVGA_HasFIFOCap(unsigned long cap)
 }
 
 
+#ifndef VXD32
+/*
+ * Return far pointer to FIFO byte offset 'pos', moves the 64K window
+ * selector (gSVGA.fifoSel) when 'pos' is outside of current window.
+ */
+static void __far *FifoPtr(uint32 pos)
+{
+	uint32 act = pos >> 16;
+	uint16 off = pos & 0xFFFF;
+	
+	if(act != gSVGA.fifoAct)
+	{
+		DPMI_SetSegBase(gSVGA.fifoSel, gSVGA.fifoLinear + (act << 16));
+		gSVGA.fifoAct = act;
+	}
+	
+	//dbg_printf("Fifo: %ld (%X:%X)\n", pos, gSVGA.fifoAct, off);
+	
+	return (void __far *)(gSVGA.fifoSel :> off);
+}
+
+#endif
+
+/*
+ * When the host cannot hold reserved data (no SVGA_FIFO_CAP_RESERVE),
+ * publish NEXT_CMD after each run of this size, so we bound how much
+ * data the guest has written and the host doesn't know to checkpoint.
+ */
+#define SVGA_FIFO_COMMIT_RUN 1024
+
+/*
+ * Copy one contiguous run of dwords to FIFO offset 'pos'. Caller must
+ * be sure that the run doesn't cross SVGA_FIFO_MAX and (in PM16) the
+ * 64K window boundary, so the selector is re-based at most once.
+ */
+static void FifoCopyRun(uint32 pos, uint8 __far *src, uint32 bytes)
+{
+#ifndef VXD32
+	static void __far *sdst;
+	static void __far *ssrc;
+	static uint16 sdwords;
+	
+	sdst = FifoPtr(pos);
+	ssrc = src;
+	sdwords = (uint16)(bytes >> 2);
+	
+	_asm
+	{
+		.386
+		push ds
+		push es
+		push si
+		push di
+		push cx
+		
+		mov cx, [sdwords]
+		les di, [sdst]
+		lds si, [ssrc]
+		cld
+		rep movsd
+		
+		pop cx
+		pop di
+		pop si
+		pop es
+		pop ds
+	};
+#else
+	uint32 *dst = (uint32 *)(((uint8 *)gSVGA.fifoMem) + pos);
+	uint32 *psrc = (uint32 *)src;
+	uint32 dwords = bytes >> 2;
+	
+	while(dwords-- > 0)
+	{
+		*dst++ = *psrc++;
+	}
+#endif
+}
+
+/*
+ * Copy 'bytes' from the bounce buffer to the FIFO starting at 'nextCmd',
+ * in runs limited by SVGA_FIFO_MAX (wrap to SVGA_FIFO_MIN) and by the
+ * 64K window. When 'publish' is set, NEXT_CMD is updated after every run
+ * (and runs are shortened to SVGA_FIFO_COMMIT_RUN).
+ *
+ * Returns new nextCmd position.
+ */
+static uint32 SVGAFIFOCopy(uint32 nextCmd, uint8 __far *buffer, uint32 bytes, Bool publish)
+{
+	volatile uint32 __far *fifo = gSVGA.fifoMem;
+	uint32 max = fifo[SVGA_FIFO_MAX];
+	uint32 min = fifo[SVGA_FIFO_MIN];
+	uint32 run;
+	
+	while(bytes > 0)
+	{
+		run = MIN(bytes, max - nextCmd);
+#ifndef VXD32
+		run = MIN(run, 0x10000UL - (nextCmd & 0xFFFFUL));
+#endif
+		if(publish)
+		{
+			run = MIN(run, SVGA_FIFO_COMMIT_RUN);
+		}
+		
+		FifoCopyRun(nextCmd, buffer, run);
+		
+		buffer  += run;
+		bytes   -= run;
+		nextCmd += run;
+		if(nextCmd >= max)
+		{
+			nextCmd = min;
+		}
+		
+		if(publish)
+		{
+			fifo[SVGA_FIFO_NEXT_CMD] = nextCmd;
+		}
+	}
+	
+	return nextCmd;
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * SVGA_FIFOFree --
+ *
+ *      Free FIFO space in bytes. Commands of up to this total size can
+ *      be reserved without blocking in SVGAFIFOFull (the host only
+ *      consumes in the meantime, so the value can't drop for a caller
+ *      which serializes FIFO commands).
+ *
+ * Results:
+ *      Number of bytes (one DWORD is always kept free).
+ *
+ * Side effects:
+ *      None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+uint32
+SVGA_FIFOFree(void)
+{
+   volatile uint32 __far *fifo = gSVGA.fifoMem;
+   uint32 max = fifo[SVGA_FIFO_MAX];
+   uint32 min = fifo[SVGA_FIFO_MIN];
+   uint32 nextCmd = fifo[SVGA_FIFO_NEXT_CMD];
+   uint32 stop = fifo[SVGA_FIFO_STOP];
+   uint32 free;
+
+   if (gSVGA.fifo.reservedSize != 0) {
+      return 0;
+   }
+
+   if (nextCmd >= stop) {
+      free = (max - min) - (nextCmd - stop);
+   } else {
+      free = stop - nextCmd;
+   }
+
+   return free > sizeof(uint32) ? free - sizeof(uint32) : 0;
+}
+
+
 /*
  *-----------------------------------------------------------------------------
  *
@@ -647,10 +972,8 @@ SVGA_FIFOReserve(uint32 bytes)  // IN
    volatile uint32 __far *fifo = gSVGA.fifoMem;
    uint32 max = fifo[SVGA_FIFO_MAX];
    uint32 min = fifo[SVGA_FIFO_MIN];
-#if 0
    uint32 nextCmd = fifo[SVGA_FIFO_NEXT_CMD];
    Bool reserveable = SVGA_HasFIFOCap(SVGA_FIFO_CAP_RESERVE);
-#endif
 
    /*
     * This example implementation uses only a statically allocated
@@ -673,7 +996,9 @@ SVGA_FIFOReserve(uint32 bytes)  // IN
 
    gSVGA.fifo.reservedSize = bytes;
 
-#if 0
+   /* VXD time-outs must stay out of FIFO until commit */
+   (*gSVGADevBusy)++;
+
    while (1) {
       uint32 stop = fifo[SVGA_FIFO_STOP];
       Bool reserveInPlace = FALSE;
@@ -750,12 +1075,26 @@ SVGA_FIFOReserve(uint32 bytes)  // IN
        * the VMX can safely support this.
        */
       if (reserveInPlace) {
+#ifndef VXD32
+         /*
+          * From PM16 the FIFO is only reachable through the 64K window
+          * selector, so the command must not cross a window boundary.
+          */
+         if (gSVGA.fifoSel == 0 ||
+             (nextCmd & 0xFFFFUL) + bytes > 0x10000UL) {
+            needBounce = TRUE;
+         } else
+#endif
          if (reserveable || bytes <= sizeof(uint32)) {
             gSVGA.fifo.usingBounceBuffer = FALSE;
             if (reserveable) {
                fifo[SVGA_FIFO_RESERVED] = bytes;
             }
+#ifndef VXD32
+            return FifoPtr(nextCmd);
+#else
             return nextCmd + (uint8 __far*) fifo;
+#endif
          } else {
             /*
              * Need to bounce because we can't trust the VMX to safely
@@ -775,10 +1114,6 @@ SVGA_FIFOReserve(uint32 bytes)  // IN
          return (void __far *)(&gSVGA.fifo.bounceBuffer[0]);
       }
    } /* while (1) */
-#else
-  gSVGA.fifo.usingBounceBuffer = TRUE;
-  return (void __far *)(&gSVGA.fifo.bounceBuffer[0]);
-#endif
 }
 
 
@@ -808,28 +1143,6 @@ SVGA_FIFOReserve(uint32 bytes)  // IN
  */
 
 
-#ifndef VXD32
-static void WriteFifo(uint32 pos, uint32 dw)
-{
-	uint32 act = pos >> 16;
-	uint16 off = pos & 0xFFFF;
-	
-	uint32 __far *ptr;
-	
-	if(act != gSVGA.fifoAct)
-	{
-		DPMI_SetSegBase(gSVGA.fifoSel, gSVGA.fifoLinear + (act << 16));
-		gSVGA.fifoAct = act;
-	}
-	
-	//dbg_printf("Fifo: %ld (%X:%X)\n", pos, gSVGA.fifoAct, off);
-	
-	ptr = (uint32 __far *)(gSVGA.fifoSel :> off);
-	
-	*ptr = dw;
-}
-#endif
-
 void
 SVGA_FIFOCommit(uint32 bytes)  // IN
 {
@@ -837,12 +1150,13 @@ SVGA_FIFOCommit(uint32 bytes)  // IN
    uint32 nextCmd = fifo[SVGA_FIFO_NEXT_CMD];
    uint32 max = fifo[SVGA_FIFO_MAX];
    uint32 min = fifo[SVGA_FIFO_MIN];
-   Bool reserveable = 0; //SVGA_HasFIFOCap(SVGA_FIFO_CAP_RESERVE);
+   Bool reserveable = SVGA_HasFIFOCap(SVGA_FIFO_CAP_RESERVE);
 
    if (gSVGA.fifo.reservedSize == 0) {
       SVGA_Panic("FIFOCommit before FIFOReserve");
    }
    gSVGA.fifo.reservedSize = 0;
+   gSVGAPerf.fifoBytes += bytes;
 
    if (gSVGA.fifo.usingBounceBuffer) {
       /*
@@ -850,9 +1164,12 @@ SVGA_FIFOCommit(uint32 bytes)  // IN
        */
       uint8 __far *buffer = gSVGA.fifo.bounceBuffer;
 
+      gSVGAPerf.bounceCopies++;
+
       if (reserveable) {
          /*
-          * Slow path: bulk copy out of a bounce buffer in two chunks.
+          * Slow path: bulk copy out of a bounce buffer in two chunks
+          * (or more in PM16, one per 64K window).
           *
           * Note that the second chunk may be zero-length if the reserved
           * size was large enough to wrap around but the commit size was
@@ -863,37 +1180,18 @@ SVGA_FIFOCommit(uint32 bytes)  // IN
           * about the data we're bouncing from there into the FIFO.
           */
 
-         uint32 chunkSize = MIN(bytes, max - nextCmd);
          fifo[SVGA_FIFO_RESERVED] = bytes;
-         drv_memcpy(nextCmd + (uint8 __far*) fifo, buffer, chunkSize);
-         drv_memcpy(min + (uint8 __far*) fifo, buffer + chunkSize, bytes - chunkSize);
+         SVGAFIFOCopy(nextCmd, buffer, bytes, FALSE);
 
       } else {
          /*
-          * Slowest path: copy one dword at a time, updating NEXT_CMD as
+          * Slowest path: copy in short runs, updating NEXT_CMD as
           * we go, so that we bound how much data the guest has written
           * and the host doesn't know to checkpoint.
           */
 
-         uint32 *dword = (uint32 *)buffer;
-
-         while (bytes > 0) {
-            //fifo[nextCmd / sizeof(uint32)] = *dword++;
-
-#ifndef VXD32
-            WriteFifo(nextCmd, *dword);
-#else
-            fifo[nextCmd / sizeof(uint32)] = *dword;
-#endif
-            dword++;
-            
-            nextCmd += sizeof(uint32);
-            if (nextCmd >= max) {
-               nextCmd = min;
-            }
-            fifo[SVGA_FIFO_NEXT_CMD] = nextCmd;
-            bytes -= sizeof *dword;
-         }
+         nextCmd = SVGAFIFOCopy(nextCmd, buffer, bytes, TRUE);
+         bytes = 0;
       }
    }
 
@@ -914,6 +1212,8 @@ SVGA_FIFOCommit(uint32 bytes)  // IN
    if (reserveable) {
       fifo[SVGA_FIFO_RESERVED] = 0;
    }
+
+   (*gSVGADevBusy)--;
 }
 
 
@@ -1048,10 +1348,22 @@ SVGA_FIFOReserveEscape(uint32 nsid,   // IN
  *-----------------------------------------------------------------------------
  */
 
-#if 0
-void
-SVGAFIFOFull(void)
+static void
+SVGAFIFOFullWait(void)
 {
+#ifdef VXD32
+   /*
+    * The VXD owns the SVGA interrupt, so sleep until the
+    * FIFO_PROGRESS interrupt occurs (or a short time-out).
+    */
+   if (SVGA_IRQBegin(SVGA_IRQFLAG_FIFO_PROGRESS)) {
+      SVGA_RingDoorbell();
+      SVGA_IRQWait();
+      SVGA_IRQEnd();
+      return;
+   }
+#endif
+
 #ifndef REALLY_TINY
    if (SVGA_IsFIFORegValid(SVGA_FIFO_FENCE_GOAL) &&
        (gSVGA.capabilities & SVGA_CAP_IRQMASK)) {
@@ -1070,22 +1382,28 @@ SVGAFIFOFull(void)
       SVGA_RingDoorbell();
       SVGA_WaitForIRQ();
       SVGA_WriteReg(SVGA_REG_IRQMASK, 0);
+      return;
+   }
+#endif
 
-   } else {
+   /*
+    * Fallback implementation: Perform one iteration of the
+    * legacy-style sync. This synchronously processes FIFO commands
+    * for an arbitrary amount of time, then returns control back to
+    * the guest CPU.
+    */
 
-      /*
-       * Fallback implementation: Perform one iteration of the
-       * legacy-style sync. This synchronously processes FIFO commands
-       * for an arbitrary amount of time, then returns control back to
-       * the guest CPU.
-       */
+   SVGA_WriteReg(SVGA_REG_SYNC, 1);
+   SVGA_ReadReg(SVGA_REG_BUSY);
+}
 
-      SVGA_WriteReg(SVGA_REG_SYNC, 1);
-      SVGA_ReadReg(SVGA_REG_BUSY);
-   }
-#endif
+static void
+SVGAFIFOFull(void)
+{
+   SVGA_TraceEvent(TRACE_FIFO_FULL_BEGIN, 0);
+   SVGAFIFOFullWait();
+   SVGA_TraceEvent(TRACE_FIFO_FULL_END, 0);
 }
-#endif
 
 
 /*
@@ -1224,6 +1542,24 @@ SVGA_SyncToFence(uint32 fence)  // IN
       return;
    }
 
+#ifdef VXD32
+   /*
+    * Sleep on ANY_FENCE interrupt, FENCE_GOAL isn't used because
+    * there could be more waiters for different fences.
+    */
+   if (SVGA_IRQBegin(SVGA_IRQFLAG_ANY_FENCE)) {
+      while (!SVGA_HasFencePassed(fence)) {
+         SVGA_RingDoorbell();
+
+         if (!SVGA_HasFencePassed(fence)) {
+            SVGA_IRQWait();
+         }
+      }
+      SVGA_IRQEnd();
+      return;
+   }
+#endif
+
 #ifndef REALLY_TINY
    if (SVGA_IsFIFORegValid(SVGA_FIFO_FENCE_GOAL) &&
        (gSVGA.capabilities & SVGA_CAP_IRQMASK)) {
@@ -1337,6 +1673,8 @@ SVGA_SyncToFence(uint32 fence)  // IN
 Bool
 SVGA_HasFencePassed(uint32 fence)  // IN
 {
+   uint32 passed;
+
    if (!fence) {
       return TRUE;
    }
@@ -1345,7 +1683,12 @@ SVGA_HasFencePassed(uint32 fence)  // IN
       return FALSE;
    }
 
-   return ((int32)(gSVGA.fifoMem[SVGA_FIFO_FENCE] - fence)) >= 0;
+   passed = gSVGA.fifoMem[SVGA_FIFO_FENCE];
+   if (gSVGAFenceMirror != NULL) {
+      *gSVGAFenceMirror = passed;
+   }
+
+   return ((int32)(passed - fence)) >= 0;
 }
 
 
@@ -1401,7 +1744,14 @@ SVGA_HasFencePassed(uint32 fence)  // IN
  *      This function implements the above guest wakeups. It uses the
  *      SVGA_FIFO_BUSY register to quickly assess whether the SVGA
  *      device may be idle. If so, it asynchronously wakes up the host
- *      by writing to SVGA_REG_SYNC.
+ *      by writing to SVGA_REG_SYNC. Hosts without SVGA_FIFO_BUSY are
+ *      woken once per batch of new FIFO commands (see
+ *      SVGA_DOORBELL_BATCH).
+ *
+ *      All "there is work" wakeups (RING escape, command buffer waits
+ *      without IRQ) go here, unconditional SVGA_REG_SYNC writes are
+ *      left only to explicit sync points (SVGA_Flush, legacy sync in
+ *      SVGA_SyncToFence).
  *
  * Results:
  *      None.
@@ -1412,24 +1762,42 @@ SVGA_HasFencePassed(uint32 fence)  // IN
  *-----------------------------------------------------------------------------
  */
 
+static uint32 doorbellNextCmd = 0;  // FIFO_NEXT_CMD at the last ring
+static uint32 doorbellBatch   = 0;  // requests since the last ring
+
 void
 SVGA_RingDoorbell(void)
 {
-   if (SVGA_IsFIFORegValid(SVGA_FIFO_BUSY) &&
-       gSVGA.fifoMem[SVGA_FIFO_BUSY] == FALSE) {
+   if (SVGA_IsFIFORegValid(SVGA_FIFO_BUSY)) {
+      if (gSVGA.fifoMem[SVGA_FIFO_BUSY] != FALSE) {
+         /* Host is processing (or was already woken up). */
+         gSVGAPerf.doorbellSkips++;
+         return;
+      }
 
       /* Remember that we already rang the doorbell. */
       gSVGA.fifoMem[SVGA_FIFO_BUSY] = TRUE;
+   } else {
+      uint32 nextCmd = gSVGA.fifoMem[SVGA_FIFO_NEXT_CMD];
 
-      /*
-       * Asynchronously wake up the SVGA3D device.  The second
-       * parameter is an arbitrary nonzero 'sync reason' which can be
-       * used for debugging, but which isn't part of the SVGA3D
-       * protocol proper and which isn't used by release builds of
-       * VMware products.
-       */
-      SVGA_WriteReg(SVGA_REG_SYNC, 1);
+      if (nextCmd == doorbellNextCmd && ++doorbellBatch < SVGA_DOORBELL_BATCH) {
+         gSVGAPerf.doorbellSkips++;
+         return;
+      }
+      doorbellNextCmd = nextCmd;
+      doorbellBatch = 0;
    }
+
+   gSVGAPerf.doorbells++;
+
+   /*
+    * Asynchronously wake up the SVGA3D device.  The second
+    * parameter is an arbitrary nonzero 'sync reason' which can be
+    * used for debugging, but which isn't part of the SVGA3D
+    * protocol proper and which isn't used by release builds of
+    * VMware products.
+    */
+   SVGA_WriteReg(SVGA_REG_SYNC, 1);
 }
 
 
@@ -1445,6 +1813,7 @@ SVGA_RingDoorbell(void)
  */
 void SVGA_Flush(void)
 {
+		gSVGAPerf.flushes++;
 		SVGA_WriteReg(SVGA_REG_SYNC, 1);
 		while (SVGA_ReadReg(SVGA_REG_BUSY) != FALSE);
 }
@@ -1728,6 +2097,180 @@ SVGA_Update(uint32 x,       // IN
 }
 
 
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * SVGA_RectCopy --
+ *
+ *      Copy rectangle inside the guest frame buffer (source and destination
+ *      can overlap) and update all screens intersecting the destination.
+ *      Caller has to check SVGA_CAP_RECT_COPY.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Frame buffer is modified asynchronously, use a fence before
+ *      touching the destination with CPU.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+void
+SVGA_RectCopy(uint32 srcX,    // IN
+              uint32 srcY,    // IN
+              uint32 destX,   // IN
+              uint32 destY,   // IN
+              uint32 width,   // IN
+              uint32 height)  // IN
+{
+   SVGAFifoCmdRectCopy __far *cmd = SVGA_FIFOReserveCmd(SVGA_CMD_RECT_COPY, sizeof *cmd);
+   cmd->srcX = srcX;
+   cmd->srcY = srcY;
+   cmd->destX = destX;
+   cmd->destY = destY;
+   cmd->width = width;
+   cmd->height = height;
+   SVGA_FIFOCommitAll();
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * SVGA_RectFill --
+ *
+ *      Fill rectangle in the guest frame buffer by solid color and update
+ *      all screens intersecting it. Caller has to check SVGA_CAP_RECT_FILL.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Frame buffer is modified asynchronously, use a fence before
+ *      touching the rectangle with CPU.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+void
+SVGA_RectFill(uint32 color,   // IN
+              uint32 x,       // IN
+              uint32 y,       // IN
+              uint32 width,   // IN
+              uint32 height)  // IN
+{
+   SVGAFifoCmdRectFill __far *cmd = SVGA_FIFOReserveCmd(SVGA_CMD_RECT_FILL, sizeof *cmd);
+   cmd->color = color;
+   cmd->x = x;
+   cmd->y = y;
+   cmd->width = width;
+   cmd->height = height;
+   SVGA_FIFOCommitAll();
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * SVGA_DefineGMRFB --
+ *
+ *      Define the GMRFB (source of SVGA_BlitGMRFBToScreen) as an image
+ *      in the guest frame buffer starting at 'offset' bytes from VRAM
+ *      start. Caller has to check SVGA_FIFO_CAP_SCREEN_OBJECT(_2).
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Replaces the current GMRFB.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+void
+SVGA_DefineGMRFB(uint32 offset,        // IN
+                 uint32 bytesPerLine,  // IN
+                 uint32 bpp,           // IN
+                 uint32 depth)         // IN
+{
+   SVGA_DefineGMRFBRegion(SVGA_GMR_FRAMEBUFFER, offset, bytesPerLine, bpp, depth);
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * SVGA_DefineGMRFBRegion --
+ *
+ *      Same as SVGA_DefineGMRFB, but the image is in guest memory region
+ *      'gmrId' (must be already bound by SVGA_REG_GMR_DESCRIPTOR).
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Replaces the current GMRFB.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+void
+SVGA_DefineGMRFBRegion(uint32 gmrId,         // IN
+                       uint32 offset,        // IN
+                       uint32 bytesPerLine,  // IN
+                       uint32 bpp,           // IN
+                       uint32 depth)         // IN
+{
+   SVGAFifoCmdDefineGMRFB __far *cmd = SVGA_FIFOReserveCmd(SVGA_CMD_DEFINE_GMRFB, sizeof *cmd);
+   cmd->ptr.gmrId = gmrId;
+   cmd->ptr.offset = offset;
+   cmd->bytesPerLine = bytesPerLine;
+   cmd->format.value = 0;
+   cmd->format.bitsPerPixel = bpp;
+   cmd->format.colorDepth = depth;
+   SVGA_FIFOCommitAll();
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * SVGA_BlitGMRFBToScreen --
+ *
+ *      Copy rectangle from the current GMRFB to the screen. Destination
+ *      is relative to screen 'screenId' origin.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      The device finished reading of the GMRFB when next fence passed.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+void
+SVGA_BlitGMRFBToScreen(int32 srcX,       // IN
+                       int32 srcY,       // IN
+                       int32 destX,      // IN
+                       int32 destY,      // IN
+                       int32 width,      // IN
+                       int32 height,     // IN
+                       uint32 screenId)  // IN
+{
+   SVGAFifoCmdBlitGMRFBToScreen __far *cmd = SVGA_FIFOReserveCmd(SVGA_CMD_BLIT_GMRFB_TO_SCREEN, sizeof *cmd);
+   cmd->srcOrigin.x = srcX;
+   cmd->srcOrigin.y = srcY;
+   cmd->destRect.left = destX;
+   cmd->destRect.top = destY;
+   cmd->destRect.right = destX + width;
+   cmd->destRect.bottom = destY + height;
+   cmd->destScreenId = screenId;
+   SVGA_FIFOCommitAll();
+}
+
+
 /*
  *-----------------------------------------------------------------------------
  *
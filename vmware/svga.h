@@ -49,6 +49,9 @@
 #include "svga_overlay.h"
 #include "svga3d_reg.h"
 
+/* registers 0..SVGA_SHADOW_REGS-1 can be cached by SVGA_ReadRegCached */
+#define SVGA_SHADOW_REGS 64
+
 typedef struct SVGADevice {
    PCIAddress pciAddr;    // 0
    uint32     ioBase;     // 4
@@ -88,6 +91,10 @@ typedef struct SVGADevice {
    /* adaper in QEMU works only on 32bit */
    uint32 only32bit;
 
+   /* shadow of registers which never change or change only on mode set */
+   uint32 shadow[SVGA_SHADOW_REGS];
+   uint32 shadowValid[(SVGA_SHADOW_REGS + 31) / 32];
+
 #ifndef REALLY_TINY
    volatile struct {
       uint32        pending;
@@ -102,6 +109,37 @@ typedef struct SVGADevice {
 
 extern SVGADevice gSVGA;
 
+/*
+ * 2D pipeline counters, cumulative (32-bit, may wrap), read by
+ * SVGA_PERF_COUNTERS escape.
+ *
+ * Present latency is time from the first damage of a flushed batch to
+ * the moment when the fence behind its updates is seen passed, in ms.
+ * Bucket 0 is < 1 ms, bucket i is 2^(i-1) .. 2^i - 1 ms and the last one
+ * is everything above.
+ */
+#define SVGA_LATENCY_BUCKETS 10
+
+typedef struct SVGAPerfCounters {
+   uint32 updates;       // rects sent to host (FIFO, VxD call or async worker)
+   uint32 coalesced;     // dirty rects merged into already pending damage
+   uint32 fullUpdates;   // damage escalated to full screen update
+   uint32 lockFails;     // flushes which found LOCK_FIFO taken (damage queued or deferred)
+   uint32 fifoBytes;     // bytes committed to FIFO
+   uint32 bounceCopies;  // commits copied from bounce buffer
+   uint32 flushes;       // SVGA_Flush calls
+   uint32 paletteWrites; // palette register writes
+   uint32 latency[SVGA_LATENCY_BUCKETS]; // present latency histogram, see below
+   uint32 doorbells;     // SVGA_REG_SYNC writes by SVGA_RingDoorbell
+   uint32 doorbellSkips; // rings dropped, host busy or ring in the same batch
+   /* boot calibration, kept by counters reset */
+   uint32 presentPath;   // 2D path of VxD updates (PRESENT_PATH_* in vmwsvxd.h), 0 = none
+   uint32 fifoCost;      // TSC cycles per SVGA_CMD_UPDATE by FIFO, 0 = not measured
+   uint32 cbCost;        // same by command buffer
+} SVGAPerfCounters;
+
+extern SVGAPerfCounters gSVGAPerf;
+
 #ifndef VXD32
 int  __loadds SVGA_Init(Bool enableFIFO);
 #else
@@ -117,12 +155,15 @@ void SVGA_Flush(void);
 
 uint32 SVGA_ReadReg(uint32 index);
 void SVGA_WriteReg(uint32 index, uint32 value);
+uint32 SVGA_ReadRegCached(uint32 index);
+void SVGA_ShadowInvalidate(Bool all);
 uint32 SVGA_ClearIRQ(void);
 uint32 SVGA_WaitForIRQ();
 
 Bool SVGA_IsFIFORegValid(int reg);
 Bool SVGA_HasFIFOCap(unsigned long cap);
 
+uint32 SVGA_FIFOFree(void);
 void __far *SVGA_FIFOReserve(uint32 bytes);
 void __far *SVGA_FIFOReserveCmd(uint32 type, uint32 bytes);
 void __far *SVGA_FIFOReserveEscape(uint32 nsid, uint32 bytes);
@@ -134,11 +175,38 @@ void SVGA_SyncToFence(uint32 fence);
 Bool SVGA_HasFencePassed(uint32 fence);
 void SVGA_RingDoorbell(void);
 
+/*
+ * Without SVGA_FIFO_BUSY host can't tell if it's awake, the doorbell is
+ * rung when new FIFO commands were committed since the last ring or on
+ * every SVGA_DOORBELL_BATCH-th request (CB waits don't move FIFO).
+ */
+#define SVGA_DOORBELL_BATCH 16
+
+extern volatile uint32 __far *gSVGAFenceMirror;
+extern volatile uint32 __far *gSVGADevBusy;
+
+#ifdef VXD32
+/* IRQ waiting, implemented by VXD (vmwsvxd.c) */
+Bool SVGA_IRQBegin(uint32 flags);
+void SVGA_IRQWait(void);
+void SVGA_IRQEnd(void);
+#endif
+
+/* hot-path tracing, implemented by VXD (vmwsvxd.c) and driver (control.c) */
+void SVGA_TraceEvent(uint32 event, uint32 arg);
+
 void __far *SVGA_AllocGMR(uint32 size, SVGAGuestPtr __far *ptr);
 
 /* 2D commands */
 
 void SVGA_Update(uint32 x, uint32 y, uint32 width, uint32 height);
+void SVGA_RectCopy(uint32 srcX, uint32 srcY, uint32 destX, uint32 destY,
+                   uint32 width, uint32 height);
+void SVGA_RectFill(uint32 color, uint32 x, uint32 y, uint32 width, uint32 height);
+void SVGA_DefineGMRFB(uint32 offset, uint32 bytesPerLine, uint32 bpp, uint32 depth);
+void SVGA_DefineGMRFBRegion(uint32 gmrId, uint32 offset, uint32 bytesPerLine, uint32 bpp, uint32 depth);
+void SVGA_BlitGMRFBToScreen(int32 srcX, int32 srcY, int32 destX, int32 destY,
+                            int32 width, int32 height, uint32 screenId);
 void SVGA_BeginDefineCursor(const SVGAFifoCmdDefineCursor __far *cursorInfo,
                             void __far * __far *andMask, void __far * __far *xorMask);
 void SVGA_BeginDefineAlphaCursor(const SVGAFifoCmdDefineAlphaCursor __far *cursorInfo,
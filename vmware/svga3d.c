@@ -39,6 +39,18 @@ void dbg_printf( const char *s, ... );
 #define dbg_printf(...)
 #endif
 
+/*
+ * Command batch: one FIFO reservation shared by all 3D commands between
+ * SVGA3D_BeginBatch and SVGA3D_EndBatch.
+ */
+static struct {
+   Bool          active;
+   uint8 __far  *buffer;   // start of FIFO reservation, NULL = none
+   uint32        size;     // reserved bytes
+   uint32        used;     // committed into batch
+   uint32        pending;  // last reserved command
+} gBatch;
+
 /*
  *----------------------------------------------------------------------
  *
@@ -122,7 +134,7 @@ SVGA3D_Init(void)
  *      This is a convenience wrapper around SVGA_FIFOReserve. We
  *      reserve space for the whole command, and write the header.
  *
- *      This function must be paired with SVGA_FIFOCommitAll().
+ *      This function must be paired with SVGA3D_FIFOCommitAll().
  *
  * Results:
  *      Returns a pointer to the space reserved for command-specific
@@ -134,13 +146,31 @@ SVGA3D_Init(void)
  *----------------------------------------------------------------------
  */
 
-void *
+void __far *
 SVGA3D_FIFOReserve(uint32 cmd,      // IN
                    uint32 cmdSize)  // IN
 {
    SVGA3dCmdHeader __far *header;
 
-   header = SVGA_FIFOReserve(sizeof *header + cmdSize);
+   if (gBatch.active) {
+      uint32 bytes = sizeof *header + cmdSize;
+
+      if (gBatch.buffer != NULL && gBatch.used + bytes > gBatch.size) {
+         SVGA3D_FlushBatch();
+      }
+
+      if (gBatch.buffer == NULL) {
+         gBatch.size = bytes > SVGA3D_BATCH_SIZE ? bytes : SVGA3D_BATCH_SIZE;
+         gBatch.buffer = SVGA_FIFOReserve(gBatch.size);
+         gBatch.used = 0;
+      }
+
+      header = (SVGA3dCmdHeader __far *)(gBatch.buffer + gBatch.used);
+      gBatch.pending = bytes;
+   } else {
+      header = SVGA_FIFOReserve(sizeof *header + cmdSize);
+   }
+
    header->id = cmd;
    header->size = cmdSize;
 
@@ -148,6 +178,125 @@ SVGA3D_FIFOReserve(uint32 cmd,      // IN
 }
 
 
+/*
+ *----------------------------------------------------------------------
+ *
+ * SVGA3D_FIFOCommitAll --
+ *
+ *      Commit the command reserved by SVGA3D_FIFOReserve. Outside of
+ *      a batch this is SVGA_FIFOCommitAll, inside a batch the command
+ *      only stays in the batch reservation.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      May write to the FIFO.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+SVGA3D_FIFOCommitAll(void)
+{
+   if (gBatch.active) {
+      gBatch.used += gBatch.pending;
+      gBatch.pending = 0;
+   } else {
+      SVGA_FIFOCommitAll();
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * SVGA3D_BeginBatch --
+ *
+ *      Start collecting 3D commands. Every following command is
+ *      written after the previous one into one FIFO reservation
+ *      (or bounce buffer) and the FIFO is committed only once, in
+ *      SVGA3D_EndBatch or when the reservation is full.
+ *
+ *      Until SVGA3D_EndBatch only SVGA3D commands may be written,
+ *      2D commands and fences need their own reservation.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+SVGA3D_BeginBatch(void)
+{
+   if (gBatch.active) {
+      SVGA_Panic("SVGA3D_BeginBatch inside batch");
+   }
+
+   gBatch.active  = TRUE;
+   gBatch.buffer  = NULL;
+   gBatch.size    = 0;
+   gBatch.used    = 0;
+   gBatch.pending = 0;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * SVGA3D_FlushBatch --
+ *
+ *      Commit commands collected so far, batch stays open.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Commits FIFO reservation.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+SVGA3D_FlushBatch(void)
+{
+   if (gBatch.buffer != NULL) {
+      SVGA_FIFOCommit(gBatch.used);
+      gBatch.buffer = NULL;
+      gBatch.size = 0;
+      gBatch.used = 0;
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * SVGA3D_EndBatch --
+ *
+ *      Commit the batch and return to one commit per command.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Commits FIFO reservation.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+SVGA3D_EndBatch(void)
+{
+   SVGA3D_FlushBatch();
+   gBatch.active = FALSE;
+}
+
+
 /*
  *----------------------------------------------------------------------
  *
@@ -157,7 +306,7 @@ SVGA3D_FIFOReserve(uint32 cmd,      // IN
  *      the FIFO, and returns pointers to the command's faces and
  *      mipsizes arrays.
  *
- *      This function must be paired with SVGA_FIFOCommitAll().
+ *      This function must be paired with SVGA3D_FIFOCommitAll().
  *      The faces and mipSizes arrays are initialized to zero.
  *
  *      This creates a "surface" object in the SVGA3D device,
@@ -208,11 +357,11 @@ void
 SVGA3D_BeginDefineSurface(uint32 sid,                  // IN
                           SVGA3dSurfaceFlags flags,    // IN
                           SVGA3dSurfaceFormat format,  // IN
-                          SVGA3dSurfaceFace **faces,   // OUT
-                          SVGA3dSize **mipSizes,       // OUT
+                          SVGA3dSurfaceFace __far **faces,   // OUT
+                          SVGA3dSize __far **mipSizes,       // OUT
                           uint32 numMipSizes)          // IN
 {
-   SVGA3dCmdDefineSurface *cmd;
+   SVGA3dCmdDefineSurface __far *cmd;
 
    cmd = SVGA3D_FIFOReserve(SVGA_3D_CMD_SURFACE_DEFINE, sizeof *cmd +
                             sizeof **mipSizes * numMipSizes);
@@ -222,10 +371,10 @@ SVGA3D_BeginDefineSurface(uint32 sid,                  // IN
    cmd->format = format;
 
    *faces = &cmd->face[0];
-   *mipSizes = (SVGA3dSize*) &cmd[1];
+   *mipSizes = (SVGA3dSize __far *) &cmd[1];
 
-   memset(*faces, 0, sizeof **faces * SVGA3D_MAX_SURFACE_FACES);
-   memset(*mipSizes, 0, sizeof **mipSizes * numMipSizes);
+   _fmemset(*faces, 0, sizeof **faces * SVGA3D_MAX_SURFACE_FACES);
+   _fmemset(*mipSizes, 0, sizeof **mipSizes * numMipSizes);
 }
 
 
@@ -248,10 +397,10 @@ SVGA3D_BeginDefineSurface(uint32 sid,                  // IN
 void
 SVGA3D_DestroySurface(uint32 sid)  // IN
 {
-   SVGA3dCmdDestroySurface *cmd;
+   SVGA3dCmdDestroySurface __far *cmd;
    cmd = SVGA3D_FIFOReserve(SVGA_3D_CMD_SURFACE_DESTROY, sizeof *cmd);
    cmd->sid = sid;
-   SVGA_FIFOCommitAll();
+   SVGA3D_FIFOCommitAll();
 }
 
 
@@ -262,7 +411,7 @@ SVGA3D_DestroySurface(uint32 sid)  // IN
  *
  *      Begin a SURFACE_DMA command. This reserves space for it in
  *      the FIFO, and returns a pointer to the command's box array.
- *      This function must be paired with SVGA_FIFOCommitAll().
+ *      This function must be paired with SVGA3D_FIFOCommitAll().
  *
  *      When the SVGA3D device asynchronously processes this FIFO
  *      command, a DMA operation is performed between host VRAM and
@@ -309,13 +458,13 @@ SVGA3D_DestroySurface(uint32 sid)  // IN
  */
 
 void
-SVGA3D_BeginSurfaceDMA(SVGA3dGuestImage *guestImage,     // IN
-                       SVGA3dSurfaceImageId *hostImage,  // IN
-                       SVGA3dTransferType transfer,      // IN
-                       SVGA3dCopyBox **boxes,            // OUT
-                       uint32 numBoxes)                  // IN
+SVGA3D_BeginSurfaceDMA(SVGA3dGuestImage __far *guestImage,     // IN
+                       SVGA3dSurfaceImageId __far *hostImage,  // IN
+                       SVGA3dTransferType transfer,            // IN
+                       SVGA3dCopyBox __far **boxes,            // OUT
+                       uint32 numBoxes)                        // IN
 {
-   SVGA3dCmdSurfaceDMA *cmd;
+   SVGA3dCmdSurfaceDMA __far *cmd;
    uint32 boxesSize = sizeof **boxes * numBoxes;
 
    cmd = SVGA3D_FIFOReserve(SVGA_3D_CMD_SURFACE_DMA, sizeof *cmd + boxesSize);
@@ -323,9 +472,9 @@ SVGA3D_BeginSurfaceDMA(SVGA3dGuestImage *guestImage,     // IN
    cmd->guest = *guestImage;
    cmd->host = *hostImage;
    cmd->transfer = transfer;
-   *boxes = (SVGA3dCopyBox*) &cmd[1];
+   *boxes = (SVGA3dCopyBox __far *) &cmd[1];
 
-   memset(*boxes, 0, boxesSize);
+   _fmemset(*boxes, 0, boxesSize);
 }
 
 
@@ -363,7 +512,7 @@ SVGA3D_DefineContext(uint32 cid)  // IN
    SVGA3dCmdDefineContext *cmd;
    cmd = SVGA3D_FIFOReserve(SVGA_3D_CMD_CONTEXT_DEFINE, sizeof *cmd);
    cmd->cid = cid;
-   SVGA_FIFOCommitAll();
+   SVGA3D_FIFOCommitAll();
 }
 
 
@@ -389,7 +538,7 @@ SVGA3D_DestroyContext(uint32 cid)  // IN
    SVGA3dCmdDestroyContext *cmd;
    cmd = SVGA3D_FIFOReserve(SVGA_3D_CMD_CONTEXT_DESTROY, sizeof *cmd);
    cmd->cid = cid;
-   SVGA_FIFOCommitAll();
+   SVGA3D_FIFOCommitAll();
 }
 
 
@@ -431,7 +580,7 @@ SVGA3D_SetRenderTarget(uint32 cid,                    // IN
    cmd->cid = cid;
    cmd->type = type;
    cmd->target = *target;
-   SVGA_FIFOCommitAll();
+   SVGA3D_FIFOCommitAll();
 }
 
 
@@ -466,7 +615,7 @@ SVGA3D_SetTransform(uint32 cid,                // IN
    cmd->cid = cid;
    cmd->type = type;
    memcpy(&cmd->matrix[0], matrix, sizeof(float) * 16);
-   SVGA_FIFOCommitAll();
+   SVGA3D_FIFOCommitAll();
 }
 
 
@@ -496,7 +645,7 @@ SVGA3D_SetMaterial(uint32 cid,                      // IN
    cmd->cid = cid;
    cmd->face = face;
    memcpy(&cmd->material, material, sizeof *material);
-   SVGA_FIFOCommitAll();
+   SVGA3D_FIFOCommitAll();
 }
 
 
@@ -526,7 +675,7 @@ SVGA3D_SetLightEnabled(uint32 cid,    // IN
    cmd->cid = cid;
    cmd->index = index;
    cmd->enabled = enabled;
-   SVGA_FIFOCommitAll();
+   SVGA3D_FIFOCommitAll();
 }
 
 
@@ -556,7 +705,7 @@ SVGA3D_SetLightData(uint32 cid,                   // IN
    cmd->cid = cid;
    cmd->index = index;
    memcpy(&cmd->data, data, sizeof *data);
-   SVGA_FIFOCommitAll();
+   SVGA3D_FIFOCommitAll();
 }
 
 
@@ -606,7 +755,7 @@ SVGA3D_DefineShader(uint32 cid,                   // IN
    cmd->shid = shid;
    cmd->type = type;
    memcpy(&cmd[1], bytecode, bytecodeLen);
-   SVGA_FIFOCommitAll();
+   SVGA3D_FIFOCommitAll();
 }
 
 
@@ -639,7 +788,7 @@ SVGA3D_DestroyShader(uint32 cid,             // IN
    cmd->cid = cid;
    cmd->shid = shid;
    cmd->type = type;
-   SVGA_FIFOCommitAll();
+   SVGA3D_FIFOCommitAll();
 }
 
 
@@ -697,7 +846,7 @@ SVGA3D_SetShaderConst(uint32 cid,                   // IN
       break;
 
    }
-   SVGA_FIFOCommitAll();
+   SVGA3D_FIFOCommitAll();
 }
 
 
@@ -731,7 +880,7 @@ SVGA3D_SetShader(uint32 cid,             // IN
    cmd->cid = cid;
    cmd->type = type;
    cmd->shid = shid;
-   SVGA_FIFOCommitAll();
+   SVGA3D_FIFOCommitAll();
 }
 
 
@@ -742,7 +891,7 @@ SVGA3D_SetShader(uint32 cid,             // IN
  *
  *      Begin a PRESENT command. This reserves space for it in the
  *      FIFO, and returns a pointer to the command's rectangle array.
- *      This function must be paired with SVGA_FIFOCommitAll().
+ *      This function must be paired with SVGA3D_FIFOCommitAll().
  *
  *      Present is the SVGA3D device's way of transferring fully
  *      rendered images to the 2D portion of the SVGA device. Present
@@ -793,7 +942,7 @@ SVGA3D_BeginPresent(uint32 sid,              // IN
  *
  *      Begin a CLEAR command. This reserves space for it in the FIFO,
  *      and returns a pointer to the command's rectangle array.  This
- *      function must be paired with SVGA_FIFOCommitAll().
+ *      function must be paired with SVGA3D_FIFOCommitAll().
  *
  *      Clear is a rendering operation which fills a list of
  *      rectangles with constant values on all render target types
@@ -839,7 +988,7 @@ SVGA3D_BeginClear(uint32 cid,             // IN
  *
  *      Begin a DRAW_PRIMITIVES command. This reserves space for it in
  *      the FIFO, and returns a pointer to the command's arrays.
- *      This function must be paired with SVGA_FIFOCommitAll().
+ *      This function must be paired with SVGA3D_FIFOCommitAll().
  *
  *      Drawing commands consist of two variable-length arrays:
  *      SVGA3dVertexDecl elements declare a set of vertex buffers to
@@ -895,7 +1044,7 @@ SVGA3D_BeginDrawPrimitives(uint32 cid,                    // IN
  *
  *      Begin a SURFACE_COPY command. This reserves space for it in
  *      the FIFO, and returns a pointer to the command's arrays.  This
- *      function must be paired with SVGA_FIFOCommitAll().
+ *      function must be paired with SVGA3D_FIFOCommitAll().
  *
  *      The box array is initialized with zeroes.
  *
@@ -945,20 +1094,20 @@ SVGA3D_BeginSurfaceCopy(SVGA3dSurfaceImageId *src,   // IN
  */
 
 void
-SVGA3D_SurfaceStretchBlt(SVGA3dSurfaceImageId *src,   // IN
-                         SVGA3dSurfaceImageId *dest,  // IN
-                         SVGA3dBox *boxSrc,           // IN
-                         SVGA3dBox *boxDest,          // IN
-                         SVGA3dStretchBltMode mode)   // IN
+SVGA3D_SurfaceStretchBlt(SVGA3dSurfaceImageId __far *src,   // IN
+                         SVGA3dSurfaceImageId __far *dest,  // IN
+                         SVGA3dBox __far *boxSrc,           // IN
+                         SVGA3dBox __far *boxDest,          // IN
+                         SVGA3dStretchBltMode mode)         // IN
 {
-   SVGA3dCmdSurfaceStretchBlt *cmd;
+   SVGA3dCmdSurfaceStretchBlt __far *cmd;
    cmd = SVGA3D_FIFOReserve(SVGA_3D_CMD_SURFACE_STRETCHBLT, sizeof *cmd);
    cmd->src = *src;
    cmd->dest = *dest;
    cmd->boxSrc = *boxSrc;
    cmd->boxDest = *boxDest;
    cmd->mode = mode;
-   SVGA_FIFOCommitAll();
+   SVGA3D_FIFOCommitAll();
 }
 
 
@@ -988,7 +1137,7 @@ SVGA3D_SetViewport(uint32 cid,        // IN
    cmd = SVGA3D_FIFOReserve(SVGA_3D_CMD_SETVIEWPORT, sizeof *cmd);
    cmd->cid = cid;
    cmd->rect = *rect;
-   SVGA_FIFOCommitAll();
+   SVGA3D_FIFOCommitAll();
 }
 
 
@@ -1019,7 +1168,7 @@ SVGA3D_SetZRange(uint32 cid,  // IN
    cmd->cid = cid;
    cmd->zRange.min = zMin;
    cmd->zRange.max = zMax;
-   SVGA_FIFOCommitAll();
+   SVGA3D_FIFOCommitAll();
 }
 
 
@@ -1030,7 +1179,7 @@ SVGA3D_SetZRange(uint32 cid,  // IN
  *
  *      Begin a SETTEXTURESTATE command. This reserves space for it in
  *      the FIFO, and returns a pointer to the command's texture state
- *      array.  This function must be paired with SVGA_FIFOCommitAll().
+ *      array.  This function must be paired with SVGA3D_FIFOCommitAll().
  *
  *      This command sets rendering state which is per-texture-unit.
  *
@@ -1068,7 +1217,7 @@ SVGA3D_BeginSetTextureState(uint32 cid,                   // IN
  *
  *      Begin a SETRENDERSTATE command. This reserves space for it in
  *      the FIFO, and returns a pointer to the command's texture state
- *      array.  This function must be paired with SVGA_FIFOCommitAll().
+ *      array.  This function must be paired with SVGA3D_FIFOCommitAll().
  *
  *      This command sets rendering state which is global to the context.
  *
@@ -1107,7 +1256,7 @@ SVGA3D_BeginSetRenderState(uint32 cid,                  // IN
  *      Begin a PRESENT_READBACK command. This reserves space for it
  *      in the FIFO, and returns a pointer to the command's SVGA3dRect
  *      array.  This function must be paired with
- *      SVGA_FIFOCommitAll().
+ *      SVGA3D_FIFOCommitAll().
  *
  *      This command will update the 2D framebuffer with the most
  *      recently presented data in the supplied regions.
@@ -1122,13 +1271,13 @@ SVGA3D_BeginSetRenderState(uint32 cid,                  // IN
  */
 
 void
-SVGA3D_BeginPresentReadback(SVGA3dRect **rects,  // OUT
-                            uint32 numRects)     // IN
+SVGA3D_BeginPresentReadback(SVGA3dRect __far **rects,  // OUT
+                            uint32 numRects)           // IN
 {
-   void *cmd;
-   cmd = (void *) SVGA3D_FIFOReserve(SVGA_3D_CMD_PRESENT_READBACK,
-                                     sizeof **rects * numRects);
-   *rects = (SVGA3dRect*) cmd;
+   void __far *cmd;
+   cmd = SVGA3D_FIFOReserve(SVGA_3D_CMD_PRESENT_READBACK,
+                            sizeof **rects * numRects);
+   *rects = (SVGA3dRect __far *) cmd;
 }
 
 
@@ -1140,7 +1289,7 @@ SVGA3D_BeginPresentReadback(SVGA3dRect **rects,  // OUT
  *      Begin a BLIT_SURFACE_TO_SCREEN command. This reserves space
  *      for it in the FIFO, and optionally returns a pointer to the
  *      command's clip rectangle array.  This function must be paired
- *      with SVGA_FIFOCommitAll().
+ *      with SVGA3D_FIFOCommitAll().
  *
  *      Copy an SVGA3D surface image to a Screen Object.  This command
  *      requires the SVGA Screen Object capability to be present.
@@ -1218,5 +1367,5 @@ SVGA3D_BlitSurfaceToScreen(const SVGA3dSurfaceImageId *srcImage,  // IN
                            const SVGASignedRect *destRect)        // IN
 {
    SVGA3D_BeginBlitSurfaceToScreen(srcImage, srcRect, destScreenId, destRect, NULL, 0);
-   SVGA_FIFOCommitAll();
+   SVGA3D_FIFOCommitAll();
 }
@@ -36,6 +36,21 @@
 #include "svga.h"
 #include "svga3d_reg.h"
 
+/* FIFO reservation used by command batch, must fit into bounce buffer */
+#define SVGA3D_BATCH_SIZE 4096
+
+void __far *SVGA3D_FIFOReserve(uint32 cmd, uint32 cmdSize);
+void SVGA3D_FIFOCommitAll(void);
+
+/*
+ * Command batching, all 3D commands between Begin and End are committed
+ * to FIFO at once
+ */
+
+void SVGA3D_BeginBatch(void);
+void SVGA3D_FlushBatch(void);
+void SVGA3D_EndBatch(void);
+
 
 /*
  * SVGA Device Interoperability
@@ -43,7 +58,7 @@
 
 Bool SVGA3D_Init(void);
 void SVGA3D_BeginPresent(uint32 sid, SVGA3dCopyRect **rects, uint32 numRects);
-void SVGA3D_BeginPresentReadback(SVGA3dRect **rects, uint32 numRects);
+void SVGA3D_BeginPresentReadback(SVGA3dRect __far **rects, uint32 numRects);
 void SVGA3D_BlitSurfaceToScreen(const SVGA3dSurfaceImageId *srcImage,
                                 const SVGASignedRect *srcRect,
                                 uint32 destScreenId,
@@ -63,14 +78,14 @@ void SVGA3D_BeginBlitSurfaceToScreen(const SVGA3dSurfaceImageId *srcImage,
 void SVGA3D_BeginDefineSurface(uint32 sid,
                                SVGA3dSurfaceFlags flags,
                                SVGA3dSurfaceFormat format,
-                               SVGA3dSurfaceFace **faces,
-                               SVGA3dSize **mipSizes,
+                               SVGA3dSurfaceFace __far **faces,
+                               SVGA3dSize __far **mipSizes,
                                uint32 numMipSizes);
 void SVGA3D_DestroySurface(uint32 sid);
-void SVGA3D_BeginSurfaceDMA(SVGA3dGuestImage *guestImage,
-                            SVGA3dSurfaceImageId *hostImage,
+void SVGA3D_BeginSurfaceDMA(SVGA3dGuestImage __far *guestImage,
+                            SVGA3dSurfaceImageId __far *hostImage,
                             SVGA3dTransferType transfer,
-                            SVGA3dCopyBox **boxes,
+                            SVGA3dCopyBox __far **boxes,
                             uint32 numBoxes);
 
 
@@ -103,9 +118,9 @@ void SVGA3D_BeginSurfaceCopy(SVGA3dSurfaceImageId *src,
                              SVGA3dSurfaceImageId *dest,
                              SVGA3dCopyBox **boxes, uint32 numBoxes);
 
-void SVGA3D_SurfaceStretchBlt(SVGA3dSurfaceImageId *src,
-                              SVGA3dSurfaceImageId *dest,
-                              SVGA3dBox *boxSrc, SVGA3dBox *boxDest,
+void SVGA3D_SurfaceStretchBlt(SVGA3dSurfaceImageId __far *src,
+                              SVGA3dSurfaceImageId __far *dest,
+                              SVGA3dBox __far *boxSrc, SVGA3dBox __far *boxDest,
                               SVGA3dStretchBltMode mode);
 
 /*
@@ -631,6 +631,7 @@ struct SVGASignedPoint {
  */
 
 #define SVGA_CAP_NONE               0x00000000UL
+#define SVGA_CAP_RECT_FILL          0x00000001UL   // Legacy, still advertised by some hosts
 #define SVGA_CAP_RECT_COPY          0x00000002UL
 #define SVGA_CAP_CURSOR             0x00000020UL
 #define SVGA_CAP_CURSOR_BYPASS      0x00000040UL   // Legacy (Use Cursor Bypass 3 instead)
@@ -1231,6 +1232,7 @@ struct SVGAScreenObject {
 typedef enum {
    SVGA_CMD_INVALID_CMD           = 0,
    SVGA_CMD_UPDATE                = 1,
+   SVGA_CMD_RECT_FILL             = 2,
    SVGA_CMD_RECT_COPY             = 3,
    SVGA_CMD_DEFINE_CURSOR         = 19,
    SVGA_CMD_DEFINE_ALPHA_CURSOR   = 22,
@@ -1312,6 +1314,26 @@ struct {
 } SVGAFifoCmdRectCopy;
 
 
+/*
+ * SVGA_CMD_RECT_FILL --
+ *
+ *    Legacy command: fill a rectangular area of the GFB with solid
+ *    color and copy the result to any screens which intersect it.
+ *
+ * Availability:
+ *    SVGA_CAP_RECT_FILL
+ */
+
+typedef
+struct {
+   uint32 color;     // In the same format as the GFB
+   uint32 x;
+   uint32 y;
+   uint32 width;
+   uint32 height;
+} SVGAFifoCmdRectFill;
+
+
 /*
  * SVGA_CMD_DEFINE_CURSOR --
  *
@@ -34,6 +34,14 @@ THE SOFTWARE.
 
 #include "version.h"
 
+#include <stddef.h> /* offsetof */
+#include "io32.h"
+#include "crt32.h"
+#include "wc32.h"
+#ifdef DBGPRINT
+#include "dbgprint.h"
+#endif
+
 #ifndef PAGE_SIZE
 #define PAGE_SIZE 4096
 #endif
@@ -103,9 +111,11 @@ char dbg_dic_ring[] = "DeviceIOControl: Ring\n";
 char dbg_dic_sync[] = "DeviceIOControl: Sync\n";
 char dbg_dic_unknown[] = "DeviceIOControl: Unknown: %d\n";
 char dbg_dic_system[] = "DeviceIOControl: System code: %d\n";
+char dbg_dic_release[] = "DeviceIOControl: released %ld regions, %ld CBs\n";
 char dbg_get_ppa[] = "%lx -> %lx\n";
 char dbg_get_ppa_beg[] = "Virtual: %lx\n";
 char dbg_mob_allocate[] = "Allocated OTable row: %d\n";
+char dbg_otable_grow[] = "OTable %d grow: %ld -> %ld bytes\n";
 
 char dbg_str[] = "%s\n";
 
@@ -115,9 +125,13 @@ char dbg_lockcb[] = "Reused CB (%d) with status: %d\n";
 
 char dbg_lockcb_lasterr[] = "Error command: %lX\n";
 
-char dbg_cb_on[] = "CB supported and allocated\n";
+char dbg_cb_on[] = "CB supported\n";
 char dbg_gb_on[] = "GB supported and allocated\n";
 char dbg_cb_ena[] = "CB context 0 enabled\n";
+char dbg_present_path[] = "Present path %ld (FIFO %ld, CB %ld cycles)\n";
+
+char dbg_irq_on[] = "IRQ %d virtualized\n";
+char dbg_irq_fail[] = "IRQ %d virtualization failed\n";
 
 char dbg_region_info_1[] = "Region id = %d\n";
 char dbg_region_info_2[] ="Region address = %lX, PPN = %lX, GMRBLK = %lX\n";
@@ -137,18 +151,45 @@ typedef struct _cmd_buf_t
 	DWORD   phy;
 	void   *lin;
 	DWORD   status;
+	DWORD   id;     /* low part of CB id, valid in CB_STATUS_PROCESS */
+	DWORD   owner;  /* CB_STATUS_LOCKED by user space: DIOC tagProcess and hDevice, 0 = ring-0 */
+	DWORD   handle;
 } cmd_buf_t;
 
 #define CB_STATUS_EMPTY   0 /* buffer was not used yet */
 #define CB_STATUS_LOCKED  1 /* buffer is using by Ring-3 proccess */
 #define CB_STATUS_PROCESS 2 /* buffer is register by VGPU */
 
-#define CB_COUNT 2
+/* number of command buffers in ring, every buffer has SVGA_CB_MAX_SIZE,
+ * device can queue up to SVGA_CB_MAX_QUEUED_PER_CONTEXT per context */
+#ifndef CB_COUNT
+#define CB_COUNT 8
+#endif
+
+/* freed PM16 regions are kept for reuse, max. pages in pool (high watermark) */
+#ifndef REGION_POOL_MAX_PAGES
+#define REGION_POOL_MAX_PAGES 8192 /* 32 MB */
+#endif
+#define REGION_POOL_SLOTS 32
+
+/* persistent staging regions for streaming uploads (ring of STAGING_COUNT) */
+#ifndef STAGING_COUNT
+#define STAGING_COUNT 2
+#endif
+#ifndef STAGING_PAGES
+#define STAGING_PAGES 64 /* 256 kB */
+#endif
+
+/* SVGA_CB_LOCK input flags */
+#define CB_LOCK_WAIT 1 /* sleep until some buffer is free (default: return NULL when busy) */
 
 uint64 cmd_buf_next_id = {0, 0};
 
 cmd_buf_t cmd_bufs[CB_COUNT] = {{0}};
 
+/* ring position where LockCB starts to search */
+static int cmd_buf_pos = 0;
+
 BOOL cb_support = FALSE;
 BOOL gb_support = FALSE;
 BOOL cb_context0 = FALSE;
@@ -160,6 +201,11 @@ BOOL cb_context0 = FALSE;
 #define FLAG_ALLOCATED 1
 #define FLAG_ACTIVE    2
 
+/* first size of growable tables (MOB and surface), IDs */
+#ifndef OTABLE_INIT_IDS
+#define OTABLE_INIT_IDS 1024
+#endif
+
 otinfo_entry_t otable[SVGA_OTABLE_DX_MAX] = {
 	{0, NULL, ROUND_TO_PAGES(SVGA3D_MAX_MOBS*sizeof(SVGAOTableMobEntry)),              0}, /* SVGA_OTABLE_MOB */
 	{0, NULL, ROUND_TO_PAGES(SVGA3D_MAX_SURFACE_IDS*sizeof(SVGAOTableSurfaceEntry)),   0}, /* SVGA_OTABLE_SURFACE */
@@ -228,547 +274,2957 @@ void VDD_Get_Mini_Dispatch_Table()
 }
 
 /**
- * Control Handles
+ * VMM semaphores, events and time-outs wrappers
  **/
-void Sys_Critical_Init_proc()
+static DWORD Create_Semaphore(DWORD tokens)
 {
-	// nop
+	static DWORD stokens;
+	static DWORD sem;
+	
+	stokens = tokens;
+	
+	_asm push eax
+	_asm push ecx
+	_asm mov ecx, [stokens]
+	VMMCall(Create_Semaphore);
+	_asm sbb ecx, ecx /* ECX = -1 on error (CF set) */
+	_asm not ecx
+	_asm and eax, ecx
+	_asm mov [sem], eax
+	_asm pop ecx
+	_asm pop eax
+	
+	return sem;
 }
 
-/*
- * 32-bit DeviceIoControl ends here
- *
- */
-#define SVGA_DBG             0x110B
-#define SVGA_REGION_CREATE   0x1114
-#define SVGA_REGION_FREE     0x1115
-#define SVGA_SYNC            0x1116
-#define SVGA_RING            0x1117
-#define SVGA_ALLOCPHY        0x1200
-#define SVGA_FREEPHY         0x1201
-#define SVGA_OTABLE_QUERY    0x1202
-#define SVGA_OTABLE_FLAGS    0x1203
+static void Wait_Semaphore(DWORD sem)
+{
+	static DWORD ssem;
+	static DWORD sflags;
+	
+	ssem = sem;
+	sflags = BLOCK_SVC_INTS | BLOCK_ENABLE_INTS;
+	
+	_asm push eax
+	_asm push ecx
+	_asm mov eax, [ssem]
+	_asm mov ecx, [sflags]
+	VMMCall(Wait_Semaphore);
+	_asm pop ecx
+	_asm pop eax
+}
 
-#define SVGA_CB_LOCK         0x1204
-#define SVGA_CB_SUBMIT       0x1205
-#define SVGA_CB_SYNC         0x1206
+static void Signal_Semaphore(DWORD sem)
+{
+	static DWORD ssem;
+	
+	ssem = sem;
+	
+	_asm push eax
+	_asm mov eax, [ssem]
+	VMMCall(Signal_Semaphore);
+	_asm pop eax
+}
 
-DWORD __stdcall Device_IO_Control_entry(struct DIOCParams *params);
+/* async service (can be called from HW interrupt) */
+static DWORD Schedule_Global_Event(DWORD callback, DWORD refdata)
+{
+	static DWORD scallback;
+	static DWORD srefdata;
+	static DWORD shandle;
+	
+	scallback = callback;
+	srefdata  = refdata;
+	
+	_asm push esi
+	_asm push edx
+	_asm mov esi, [scallback]
+	_asm mov edx, [srefdata]
+	VMMCall(Schedule_Global_Event);
+	_asm mov [shandle], esi
+	_asm pop edx
+	_asm pop esi
+	
+	return shandle;
+}
 
-void __declspec(naked) Device_IO_Control_proc()
+static DWORD Set_Global_Time_Out(DWORD ms, DWORD callback, DWORD refdata)
 {
-	_asm {
-		push esi /* struct DIOCParams */
-		call Device_IO_Control_entry
-		retn
-	}
+	static DWORD sms;
+	static DWORD scallback;
+	static DWORD srefdata;
+	static DWORD shandle;
+	
+	sms       = ms;
+	scallback = callback;
+	srefdata  = refdata;
+	
+	_asm push eax
+	_asm push esi
+	_asm push edx
+	_asm mov eax, [sms]
+	_asm mov esi, [scallback]
+	_asm mov edx, [srefdata]
+	VMMCall(Set_Global_Time_Out);
+	_asm mov [shandle], esi
+	_asm pop edx
+	_asm pop esi
+	_asm pop eax
+	
+	return shandle;
 }
 
-void Device_Init_proc();
+static DWORD Get_System_Time()
+{
+	static DWORD stime;
+	
+	_asm push eax
+	VMMCall(Get_System_Time);
+	_asm mov [stime], eax
+	_asm pop eax
+	
+	return stime;
+}
 
-/*
- * service module calls (init, exit, deviceIoControl, ...)
- * clear carry if succes (this is always success)
- */
-void __declspec(naked) VMWS_Control()
+static void Cancel_Time_Out(DWORD handle)
 {
-	// eax = 0x00 - Sys Critical Init
-	// eax = 0x01 - sys dynamic init
-	// eax = 0x1B - dynamic init
-	// eax = 0x1C - dynamic exit
-	// eax = 0x23 - device IO control
+	static DWORD shandle;
 	
-	_asm {
-		cmp eax,Sys_Critical_Init
-		jnz control_1
-			pushad
-			call Sys_Critical_Init_proc
-			popad
-			clc
-			ret
-		control_1: 
-		cmp eax,Device_Init
-		jnz control_2
-			pushad
-		  call Device_Init_proc
-			popad
-			clc
-			ret
-		control_2:
-		cmp eax,0x1B
-		jnz control_3
-			pushad
-		  call Device_Init_proc
-		  popad
-			clc
-			ret
-		control_3:
-		cmp eax,W32_DEVICEIOCONTROL
-		jnz control_4
-			jmp Device_IO_Control_proc
-		control_4:
-		clc
-	  ret
-	};
+	shandle = handle;
+	
+	_asm push esi
+	_asm mov esi, [shandle]
+	VMMCall(Cancel_Time_Out);
+	_asm pop esi
 }
 
 /**
- * Return PPN (physical page number) from virtual address
- * 
+ * VPICD calls wrapers
  **/
-static DWORD getPPN(DWORD virtualaddr)
+static DWORD VPICD_Virtualize_IRQ(VPICD_IRQ_Descriptor *desc)
 {
-	DWORD phy = 0;
-	_CopyPageTable(virtualaddr/P_SIZE, 1, &phy, 0);
-	return phy/P_SIZE;
+	static DWORD sdesc;
+	static DWORD shandle;
+	
+	sdesc = (DWORD)desc;
+	
+	_asm push eax
+	_asm push ecx
+	_asm push edi
+	_asm mov edi, [sdesc]
+	VxDCall(VPICD, Virtualize_IRQ);
+	_asm sbb ecx, ecx /* ECX = -1 on error (CF set) */
+	_asm not ecx
+	_asm and eax, ecx
+	_asm mov [shandle], eax
+	_asm pop edi
+	_asm pop ecx
+	_asm pop eax
+	
+	return shandle;
+}
+
+static void VPICD_Phys_EOI(DWORD handle)
+{
+	static DWORD shandle;
+	
+	shandle = handle;
+	
+	_asm push eax
+	_asm mov eax, [shandle]
+	VxDCall(VPICD, Phys_EOI);
+	_asm pop eax
+}
+
+static void VPICD_Physically_Unmask(DWORD handle)
+{
+	static DWORD shandle;
+	
+	shandle = handle;
+	
+	_asm push eax
+	_asm mov eax, [shandle]
+	VxDCall(VPICD, Physically_Unmask);
+	_asm pop eax
 }
 
 /**
- * Allocate guest memory region (GMR) - HW needs know memory physical
- * addressed of pages in (virtual) memory block.
- * Technically this allocate 2 memory block, 1st for data and 2nd as its
- * physical description.
- *
- * @param nPages: number of pages to allocate
- * @param outDataAddr: linear address (system space) of data block
- * @param outGMRAddr: linear address of GMR block
- * @param outPPN: physical page number of outGMRAddr (first page)
- * @param outMobAddr: linear address of MOB PT block - if is NOT null,
- *                    extra memory of MOB maybe allocated. If result 
- *                    is NULL, MOB is full flat (no PT needed).
- * @param outMobPPN: physical page number of MOB
- *
- * @return: TRUE on success
+ * Wait slots
  *
+ * Every sleeper has its own slot with semaphore and 'armed' flag. Wake up
+ * and time-out take the flag by xchg and only the one which took it
+ * signals, so each wait gets exactly one token and no token is left for
+ * the next wait on the same slot. Sleepers are grouped by queue id.
  **/
-static BOOL GMRAlloc(ULONG nPages, ULONG *outDataAddr, ULONG *outGMRAddr, ULONG *outPPN, 
-	ULONG *outMobAddr, ULONG *outMobPPN)
+#define WAIT_SLOTS      16
+#define WAIT_QUEUE_LOCK 1
+#define WAIT_QUEUE_IRQ  2
+
+typedef struct _wait_slot_t
 {
-	ULONG phy;
-	ULONG pgblk_phy;
-	ULONG laddr;
-	ULONG pgblk;
-	SVGAGuestMemDescriptor *desc;
-	laddr = _PageAllocate(nPages, PG_SYS, 0, 0, 0x0, 0x100000, &phy, PAGECONTIG | PAGEUSEALIGN | PAGEFIXED);
+	volatile DWORD used;
+	volatile DWORD armed; /* sleeping and not signaled yet */
+	volatile DWORD queue;
+	DWORD          sem;
+	DWORD          timer;
+} wait_slot_t;
+
+static wait_slot_t wait_slots[WAIT_SLOTS];
+
+void Wait_Timeout_entry();
+
+static DWORD waitXchg(volatile DWORD *ptr, DWORD value)
+{
+	static volatile DWORD *sptr;
+	static DWORD sval;
 	
-	if(laddr)
+	sptr = ptr;
+	sval = value;
+	
+	_asm mov edx, [sptr]
+	_asm mov eax, [sval]
+	_asm xchg [edx], eax
+	_asm mov [sval], eax
+	
+	return sval;
+}
+
+/* signal slot only if its wait wasn't signaled yet */
+static void waitSignal(wait_slot_t *slot)
+{
+	if(waitXchg(&slot->armed, 0) != 0)
 	{
-		pgblk = _PageAllocate(1, PG_SYS, 0, 0, 0x0, 0x100000, &pgblk_phy, PAGECONTIG | PAGEUSEALIGN | PAGEFIXED);
-		if(pgblk)
+		Signal_Semaphore(slot->sem);
+	}
+}
+
+/* wake all sleepers of queue */
+static void waitWake(DWORD queue)
+{
+	DWORD i;
+	
+	for(i = 0; i < WAIT_SLOTS; i++)
+	{
+		if(wait_slots[i].used && wait_slots[i].queue == queue)
 		{
-			desc = (SVGAGuestMemDescriptor*)pgblk;
-			desc->ppn = (phy/P_SIZE);
-			desc->numPages = nPages;
-			desc++;
-			desc->ppn = 0;
-			desc->numPages = 0;
-		
-			*outDataAddr = laddr;
-			*outGMRAddr = pgblk;
-			*outPPN = (pgblk_phy/P_SIZE);
-			
-			if(outMobAddr)
-				*outMobAddr = 0;
-			
-			if(outMobPPN)
-				*outMobPPN = (phy/P_SIZE);
+			waitSignal(&wait_slots[i]);
+		}
+	}
+}
 
-			return TRUE;
+static void __stdcall Wait_Timeout_proc(wait_slot_t *slot)
+{
+	slot->timer = 0;
+	waitSignal(slot);
+}
+
+void __declspec(naked) Wait_Timeout_entry()
+{
+	_asm {
+		pushad
+		push edx /* ref data = slot */
+		call Wait_Timeout_proc
+		popad
+		retn
+	}
+}
+
+/*
+ * Sleep until waitWake of queue or 'ms' time-out. Returns FALSE without
+ * sleeping when there is no free slot (caller just polls then).
+ */
+static BOOL waitSleep(DWORD queue, DWORD ms)
+{
+	wait_slot_t *slot = NULL;
+	DWORD i;
+	
+	for(i = 0; i < WAIT_SLOTS; i++)
+	{
+		if(waitXchg(&wait_slots[i].used, 1) == 0)
+		{
+			slot = &wait_slots[i];
+			break;
 		}
-		else
+	}
+	
+	if(slot == NULL)
+	{
+		return FALSE;
+	}
+	
+	if(slot->sem == 0)
+	{
+		slot->sem = Create_Semaphore(0);
+		if(slot->sem == 0)
 		{
-			_PageFree((PVOID)laddr, 0);
+			slot->used = 0;
 			return FALSE;
 		}
 	}
-	else
+	
+	slot->queue = queue;
+	slot->armed = 1;
+	slot->timer = Set_Global_Time_Out(ms, (DWORD)Wait_Timeout_entry, (DWORD)slot);
+	Wait_Semaphore(slot->sem);
+	if(slot->timer != 0)
 	{
-		ULONG taddr;
-		ULONG tppn;
-		ULONG pgi;
-		ULONG base_ppn;
-		ULONG base_cnt;
-		ULONG blocks = 1;
-		ULONG blk_pages = 0;
-		
-		//laddr = _PageAllocate(nPages, PG_SYS, 0, 0, 0x0, 0x100000, NULL, PAGEFIXED);
-		laddr = 0;
-		
-		if(laddr)
-		{
-			/* determine how many physical continuous blocks we have */
-			base_ppn = getPPN(laddr);
-			base_cnt = 1;
-			for(pgi = 1; pgi < nPages; pgi++)
-			{
-				taddr = laddr + pgi*P_SIZE;
-				tppn = getPPN(taddr);
-				
-				if(tppn != base_ppn + base_cnt)
-				{
-					base_ppn = tppn;
-					base_cnt = 1;
-					blocks++;
-				}
-				else
-				{
-					base_cnt++;
-				}
-			}
-			
-			// number of pages to store regions information
-			blk_pages = ((blocks+1)/(P_SIZE/sizeof(SVGAGuestMemDescriptor))) + 1;
-			
-			// add extra descriptors for pages edge
-			blk_pages = ((blocks+blk_pages+1)/(P_SIZE/sizeof(SVGAGuestMemDescriptor))) + 1;
-			
-			pgblk = _PageAllocate(blk_pages, PG_SYS, 0, 0, 0x0, 0x100000, &pgblk_phy, PAGECONTIG | PAGEUSEALIGN | PAGEFIXED);
-			if(pgblk)
-			{
-				desc = (SVGAGuestMemDescriptor*)pgblk;
-				desc->ppn = getPPN(laddr);
-				desc->numPages = 1;
-				blocks = 1;
-				
-				for(pgi = 1; pgi < nPages; pgi++)
-				{
-					taddr = laddr + pgi*P_SIZE;
-					tppn = getPPN(taddr);
-					
-					if(tppn == desc->ppn + desc->numPages)
-					{
-						desc->numPages++;
-					}
-					else
+		Cancel_Time_Out(slot->timer);
+		slot->timer = 0;
+	}
+	slot->queue = 0;
+	slot->used = 0;
+	
+	return TRUE;
+}
+
+/**
+ * SVGA interrupts
+ *
+ * HW interrupt handler only acknowledges the device and schedules global
+ * event, the event wakes threads waiting in SVGA_IRQWait. Every wait has
+ * also a time-out, so lost interrupt means only a delay not a dead lock.
+ **/
+#define SVGA_IRQ_TIMEOUT 10 /* ms */
+
+static VPICD_IRQ_Descriptor irq_desc = {0};
+static DWORD irq_handle = 0;
+static volatile DWORD irq_waiters = 0;
+static volatile DWORD irq_mask = 0;
+static volatile DWORD irq_pending = 0;
+static volatile DWORD irq_event = 0;
+
+BOOL irq_support = FALSE;
+
+void IRQ_Event_entry();
+void IRQ_Hw_Int_entry();
+
+/* wake all waiting threads (time-out of each wait is in its wait slot) */
+static void __stdcall IRQ_Event_proc()
+{
+	irq_event = 0;
+	waitWake(WAIT_QUEUE_IRQ);
+}
+
+static BOOL __stdcall IRQ_Hw_Int_proc()
+{
+	DWORD flags = inpd_asm(gSVGA.ioBase + SVGA_IRQSTATUS_PORT);
+	if(flags == 0)
+	{
+		return FALSE; /* shared line, not our interrupt */
+	}
+	
+	outpd_asm(gSVGA.ioBase + SVGA_IRQSTATUS_PORT, flags);
+	irq_pending |= flags;
+	
+	if((flags & SVGA_IRQFLAG_ANY_FENCE) && gSVGAFenceMirror != NULL)
+	{
+		*gSVGAFenceMirror = gSVGA.fifoMem[SVGA_FIFO_FENCE];
+	}
+	
+	VPICD_Phys_EOI(irq_handle);
+	
+	if(irq_waiters > 0 && irq_event == 0)
+	{
+		irq_event = Schedule_Global_Event((DWORD)IRQ_Event_entry, 0);
+	}
+	
+	return TRUE;
+}
+
+void __declspec(naked) IRQ_Event_entry()
+{
+	_asm {
+		pushad
+		call IRQ_Event_proc
+		popad
+		retn
+	}
+}
+
+/* clear carry if interrupt was processed */
+void __declspec(naked) IRQ_Hw_Int_entry()
+{
+	_asm {
+		call IRQ_Hw_Int_proc
+		cmp eax, 1
+		retn
+	}
+}
+
+static void IRQ_Init()
+{
+	BYTE irq;
+	
+	if(irq_handle != 0)
+	{
+		return;
+	}
+	
+	irq = PCI_ConfigRead8(&gSVGA.pciAddr, offsetof(PCIConfigSpace, intrLine));
+	if(irq == 0 || irq >= 16)
+	{
+		return;
+	}
+	
+	/* Start out with all SVGA IRQs masked */
+	SVGA_WriteReg(SVGA_REG_IRQMASK, 0);
+	/* Clear all pending IRQs stored by the device */
+	outpd_asm(gSVGA.ioBase + SVGA_IRQSTATUS_PORT, 0xFF);
+	
+	irq_desc.VID_IRQ_Number    = irq;
+	irq_desc.VID_Options       = VPICD_OPT_CAN_SHARE;
+	irq_desc.VID_Hw_Int_Proc   = (DWORD)IRQ_Hw_Int_entry;
+	irq_desc.VID_IRET_Time_Out = 500;
+	
+	irq_handle = VPICD_Virtualize_IRQ(&irq_desc);
+	if(irq_handle != 0)
+	{
+		VPICD_Physically_Unmask(irq_handle);
+		irq_support = TRUE;
+		dbg_printf(dbg_irq_on, irq);
+	}
+	else
+	{
+		dbg_printf(dbg_irq_fail, irq);
+	}
+}
+
+/*
+ * Start waiting on IRQ 'flags', return FALSE if interrupts aren't
+ * supported (and caller have to poll). Every successful call must
+ * be paired with SVGA_IRQEnd.
+ */
+Bool SVGA_IRQBegin(uint32 flags)
+{
+	if(!irq_support)
+	{
+		return FALSE;
+	}
+	
+	irq_waiters++;
+	if((irq_mask & flags) != flags)
+	{
+		irq_mask |= flags;
+		SVGA_WriteReg(SVGA_REG_IRQMASK, irq_mask);
+	}
+	
+	return TRUE;
+}
+
+/*
+ * Sleep until some of unmasked IRQ arrive (or time-out). Caller must
+ * check its condition again after return.
+ */
+void SVGA_IRQWait(void)
+{
+	waitSleep(WAIT_QUEUE_IRQ, SVGA_IRQ_TIMEOUT);
+}
+
+void SVGA_IRQEnd(void)
+{
+	if(irq_waiters > 0)
+	{
+		irq_waiters--;
+	}
+	
+	if(irq_waiters == 0)
+	{
+		irq_mask = 0;
+		SVGA_WriteReg(SVGA_REG_IRQMASK, 0);
+	}
+}
+
+/**
+ * Sleeping userlist locks
+ *
+ * Locks itself are in shared userlist (atomic fast path in the driver and
+ * user space). On contention the locker announces itself in userlist and
+ * sleeps here until the unlocker wakes it (or time-out, unlocker may not
+ * know about waiters), then it tries the lock again.
+ **/
+#define LOCK_WAIT_TIMEOUT 1 /* ms */
+
+static void LockWait()
+{
+	waitSleep(WAIT_QUEUE_LOCK, LOCK_WAIT_TIMEOUT);
+}
+
+/* wake all sleeping lockers, they will compete for lock again */
+static void LockWake()
+{
+	waitWake(WAIT_QUEUE_LOCK);
+}
+
+/**
+ * Virtual vertical blank (see vmwsvxd.h)
+ *
+ * Position in frame is in 1/1000 of frame, one unit is 1/hz ms. Waiters
+ * sleep on semaphore, time-out is armed to nearest vblank edge only when
+ * someone waits and wakes all of them, each waiter then checks its own
+ * frame counter. Mode set changes 'vblank_gen' to release waiters.
+ **/
+static DWORD vblank_hz        = 0;
+static DWORD vblank_lines     = 0; /* visible lines */
+static DWORD vblank_total     = 0; /* visible + blank lines */
+static DWORD vblank_start     = 0; /* vblank begin, 1/1000 of frame */
+static DWORD vblank_sem       = 0;
+static DWORD vblank_timer     = 0;
+static volatile DWORD vblank_gen     = 0;
+static volatile DWORD vblank_waiters = 0;
+
+void VBlank_Timeout_entry();
+
+static void vblankPos(DWORD now, DWORD *frame, DWORD *pos)
+{
+	DWORD ms = now % 1000;
+	
+	*frame = (now / 1000) * vblank_hz + (ms * vblank_hz) / 1000;
+	*pos   = (ms * vblank_hz) % 1000;
+}
+
+/* number of vblank edges (begins or ends) up to 'now' */
+static DWORD vblankEdges(DWORD now, DWORD flags)
+{
+	DWORD frame, pos;
+	
+	vblankPos(now, &frame, &pos);
+	if((flags & VBLANK_WAIT_END) == 0 && pos >= vblank_start)
+	{
+		return frame + 1;
+	}
+	
+	return frame;
+}
+
+static void vblankArm()
+{
+	DWORD frame, pos, next, ms;
+	
+	if(vblank_timer != 0 || vblank_hz == 0)
+	{
+		return;
+	}
+	
+	vblankPos(Get_System_Time(), &frame, &pos);
+	next = pos < vblank_start ? vblank_start : 1000;
+	ms = (next - pos + vblank_hz - 1) / vblank_hz;
+	if(ms == 0)
+	{
+		ms = 1;
+	}
+	
+	vblank_timer = Set_Global_Time_Out(ms, (DWORD)VBlank_Timeout_entry, 0);
+}
+
+static void vblankWakeAll()
+{
+	DWORD i;
+	for(i = 0; i < vblank_waiters; i++)
+	{
+		Signal_Semaphore(vblank_sem);
+	}
+}
+
+static void __stdcall VBlank_Timeout_proc()
+{
+	vblank_timer = 0;
+	vblankWakeAll();
+	
+	if(vblank_waiters > 0)
+	{
+		vblankArm();
+	}
+}
+
+void __declspec(naked) VBlank_Timeout_entry()
+{
+	_asm {
+		pushad
+		call VBlank_Timeout_proc
+		popad
+		retn
+	}
+}
+
+/* hz = 0 disables virtual vblank */
+static void VBlankSet(DWORD hz, DWORD lines)
+{
+	vblank_hz    = hz;
+	vblank_lines = lines;
+	/* about 6 % of frame is blank, as on CRT timings */
+	vblank_total = lines + lines/16 + 1;
+	vblank_start = (lines * 1000) / vblank_total;
+	
+	vblank_gen++;
+	if(vblank_sem != 0)
+	{
+		vblankWakeAll();
+	}
+}
+
+static BOOL VBlankWait(DWORD flags)
+{
+	DWORD target;
+	DWORD gen = vblank_gen;
+	
+	if(vblank_hz == 0 || (flags & (VBLANK_WAIT_BEGIN | VBLANK_WAIT_END)) == 0)
+	{
+		return FALSE;
+	}
+	
+	if(vblank_sem == 0)
+	{
+		vblank_sem = Create_Semaphore(0);
+		if(vblank_sem == 0)
+		{
+			return FALSE;
+		}
+	}
+	
+	target = vblankEdges(Get_System_Time(), flags) + 1;
+	
+	while(gen == vblank_gen && (LONG)(vblankEdges(Get_System_Time(), flags) - target) < 0)
+	{
+		vblank_waiters++;
+		vblankArm();
+		Wait_Semaphore(vblank_sem);
+		vblank_waiters--;
+	}
+	
+	return TRUE;
+}
+
+static BOOL VBlankStatus(vblank_status_t *st)
+{
+	DWORD frame, pos;
+	
+	if(vblank_hz == 0)
+	{
+		return FALSE;
+	}
+	
+	vblankPos(Get_System_Time(), &frame, &pos);
+	
+	st->frame     = frame;
+	st->scanline  = (pos * vblank_total) / 1000;
+	st->in_vblank = pos >= vblank_start;
+	st->hz        = vblank_hz;
+	
+	if(!st->in_vblank && st->scanline >= vblank_lines)
+	{
+		st->scanline = vblank_lines - 1;
+	}
+	
+	return TRUE;
+}
+
+/**
+ * Sparse userlist (see vmwsvxd.h), VXD keeps own copy of directories,
+ * so pages can be released when driver registers new userlist.
+ **/
+static DWORD *ul_dir[UL_SECTIONS]       = {NULL, NULL}; /* directory in userlist */
+static DWORD  ul_dir_pages[UL_SECTIONS] = {0, 0};
+static DWORD  ul_dir_ids[UL_SECTIONS]   = {0, 0};       /* IDs per page */
+static DWORD  ul_pages[UL_SECTIONS][UL_DIR_MAX];
+
+static BOOL ULSparse(DWORD section, DWORD dir, DWORD pages, DWORD ids)
+{
+	DWORD i;
+	
+	if(section >= UL_SECTIONS || pages > UL_DIR_MAX || (pages != 0 && ids == 0))
+	{
+		return FALSE;
+	}
+	
+	for(i = 0; i < UL_DIR_MAX; i++)
+	{
+		if(ul_pages[section][i] != 0)
+		{
+			_PageFree((PVOID)ul_pages[section][i], 0);
+			ul_pages[section][i] = 0;
+		}
+	}
+	
+	ul_dir[section]       = (DWORD*)dir;
+	ul_dir_pages[section] = pages;
+	ul_dir_ids[section]   = ids;
+	
+	return TRUE;
+}
+
+/**
+ * Commit page with slot of 'id', return its linear address (0 = fail).
+ * Must not be called from time-out (memory allocation can block).
+ **/
+static DWORD ULCommit(DWORD section, DWORD id)
+{
+	DWORD page;
+	DWORD lin;
+	DWORD phy;
+	
+	if(section >= UL_SECTIONS || ul_dir[section] == NULL || ul_dir_pages[section] == 0)
+	{
+		return 0;
+	}
+	
+	page = id / ul_dir_ids[section];
+	if(page >= ul_dir_pages[section])
+	{
+		return 0;
+	}
+	
+	if(ul_pages[section][page] == 0)
+	{
+		lin = _PageAllocate(1, PG_SYS, 0, 0, 0x0, 0x100000, &phy, PAGEFIXED | PAGEZEROINIT);
+		if(lin == 0)
+		{
+			return 0;
+		}
+		
+		/* other thread could commit it while allocation was blocked */
+		if(ul_pages[section][page] != 0)
+		{
+			_PageFree((PVOID)lin, 0);
+		}
+		else
+		{
+			ul_pages[section][page] = lin;
+		}
+	}
+	
+	ul_dir[section][page] = ul_pages[section][page];
+	
+	return ul_pages[section][page];
+}
+
+/**
+ * Hot-path trace ring (see vmwsvxd.h)
+ **/
+static trace_ring_t *trace_ring = NULL;
+
+static void traceInit()
+{
+	DWORD phy;
+	DWORD pages = (sizeof(trace_ring_t) + PAGE_SIZE - 1)/PAGE_SIZE;
+	
+	trace_ring = (trace_ring_t *)_PageAllocate(pages, PG_SYS, 0, 0, 0x0, 0x100000, &phy, PAGEFIXED);
+	if(trace_ring != NULL)
+	{
+		memset(trace_ring, 0, sizeof(trace_ring_t));
+		trace_ring->entries_cnt = TRACE_ENTRIES;
+	}
+}
+
+/**
+ * Record one event, no locks, no sleep (can be called from time-out)
+ **/
+void SVGA_TraceEvent(uint32 event, uint32 arg)
+{
+	static volatile DWORD *shead;
+	static DWORD sslot;
+	static DWORD stsc_lo;
+	static DWORD stsc_hi;
+	trace_entry_t *entry;
+	
+	if(trace_ring == NULL)
+	{
+		return;
+	}
+	
+	shead = &trace_ring->head;
+	
+	_asm mov edx, [shead]
+	_asm mov eax, 1
+	_asm lock xadd [edx], eax
+	_asm mov [sslot], eax
+	_asm rdtsc
+	_asm mov [stsc_lo], eax
+	_asm mov [stsc_hi], edx
+	
+	entry = &trace_ring->entries[sslot % TRACE_ENTRIES];
+	entry->tsc_lo = stsc_lo;
+	entry->tsc_hi = stsc_hi;
+	entry->event  = event;
+	entry->arg    = arg;
+}
+
+#ifdef DBGPRINT
+/**
+ * Buffered debug output (see dbgprint.h), [0] is VXD ring, [1] is driver
+ * ring (PM16 DBG_RING), time-out sends them every DBG_DRAIN_PERIOD ms.
+ **/
+#define DBG_DRAIN_PERIOD 10
+#define DBG_DRAIN_MAX    256 /* per ring and tick */
+
+static dbg_ring_t *dbg_rings = NULL;
+
+void DbgDrain_Timeout_entry();
+
+static void dbgRingsInit()
+{
+	DWORD phy;
+	
+	dbg_rings = (dbg_ring_t *)_PageAllocate(2, PG_SYS, 0, 0, 0x0, 0x100000, &phy, PAGEFIXED);
+	if(dbg_rings != NULL)
+	{
+		dbg_ring_init(&dbg_rings[0], DBG_PORT_COM2);
+		dbg_ring_init(&dbg_rings[1], DBG_PORT_COM1);
+		dbg_buffered(&dbg_rings[0]);
+		
+		Set_Global_Time_Out(DBG_DRAIN_PERIOD, (DWORD)DbgDrain_Timeout_entry, 0);
+	}
+}
+
+static void __stdcall DbgDrain_Timeout_proc()
+{
+	dbg_drain(&dbg_rings[0], DBG_DRAIN_MAX);
+	dbg_drain(&dbg_rings[1], DBG_DRAIN_MAX);
+	
+	Set_Global_Time_Out(DBG_DRAIN_PERIOD, (DWORD)DbgDrain_Timeout_entry, 0);
+}
+
+void __declspec(naked) DbgDrain_Timeout_entry()
+{
+	_asm {
+		pushad
+		call DbgDrain_Timeout_proc
+		popad
+		retn
+	}
+}
+#endif
+
+/**
+ * Control Handles
+ **/
+void Sys_Critical_Init_proc()
+{
+	// nop
+}
+
+/*
+ * 32-bit DeviceIoControl ends here
+ *
+ */
+#define SVGA_DBG             0x110B
+#define SVGA_REGION_CREATE   0x1114
+#define SVGA_REGION_FREE     0x1115
+#define SVGA_SYNC            0x1116
+#define SVGA_RING            0x1117
+#define SVGA_ALLOCPHY        0x1200
+#define SVGA_FREEPHY         0x1201
+#define SVGA_OTABLE_QUERY    0x1202
+#define SVGA_OTABLE_FLAGS    0x1203
+
+#define SVGA_CB_LOCK         0x1204
+#define SVGA_CB_SUBMIT       0x1205
+#define SVGA_CB_SYNC         0x1206
+#define SVGA_CB_RING         0x1207
+#define SVGA_CB_KICK         0x1208
+#define SVGA_LOCK_WAIT       0x1209
+#define SVGA_LOCK_WAKE       0x120A
+#define SVGA_TRACE_SNAPSHOT  0x120B
+#define SVGA_VBLANK_WAIT     0x120C
+#define SVGA_VBLANK_STATUS   0x120D
+#define SVGA_OTABLE_GROW     0x120E
+#define SVGA_UL_COMMIT       0x120F
+#define SVGA_REGION_USER     0x1210
+
+DWORD __stdcall Device_IO_Control_entry(struct DIOCParams *params);
+
+void __declspec(naked) Device_IO_Control_proc()
+{
+	_asm {
+		push esi /* struct DIOCParams */
+		call Device_IO_Control_entry
+		retn
+	}
+}
+
+void Device_Init_proc();
+
+/*
+ * service module calls (init, exit, deviceIoControl, ...)
+ * clear carry if succes (this is always success)
+ */
+void __declspec(naked) VMWS_Control()
+{
+	// eax = 0x00 - Sys Critical Init
+	// eax = 0x01 - sys dynamic init
+	// eax = 0x1B - dynamic init
+	// eax = 0x1C - dynamic exit
+	// eax = 0x23 - device IO control
+	
+	_asm {
+		cmp eax,Sys_Critical_Init
+		jnz control_1
+			pushad
+			call Sys_Critical_Init_proc
+			popad
+			clc
+			ret
+		control_1: 
+		cmp eax,Device_Init
+		jnz control_2
+			pushad
+		  call Device_Init_proc
+			popad
+			clc
+			ret
+		control_2:
+		cmp eax,0x1B
+		jnz control_3
+			pushad
+		  call Device_Init_proc
+		  popad
+			clc
+			ret
+		control_3:
+		cmp eax,W32_DEVICEIOCONTROL
+		jnz control_4
+			jmp Device_IO_Control_proc
+		control_4:
+		clc
+	  ret
+	};
+}
+
+/**
+ * Return PPN (physical page number) from virtual address
+ * 
+ **/
+static DWORD getPPN(DWORD virtualaddr)
+{
+	DWORD phy = 0;
+	_CopyPageTable(virtualaddr/P_SIZE, 1, &phy, 0);
+	return phy/P_SIZE;
+}
+
+/**
+ * Build GMR descriptor list for nPages of already allocated (and locked)
+ * memory on laddr. Physically continuous pages are merged to one
+ * descriptor. Descriptor pages are allocated as one continuous block.
+ *
+ * @param outGMRAddr: linear address of descriptor block
+ * @param outGMRPhy: physical address of descriptor block
+ *
+ * @return: TRUE on success
+ *
+ **/
+static BOOL GMRDescribe(ULONG laddr, ULONG nPages, ULONG *outGMRAddr, ULONG *outGMRPhy)
+{
+	const ULONG desc_on_page = P_SIZE/sizeof(SVGAGuestMemDescriptor);
+	SVGAGuestMemDescriptor *desc;
+	ULONG pgblk;
+	ULONG pgblk_phy;
+	ULONG taddr;
+	ULONG tppn;
+	ULONG pgi;
+	ULONG base_ppn;
+	ULONG blocks = 1;
+	ULONG blk_pages = 0;
+	ULONG desc_pos;
+	
+	/* determine how many physical continuous blocks we have */
+	base_ppn = getPPN(laddr);
+	for(pgi = 1; pgi < nPages; pgi++)
+	{
+		taddr = laddr + pgi*P_SIZE;
+		tppn = getPPN(taddr);
+		
+		if(tppn != base_ppn + pgi)
+		{
+			base_ppn = tppn - pgi;
+			blocks++;
+		}
+	}
+	
+	/* 
+	 * number of pages to store regions information, last descriptor
+	 * on every page is reserved for continuation to next page,
+	 * +1 for terminator
+	 */
+	blk_pages = (blocks + 1 + (desc_on_page - 2)) / (desc_on_page - 1);
+	
+	pgblk = _PageAllocate(blk_pages, PG_SYS, 0, 0, 0x0, 0x100000, &pgblk_phy, PAGECONTIG | PAGEUSEALIGN | PAGEFIXED);
+	if(!pgblk)
+	{
+		return FALSE;
+	}
+	
+	desc = (SVGAGuestMemDescriptor*)pgblk;
+	desc->ppn = getPPN(laddr);
+	desc->numPages = 1;
+	desc_pos = 1; /* index of next free descriptor */
+	
+	for(pgi = 1; pgi < nPages; pgi++)
+	{
+		taddr = laddr + pgi*P_SIZE;
+		tppn = getPPN(taddr);
+		
+		if(tppn == desc->ppn + desc->numPages)
+		{
+			desc->numPages++;
+		}
+		else
+		{
+			/* next descriptor is on page edge: numPages = 0 and ppn = next descriptor page */
+			if(desc_pos % desc_on_page == desc_on_page - 1)
+			{
+				desc++;
+				desc->numPages = 0;
+				desc->ppn = (pgblk_phy/P_SIZE) + (desc_pos/desc_on_page) + 1;
+				desc_pos++;
+			}
+			
+			desc++;
+			desc->ppn = tppn;
+			desc->numPages = 1;
+			desc_pos++;
+		}
+	}
+	
+	/* terminator (may be on the last place on page too) */
+	desc++;
+	desc->ppn = 0;
+	desc->numPages = 0;
+	
+	*outGMRAddr = pgblk;
+	*outGMRPhy  = pgblk_phy;
+	
+	return TRUE;
+}
+
+/**
+ * Lock foreign memory (e.g. application DIB) and describe it as GMR, so
+ * host can read it directly. Memory must be unlocked by GMRUnlock after
+ * host finished with it.
+ *
+ * @param laddr: linear address, page offset is ignored
+ * @param size: size from laddr in bytes
+ * @param outGMRAddr: linear address of descriptor block
+ * @param outPPN: physical page number of descriptor block
+ *
+ * @return: TRUE on success
+ *
+ **/
+static BOOL GMRLock(ULONG laddr, ULONG size, ULONG *outGMRAddr, ULONG *outPPN)
+{
+	ULONG page   = laddr / P_SIZE;
+	ULONG npages = (laddr + size + P_SIZE - 1) / P_SIZE - page;
+	ULONG pgblk_phy;
+	
+	if(size == 0)
+	{
+		return FALSE;
+	}
+	
+	if(_LinPageLock(page, npages, 0) == 0)
+	{
+		return FALSE;
+	}
+	
+	if(!GMRDescribe(page * P_SIZE, npages, outGMRAddr, &pgblk_phy))
+	{
+		_LinPageUnLock(page, npages, 0);
+		return FALSE;
+	}
+	
+	*outPPN = pgblk_phy/P_SIZE;
+	
+	return TRUE;
+}
+
+static void GMRUnlock(ULONG laddr, ULONG size, ULONG GMRAddr)
+{
+	ULONG page   = laddr / P_SIZE;
+	ULONG npages = (laddr + size + P_SIZE - 1) / P_SIZE - page;
+	
+	_PageFree((PVOID)GMRAddr, 0);
+	_LinPageUnLock(page, npages, 0);
+}
+
+/**
+ * Build MOB page table for nPages of already allocated (and locked)
+ * non-contiguous memory on laddr, format as in GMRAlloc.
+ *
+ * @return: TRUE on success
+ *
+ **/
+static BOOL MOBDescribe(ULONG laddr, ULONG nPages, ULONG *outMobAddr, ULONG *outMobPPN, ULONG *outMobFmt)
+{
+	ULONG pgi;
+	DWORD mobphy;
+	ULONG pt_pages = (nPages + PTONPAGE - 1)/PTONPAGE;
+	/* depth 1 = single page of PPNs, one less allocation and host page walk */
+	BOOL depth1 = outMobFmt != NULL && pt_pages == 1;
+	/* depth 2 = first page is page of PPN pages */
+	ULONG mob_pages = depth1 ? 1 : 1 + pt_pages;
+	DWORD *mob = (DWORD *)_PageAllocate(mob_pages, PG_SYS, 0, 0, 0x0, 0x100000, &mobphy,
+		PAGECONTIG | PAGEUSEALIGN | PAGEFIXED);
+	
+	if(mob == NULL)
+	{
+		return FALSE;
+	}
+	
+	if(depth1)
+	{
+		for(pgi = 0; pgi < nPages; pgi++)
+		{
+			mob[pgi] = getPPN(laddr + pgi*PAGE_SIZE);
+		}
+	}
+	else
+	{
+		/* dim 1 */
+		for(pgi = 0; pgi < pt_pages; pgi++)
+		{
+			mob[pgi] = (mobphy/PAGE_SIZE) + pgi + 1;
+		}
+		
+		/* dim 2 */
+		for(pgi = 0; pgi < nPages; pgi++)
+		{
+			mob[PTONPAGE + pgi] = getPPN(laddr + pgi*PAGE_SIZE);
+		}
+	}
+	
+	*outMobAddr = (DWORD)mob;
+	if(outMobPPN) *outMobPPN = mobphy/PAGE_SIZE;
+	if(outMobFmt) *outMobFmt = depth1 ? SVGA3D_MOBFMT_PTDEPTH_1 : SVGA3D_MOBFMT_PTDEPTH_2;
+	
+	return TRUE;
+}
+
+/**
+ * Allocate guest memory region (GMR) - HW needs know memory physical
+ * addressed of pages in (virtual) memory block.
+ * Technically this allocate 2 memory block, 1st for data and 2nd as its
+ * physical description.
+ *
+ * @param nPages: number of pages to allocate
+ * @param outDataAddr: linear address (system space) of data block
+ * @param outGMRAddr: linear address of GMR block
+ * @param outPPN: physical page number of outGMRAddr (first page)
+ * @param outMobAddr: linear address of MOB PT block - if is NOT null,
+ *                    extra memory of MOB maybe allocated. If result 
+ *                    is NULL, MOB is full flat (no PT needed).
+ * @param outMobPPN: physical page number of MOB
+ * @param outMobFmt: if is NOT null, page table depth is chosen by size
+ *                   and reported here (SVGA3D_MOBFMT_*): RANGE/PTDEPTH_0
+ *                   for contiguous memory, PTDEPTH_1 when PPNs fit in one
+ *                   page, PTDEPTH_2 beyond that. If is NULL, table
+ *                   of non-contiguous memory has always depth 2.
+ *
+ * @return: TRUE on success
+ *
+ **/
+static BOOL GMRAlloc(ULONG nPages, ULONG *outDataAddr, ULONG *outGMRAddr, ULONG *outPPN, 
+	ULONG *outMobAddr, ULONG *outMobPPN, ULONG *outMobFmt)
+{
+	ULONG phy;
+	ULONG pgblk_phy;
+	ULONG laddr;
+	ULONG pgblk;
+	SVGAGuestMemDescriptor *desc;
+	laddr = _PageAllocate(nPages, PG_SYS, 0, 0, 0x0, 0x100000, &phy, PAGECONTIG | PAGEUSEALIGN | PAGEFIXED);
+	
+	if(laddr)
+	{
+		pgblk = _PageAllocate(1, PG_SYS, 0, 0, 0x0, 0x100000, &pgblk_phy, PAGECONTIG | PAGEUSEALIGN | PAGEFIXED);
+		if(pgblk)
+		{
+			desc = (SVGAGuestMemDescriptor*)pgblk;
+			desc->ppn = (phy/P_SIZE);
+			desc->numPages = nPages;
+			desc++;
+			desc->ppn = 0;
+			desc->numPages = 0;
+		
+			*outDataAddr = laddr;
+			*outGMRAddr = pgblk;
+			*outPPN = (pgblk_phy/P_SIZE);
+			
+			if(outMobAddr)
+				*outMobAddr = 0;
+			
+			if(outMobPPN)
+				*outMobPPN = (phy/P_SIZE);
+			
+			if(outMobFmt)
+				*outMobFmt = nPages == 1 ? SVGA3D_MOBFMT_PTDEPTH_0 : SVGA3D_MOBFMT_RANGE;
+
+			return TRUE;
+		}
+		else
+		{
+			_PageFree((PVOID)laddr, 0);
+			return FALSE;
+		}
+	}
+	else
+	{
+		/* no continuous block large enough, use ordinary pages and describe them piece by piece */
+		laddr = _PageAllocate(nPages, PG_SYS, 0, 0, 0x0, 0x100000, NULL, PAGEFIXED);
+		
+		if(laddr)
+		{
+			if(GMRDescribe(laddr, nPages, &pgblk, &pgblk_phy))
+			{
+				if(outMobAddr && !MOBDescribe(laddr, nPages, outMobAddr, outMobPPN, outMobFmt))
+				{
+					/* pages aren't continuous, so flat MOB isn't possible */
+					_PageFree((PVOID)pgblk, 0);
+					_PageFree((PVOID)laddr, 0);
+					return FALSE;
+				}
+				
+				*outDataAddr = laddr;
+				*outGMRAddr = pgblk;
+				*outPPN = (pgblk_phy/P_SIZE);
+				
+				return TRUE;
+			}
+			else
+			{
+				_PageFree((PVOID)laddr, 0);
+				return FALSE;
+			}
+		}
+	}
+	
+	return FALSE;
+}
+
+/**
+ * Free data allocated by GMRAlloc
+ *
+ **/
+static BOOL GMRFree(ULONG DataAddr, ULONG GMRAddr, ULONG MobAddr)
+{
+	BOOL ret = FALSE;
+
+	if(_PageFree((PVOID)DataAddr, 0) != 0)
+	{
+		ret = TRUE;
+	}
+	
+	if(_PageFree((PVOID)GMRAddr, 0) != 0)
+	{
+		ret = TRUE;
+	}
+	
+	if(MobAddr != 0)
+	{
+		_PageFree((PVOID)MobAddr, 0);
+	}
+	
+	return ret;
+}
+
+/* maximum table size in bytes, 0 = table can't grow */
+static DWORD otable_max[SVGA_OTABLE_DX_MAX] = {0};
+
+static const DWORD otable_entry[SVGA_OTABLE_DX_MAX] = {
+	sizeof(SVGAOTableMobEntry),
+	sizeof(SVGAOTableSurfaceEntry),
+	sizeof(SVGAOTableContextEntry),
+	0,
+	sizeof(SVGAOTableScreenTargetEntry),
+	sizeof(SVGAOTableDXContextEntry)
+};
+
+/**
+ * Size context tables (and MOBs for them) by host limit. With command
+ * buffers MOB and surface tables start small and grow on demand
+ * (GrowOTable), user space and driver allocate IDs from bottom of range.
+ **/
+static void SizeOTable()
+{
+	DWORD ctx;
+	
+	SVGA_WriteReg(SVGA_REG_DEV_CAP, SVGA3D_DEVCAP_MAX_CONTEXT_IDS);
+	ctx = SVGA_ReadReg(SVGA_REG_DEV_CAP);
+	if(ctx == 0 || ctx > SVGA3D_MAX_CONTEXT_IDS)
+	{
+		ctx = SVGA3D_MAX_CONTEXT_IDS;
+	}
+	
+	otable[SVGA_OTABLE_MOB].size       = ROUND_TO_PAGES((ctx + ctx + SVGA3D_MAX_SURFACE_IDS)*sizeof(SVGAOTableMobEntry));
+	otable[SVGA_OTABLE_CONTEXT].size   = ROUND_TO_PAGES(ctx*sizeof(SVGAOTableContextEntry));
+	otable[SVGA_OTABLE_DXCONTEXT].size = ROUND_TO_PAGES(ctx*sizeof(SVGAOTableDXContextEntry));
+	
+	/* SVGA_3D_CMD_GROW_OTABLE is only sent by CB */
+	if(cb_support)
+	{
+		otable_max[SVGA_OTABLE_MOB]     = otable[SVGA_OTABLE_MOB].size;
+		otable_max[SVGA_OTABLE_SURFACE] = otable[SVGA_OTABLE_SURFACE].size;
+		
+		otable[SVGA_OTABLE_MOB].size     = ROUND_TO_PAGES((ctx + ctx + OTABLE_INIT_IDS)*sizeof(SVGAOTableMobEntry));
+		otable[SVGA_OTABLE_SURFACE].size = ROUND_TO_PAGES(OTABLE_INIT_IDS*sizeof(SVGAOTableSurfaceEntry));
+	}
+}
+
+/**
+ * Allocate OTable for GB objects, tables are allocated on first use,
+ * so VM without 3D (and screen target) don't lose contiguous memory
+ **/
+static BOOL AllocateOTable(DWORD id)
+{
+	otinfo_entry_t *entry;
+	
+	if(id >= SVGA_OTABLE_DX_MAX)
+	{
+		return FALSE;
+	}
+	
+	entry = &otable[id];
+	if(entry->size != 0 && (entry->flags & FLAG_ALLOCATED) == 0)
+	{
+		entry->lin = (void*)_PageAllocate(entry->size/PAGE_SIZE, PG_SYS, 0, 0, 0x0, 0x100000, &entry->phy, PAGECONTIG | PAGEUSEALIGN | PAGEFIXED);
+		if(entry->lin)
+		{
+			dbg_printf(dbg_mob_allocate, id);
+			entry->flags |= FLAG_ALLOCATED;
+		}
+	}
+	
+	return (entry->flags & FLAG_ALLOCATED) != 0;
+}
+
+/**
+ * Device lock (gSVGADevBusy, page is shared with driver by PM16 DEV_LOCK)
+ *
+ * Synchronous code which touches index/value registers (svga.c) or command
+ * buffer state only increments the counter, because only time-outs can
+ * interrupt it. Time-out takes the lock by devTryLock and leaves its work
+ * for next tick when the lock is busy. Nobody sleeps with lock held.
+ **/
+static volatile DWORD *dev_lock = NULL;
+
+static void devLockInit()
+{
+	DWORD phy;
+	
+	dev_lock = (volatile DWORD *)_PageAllocate(1, PG_SYS, 0, 0, 0x0, 0x100000, &phy, PAGEFIXED);
+	if(dev_lock != NULL)
+	{
+		*dev_lock = 0;
+		gSVGADevBusy = dev_lock;
+	}
+}
+
+static void devLock()
+{
+	(*gSVGADevBusy)++;
+}
+
+static void devUnlock()
+{
+	(*gSVGADevBusy)--;
+}
+
+/* time-outs only */
+static BOOL devTryLock()
+{
+	if(*gSVGADevBusy != 0)
+	{
+		return FALSE;
+	}
+	
+	(*gSVGADevBusy)++;
+	return TRUE;
+}
+
+static BOOL cb_allocated = FALSE;
+
+/**
+ * Allocate Command Buffers, on first CB_START (driver) or SVGA_CB_LOCK
+ * (user space). Must not be called from time-out.
+ **/
+static void AllocateCB()
+{
+	int i;
+	
+	cb_allocated = TRUE;
+	for(i = 0; i < CB_COUNT; i++)
+	{
+		if(cmd_bufs[i].phy == 0)
+		{
+			cmd_bufs[i].lin = (void *)_PageAllocate((SVGA_CB_MAX_SIZE+PAGE_SIZE-1)/PAGE_SIZE, PG_SYS, 0, 0, 0x0, 0x100000, &(cmd_bufs[i].phy), PAGECONTIG | PAGEUSEALIGN | PAGEFIXED);
+			cmd_bufs[i].status = CB_STATUS_EMPTY;
+		}
+	}
+}
+
+/**
+ * Test if selected CB is not used
+ **/
+static BOOL isCBfree(int index)
+{
+	switch(cmd_bufs[index].status)
+	{
+		case CB_STATUS_EMPTY:
+			return TRUE;
+		case CB_STATUS_PROCESS:
+		{
+			SVGACBHeader *cb = (SVGACBHeader *)cmd_bufs[index].lin;
+			if(cb->status > SVGA_CB_STATUS_NONE)
+			{
+				return TRUE;
+			}
+			break;
+		}
+	}
+	
+	return FALSE;
+}
+
+/**
+ * Increment 64-bit ID of CB segment
+ **/
+static void nextID_CB()
+{
+	_asm
+	{
+		inc dword ptr [cmd_buf_next_id]
+		adc dword ptr [cmd_buf_next_id+4], 0
+	}
+}
+
+/**
+ * Wait for end of some command buffer (IRQ if possible, alternatively
+ * wake up host by doorbell and poll)
+ **/
+static void waitCB()
+{
+	if(SVGA_IRQBegin(SVGA_IRQFLAG_COMMAND_BUFFER))
+	{
+		SVGA_IRQWait();
+		SVGA_IRQEnd();
+	}
+	else
+	{
+		SVGA_RingDoorbell();
+	}
+}
+
+/**
+ * Lock one of buffers and return ptr for RING-3, return NULL if all
+ * buffers are busy.
+ *
+ * Buffers are used in ring order, so the next buffer is usually the
+ * oldest submitted one and the first probe is a hit.
+ **/
+static void *LockCB()
+{
+	int i;
+	int index;
+	
+	devLock();
+	for(i = 0; i < CB_COUNT; i++)
+	{
+		index = (cmd_buf_pos + i) % CB_COUNT;
+		if(isCBfree(index))
+		{
+#ifdef DBGPRINT
+			{
+				SVGACBHeader *cb = (SVGACBHeader *)cmd_bufs[index].lin;
+				if(cb->status > 1)
+				{
+					dbg_printf(dbg_lockcb, index, cb->status);
+					
+					if(cb->status == SVGA_CB_STATUS_COMMAND_ERROR)
 					{
-						/* next descriptor is on page edge */
-						if((blocks+1) % (P_SIZE/sizeof(SVGAGuestMemDescriptor)) == 0)
-						{
-							desc++;
-							desc->numPages = 0;
-							desc->ppn = getPPN((DWORD)(desc+1));
-							//dbg_printf(old_new_ppn, blocks, getPPN((DWORD)(desc)), getPPN((DWORD)(desc+1)), getPPN((DWORD)(desc+2)));
-							blocks++;
-						}
-						
-						desc++;
-						desc->ppn = tppn;
-						desc->numPages = 1;
-						blocks++;
+						DWORD *ptr = (DWORD*)(((unsigned char*)cmd_bufs[index].lin) + sizeof(SVGACBHeader) + cb->errorOffset);
+						dbg_printf(dbg_lockcb_lasterr, *ptr);
 					}
+					
+				}
+			}
+#endif
+			if(cmd_bufs[index].status == CB_STATUS_PROCESS)
+			{
+				SVGACBHeader *cb = (SVGACBHeader *)cmd_bufs[index].lin;
+				SVGA_TraceEvent(TRACE_CB_DONE, index | (cb->status << 16));
+			}
+			SVGA_TraceEvent(TRACE_CB_LOCK, index);
+			cmd_bufs[index].status = CB_STATUS_LOCKED;
+			cmd_bufs[index].owner  = 0;
+			cmd_bufs[index].handle = 0;
+			cmd_buf_pos = (index + 1) % CB_COUNT;
+			devUnlock();
+			return cmd_bufs[index].lin;
+		}
+	}
+	devUnlock();
+	
+	return NULL;
+}
+
+/**
+ * Same as LockCB, but sleep until some buffer is completed when
+ * all are busy.
+ **/
+static void *LockCBWait()
+{
+	void *ptr;
+	BOOL irq;
+	
+	ptr = LockCB();
+	if(ptr != NULL)
+	{
+		return ptr;
+	}
+	
+	irq = SVGA_IRQBegin(SVGA_IRQFLAG_COMMAND_BUFFER);
+	while((ptr = LockCB()) == NULL)
+	{
+		if(irq)
+		{
+			SVGA_IRQWait();
+		}
+		else
+		{
+			SVGA_RingDoorbell();
+		}
+	}
+	
+	if(irq)
+	{
+		SVGA_IRQEnd();
+	}
+	
+	return ptr;
+}
+
+#define CB_SUBMIT_OK   0
+#define CB_SUBMIT_FAIL 1
+#define CB_SUBMIT_FULL 2 /* device queue is full, buffer stays locked (only if wait == FALSE) */
+
+/**
+ * Submit CB to GPU.
+ * If length is 0, buffer not executed
+ * cbctx_id = SVGA_CB_CONTEXT_0,...
+ * If wait is FALSE, function never sleeps (can be called from time-out)
+ **/
+static DWORD submitCBex(void *ptr, DWORD cbctx_id, BOOL wait)
+{
+	int index;
+	
+	/* context 0 is turned on and of by driver and if it is off don't use it! */
+	if(cb_context0 == FALSE && cbctx_id == SVGA_CB_CONTEXT_0)
+	{
+		return CB_SUBMIT_FAIL;
+	}
+	
+	devLock();
+	for(index = 0; index < CB_COUNT; index++)
+	{
+		if(cmd_bufs[index].lin == ptr)
+		{
+			SVGACBHeader *cb = (SVGACBHeader *)cmd_bufs[index].lin;
+			if(cb->length > 0)
+			{
+				cb->ptr.pa.hi   = 0;
+				cb->ptr.pa.low  = cmd_bufs[index].phy + sizeof(SVGACBHeader);
+				if(irq_support)
+				{
+					/* syncCB sleeps until SVGA_IRQFLAG_COMMAND_BUFFER */
+					cb->flags &= ~SVGA_CB_FLAG_NO_IRQ;
 				}
+				else
+				{
+					cb->flags |= SVGA_CB_FLAG_NO_IRQ;
+				}
+				cb->id.low = cmd_buf_next_id.low;
+				cb->id.hi  = cmd_buf_next_id.hi;
+				cmd_bufs[index].id = cmd_buf_next_id.low;
 				
-				desc++;
-				desc->ppn = 0;
-				desc->numPages = 0;
+				for(;;)
+				{
+					cb->status = SVGA_CB_STATUS_NONE;
+					SVGA_WriteReg(SVGA_REG_COMMAND_HIGH, 0); // high part of 64-bit memory address...
+					SVGA_WriteReg(SVGA_REG_COMMAND_LOW, cmd_bufs[index].phy | cbctx_id);
+					
+					/* device queue is full (status is written synchronously), wait and try again */
+					if(cb->status != SVGA_CB_STATUS_QUEUE_FULL)
+					{
+						break;
+					}
+					
+					if(!wait)
+					{
+						devUnlock();
+						return CB_SUBMIT_FULL;
+					}
+					devUnlock();
+					waitCB();
+					devLock();
+				}
+				cmd_bufs[index].status = CB_STATUS_PROCESS;
+				SVGA_TraceEvent(TRACE_CB_SUBMIT, index | (cbctx_id << 16));
 				
-				*outDataAddr = laddr;
-				*outGMRAddr = pgblk;
-				*outPPN = (pgblk_phy/P_SIZE);
+				//dbg_printf(dbg_submitcb, cbctx_id);
 				
-				if(outMobAddr)
+				nextID_CB();
+			}
+			else
+			{
+				cmd_bufs[index].status = CB_STATUS_EMPTY;
+			}
+			
+			devUnlock();
+			return CB_SUBMIT_OK;
+		}
+	}
+	devUnlock();
+	
+	dbg_printf(dbg_submitcb_fail);
+	
+	return CB_SUBMIT_FAIL;
+}
+
+static BOOL submitCB(void *ptr, DWORD cbctx_id)
+{
+	return submitCBex(ptr, cbctx_id, TRUE) == CB_SUBMIT_OK;
+}
+
+/**
+ * Return locked buffer which wasn't submitted
+ **/
+static void releaseCB(void *ptr)
+{
+	int i;
+	
+	devLock();
+	for(i = 0; i < CB_COUNT; i++)
+	{
+		if(cmd_bufs[i].lin == ptr)
+		{
+			cmd_bufs[i].status = CB_STATUS_EMPTY;
+		}
+	}
+	devUnlock();
+}
+
+/**
+ * Wait until all CB submitted before this call are completed
+ * (buffers submitted while waiting are ignored)
+ **/
+static void syncCB()
+{
+	int index;
+	BOOL synced;
+	BOOL irq = SVGA_IRQBegin(SVGA_IRQFLAG_COMMAND_BUFFER);
+	DWORD last_id = cmd_buf_next_id.low;
+	
+	SVGA_TraceEvent(TRACE_CB_SYNC_BEGIN, 0);
+	
+	do
+	{
+		synced = TRUE;
+		for(index = 0; index < CB_COUNT; index++)
+		{
+			switch(cmd_bufs[index].status)
+			{
+				case CB_STATUS_EMPTY:
+				case CB_STATUS_LOCKED:
+					break;
+				case CB_STATUS_PROCESS:
+				{
+					SVGACBHeader *cb = (SVGACBHeader *)cmd_bufs[index].lin;
+					if(cb->status == SVGA_CB_STATUS_NONE &&
+						(long)(cmd_bufs[index].id - last_id) < 0)
+					{
+						synced = FALSE;
+					}
+					break;
+				}
+			}
+		}
+		
+		if(!synced)
+		{
+			if(irq)
+			{
+				SVGA_IRQWait();
+			}
+			else
+			{
+				SVGA_RingDoorbell();
+			}
+		}
+	} while(!synced);
+	
+	SVGA_TraceEvent(TRACE_CB_SYNC_END, 0);
+	
+	if(irq)
+	{
+		SVGA_IRQEnd();
+	}
+}
+
+#pragma pack(push)
+#pragma pack(1)
+typedef struct _cb_otable_t
+{
+	SVGA3dCmdHeader     header;
+	SVGA3dCmdGrowOTable grow;
+} cb_otable_t;
+#pragma pack(pop)
+
+/**
+ * Send READBACK_OTABLE (size == 0) or GROW_OTABLE on CB context 0 and
+ * wait for completion.
+ **/
+static BOOL otableCmd(DWORD id, DWORD phy, DWORD size, DWORD valid)
+{
+	SVGACBHeader *cb;
+	cb_otable_t *cmd;
+	
+	cb = LockCBWait();
+	memset(cb, 0, sizeof(SVGACBHeader) + sizeof(cb_otable_t));
+	cmd = (cb_otable_t *)(cb + 1);
+	
+	cmd->grow.type = id;
+	if(size == 0)
+	{
+		cmd->header.id   = SVGA_3D_CMD_READBACK_OTABLE;
+		cmd->header.size = sizeof(SVGA3dCmdReadbackOTable);
+	}
+	else
+	{
+		cmd->header.id   = SVGA_3D_CMD_GROW_OTABLE;
+		cmd->header.size = sizeof(SVGA3dCmdGrowOTable);
+		cmd->grow.baseAddress      = phy/PAGE_SIZE;
+		cmd->grow.sizeInBytes      = size;
+		cmd->grow.validSizeInBytes = valid;
+		cmd->grow.ptDepth          = SVGA3D_MOBFMT_RANGE;
+	}
+	cb->length = sizeof(SVGA3dCmdHeader) + cmd->header.size;
+	
+	if(!submitCB(cb, SVGA_CB_CONTEXT_0))
+	{
+		releaseCB(cb);
+		return FALSE;
+	}
+	
+	syncCB();
+	return ((SVGACBHeader *)cb)->status == SVGA_CB_STATUS_COMPLETED;
+}
+
+/**
+ * Make table large enough for 'ids' objects. Size is at least doubled,
+ * so the table is moved only few times. If table is active, host copy
+ * is read back, moved to new memory and host is switched by GROW_OTABLE
+ * (old entries stay valid). Caller must not use IDs above old size
+ * before this returns. Sleeps, never call from time-out.
+ **/
+static BOOL GrowOTable(DWORD id, DWORD ids)
+{
+	otinfo_entry_t *entry;
+	DWORD need, size, phy;
+	void *lin;
+	
+	if(id >= SVGA_OTABLE_DX_MAX || !AllocateOTable(id))
+	{
+		return FALSE;
+	}
+	
+	entry = &otable[id];
+	if(ids <= entry->size/otable_entry[id])
+	{
+		return TRUE;
+	}
+	
+	if(ids > otable_max[id]/otable_entry[id])
+	{
+		return FALSE;
+	}
+	
+	need = ROUND_TO_PAGES(ids*otable_entry[id]);
+	size = entry->size*2;
+	if(size < need)
+	{
+		size = need;
+	}
+	if(size > otable_max[id])
+	{
+		size = otable_max[id];
+	}
+	
+	lin = (void*)_PageAllocate(size/PAGE_SIZE, PG_SYS, 0, 0, 0x0, 0x100000, &phy, PAGECONTIG | PAGEUSEALIGN | PAGEFIXED);
+	if(lin == NULL)
+	{
+		return FALSE;
+	}
+	
+	if(entry->flags & FLAG_ACTIVE)
+	{
+		/* commands in FIFO may still define objects in this table */
+		SVGA_Flush();
+		if(!otableCmd(id, 0, 0, 0))
+		{
+			_PageFree(lin, 0);
+			return FALSE;
+		}
+	}
+	
+	memcpy(lin, entry->lin, entry->size);
+	memset(((unsigned char*)lin) + entry->size, 0, size - entry->size);
+	
+	if(entry->flags & FLAG_ACTIVE)
+	{
+		if(!otableCmd(id, phy, size, entry->size))
+		{
+			_PageFree(lin, 0);
+			return FALSE;
+		}
+	}
+	
+	dbg_printf(dbg_otable_grow, id, entry->size, size);
+	
+	_PageFree(entry->lin, 0);
+	entry->lin  = lin;
+	entry->phy  = phy;
+	entry->size = size;
+	
+	return TRUE;
+}
+
+/**
+ * Shared CB submission ring
+ *
+ * Page in shared arena (so visible from every Ring-3 process), Ring-3
+ * locks buffer, fills entry (buffer linear address + CB context ID) and
+ * increments 'prod'. VXD submits entries from time-out running every
+ * CB_RING_PERIOD ms. When ring is empty for CB_RING_IDLE_TICKS the
+ * time-out stops and 'idle' is set, in this case Ring-3 has to ring the
+ * doorbell (SVGA_CB_KICK) after increment of 'prod'.
+ *
+ * Ring-3 have to increment 'prod' by locked instruction (lock xadd)
+ * before it reads 'idle', VXD does same with 'idle' and 'prod',
+ * otherwise an entry can be lost.
+ **/
+#define CB_RING_SIZE       64 /* entries, power of 2 */
+#define CB_RING_PERIOD     1  /* ms */
+#define CB_RING_IDLE_TICKS 16
+
+typedef struct _cb_ring_entry_t
+{
+	DWORD lin;
+	DWORD ctx;
+} cb_ring_entry_t;
+
+typedef struct _cb_ring_t
+{
+	volatile DWORD  prod; /* written by Ring-3 */
+	volatile DWORD  cons; /* written by VXD */
+	volatile DWORD  idle; /* non zero: doorbell is needed */
+	DWORD           size; /* CB_RING_SIZE */
+	cb_ring_entry_t entries[CB_RING_SIZE];
+} cb_ring_t;
+
+static cb_ring_t *cb_ring = NULL;
+static DWORD cb_ring_timer = 0;
+static DWORD cb_ring_idle  = 0;
+static BOOL  cb_ring_busy  = FALSE; /* drainCBRing can sleep on full queue */
+
+void CBRing_Timeout_entry();
+
+static void AllocateCBRing()
+{
+	DWORD phy;
+	
+	if(cb_ring == NULL)
+	{
+		cb_ring = (cb_ring_t *)_PageAllocate(1, PG_SYS, 0, 0, 0x0, 0x100000, &phy, PAGEFIXED);
+		if(cb_ring != NULL)
+		{
+			cb_ring->prod = 0;
+			cb_ring->cons = 0;
+			cb_ring->idle = 1;
+			cb_ring->size = CB_RING_SIZE;
+		}
+	}
+}
+
+/**
+ * Submit all entries in ring (in order), return number of submitted buffers
+ **/
+static DWORD drainCBRing(BOOL wait)
+{
+	DWORD cnt = 0;
+	
+	if(cb_ring == NULL || cb_ring_busy)
+	{
+		return 0;
+	}
+	
+	cb_ring_busy = TRUE;
+	while(cb_ring->cons != cb_ring->prod)
+	{
+		cb_ring_entry_t *entry = &(cb_ring->entries[cb_ring->cons & (CB_RING_SIZE-1)]);
+		
+		if(submitCBex((void*)entry->lin, entry->ctx, wait) == CB_SUBMIT_FULL)
+		{
+			break; /* try it again on next tick */
+		}
+		
+		cb_ring->cons++;
+		cnt++;
+	}
+	cb_ring_busy = FALSE;
+	
+	return cnt;
+}
+
+/* set ring idle flag with full barrier, return TRUE if ring is really empty */
+static BOOL idleCBRing()
+{
+	static volatile DWORD *pidle;
+	
+	pidle = &(cb_ring->idle);
+	_asm mov edx, [pidle]
+	_asm mov eax, 1
+	_asm xchg [edx], eax
+	
+	return cb_ring->cons == cb_ring->prod;
+}
+
+static void startCBRing()
+{
+	cb_ring_idle = 0;
+	cb_ring->idle = 0;
+	if(cb_ring_timer == 0)
+	{
+		cb_ring_timer = Set_Global_Time_Out(CB_RING_PERIOD, (DWORD)CBRing_Timeout_entry, 0);
+	}
+}
+
+static void __stdcall CBRing_Timeout_proc()
+{
+	DWORD cnt = 0;
+	
+	cb_ring_timer = 0;
+	
+	/*
+	 * Time-out can interrupt driver or VXD between register accesses or
+	 * in the middle of CB state change, then try it on next tick.
+	 */
+	if(devTryLock())
+	{
+		cnt = drainCBRing(FALSE);
+		devUnlock();
+	}
+	
+	if(cnt > 0 || cb_ring->cons != cb_ring->prod)
+	{
+		cb_ring_idle = 0;
+	}
+	else if(++cb_ring_idle >= CB_RING_IDLE_TICKS)
+	{
+		if(idleCBRing())
+		{
+			return;
+		}
+		/* Ring-3 was faster than idle flag */
+		cb_ring_idle = 0;
+		cb_ring->idle = 0;
+	}
+	
+	cb_ring_timer = Set_Global_Time_Out(CB_RING_PERIOD, (DWORD)CBRing_Timeout_entry, 0);
+}
+
+void __declspec(naked) CBRing_Timeout_entry()
+{
+	_asm {
+		pushad
+		call CBRing_Timeout_proc
+		popad
+		retn
+	}
+}
+
+/**
+ * Async present
+ *
+ * GDI queues screen damage to pending update ring in userlist (see
+ * UL_PENDING_* in control.c) and SVGA_CMD_UPDATE is sent from time-out
+ * here (command buffer on context 0 when available, FIFO otherwise), so
+ * GDI doesn't wait for FIFO commit. FIFO is taken by
+ * the userlist lock, when it's busy or 3D owns some part of screen (must
+ * be read back first) the rects are left for lock owner. Time-out must
+ * not sleep and must not touch registers (driver can be between index
+ * and value port access or FIFO reservation), so device enable state is
+ * read from userlist, rects are sent only under devTryLock and rects which
+ * don't fit to free FIFO space stay queued.
+ *
+ * Time-out runs every PRESENT_PERIOD ms and stops after PRESENT_IDLE_TICKS
+ * of empty ring, then 'idle' in present_state_t is set and GDI has to kick
+ * the worker (PM16_PRESENT_KICK) after push. Same ordering rules as
+ * CB ring: both sides have to write by locked instruction before reading
+ * the other one.
+ **/
+#define PRESENT_PERIOD     1  /* ms */
+#define PRESENT_IDLE_TICKS 16
+
+/* userlist layout, as in control.c */
+#define PRESENT_ULF_WIDTH     1
+#define PRESENT_ULF_HEIGHT    2
+#define PRESENT_ULF_PITCH     4
+#define PRESENT_ULF_LOCK_FIFO 6
+#define PRESENT_ULF_ENABLED   8
+#define PRESENT_OWNED_FENCE   0
+#define PRESENT_OWNED_CNT     1
+#define PRESENT_PENDING_HEAD  0
+#define PRESENT_PENDING_TAIL  1
+#define PRESENT_PENDING_RECTS 2
+#define PRESENT_PENDING_MAX   16
+
+typedef struct _present_state_t
+{
+	volatile DWORD idle; /* non zero: kick is needed */
+} present_state_t;
+
+static present_state_t *present_state = NULL;
+static volatile DWORD *present_ul     = NULL;
+static volatile DWORD *present_ring   = NULL;
+static volatile DWORD *present_owned  = NULL;
+static DWORD present_ul_size  = 0;
+static DWORD present_timer    = 0;
+static DWORD present_idle     = 0;
+
+void Present_Timeout_entry();
+
+static DWORD presentXchg(volatile DWORD *ptr, DWORD value)
+{
+	static volatile DWORD *sptr;
+	static DWORD sval;
+	
+	sptr = ptr;
+	sval = value;
+	
+	_asm mov edx, [sptr]
+	_asm mov eax, [sval]
+	_asm xchg [edx], eax
+	_asm mov [sval], eax
+	
+	return sval;
+}
+
+static void presentStop()
+{
+	if(present_timer != 0)
+	{
+		Cancel_Time_Out(present_timer);
+		present_timer = 0;
+	}
+	
+	if(present_ul != NULL)
+	{
+		ULONG page = (ULONG)present_ul / P_SIZE;
+		ULONG npages = ((ULONG)present_ul + present_ul_size + P_SIZE - 1) / P_SIZE - page;
+		_LinPageUnLock(page, npages, 0);
+		present_ul = NULL;
+	}
+}
+
+/* userlist is touched from time-out, so its pages are locked */
+static BOOL presentStart(DWORD ul, DWORD ul_size, DWORD ring, DWORD owned)
+{
+	ULONG page   = ul / P_SIZE;
+	ULONG npages = (ul + ul_size + P_SIZE - 1) / P_SIZE - page;
+	ULONG phy;
+	
+	presentStop();
+	
+	if(ul == 0 || ul_size == 0)
+	{
+		return FALSE;
+	}
+	
+	if(present_state == NULL)
+	{
+		present_state = (present_state_t *)_PageAllocate(1, PG_SYS, 0, 0, 0x0, 0x100000, &phy, PAGEFIXED);
+		if(present_state == NULL)
+		{
+			return FALSE;
+		}
+	}
+	
+	if(_LinPageLock(page, npages, 0) == 0)
+	{
+		return FALSE;
+	}
+	
+	present_ul      = (volatile DWORD *)ul;
+	present_ul_size = ul_size;
+	present_ring    = (volatile DWORD *)ring;
+	present_owned   = (volatile DWORD *)owned;
+	present_idle    = 0;
+	present_state->idle = 1;
+	
+	return TRUE;
+}
+
+#pragma pack(push)
+#pragma pack(1)
+typedef struct _cb_update_t
+{
+	uint32             cmd;
+	SVGAFifoCmdUpdate  update;
+} cb_update_t;
+#pragma pack(pop)
+
+/*
+ * Send updates by command buffer on context 0 (cheaper for host than FIFO
+ * processing), FALSE when CB isn't usable now and FIFO must be used.
+ * Never sleeps.
+ */
+static DWORD present_path = PRESENT_PATH_CB; /* CB when context 0 runs */
+
+static BOOL presentCB(SVGAFifoCmdUpdate *rects, DWORD cnt)
+{
+	SVGACBHeader *cb;
+	cb_update_t *cmd;
+	DWORD i;
+	
+	if(!cb_context0 || cnt == 0 || present_path != PRESENT_PATH_CB)
+	{
+		return FALSE;
+	}
+	
+	cb = LockCB();
+	if(cb == NULL)
+	{
+		return FALSE;
+	}
+	
+	memset(cb, 0, sizeof(SVGACBHeader));
+	cmd = (cb_update_t *)(cb + 1);
+	for(i = 0; i < cnt; i++)
+	{
+		cmd[i].cmd    = SVGA_CMD_UPDATE;
+		cmd[i].update = rects[i];
+	}
+	cb->length = cnt * sizeof(cb_update_t);
+	
+	if(submitCBex(cb, SVGA_CB_CONTEXT_0, FALSE) != CB_SUBMIT_OK)
+	{
+		releaseCB(cb);
+		return FALSE;
+	}
+	
+	return TRUE;
+}
+
+/**
+ * Present path calibration
+ *
+ * Which path is cheaper depends on host (VMware, VirtualBox, QEMU), so
+ * driver lets us time CALIB_ROUNDS of CALIB_BATCHES * CALIB_BATCH 1x1
+ * updates with every path, including the host processing them (FIFO
+ * drain or CB completion). Cost is the best round in TSC cycles per
+ * update. FIFO lock is held by caller, so present worker is out.
+ **/
+#define CALIB_BATCH   PRESENT_PENDING_MAX
+#define CALIB_BATCHES 4
+#define CALIB_ROUNDS  3
+
+static DWORD tscLow()
+{
+	static DWORD stsc;
+	
+	_asm rdtsc
+	_asm mov [stsc], eax
+	
+	return stsc;
+}
+
+/* 0 = path is unusable */
+static DWORD presentMeasure(DWORD path)
+{
+	SVGAFifoCmdUpdate rects[CALIB_BATCH];
+	DWORD best = 0;
+	DWORD r, b, i;
+	
+	for(i = 0; i < CALIB_BATCH; i++)
+	{
+		rects[i].x      = i;
+		rects[i].y      = 0;
+		rects[i].width  = 1;
+		rects[i].height = 1;
+	}
+	
+	for(r = 0; r < CALIB_ROUNDS; r++)
+	{
+		DWORD start = tscLow();
+		DWORD cost;
+		
+		for(b = 0; b < CALIB_BATCHES; b++)
+		{
+			if(path == PRESENT_PATH_CB)
+			{
+				/* all buffers can be in flight, here we can wait */
+				if(!presentCB(rects, CALIB_BATCH))
 				{
-					DWORD mobphy;
-					/* for simplicity we're always creating table of depth 2, first page is page of PPN pages */
-					DWORD *mob = (DWORD *)_PageAllocate(1 + (nPages + PTONPAGE - 1)/PTONPAGE, PG_SYS, 0, 0, 0x0, 0x100000, &mobphy,
-						PAGECONTIG | PAGEUSEALIGN | PAGEFIXED);
-					
-					if(mob)
-					{
-						int i;
-						/* dim 1 */
-						for(i = 0; i < (nPages + PTONPAGE - 1)/PTONPAGE; i++)
-						{
-							mob[i] = (mobphy/PAGE_SIZE) + i + 1;
-						}
-						
-						/* dim 2 */
-						for(i = 0; i < nPages; i++)
-						{
-							mob[PTONPAGE + i] = getPPN(laddr + i*PAGE_SIZE);
-						}
-						
-						*outMobAddr = (DWORD)mob;
-						if(outMobPPN) *outMobPPN = mobphy/PAGE_SIZE;
-					}
-					else
+					syncCB();
+					if(!presentCB(rects, CALIB_BATCH))
 					{
-						*outMobAddr = NULL;
-						if(outMobPPN) *outMobPPN = getPPN(laddr);
+						return 0;
 					}
 				}
-				
-				return TRUE;
 			}
 			else
 			{
-				_PageFree((PVOID)laddr, 0);
-				return FALSE;
+				for(i = 0; i < CALIB_BATCH; i++)
+				{
+					SVGA_Update(rects[i].x, rects[i].y, rects[i].width, rects[i].height);
+				}
+			}
+		}
+		
+		if(path == PRESENT_PATH_CB)
+		{
+			syncCB();
+		}
+		else
+		{
+			SVGA_Flush();
+		}
+		
+		cost = (tscLow() - start) / (CALIB_BATCH * CALIB_BATCHES);
+		if(cost == 0)
+		{
+			cost = 1;
+		}
+		
+		if(best == 0 || cost < best)
+		{
+			best = cost;
+		}
+	}
+	
+	return best;
+}
+
+/* FIFO is always usable, CB only when context 0 is running */
+static DWORD presentPath(DWORD mode, DWORD *fifo_cost, DWORD *cb_cost)
+{
+	*fifo_cost = 0;
+	*cb_cost   = 0;
+	
+	if(mode == PRESENT_PATH_AUTO)
+	{
+		mode = PRESENT_PATH_FIFO;
+		if(cb_context0)
+		{
+			present_path = PRESENT_PATH_CB;
+			*cb_cost   = presentMeasure(PRESENT_PATH_CB);
+			*fifo_cost = presentMeasure(PRESENT_PATH_FIFO);
+			
+			if(*cb_cost != 0 && *cb_cost <= *fifo_cost)
+			{
+				mode = PRESENT_PATH_CB;
+			}
+		}
+	}
+	
+	if(mode != PRESENT_PATH_CB)
+	{
+		mode = PRESENT_PATH_FIFO;
+	}
+	
+	present_path = mode;
+	dbg_printf(dbg_present_path, mode, *fifo_cost, *cb_cost);
+	
+	return mode;
+}
+
+/*
+ * Send rects (left, top, right, bottom) in flat code for the driver, FIFO
+ * lock is held by caller.
+ */
+static void presentRects(const LONG *lrects, DWORD cnt)
+{
+	SVGAFifoCmdUpdate rects[PRESENT_PENDING_MAX];
+	
+	while(cnt > 0)
+	{
+		DWORD n = cnt < PRESENT_PENDING_MAX ? cnt : PRESENT_PENDING_MAX;
+		DWORD i;
+		
+		for(i = 0; i < n; i++, lrects += 4)
+		{
+			rects[i].x      = lrects[0];
+			rects[i].y      = lrects[1];
+			rects[i].width  = lrects[2] - lrects[0];
+			rects[i].height = lrects[3] - lrects[1];
+		}
+		
+		if(!presentCB(rects, n))
+		{
+			for(i = 0; i < n; i++)
+			{
+				SVGA_Update(rects[i].x, rects[i].y, rects[i].width, rects[i].height);
+			}
+		}
+		
+		cnt -= n;
+	}
+}
+
+/*
+ * Send rects from time-out, return how many of them were sent (from
+ * start). Caller holds FIFO lock and device lock (devTryLock), so nobody
+ * is in the middle of register access or FIFO reservation.
+ */
+static DWORD presentAsync(SVGAFifoCmdUpdate *rects, DWORD cnt)
+{
+	DWORD room;
+	DWORD i;
+	
+	if(presentCB(rects, cnt))
+	{
+		return cnt;
+	}
+	
+	/* SVGA_FIFOReserve would wait for host when FIFO is full */
+	room = SVGA_FIFOFree() / sizeof(cb_update_t);
+	if(cnt > room)
+	{
+		cnt = room;
+	}
+	
+	for(i = 0; i < cnt; i++)
+	{
+		SVGA_Update(rects[i].x, rects[i].y, rects[i].width, rects[i].height);
+	}
+	
+	return cnt;
+}
+
+/* send queued rects, return number of ring entries consumed */
+static DWORD drainPresent()
+{
+	DWORD head;
+	DWORD tail;
+	DWORD cnt = 0;
+	SVGAFifoCmdUpdate rects[PRESENT_PENDING_MAX];
+	DWORD rects_pos[PRESENT_PENDING_MAX]; /* ring position of each rect */
+	DWORD rects_cnt = 0;
+	DWORD sent;
+	
+	if(present_ring[PRESENT_PENDING_HEAD] == present_ring[PRESENT_PENDING_TAIL])
+	{
+		return 0;
+	}
+	
+	if(presentXchg(present_ul + PRESENT_ULF_LOCK_FIFO, 1) != 0)
+	{
+		/* lock owner sends them */
+		return 0;
+	}
+	
+	/* driver FIFO writers without FIFO lock hold the device lock */
+	if(present_owned[PRESENT_OWNED_CNT] == 0 && present_owned[PRESENT_OWNED_FENCE] == 0 &&
+		devTryLock())
+	{
+		LONG w = present_ul[PRESENT_ULF_WIDTH];
+		LONG h = present_ul[PRESENT_ULF_HEIGHT];
+		BOOL enabled = present_ul[PRESENT_ULF_ENABLED] != 0;
+		
+		head = present_ring[PRESENT_PENDING_HEAD];
+		tail = present_ring[PRESENT_PENDING_TAIL];
+		for(; tail != head; tail++)
+		{
+			volatile DWORD *r = present_ring + PRESENT_PENDING_RECTS + (tail % PRESENT_PENDING_MAX)*4;
+			LONG left   = (LONG)r[0] > 0 ? (LONG)r[0] : 0;
+			LONG top    = (LONG)r[1] > 0 ? (LONG)r[1] : 0;
+			LONG right  = (LONG)r[2] < w ? (LONG)r[2] : w;
+			LONG bottom = (LONG)r[3] < h ? (LONG)r[3] : h;
+			
+			/* mode can be changed under us, FIFO is off in full screen DOS */
+			if(enabled && left < right && top < bottom && rects_cnt < PRESENT_PENDING_MAX)
+			{
+				rects[rects_cnt].x      = left;
+				rects[rects_cnt].y      = top;
+				rects[rects_cnt].width  = right - left;
+				rects[rects_cnt].height = bottom - top;
+				rects_pos[rects_cnt] = tail;
+				rects_cnt++;
 			}
+			cnt++;
+		}
+		
+		/* unsent rects (and entries behind them) are left for next tick */
+		sent = presentAsync(rects, rects_cnt);
+		if(sent < rects_cnt)
+		{
+			cnt -= tail - rects_pos[sent];
+			tail = rects_pos[sent];
+		}
+		presentXchg(present_ring + PRESENT_PENDING_TAIL, tail);
+		devUnlock();
+	}
+	
+	presentXchg(present_ul + PRESENT_ULF_LOCK_FIFO, 0);
+	LockWake();
+	
+	return cnt;
+}
+
+static void startPresent()
+{
+	present_idle = 0;
+	present_state->idle = 0;
+	if(present_timer == 0)
+	{
+		present_timer = Set_Global_Time_Out(PRESENT_PERIOD, (DWORD)Present_Timeout_entry, 0);
+	}
+}
+
+static void __stdcall Present_Timeout_proc()
+{
+	present_timer = 0;
+	
+	if(present_ul == NULL)
+	{
+		return;
+	}
+	
+	if(drainPresent() > 0 ||
+		present_ring[PRESENT_PENDING_HEAD] != present_ring[PRESENT_PENDING_TAIL])
+	{
+		present_idle = 0;
+	}
+	else if(++present_idle >= PRESENT_IDLE_TICKS)
+	{
+		presentXchg(&present_state->idle, 1);
+		if(present_ring[PRESENT_PENDING_HEAD] == present_ring[PRESENT_PENDING_TAIL])
+		{
+			return;
 		}
+		/* GDI was faster than idle flag */
+		present_idle = 0;
+		present_state->idle = 0;
 	}
 	
-	return FALSE;
+	present_timer = Set_Global_Time_Out(PRESENT_PERIOD, (DWORD)Present_Timeout_entry, 0);
+}
+
+void __declspec(naked) Present_Timeout_entry()
+{
+	_asm {
+		pushad
+		call Present_Timeout_proc
+		popad
+		retn
+	}
 }
 
 /**
- * Free data allocated by GMRAlloc
+ * Frame buffer dirty scan
  *
+ * Applications writing the frame buffer directly (FBHDA_REQ, DirectDraw
+ * primary without unlock) make no damage, without host traces their
+ * drawing isn't shown. Driver registers linear address of visible screen
+ * (PM16_DIRTY_SCAN) and time-out here reads and clears dirty bits of its
+ * PTEs every DIRTY_PERIOD ms. Runs of dirty pages are sent as full width
+ * scanline bands, same way as async present (FIFO lock, nothing when
+ * host owns part of screen or FIFO hasn't room for all bands, bits are
+ * left for next round then). Page tables are mapped when the screen is
+ * registered, time-out only walks them. Mode size is taken from
+ * userlist, so async present must be running.
  **/
-static BOOL GMRFree(ULONG DataAddr, ULONG GMRAddr, ULONG MobAddr)
+#define DIRTY_PERIOD 16 /* ms */
+#define DIRTY_BANDS  PRESENT_PENDING_MAX
+
+static DWORD dirty_linear = 0;
+static DWORD dirty_timer  = 0;
+
+void Dirty_Timeout_entry();
+
+static void dirtyScan()
 {
-	BOOL ret = FALSE;
+	DWORD runs[DIRTY_BANDS*2];
+	SVGAFifoCmdUpdate bands[DIRTY_BANDS];
+	DWORD w, h, pitch, size, skew, cnt, i;
+	
+	if(presentXchg(present_ul + PRESENT_ULF_LOCK_FIFO, 1) != 0)
+	{
+		return;
+	}
+	
+	w     = present_ul[PRESENT_ULF_WIDTH];
+	h     = present_ul[PRESENT_ULF_HEIGHT];
+	pitch = present_ul[PRESENT_ULF_PITCH];
+	
+	if(w != 0 && h != 0 && pitch != 0 &&
+		present_owned[PRESENT_OWNED_CNT] == 0 && present_owned[PRESENT_OWNED_FENCE] == 0 &&
+		present_ul[PRESENT_ULF_ENABLED] != 0 && devTryLock())
+	{
+		size = pitch * h;
+		skew = dirty_linear & (P_SIZE - 1);
+		cnt  = 0;
+		
+		/* without room for all bands bits are left for next round */
+		if(SVGA_FIFOFree() / sizeof(cb_update_t) >= DIRTY_BANDS)
+		{
+			cnt = WC_DirtyRuns(size, runs, DIRTY_BANDS);
+		}
+		
+		for(i = 0; i < cnt; i++)
+		{
+			DWORD lo = runs[i*2] * P_SIZE;
+			DWORD hi = runs[i*2 + 1] * P_SIZE - skew;
+			
+			lo = lo > skew ? lo - skew : 0;
+			if(hi > size)
+			{
+				hi = size;
+			}
+			
+			bands[i].x      = 0;
+			bands[i].y      = lo / pitch;
+			bands[i].width  = w;
+			bands[i].height = (hi + pitch - 1) / pitch - bands[i].y;
+		}
+		
+		/* all fit to FIFO (checked above), so no dirty bit is lost */
+		if(cnt > 0)
+		{
+			presentAsync(bands, cnt);
+		}
+		devUnlock();
+	}
+	
+	presentXchg(present_ul + PRESENT_ULF_LOCK_FIFO, 0);
+	LockWake();
+}
 
-	if(_PageFree((PVOID)DataAddr, 0) != 0)
+static void __stdcall Dirty_Timeout_proc()
+{
+	dirty_timer = 0;
+	
+	if(dirty_linear == 0 || present_ul == NULL)
 	{
-		ret = TRUE;
+		return;
 	}
 	
-	if(_PageFree((PVOID)GMRAddr, 0) != 0)
+	dirtyScan();
+	dirty_timer = Set_Global_Time_Out(DIRTY_PERIOD, (DWORD)Dirty_Timeout_entry, 0);
+}
+
+void __declspec(naked) Dirty_Timeout_entry()
+{
+	_asm {
+		pushad
+		call Dirty_Timeout_proc
+		popad
+		retn
+	}
+}
+
+/* linear address and size of visible screen, 0 stops scanning */
+static BOOL dirtyScanSet(DWORD linear, DWORD size)
+{
+	/* time-out uses mapped page tables */
+	if(dirty_timer != 0)
 	{
-		ret = TRUE;
+		Cancel_Time_Out(dirty_timer);
+		dirty_timer = 0;
 	}
 	
-	if(MobAddr != 0)
+	dirty_linear = 0;
+	WC_DirtyMap(0, 0);
+	
+	if(linear == 0 || present_ul == NULL)
 	{
-		_PageFree((PVOID)MobAddr, 0);
+		return linear == 0;
 	}
 	
-	return ret;
+	if(!WC_DirtyMap(linear, size))
+	{
+		return FALSE;
+	}
+	dirty_linear = linear;
+	
+	if(dirty_timer == 0)
+	{
+		dirty_timer = Set_Global_Time_Out(DIRTY_PERIOD, (DWORD)Dirty_Timeout_entry, 0);
+	}
+	
+	return TRUE;
 }
 
 /**
- * Allocate OTable for GB objects
+ * Pool of freed regions, regions are allocated in power of 2 size classes,
+ * so free region can be given back on next create without new allocation
+ * and without rebuilding its descriptors.
  **/
-static void AllocateOTable()
+typedef struct _region_pool_t
 {
-	int i;
-	for(i = 0; i < SVGA_OTABLE_DX_MAX; i++)
+	ULONG lAddr;
+	ULONG PPN;
+	ULONG PGBLK;
+	ULONG nPages; /* 0 = free slot */
+} region_pool_t;
+
+static region_pool_t region_pool[REGION_POOL_SLOTS];
+static ULONG region_pool_pages = 0;
+
+/* smallest power of 2 >= nPages */
+static ULONG RegionClass(ULONG nPages)
+{
+	ULONG c = 1;
+	while(c < nPages && c < 0x80000000UL)
+	{
+		c <<= 1;
+	}
+	return c;
+}
+
+/* number of pages described by GMR descriptor list */
+static ULONG RegionPages(ULONG PGBLK)
+{
+	SVGAGuestMemDescriptor *desc = (SVGAGuestMemDescriptor*)PGBLK;
+	ULONG pages = 0;
+	ULONG pgblk_page = 0;
+	
+	for(;;)
 	{
-		otinfo_entry_t *entry = &otable[i];
-		if(entry->size != 0 && (entry->flags & FLAG_ALLOCATED) == 0)
+		if(desc->numPages == 0)
 		{
-			entry->lin = (void*)_PageAllocate(entry->size/PAGE_SIZE, PG_SYS, 0, 0, 0x0, 0x100000, &entry->phy, PAGECONTIG | PAGEUSEALIGN | PAGEFIXED);
-			if(entry->lin)
+			if(desc->ppn == 0)
 			{
-				dbg_printf(dbg_mob_allocate, i);
-				entry->flags |= FLAG_ALLOCATED;
+				break;
 			}
+			/* continuation, descriptor pages are continuous (see GMRAlloc) */
+			pgblk_page++;
+			desc = (SVGAGuestMemDescriptor*)(PGBLK + pgblk_page*P_SIZE);
+			continue;
 		}
+		
+		pages += desc->numPages;
+		desc++;
 	}
+	
+	return pages;
 }
 
-/**
- * Allocate Command Buffers
- **/
-static void AllocateCB()
+/* free largest pooled regions until pool is under the limit */
+static void RegionPoolTrim(ULONG limit)
 {
 	int i;
-	for(i = 0; i < CB_COUNT; i++)
+	int largest;
+	
+	while(region_pool_pages > limit)
 	{
-		if(cmd_bufs[i].phy == 0)
+		largest = -1;
+		for(i = 0; i < REGION_POOL_SLOTS; i++)
 		{
-			cmd_bufs[i].lin = (void *)_PageAllocate((SVGA_CB_MAX_SIZE+PAGE_SIZE-1)/PAGE_SIZE, PG_SYS, 0, 0, 0x0, 0x100000, &(cmd_bufs[i].phy), PAGECONTIG | PAGEUSEALIGN | PAGEFIXED);
-			cmd_bufs[i].status = CB_STATUS_EMPTY;
+			if(region_pool[i].nPages != 0 &&
+				(largest < 0 || region_pool[i].nPages > region_pool[largest].nPages))
+			{
+				largest = i;
+			}
+		}
+		
+		if(largest < 0)
+		{
+			region_pool_pages = 0;
+			break;
 		}
+		
+		GMRFree(region_pool[largest].lAddr, region_pool[largest].PGBLK, 0);
+		region_pool_pages -= region_pool[largest].nPages;
+		region_pool[largest].nPages = 0;
 	}
 }
 
 /**
- * Test if selected CB is not used
+ * Staging regions are allocated on first request and never freed, so
+ * uploads don't pay for allocation and descriptor build every time.
  **/
-static BOOL isCBfree(int index)
+typedef struct _staging_t
 {
-	switch(cmd_bufs[index].status)
+	ULONG lAddr;
+	ULONG PPN;
+	ULONG PGBLK; /* 0 = not allocated */
+} staging_t;
+
+static staging_t staging[STAGING_COUNT];
+
+static BOOL GetStaging(ULONG index, staging_t **out)
+{
+	if(index >= STAGING_COUNT)
 	{
-		case CB_STATUS_EMPTY:
-			return TRUE;
-		case CB_STATUS_PROCESS:
+		return FALSE;
+	}
+	
+	if(staging[index].PGBLK == 0)
+	{
+		if(!GMRAlloc(STAGING_PAGES, &staging[index].lAddr, &staging[index].PGBLK, &staging[index].PPN, NULL, NULL, NULL))
 		{
-			SVGACBHeader *cb = (SVGACBHeader *)cmd_bufs[index].lin;
-			if(cb->status > SVGA_CB_STATUS_NONE)
-			{
-				return TRUE;
-			}
-			break;
+			staging[index].PGBLK = 0;
+			return FALSE;
 		}
 	}
 	
-	return FALSE;
+	*out = &staging[index];
+	return TRUE;
 }
 
 /**
- * Increment 64-bit ID of CB segment
+ * PM16 driver RING0 calls
  **/
-static void nextID_CB()
+BOOL CreateRegion(unsigned int nPages, ULONG *lpLAddr, ULONG *lpPPN, ULONG *lpPGBLK)
 {
-	_asm
+	int i;
+	int best = -1;
+	ULONG cls = RegionClass(nPages);
+	
+	SVGA_TraceEvent(TRACE_REGION_CREATE, nPages);
+	
+	/* smallest pooled region in nPages..class */
+	for(i = 0; i < REGION_POOL_SLOTS; i++)
 	{
-		inc dword ptr [cmd_buf_next_id]
-		adc dword ptr [cmd_buf_next_id+4], 0
+		if(region_pool[i].nPages >= nPages && region_pool[i].nPages <= cls)
+		{
+			if(best < 0 || region_pool[i].nPages < region_pool[best].nPages)
+			{
+				best = i;
+			}
+		}
+	}
+	
+	if(best >= 0)
+	{
+		*lpLAddr = region_pool[best].lAddr;
+		*lpPPN   = region_pool[best].PPN;
+		*lpPGBLK = region_pool[best].PGBLK;
+		region_pool_pages -= region_pool[best].nPages;
+		region_pool[best].nPages = 0;
+		return TRUE;
+	}
+	
+	if(GMRAlloc(cls, lpLAddr, lpPGBLK, lpPPN, NULL, NULL, NULL))
+	{
+		return TRUE;
 	}
+	
+	/* memory is low: return pooled memory to system and don't round size */
+	RegionPoolTrim(0);
+	return GMRAlloc(nPages, lpLAddr, lpPGBLK, lpPPN, NULL, NULL, NULL);
 }
 
-/**
- * Lock one of buffers and return ptr for RING-3
- **/
-static void *LockCB()
+BOOL FreeRegion(ULONG LAddr, ULONG PGBLK, ULONG MobAddr)
 {
-	int index;
-	for(index = 0; index < CB_COUNT; index++)
+	int i;
+	ULONG nPages;
+	
+	SVGA_TraceEvent(TRACE_REGION_FREE, LAddr);
+	
+	if(MobAddr == 0 && PGBLK != 0)
 	{
-		if(isCBfree(index))
+		nPages = RegionPages(PGBLK);
+		if(nPages != 0 && nPages <= REGION_POOL_MAX_PAGES)
 		{
-#ifdef DBGPRINT
+			for(i = 0; i < REGION_POOL_SLOTS; i++)
 			{
-				SVGACBHeader *cb = (SVGACBHeader *)cmd_bufs[index].lin;
-				if(cb->status > 1)
+				if(region_pool[i].nPages == 0)
 				{
-					dbg_printf(dbg_lockcb, index, cb->status);
+					region_pool[i].lAddr  = LAddr;
+					region_pool[i].PGBLK  = PGBLK;
+					region_pool[i].PPN    = getPPN(PGBLK);
+					region_pool[i].nPages = nPages;
+					region_pool_pages += nPages;
 					
-					if(cb->status == SVGA_CB_STATUS_COMMAND_ERROR)
+					/* over high watermark: trim to half */
+					if(region_pool_pages > REGION_POOL_MAX_PAGES)
 					{
-						DWORD *ptr = (DWORD*)(((unsigned char*)cmd_bufs[index].lin) + sizeof(SVGACBHeader) + cb->errorOffset);
-						dbg_printf(dbg_lockcb_lasterr, *ptr);
+						RegionPoolTrim(REGION_POOL_MAX_PAGES/2);
 					}
-					
+					return TRUE;
 				}
 			}
-#endif
-			cmd_bufs[index].status = CB_STATUS_LOCKED;
-			return cmd_bufs[index].lin;
 		}
 	}
 	
-	return NULL;
+	return GMRFree(LAddr, PGBLK, MobAddr);
 }
 
 /**
- * Submit CB to GPU.
- * If length is 0, buffer not executed
- * cbctx_id = SVGA_CB_CONTEXT_0,...
+ * Resources owned by user space handles
+ *
+ * Regions from SVGA_REGION_CREATE and buffers from SVGA_CB_LOCK are
+ * recorded with DIOC tagProcess and hDevice, DIOC_CLOSEHANDLE (also
+ * sent when process crashes) returns the rest of them: locked CBs are
+ * marked empty, GMRs are unbound and memory goes to region pool
+ * (FreeRegion) after host completed all previous work. Regions of
+ * user memory (SVGA_REGION_USER) are unlocked instead, memory belongs
+ * to application.
  **/
+#define DIOC_REGIONS_MAX 512
 
-static BOOL submitCB(void *ptr, DWORD cbctx_id)
+typedef struct _dioc_region_t
 {
-	int index;
-	
-	/* context 0 is turned on and of by driver and if it is off don't use it! */
-	if(cb_context0 == FALSE && cbctx_id == SVGA_CB_CONTEXT_0)
-	{
-		return FALSE;
-	}
-	
-	for(index = 0; index < CB_COUNT; index++)
+	DWORD owner;   /* tagProcess, 0 = free slot */
+	DWORD handle;  /* hDevice */
+	DWORD id;      /* GMR id, 0 = not bound */
+	DWORD lAddr;
+	DWORD PGBLK;
+	DWORD MobAddr;
+	DWORD userSize; /* locked user memory in bytes, 0 = memory from GMRAlloc */
+} dioc_region_t;
+
+static dioc_region_t dioc_regions[DIOC_REGIONS_MAX];
+
+static BOOL diocRegionAdd(struct DIOCParams *params, DWORD id, DWORD lAddr, DWORD PGBLK, DWORD MobAddr, DWORD userSize)
+{
+	DWORD i;
+	for(i = 0; i < DIOC_REGIONS_MAX; i++)
 	{
-		if(cmd_bufs[index].lin == ptr)
+		if(dioc_regions[i].owner == 0)
 		{
-			SVGACBHeader *cb = (SVGACBHeader *)cmd_bufs[index].lin;
-			if(cb->length > 0)
-			{
-				cb->status = SVGA_CB_STATUS_NONE;
-				cb->ptr.pa.hi   = 0;
-				cb->ptr.pa.low  = cmd_bufs[index].phy + sizeof(SVGACBHeader);
-				cb->flags |= SVGA_CB_FLAG_NO_IRQ;
-				cb->id.low = cmd_buf_next_id.low;
-				cb->id.hi  = cmd_buf_next_id.hi;
-				
-				SVGA_WriteReg(SVGA_REG_COMMAND_HIGH, 0); // high part of 64-bit memory address...
-				SVGA_WriteReg(SVGA_REG_COMMAND_LOW, cmd_bufs[index].phy | cbctx_id);
-				cmd_bufs[index].status = CB_STATUS_PROCESS;
-				
-				//dbg_printf(dbg_submitcb, cbctx_id);
-				
-				nextID_CB();
-			}
-			else
-			{
-				cmd_bufs[index].status = CB_STATUS_EMPTY;
-			}
-			
+			dioc_regions[i].owner    = params->tagProcess;
+			dioc_regions[i].handle   = params->hDevice;
+			dioc_regions[i].id       = id;
+			dioc_regions[i].lAddr    = lAddr;
+			dioc_regions[i].PGBLK    = PGBLK;
+			dioc_regions[i].MobAddr  = MobAddr;
+			dioc_regions[i].userSize = userSize;
 			return TRUE;
 		}
 	}
-	
-	dbg_printf(dbg_submitcb_fail);
-	
+	/* table is full, region stays untracked (lives until free or reboot) */
 	return FALSE;
 }
 
-/**
- * Wait until all CB are completed
- **/
-static void syncCB()
+/* locked user size of removed region, 0 when it's allocated memory (or untracked) */
+static DWORD diocRegionRemove(DWORD lAddr)
 {
-	int index;
-	BOOL synced;
-	do
+	DWORD i;
+	for(i = 0; i < DIOC_REGIONS_MAX; i++)
 	{
-		synced = TRUE;
-		for(index = 0; index < CB_COUNT; index++)
-		{
-			switch(cmd_bufs[index].status)
-			{
-				case CB_STATUS_EMPTY:
-				case CB_STATUS_LOCKED:
-					break;
-				case CB_STATUS_PROCESS:
-				{
-					SVGACBHeader *cb = (SVGACBHeader *)cmd_bufs[index].lin;
-					if(cb->status == SVGA_CB_STATUS_NONE)
-					{
-						synced = FALSE;
-					}
-					break;
-				}
-			}
-		}
-		
-		if(!synced)
+		if(dioc_regions[i].owner != 0 && dioc_regions[i].lAddr == lAddr)
 		{
-			SVGA_WriteReg(SVGA_REG_SYNC, 1);
+			dioc_regions[i].owner = 0;
+			return dioc_regions[i].userSize;
 		}
-	} while(!synced);
+	}
+	return 0;
 }
 
-/**
- * PM16 driver RING0 calls
- **/
-BOOL CreateRegion(unsigned int nPages, ULONG *lpLAddr, ULONG *lpPPN, ULONG *lpPGBLK)
-{	
-	return GMRAlloc(nPages, lpLAddr, lpPGBLK, lpPPN, NULL, NULL);
+/* give back memory of unbound region */
+static BOOL RegionRelease(DWORD lAddr, DWORD PGBLK, DWORD MobAddr, DWORD userSize)
+{
+	if(userSize != 0)
+	{
+		if(MobAddr != 0)
+		{
+			_PageFree((PVOID)MobAddr, 0);
+		}
+		GMRUnlock(lAddr, userSize, PGBLK);
+		return TRUE;
+	}
+	
+	return FreeRegion(lAddr, PGBLK, MobAddr);
 }
 
-BOOL FreeRegion(ULONG LAddr, ULONG PGBLK, ULONG MobAddr)
+static void diocCBOwner(void *ptr, struct DIOCParams *params)
 {
-	return GMRFree(LAddr, PGBLK, MobAddr);
+	int i;
+	
+	devLock();
+	for(i = 0; i < CB_COUNT; i++)
+	{
+		if(cmd_bufs[i].lin == ptr)
+		{
+			cmd_bufs[i].owner  = params->tagProcess;
+			cmd_bufs[i].handle = params->hDevice;
+			break;
+		}
+	}
+	devUnlock();
 }
 
-/* some CRT */
-void memset(void *dst, int c, unsigned int size)
+static void diocRelease(struct DIOCParams *params)
 {
-	unsigned int par;
-	unsigned int i;
-	unsigned int dw_count;
-	unsigned int dw_size;
+	DWORD i;
+	DWORD regions = 0;
+	DWORD cbs = 0;
+	BOOL synced = FALSE;
+	
+	if(params->tagProcess == 0)
+	{
+		return;
+	}
+	
+	if(cb_support && cb_allocated)
+	{
+		/* buffers which process already queued are submitted as usual */
+		drainCBRing(TRUE);
+		
+		devLock();
+		for(i = 0; i < CB_COUNT; i++)
+		{
+			if(cmd_bufs[i].status == CB_STATUS_LOCKED &&
+				cmd_bufs[i].owner == params->tagProcess && cmd_bufs[i].handle == params->hDevice)
+			{
+				cmd_bufs[i].status = CB_STATUS_EMPTY;
+				cmd_bufs[i].owner  = 0;
+				cbs++;
+			}
+		}
+		devUnlock();
+	}
 	
-	c &= 0xFF;
-	par = (c << 24) | (c << 16) | (c << 8) | c;
-	dw_count = size >> 2;
-	dw_size = size & 0xFFFFFFFCUL;
+	for(i = 0; i < DIOC_REGIONS_MAX; i++)
+	{
+		dioc_region_t *r = &dioc_regions[i];
+		if(r->owner != params->tagProcess || r->handle != params->hDevice)
+		{
+			continue;
+		}
+		
+		if(!synced)
+		{
+			/* host may still read regions from submitted commands */
+			if(cb_support && cb_allocated)
+			{
+				syncCB();
+			}
+			SVGA_Flush();
+			synced = TRUE;
+		}
+		
+		if(r->id != 0)
+		{
+			SVGA_WriteReg(SVGA_REG_GMR_ID, r->id);
+			SVGA_WriteReg(SVGA_REG_GMR_DESCRIPTOR, 0);
+		}
+		
+		RegionRelease(r->lAddr, r->PGBLK, r->MobAddr, r->userSize);
+		r->owner = 0;
+		regions++;
+	}
 	
-	for(i = 0; i < dw_count; i++)
+	if(synced)
 	{
-		((unsigned int*)dst)[i] = par; 
+		SVGA_Flush();
 	}
 	
-	for(i = dw_size; i < size; i++)
+	if(regions != 0 || cbs != 0)
 	{
-		((unsigned char*)dst)[i] = c; 
+		dbg_printf(dbg_dic_release, regions, cbs);
 	}
 }
 
-
 #if 0
 /* I'm using this sometimes for developing, not for end user! */
 BOOL AllocPhysical(DWORD nPages, DWORD *outLinear, DWORD *outPhysical)
@@ -851,6 +3307,203 @@ WORD __stdcall VMWS_API_Proc(PCRS_32 state)
 			}
 			break;			
 		}
+		/* lock memory = input: ESI - lin. address, ECX - size; output: ECX - PPN of descriptor, EBX - lin. address of descriptor */
+		case VMWSVXD_PM16_LOCK_REGION:
+		{
+			ULONG PPN;
+			ULONG PGBLK;
+			
+			if(GMRLock(state->Client_ESI, state->Client_ECX, &PGBLK, &PPN))
+			{
+				state->Client_ECX = PPN;
+				state->Client_EBX = PGBLK;
+				rc = 1;
+			}
+			else
+			{
+				state->Client_ECX = 0;
+				state->Client_EBX = 0;
+				rc = 0;
+			}
+			break;
+		}
+		/* unlock memory = input: ESI - lin. address, ECX - size, EBX - lin. address of descriptor */
+		case VMWSVXD_PM16_UNLOCK_REGION:
+			GMRUnlock(state->Client_ESI, state->Client_ECX, state->Client_EBX);
+			rc = 1;
+			break;
+		/*
+		 * activate object table = input: ECX - table id; output: ECX - physical
+		 * address, EBX - size; rc = 1 when caller have to set table base to device,
+		 * rc = 2 when table is already active
+		 */
+		case VMWSVXD_PM16_OTABLE_ACTIVATE:
+		{
+			ULONG id = state->Client_ECX;
+			rc = 0;
+			if(gb_support && AllocateOTable(id))
+			{
+				state->Client_ECX = otable[id].phy;
+				state->Client_EBX = otable[id].size;
+				if(otable[id].flags & FLAG_ACTIVE)
+				{
+					rc = 2;
+				}
+				else
+				{
+					memset(otable[id].lin, 0, otable[id].size);
+					otable[id].flags |= FLAG_ACTIVE;
+					rc = 1;
+				}
+			}
+			break;
+		}
+		/*
+		 * staging region = input: ECX - index; output: EDX - lin. address,
+		 * ECX - PPN of descriptor, EBX - number of pages; rc = 0 when
+		 * index is out of ring or memory is low
+		 */
+		case VMWSVXD_PM16_STAGING:
+		{
+			staging_t *st;
+			
+			if(GetStaging(state->Client_ECX, &st))
+			{
+				state->Client_EDX = st->lAddr;
+				state->Client_ECX = st->PPN;
+				state->Client_EBX = STAGING_PAGES;
+				rc = 1;
+			}
+			else
+			{
+				state->Client_EDX = 0;
+				state->Client_ECX = 0;
+				state->Client_EBX = 0;
+				rc = 0;
+			}
+			break;
+		}
+		/* mirror passed fences to dword on linear address ESI (0 = stop) */
+		case VMWSVXD_PM16_FENCE_MIRROR:
+			gSVGAFenceMirror = (volatile uint32 *)state->Client_ESI;
+			rc = 1;
+			break;
+		/* sleep until some userlist lock is released (or time-out) */
+		case VMWSVXD_PM16_LOCK_WAIT:
+			LockWait();
+			rc = 1;
+			break;
+		/* userlist lock was released and someone is waiting for it */
+		case VMWSVXD_PM16_LOCK_WAKE:
+			LockWake();
+			rc = 1;
+			break;
+		/* fill memory on linear address (EDI) by value (BL), size is in ECX */
+		case VMWSVXD_PM16_MEMSET:
+			memset((void*)state->Client_EDI, state->Client_EBX & 0xFF, state->Client_ECX);
+			rc = 1;
+			break;
+		/* copy ECX bytes from ESI to EDI, both are linear addresses */
+		case VMWSVXD_PM16_MEMCPY:
+			memcpy((void*)state->Client_EDI, (void*)state->Client_ESI, state->Client_ECX);
+			rc = 1;
+			break;
+		/* same as MEMCPY but areas can overlap */
+		case VMWSVXD_PM16_MEMMOVE:
+			memmove((void*)state->Client_EDI, (void*)state->Client_ESI, state->Client_ECX);
+			rc = 1;
+			break;
+		/* set write combining for framebuffer: ESI = linear, EDI = physical address, ECX = size */
+		case VMWSVXD_PM16_FB_WC:
+			rc = WC_Enable(state->Client_ESI, state->Client_EDI, state->Client_ECX) ? 1 : 0;
+			break;
+		/* set ECX to system time in ms (present pacing) */
+		case VMWSVXD_PM16_GET_TIME:
+			state->Client_ECX = Get_System_Time();
+			rc = 1;
+			break;
+		/*
+		 * start async present = input: ESI - userlist lin. address, ECX - userlist
+		 * size, EDI - lin. address of pending update ring, EBX - lin. address
+		 * of owned regions; output: ECX - lin. address of present_state_t.
+		 * ESI = 0 stops the worker.
+		 */
+		case VMWSVXD_PM16_PRESENT_START:
+			rc = 0;
+			if(presentStart(state->Client_ESI, state->Client_ECX, state->Client_EDI, state->Client_EBX))
+			{
+				state->Client_ECX = (DWORD)present_state;
+				rc = 1;
+			}
+			else
+			{
+				state->Client_ECX = 0;
+			}
+			break;
+		/* send screen updates = input: ESI - lin. address of rects (left, top, right, bottom), ECX - count */
+		case VMWSVXD_PM16_UPDATE_RECTS:
+			presentRects((const LONG *)state->Client_ESI, state->Client_ECX);
+			rc = 1;
+			break;
+		/* output: ECX - lin. address of trace_ring_t (or 0) */
+		case VMWSVXD_PM16_TRACE_RING:
+			state->Client_ECX = (DWORD)trace_ring;
+			rc = trace_ring != NULL ? 1 : 0;
+			break;
+		/* virtual vblank = input: ECX - refresh rate in Hz (0 = off), EBX - visible lines */
+		case VMWSVXD_PM16_VBLANK_SET:
+			VBlankSet(state->Client_ECX, state->Client_EBX);
+			rc = 1;
+			break;
+		/* sparse userlist section = input: ECX - section, EBX - lin. address of directory, ESI - pages, EDI - IDs per page */
+		case VMWSVXD_PM16_UL_SPARSE:
+			rc = ULSparse(state->Client_ECX, state->Client_EBX, state->Client_ESI, state->Client_EDI) ? 1 : 0;
+			break;
+		/* frame buffer dirty scan = input: ESI - lin. address of visible screen, 0 stops it, ECX - size (needs async present) */
+		case VMWSVXD_PM16_DIRTY_SCAN:
+			rc = dirtyScanSet(state->Client_ESI, state->Client_ECX) ? 1 : 0;
+			break;
+		/*
+		 * 2D submission path = input: ECX - PRESENT_PATH_*; output: ECX - path
+		 * in use, EBX - FIFO, EDX - CB cost of update (0 = not measured)
+		 */
+		case VMWSVXD_PM16_PRESENT_PATH:
+		{
+			DWORD fifo_cost;
+			DWORD cb_cost;
+			
+			state->Client_ECX = presentPath(state->Client_ECX, &fifo_cost, &cb_cost);
+			state->Client_EBX = fifo_cost;
+			state->Client_EDX = cb_cost;
+			rc = 1;
+			break;
+		}
+		/* output: ECX - lin. address of device lock counter (see devLock) */
+		case VMWSVXD_PM16_DEV_LOCK:
+			state->Client_ECX = (DWORD)dev_lock;
+			rc = dev_lock != NULL ? 1 : 0;
+			break;
+		/* output: ECX - lin. address of driver dbg_ring_t (DBGPRINT builds only) */
+		case VMWSVXD_PM16_DBG_RING:
+			state->Client_ECX = 0;
+			rc = 0;
+#ifdef DBGPRINT
+			if(dbg_rings != NULL)
+			{
+				state->Client_ECX = (DWORD)&dbg_rings[1];
+				rc = 1;
+			}
+#endif
+			break;
+		/* pending ring isn't empty and worker was idle */
+		case VMWSVXD_PM16_PRESENT_KICK:
+			rc = 0;
+			if(present_ul != NULL)
+			{
+				startPresent();
+				rc = 1;
+			}
+			break;
 		/* clear memory on linear address (ESI) by defined size (ECX) */
 		case VMWSVXD_PM16_ZEROMEM:
 		{
@@ -875,10 +3528,12 @@ WORD __stdcall VMWS_API_Proc(PCRS_32 state)
 			if(cb_support)
 			{
 				cb_enable_t *cbe;
-				do
+				if(!cb_allocated)
 				{
-					cbe = LockCB();
-				} while(cbe == NULL);
+					AllocateCB();
+					AllocateCBRing();
+				}
+				cbe = LockCBWait();
 				memset(cbe, 0, sizeof(cb_enable_t));
 				cbe->cbheader.length = sizeof(SVGADCCmdStartStop) + sizeof(uint32);
 				cbe->cmd = SVGA_DC_CMD_START_STOP_CONTEXT;
@@ -893,16 +3548,14 @@ WORD __stdcall VMWS_API_Proc(PCRS_32 state)
 			rc = 1;
 			break;
 		case VMWSVXD_PM16_CB_STOP:
-			if(cb_support)
+			/* without buffers context was never started */
+			if(cb_support && cb_allocated)
 			{
 				cb_enable_t *cbe;
 				cb_context0 = FALSE;
 				
 				syncCB();
-				do
-				{
-					cbe = LockCB();
-				} while(cbe == NULL);
+				cbe = LockCBWait();
 				memset(cbe, 0, sizeof(cb_enable_t));
 				cbe->cbheader.length = sizeof(SVGADCCmdStartStop) + sizeof(uint32);
 				cbe->cmd = SVGA_DC_CMD_START_STOP_CONTEXT;
@@ -961,29 +3614,44 @@ void Device_Init_proc()
 	
 	// VMMCall _Allocate_Device_CB_Area
 	
+	traceInit();
+	devLockInit();
+#ifdef DBGPRINT
+	dbgRingsInit();
+#endif
+	
 	if(SVGA_Init(FALSE) == 0)
 	{
 		dbg_printf(dbg_Device_Init_proc_succ);
 		svga_init_success = TRUE;
 			
+		if(SVGA_ReadReg(SVGA_REG_CAPABILITIES) & (SVGA_CAP_COMMAND_BUFFERS | SVGA_CAP_CMD_BUFFERS_2))
+		{
+			cb_support = TRUE;
+			dbg_printf(dbg_cb_on);
+		}
+		
+		/* after cb_support, table growing depends on it */
 		if(SVGA_ReadReg(SVGA_REG_CAPABILITIES) & SVGA_CAP_GBOBJECTS)
 		{
-			AllocateOTable();
+			SizeOTable();
 			gb_support = TRUE;
 			dbg_printf(dbg_gb_on);
 		}
 		
-		if(SVGA_ReadReg(SVGA_REG_CAPABILITIES) & (SVGA_CAP_COMMAND_BUFFERS | SVGA_CAP_CMD_BUFFERS_2))
+		if(gSVGA.capabilities & SVGA_CAP_IRQMASK)
 		{
-			AllocateCB();
-			cb_support = TRUE;
-			dbg_printf(dbg_cb_on);
+			IRQ_Init();
 		}
 			
 		VDD_Get_Mini_Dispatch_Table();
 		if(DispatchTableLength >= 0x31)
 		{
 			#include "minivdd_func.h"
+			
+			/* LFB can be smaller than VRAM, VESA can use only LFB */
+			MiniVDD_HiresInit(DispatchTable, gSVGA.fbPhy,
+				gSVGA.fbSize < gSVGA.vramSize ? gSVGA.fbSize : gSVGA.vramSize);
 		}
 	}
 }
@@ -995,14 +3663,90 @@ DWORD __stdcall Device_IO_Control_entry(struct DIOCParams *params)
 	switch(params->dwIoControlCode)
 	{
 		case DIOC_OPEN:
+			dbg_printf(dbg_dic_system, params->dwIoControlCode);
+			return 0;
 		case DIOC_CLOSEHANDLE:
 			dbg_printf(dbg_dic_system, params->dwIoControlCode);
+			diocRelease(params);
 			return 0;
 		case SVGA_SYNC:
 			SVGA_Flush();
 			return 0;
 		case SVGA_RING:
-			SVGA_WriteReg(SVGA_REG_SYNC, 1);
+			SVGA_RingDoorbell();
+			return 0;
+		/* same as VMWSVXD_PM16_LOCK_WAIT/WAKE for user space */
+		case SVGA_LOCK_WAIT:
+			LockWait();
+			return 0;
+		case SVGA_LOCK_WAKE:
+			LockWake();
+			return 0;
+		/* output: copy of trace_ring_t (truncated to cbOutBuffer) */
+		case SVGA_TRACE_SNAPSHOT:
+		{
+			DWORD size = sizeof(trace_ring_t);
+			if(trace_ring == NULL || params->lpOutBuffer == 0)
+			{
+				return 1;
+			}
+			
+			if(params->cbOutBuffer < size)
+			{
+				size = params->cbOutBuffer;
+			}
+			memcpy((void*)params->lpOutBuffer, trace_ring, size);
+			
+			if(params->lpcbBytesReturned != 0)
+			{
+				*((DWORD*)params->lpcbBytesReturned) = size;
+			}
+			return 0;
+		}
+		/* input: DWORD section (UL_SECTION_*), DWORD id; output: DWORD lin. address of page with slot */
+		case SVGA_UL_COMMIT:
+		{
+			DWORD lin;
+			if(params->lpInBuffer == 0 || params->cbInBuffer < 2*sizeof(DWORD) ||
+				params->lpOutBuffer == 0 || params->cbOutBuffer < sizeof(DWORD))
+			{
+				return 1;
+			}
+			
+			lin = ULCommit(((DWORD*)params->lpInBuffer)[0], ((DWORD*)params->lpInBuffer)[1]);
+			if(lin == 0)
+			{
+				return 1;
+			}
+			
+			((DWORD*)params->lpOutBuffer)[0] = lin;
+			if(params->lpcbBytesReturned != 0)
+			{
+				*((DWORD*)params->lpcbBytesReturned) = sizeof(DWORD);
+			}
+			return 0;
+		}
+		/* input: DWORD flags (VBLANK_WAIT_*), sleeps until vblank edge */
+		case SVGA_VBLANK_WAIT:
+			if(params->lpInBuffer == 0 || params->cbInBuffer < sizeof(DWORD))
+			{
+				return 1;
+			}
+			return VBlankWait(((DWORD*)params->lpInBuffer)[0]) ? 0 : 1;
+		/* output: vblank_status_t */
+		case SVGA_VBLANK_STATUS:
+			if(params->lpOutBuffer == 0 || params->cbOutBuffer < sizeof(vblank_status_t))
+			{
+				return 1;
+			}
+			if(!VBlankStatus((vblank_status_t*)params->lpOutBuffer))
+			{
+				return 1;
+			}
+			if(params->lpcbBytesReturned != 0)
+			{
+				*((DWORD*)params->lpcbBytesReturned) = sizeof(vblank_status_t);
+			}
 			return 0;
 #if 0
 		case SVGA_ALLOCPHY:
@@ -1041,6 +3785,7 @@ DWORD __stdcall Device_IO_Control_entry(struct DIOCParams *params)
 			
 			if(id < SVGA_OTABLE_DX_MAX)
 			{
+				AllocateOTable(id);
 				out[0] = (DWORD)otable[id].lin;
 				out[1] = otable[id].phy;
 				out[2] = otable[id].size;
@@ -1049,6 +3794,30 @@ DWORD __stdcall Device_IO_Control_entry(struct DIOCParams *params)
 			}
 			return 1;
 		}
+		/* input:
+		    - id
+		    - number of IDs which table must hold
+		   output (same as SVGA_OTABLE_QUERY):
+		    - linear
+		    - physical
+		    - size
+		    - flags
+		 */
+		case SVGA_OTABLE_GROW:
+		{
+			DWORD   id = ((DWORD*)params->lpInBuffer)[0];
+			DWORD  ids = ((DWORD*)params->lpInBuffer)[1];
+			DWORD *out = (DWORD*)params->lpOutBuffer;
+			
+			if(!gb_support || !GrowOTable(id, ids))
+				return 1;
+			
+			out[0] = (DWORD)otable[id].lin;
+			out[1] = otable[id].phy;
+			out[2] = otable[id].size;
+			out[3] = otable[id].flags;
+			return 0;
+		}
 		/* input:
 		   - id
 		   - new flags
@@ -1069,16 +3838,42 @@ DWORD __stdcall Device_IO_Control_entry(struct DIOCParams *params)
 			return 1;
 		}
 		/*
-		 input:
+		 input (optional):
+		  - flags (CB_LOCK_WAIT)
 		 output:
-		  - linear address of buffer
+		  - linear address of buffer (NULL if all buffers are busy)
 		 */
 		case SVGA_CB_LOCK:
 		{
 			if(cb_support)
 			{
 				DWORD *out = (DWORD*)params->lpOutBuffer;
-				out[0] = (DWORD)LockCB();
+				DWORD flags = 0;
+				
+				if(!cb_allocated)
+				{
+					AllocateCB();
+					AllocateCBRing();
+				}
+				
+				if(params->lpInBuffer != 0 && params->cbInBuffer >= sizeof(DWORD))
+				{
+					flags = ((DWORD*)params->lpInBuffer)[0];
+				}
+				
+				if(flags & CB_LOCK_WAIT)
+				{
+					out[0] = (DWORD)LockCBWait();
+				}
+				else
+				{
+					out[0] = (DWORD)LockCB();
+				}
+				
+				if(out[0] != 0)
+				{
+					diocCBOwner((void*)out[0], params);
+				}
 				return 0;
 			}
 			return 1;
@@ -1095,6 +3890,9 @@ DWORD __stdcall Device_IO_Control_entry(struct DIOCParams *params)
 			{
 				DWORD *in = (DWORD*)params->lpInBuffer;
 				
+				/* keep order with buffers in shared ring */
+				drainCBRing(TRUE);
+				
 				if(submitCB((void*)in[0], in[1]))
 				{
 					return 0;
@@ -1108,10 +3906,43 @@ DWORD __stdcall Device_IO_Control_entry(struct DIOCParams *params)
 		case SVGA_CB_SYNC:
 			if(cb_support)
 			{
+				drainCBRing(TRUE);
 				syncCB();
 				return 0;
 			}
 			return 1;
+		/*
+		 input:
+		 output:
+		  - linear address of shared submission ring (cb_ring_t)
+		 */
+		case SVGA_CB_RING:
+		{
+			if(cb_support && !cb_allocated)
+			{
+				AllocateCB();
+				AllocateCBRing();
+			}
+			
+			if(cb_support && cb_ring != NULL)
+			{
+				DWORD *out = (DWORD*)params->lpOutBuffer;
+				out[0] = (DWORD)cb_ring;
+				return 0;
+			}
+			return 1;
+		}
+		/*
+		 doorbell: submit shared ring entries and start the ring time-out
+		*/
+		case SVGA_CB_KICK:
+			if(cb_support && cb_ring != NULL)
+			{
+				drainCBRing(TRUE);
+				startCBRing();
+				return 0;
+			}
+			return 1;
 		/*
 		 input:
 			- region id
@@ -1122,16 +3953,24 @@ DWORD __stdcall Device_IO_Control_entry(struct DIOCParams *params)
 			- page block
 			- mob page address
 			- mob ppn
+			- mob format (SVGA3D_MOBFMT_*), only when output has room for it,
+			  otherwise MOB of non-contiguous memory has always depth 2
 		*/
 		case SVGA_REGION_CREATE:
 		{
   		DWORD *lpIn  = (DWORD*)params->lpInBuffer;
   		DWORD *lpOut = (DWORD*)params->lpOutBuffer;
   		DWORD gmrPPN = 0;
+  		ULONG *lpMobFmt = NULL;
   		
   		dbg_printf(dbg_region_info_1, lpIn[0]);
   		
-			if(GMRAlloc(lpIn[1], &lpOut[1], &lpOut[2], &gmrPPN, &lpOut[3], &lpOut[4]))
+  		if(params->cbOutBuffer >= 6*sizeof(DWORD))
+  		{
+  			lpMobFmt = &lpOut[5];
+  		}
+  		
+			if(GMRAlloc(lpIn[1], &lpOut[1], &lpOut[2], &gmrPPN, &lpOut[3], &lpOut[4], lpMobFmt))
 			{
 				if(lpIn[0] != 0)
 				{
@@ -1145,6 +3984,7 @@ DWORD __stdcall Device_IO_Control_entry(struct DIOCParams *params)
 		    	
 		    	lpOut[0] = lpIn[0]; // copy GMR ID
 				}
+				diocRegionAdd(params, lpIn[0], lpOut[1], lpOut[2], lpOut[3], 0);
 				return 0;
 			}
 			else
@@ -1154,6 +3994,78 @@ DWORD __stdcall Device_IO_Control_entry(struct DIOCParams *params)
   		
   		return 1;
 		}
+		/*
+		 region of application memory, pages are locked until SVGA_REGION_FREE
+		 (or handle close), host reads and writes the buffer directly
+		 input:
+			- region id
+			- user linear address (any alignment)
+			- size in bytes
+		 output: same as SVGA_REGION_CREATE, user page address is
+		 address rounded down to page, it's the address for SVGA_REGION_FREE
+		*/
+		case SVGA_REGION_USER:
+		{
+			DWORD *lpIn  = (DWORD*)params->lpInBuffer;
+			DWORD *lpOut = (DWORD*)params->lpOutBuffer;
+			DWORD page   = lpIn[1] & ~(P_SIZE - 1);
+			DWORD size   = lpIn[1] + lpIn[2] - page;
+			DWORD nPages = (size + P_SIZE - 1) / P_SIZE;
+			DWORD gmrPPN = 0;
+			DWORD pgblk  = 0;
+			DWORD mob    = 0;
+			ULONG mobFmt = SVGA3D_MOBFMT_PTDEPTH_0;
+			ULONG mobPPN;
+			
+			dbg_printf(dbg_region_info_1, lpIn[0]);
+			
+			if(lpIn[2] == 0 || !GMRLock(page, size, &pgblk, &gmrPPN))
+			{
+				dbg_printf(dbg_region_err);
+				return 1;
+			}
+			
+			if(nPages == 1)
+			{
+				mobPPN = getPPN(page);
+			}
+			else if(!MOBDescribe(page, nPages, &mob, &mobPPN, params->cbOutBuffer >= 6*sizeof(DWORD) ? &mobFmt : NULL))
+			{
+				GMRUnlock(page, size, pgblk);
+				dbg_printf(dbg_region_err);
+				return 1;
+			}
+			
+			/* untracked region would stay locked after process exit */
+			if(!diocRegionAdd(params, lpIn[0], page, pgblk, mob, size))
+			{
+				RegionRelease(page, pgblk, mob, size);
+				dbg_printf(dbg_region_err);
+				return 1;
+			}
+			
+			if(lpIn[0] != 0)
+			{
+				SVGA_WriteReg(SVGA_REG_GMR_ID, lpIn[0]);
+				SVGA_WriteReg(SVGA_REG_GMR_DESCRIPTOR, gmrPPN);
+				
+				dbg_printf(dbg_region_info_2, page, gmrPPN, pgblk);
+				
+				/* refresh all register, so make sure that new commands will accepts this region */
+				SVGA_Flush();
+			}
+			
+			lpOut[0] = lpIn[0];
+			lpOut[1] = page;
+			lpOut[2] = pgblk;
+			lpOut[3] = mob;
+			lpOut[4] = mobPPN;
+			if(params->cbOutBuffer >= 6*sizeof(DWORD))
+			{
+				lpOut[5] = mobFmt;
+			}
+			return 0;
+		}
 		/*
 		 input
 			- region id
@@ -1174,7 +4086,7 @@ DWORD __stdcall Device_IO_Control_entry(struct DIOCParams *params)
 			/* sync again */
     	SVGA_Flush();
 			
-			if(FreeRegion(lpIn[1], lpIn[2], lpIn[3]))
+			if(RegionRelease(lpIn[1], lpIn[2], lpIn[3], diocRegionRemove(lpIn[1])))
 			{
 				return 0;
 			}
@@ -18,5 +18,110 @@
 #define VMWSVXD_PM16_APIVER                       7
 #define VMWSVXD_PM16_CB_START                     8
 #define VMWSVXD_PM16_CB_STOP                      9
+#define VMWSVXD_PM16_LOCK_REGION                 10
+#define VMWSVXD_PM16_UNLOCK_REGION               11
+#define VMWSVXD_PM16_OTABLE_ACTIVATE             12
+#define VMWSVXD_PM16_STAGING                     13
+#define VMWSVXD_PM16_LOCK_WAIT                   14
+#define VMWSVXD_PM16_LOCK_WAKE                   15
+#define VMWSVXD_PM16_FENCE_MIRROR                16
+#define VMWSVXD_PM16_MEMSET                      17
+#define VMWSVXD_PM16_MEMCPY                      18
+#define VMWSVXD_PM16_MEMMOVE                     19
+#define VMWSVXD_PM16_FB_WC                       20
+#define VMWSVXD_PM16_GET_TIME                    21
+#define VMWSVXD_PM16_PRESENT_START               22
+#define VMWSVXD_PM16_PRESENT_KICK                23
+#define VMWSVXD_PM16_UPDATE_RECTS                24
+#define VMWSVXD_PM16_TRACE_RING                  25
+#define VMWSVXD_PM16_DBG_RING                    26
+#define VMWSVXD_PM16_VBLANK_SET                  27
+#define VMWSVXD_PM16_UL_SPARSE                   28
+#define VMWSVXD_PM16_DIRTY_SCAN                  29
+#define VMWSVXD_PM16_PRESENT_PATH                30
+#define VMWSVXD_PM16_DEV_LOCK                    31
+
+/*
+ * 2D submission path of SVGA_CMD_UPDATE sent by VXD (PM16 PRESENT_PATH),
+ * AUTO times a batch by both paths and keeps the faster one.
+ */
+#define PRESENT_PATH_AUTO 0
+#define PRESENT_PATH_FIFO 1
+#define PRESENT_PATH_CB   2
+
+/*
+ * Virtual vertical blank (DIOC SVGA_VBLANK_WAIT, SVGA_VBLANK_STATUS)
+ *
+ * Host has no retrace, so VXD derives it from system time: frames are
+ * 1/hz s long (aligned to whole seconds) and last lines of each frame
+ * are vertical blank. Rate and visible height are set by driver on mode
+ * set (PM16 service VBLANK_SET). Values of wait flags are same as
+ * DDWAITVB_BLOCKBEGIN and DDWAITVB_BLOCKEND.
+ */
+#define VBLANK_WAIT_BEGIN 0x1 /* return on start of next vertical blank */
+#define VBLANK_WAIT_END   0x4 /* return on end of current or next vertical blank */
+
+typedef struct vblank_status
+{
+	DWORD frame;     /* frames since system start */
+	DWORD scanline;  /* virtual beam position, >= height in vertical blank */
+	DWORD in_vblank;
+	DWORD hz;
+} vblank_status_t;
+
+/*
+ * Sparse userlist (PM16 service UL_SPARSE, DIOC SVGA_UL_COMMIT)
+ *
+ * GMR and surface slots aren't in userlist itself, userlist holds
+ * directory for each section: linear address of page with slots of
+ * 'ids per page' IDs, 0 = not committed yet. Page is allocated (zeroed)
+ * by VXD on first SVGA_UL_COMMIT for any ID in its range.
+ */
+#define UL_SECTION_GMR  0
+#define UL_SECTION_SURF 1
+#define UL_SECTIONS     2
+
+#define UL_DIR_MAX      256 /* max. pages of one section */
+
+/*
+ * Hot-path trace ring
+ *
+ * Allocated by VXD on init (PAGEFIXED) and shared with driver (PM16
+ * service TRACE_RING) and user space (SVGA_TRACE_SNAPSHOT). Writer
+ * claims slot by lock xadd on 'head' and fills it, so entry index is
+ * head % TRACE_ENTRIES and entries older than head - TRACE_ENTRIES are
+ * overwritten. Timestamp is raw RDTSC value.
+ */
+#define TRACE_ENTRIES 1024
+
+#define TRACE_CB_LOCK           1 /* arg = buffer index */
+#define TRACE_CB_SUBMIT         2 /* arg = buffer index | (CB context << 16) */
+#define TRACE_CB_DONE           3 /* buffer found completed on reuse, arg = index | (status << 16) */
+#define TRACE_CB_SYNC_BEGIN     4
+#define TRACE_CB_SYNC_END       5
+#define TRACE_REGION_CREATE     6 /* arg = pages */
+#define TRACE_REGION_FREE       7 /* arg = linear address */
+#define TRACE_FIFO_FULL_BEGIN   8
+#define TRACE_FIFO_FULL_END     9
+#define TRACE_ESCAPE_ENTER     10 /* arg = escape function */
+#define TRACE_ESCAPE_EXIT      11 /* arg = escape function */
+
+#define TRACE_SRC_DRIVER   0x10000UL /* event was recorded by the 16-bit driver */
+
+typedef struct trace_entry
+{
+	DWORD tsc_lo;
+	DWORD tsc_hi;
+	DWORD event;
+	DWORD arg;
+} trace_entry_t;
+
+typedef struct trace_ring
+{
+	volatile DWORD head;
+	DWORD entries_cnt;
+	DWORD reserved[2];
+	trace_entry_t entries[TRACE_ENTRIES];
+} trace_ring_t;
 
 #endif
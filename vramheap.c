@@ -0,0 +1,319 @@
+/*****************************************************************************
+
+Copyright (c) 2023 Jaroslav Hensl <emulator@emulace.cz>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+
+*****************************************************************************/
+
+/* Offscreen VRAM heap */
+
+#include "winhack.h"
+#include "vramheap.h"
+
+/*
+ * Heap is a table of blocks sorted by offset which covers whole offscreen
+ * area (free blocks have owner VRAM_OWNER_FREE). Allocation is best-fit,
+ * all sizes are rounded to heap alignment, so every block starts aligned.
+ * Free neighbours are always coalesced.
+ *
+ * GDI blocks are only cache, when allocation for other owner fails, the
+ * oldest GDI blocks are evicted (owner is notified by callback) until
+ * there is space.
+ */
+typedef struct _vram_block_t
+{
+	DWORD        offset;
+	DWORD        size;
+	WORD         owner;
+	DWORD        tag;
+	DWORD        age;
+	vram_evict_t evict;
+} vram_block_t;
+
+static vram_block_t heap[VRAMHEAP_BLOCKS];
+static WORD  heap_cnt   = 0;
+static DWORD heap_align = VRAMHEAP_ALIGN;
+static DWORD heap_age   = 0;
+
+#pragma code_seg( _TEXT )
+
+static DWORD align_up(DWORD x)
+{
+	return (x + heap_align - 1) & ~(heap_align - 1);
+}
+
+/* make free slot on index i */
+static BOOL heap_insert(WORD i)
+{
+	WORD j;
+
+	if(heap_cnt >= VRAMHEAP_BLOCKS)
+	{
+		return FALSE;
+	}
+
+	for(j = heap_cnt; j > i; j--)
+	{
+		heap[j] = heap[j-1];
+	}
+	heap_cnt++;
+
+	return TRUE;
+}
+
+static void heap_remove(WORD i)
+{
+	heap_cnt--;
+	for(; i < heap_cnt; i++)
+	{
+		heap[i] = heap[i+1];
+	}
+}
+
+/* mark block as free and merge it with free neighbours */
+static void heap_release(WORD i)
+{
+	heap[i].owner = VRAM_OWNER_FREE;
+	heap[i].evict = NULL;
+
+	if(i+1 < heap_cnt && heap[i+1].owner == VRAM_OWNER_FREE)
+	{
+		heap[i].size += heap[i+1].size;
+		heap_remove(i+1);
+	}
+
+	if(i > 0 && heap[i-1].owner == VRAM_OWNER_FREE)
+	{
+		heap[i-1].size += heap[i].size;
+		heap_remove(i);
+	}
+}
+
+static void heap_evict(WORD i)
+{
+	vram_evict_t evict = heap[i].evict;
+	DWORD offset = heap[i].offset;
+	DWORD tag    = heap[i].tag;
+
+	heap_release(i);
+
+	if(evict)
+	{
+		evict(offset, tag);
+	}
+}
+
+/* oldest GDI block or heap_cnt if there isn't any */
+static WORD heap_oldest_gdi()
+{
+	WORD i;
+	WORD best = heap_cnt;
+
+	for(i = 0; i < heap_cnt; i++)
+	{
+		if(heap[i].owner == VRAM_OWNER_GDI)
+		{
+			if(best == heap_cnt || heap[i].age < heap[best].age)
+			{
+				best = i;
+			}
+		}
+	}
+
+	return best;
+}
+
+/* allocate 'size' bytes from start of free block i */
+static DWORD heap_take(WORD i, DWORD size, WORD owner, DWORD tag, vram_evict_t evict)
+{
+	if(size < heap[i].size && heap_insert(i+1))
+	{
+		heap[i+1].offset = heap[i].offset + size;
+		heap[i+1].size   = heap[i].size - size;
+		heap[i+1].owner  = VRAM_OWNER_FREE;
+		heap[i+1].evict  = NULL;
+		heap[i].size     = size;
+	}
+	/* else: no slot for rest, whole block is used */
+
+	heap[i].owner = owner;
+	heap[i].tag   = tag;
+	heap[i].age   = heap_age++;
+	heap[i].evict = evict;
+
+	return heap[i].offset;
+}
+
+/*
+ * Reset heap to area start-end (offsets from VRAM begin). All existing
+ * blocks are lost, their owners are notified.
+ */
+void VRAMHeap_Init(DWORD start, DWORD end, DWORD align)
+{
+	WORD i;
+	WORD cnt = heap_cnt;
+
+	/* owners can call VRAMHeap_Free from callback, so heap is empty now */
+	heap_cnt = 0;
+	for(i = 0; i < cnt; i++)
+	{
+		if(heap[i].owner != VRAM_OWNER_FREE && heap[i].evict)
+		{
+			heap[i].evict(heap[i].offset, heap[i].tag);
+		}
+	}
+
+	/* alignment must be power of 2 */
+	if(align == 0 || (align & (align - 1)) != 0)
+	{
+		align = VRAMHEAP_ALIGN;
+	}
+	heap_align = align;
+
+	start = align_up(start);
+	end  &= ~(heap_align - 1);
+	if(end > start)
+	{
+		heap[0].offset = start;
+		heap[0].size   = end - start;
+		heap[0].owner  = VRAM_OWNER_FREE;
+		heap[0].evict  = NULL;
+		heap_cnt = 1;
+	}
+}
+
+/*
+ * Allocate block, return its offset or VRAMHEAP_NULL. If owner isn't GDI
+ * cache, old GDI blocks are evicted when there is no space.
+ */
+DWORD VRAMHeap_Alloc(DWORD size, WORD owner, DWORD tag, vram_evict_t evict)
+{
+	WORD i;
+	WORD best;
+
+	if(size == 0 || owner == VRAM_OWNER_FREE)
+	{
+		return VRAMHEAP_NULL;
+	}
+
+	size = align_up(size);
+
+	for(;;)
+	{
+		best = heap_cnt;
+		for(i = 0; i < heap_cnt; i++)
+		{
+			if(heap[i].owner == VRAM_OWNER_FREE && heap[i].size >= size)
+			{
+				if(best == heap_cnt || heap[i].size < heap[best].size)
+				{
+					best = i;
+				}
+			}
+		}
+
+		if(best < heap_cnt)
+		{
+			return heap_take(best, size, owner, tag, evict);
+		}
+
+		if(owner == VRAM_OWNER_GDI)
+		{
+			return VRAMHEAP_NULL;
+		}
+
+		best = heap_oldest_gdi();
+		if(best == heap_cnt)
+		{
+			return VRAMHEAP_NULL;
+		}
+		heap_evict(best);
+	}
+}
+
+/*
+ * Evict all GDI blocks and allocate the largest free block,
+ * size of block is stored to lpSize.
+ */
+DWORD VRAMHeap_AllocMax(WORD owner, DWORD tag, vram_evict_t evict, DWORD __far *lpSize)
+{
+	WORD i;
+	WORD best;
+
+	while((i = heap_oldest_gdi()) < heap_cnt)
+	{
+		heap_evict(i);
+	}
+
+	best = heap_cnt;
+	for(i = 0; i < heap_cnt; i++)
+	{
+		if(heap[i].owner == VRAM_OWNER_FREE)
+		{
+			if(best == heap_cnt || heap[i].size > heap[best].size)
+			{
+				best = i;
+			}
+		}
+	}
+
+	if(best == heap_cnt || owner == VRAM_OWNER_FREE)
+	{
+		*lpSize = 0;
+		return VRAMHEAP_NULL;
+	}
+
+	*lpSize = heap[best].size;
+	return heap_take(best, heap[best].size, owner, tag, evict);
+}
+
+void VRAMHeap_Free(DWORD offset)
+{
+	WORD i;
+
+	for(i = 0; i < heap_cnt; i++)
+	{
+		if(heap[i].offset == offset)
+		{
+			if(heap[i].owner != VRAM_OWNER_FREE)
+			{
+				heap_release(i);
+			}
+			return;
+		}
+	}
+}
+
+/* total free bytes (can be fragmented) */
+DWORD VRAMHeap_Avail(void)
+{
+	WORD i;
+	DWORD sum = 0;
+
+	for(i = 0; i < heap_cnt; i++)
+	{
+		if(heap[i].owner == VRAM_OWNER_FREE)
+		{
+			sum += heap[i].size;
+		}
+	}
+
+	return sum;
+}
@@ -0,0 +1,26 @@
+#ifndef __VRAMHEAP_H__INCLUDED__
+#define __VRAMHEAP_H__INCLUDED__
+
+/*
+ * Offscreen VRAM allocator, offsets are relative to start of VRAM
+ * (dwScreenFlatAddr).
+ */
+
+#define VRAMHEAP_NULL   0xFFFFFFFFUL
+#define VRAMHEAP_BLOCKS 64  /* max number of free + used blocks */
+#define VRAMHEAP_ALIGN  64  /* default alignment, same as dwOffscreenAlign */
+
+#define VRAM_OWNER_FREE  0
+#define VRAM_OWNER_DDRAW 1  /* DirectDraw heap */
+#define VRAM_OWNER_GDI   2  /* GDI cache, can be evicted */
+
+/* called when block is taken back (eviction or heap reset) */
+typedef void (__far *vram_evict_t)(DWORD offset, DWORD tag);
+
+void  VRAMHeap_Init(DWORD start, DWORD end, DWORD align);
+DWORD VRAMHeap_Alloc(DWORD size, WORD owner, DWORD tag, vram_evict_t evict);
+DWORD VRAMHeap_AllocMax(WORD owner, DWORD tag, vram_evict_t evict, DWORD __far *lpSize);
+void  VRAMHeap_Free(DWORD offset);
+DWORD VRAMHeap_Avail(void);
+
+#endif /* __VRAMHEAP_H__INCLUDED__ */
@@ -0,0 +1,537 @@
+/*****************************************************************************
+
+Copyright (c) 2023 Jaroslav Hensl <emulator@emulace.cz>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+
+*****************************************************************************/
+/* Write combining memory type for framebuffer */
+
+#include "winhack.h"
+#include "vmm.h"
+#include "wc32.h"
+
+#include "code32.h"
+
+/*
+ * With PAT, entry 7 (PTE bits PWT=1, PCD=1, PAT=1, by default UC) is
+ * reprogrammed to WC and pages of framebuffer mapping are switched to it.
+ * Windows 9x doesn't know PAT and never sets PAT bit in PTE, so no other
+ * mapping references entries 4-7 and their types don't change. PAT WC
+ * wins over any MTRR type, so it works even when BIOS covers PCI hole by
+ * UC MTRR. Without PAT one free variable MTRR is used, but base must be
+ * aligned to (power of 2) size.
+ *
+ * Windows 9x runs only on one CPU, so there isn't anything to synchronize
+ * with other processors.
+ */
+
+#define CPUID_MTRR (1UL << 12)
+#define CPUID_PAT  (1UL << 16)
+
+#define MSR_MTRRCAP     0x0FE
+#define MSR_PAT         0x277
+#define MSR_MTRRDEFTYPE 0x2FF
+#define MSR_MTRRBASE(_n) (0x200 + (_n)*2)
+#define MSR_MTRRMASK(_n) (0x201 + (_n)*2)
+
+#define MTRRCAP_VCNT  0xFF
+#define MTRRCAP_WC    (1UL << 10)
+#define MTRR_ENABLE   (1UL << 11)
+#define MTRR_VALID    (1UL << 11)
+
+#define MEMTYPE_UC 0x00
+#define MEMTYPE_WC 0x01
+
+#define PAT_WC_SHIFT 24 /* entry 7 in high dword of MSR_PAT */
+
+#define PTE_PRESENT 0x001
+#define PTE_PWT     0x008
+#define PTE_PCD     0x010
+#define PTE_DIRTY   0x040
+#define PTE_PS      0x080 /* in PDE */
+#define PTE_PAT     0x080 /* in PTE */
+#define PTE_PAT_WC  (PTE_PAT | PTE_PCD | PTE_PWT)
+
+/* page tables of 256 MB (MAX_VRAM) framebuffer with unaligned start */
+#define WC_PT_MAX 65
+
+#define MAPPING_FAILED 0xFFFFFFFFUL
+
+static ULONG __declspec(naked) __cdecl _MapPhysToLinear(ULONG PhysAddr, ULONG nBytes, ULONG flags)
+{
+	VMMJmp(_MapPhysToLinear);
+}
+
+static DWORD wc_cpuid(DWORD leaf)
+{
+	DWORD sleaf = leaf;
+	DWORD features = 0;
+
+	_asm
+	{
+		.586
+		push eax
+		push ebx
+		push ecx
+		push edx
+
+		/* CPUID exists when EFLAGS.ID can be changed */
+		pushfd
+		pop eax
+		mov ecx, eax
+		xor eax, 200000h
+		push eax
+		popfd
+		pushfd
+		pop eax
+		push ecx
+		popfd
+		xor eax, ecx
+		jz wc_no_cpuid
+
+		mov eax, [sleaf]
+		cpuid
+		mov [features], edx
+
+		wc_no_cpuid:
+		pop edx
+		pop ecx
+		pop ebx
+		pop eax
+	}
+
+	return features;
+}
+
+static void wc_rdmsr(DWORD msr, DWORD *lo, DWORD *hi)
+{
+	DWORD smsr = msr;
+	DWORD slo;
+	DWORD shi;
+
+	_asm
+	{
+		.586p
+		push eax
+		push ecx
+		push edx
+		mov ecx, [smsr]
+		rdmsr
+		mov [slo], eax
+		mov [shi], edx
+		pop edx
+		pop ecx
+		pop eax
+	}
+
+	*lo = slo;
+	*hi = shi;
+}
+
+static void wc_wrmsr(DWORD msr, DWORD lo, DWORD hi)
+{
+	DWORD smsr = msr;
+	DWORD slo = lo;
+	DWORD shi = hi;
+
+	_asm
+	{
+		.586p
+		push eax
+		push ecx
+		push edx
+		mov ecx, [smsr]
+		mov eax, [slo]
+		mov edx, [shi]
+		wrmsr
+		pop edx
+		pop ecx
+		pop eax
+	}
+}
+
+/*
+ * Memory type change sequence from Intel SDM: disable interrupts and
+ * caches, flush caches and TLB, after change flush again and restore.
+ */
+static DWORD wc_begin(DWORD *pcr0)
+{
+	DWORD sflags;
+	DWORD scr0;
+
+	_asm
+	{
+		.586p
+		push eax
+		pushfd
+		pop eax
+		mov [sflags], eax
+		cli
+		mov eax, cr0
+		mov [scr0], eax
+		or eax, 40000000h  ; CR0.CD
+		and eax, 0DFFFFFFFh ; CR0.NW
+		mov cr0, eax
+		wbinvd
+		mov eax, cr3
+		mov cr3, eax
+		pop eax
+	}
+
+	*pcr0 = scr0;
+	return sflags;
+}
+
+static void wc_end(DWORD flags, DWORD cr0)
+{
+	DWORD sflags = flags;
+	DWORD scr0 = cr0;
+
+	_asm
+	{
+		.586p
+		push eax
+		wbinvd
+		mov eax, cr3
+		mov cr3, eax
+		mov eax, [scr0]
+		mov cr0, eax
+		push dword ptr [sflags]
+		popfd
+		pop eax
+	}
+}
+
+static DWORD wc_cr3()
+{
+	DWORD scr3;
+
+	_asm
+	{
+		.586p
+		push eax
+		mov eax, cr3
+		mov [scr3], eax
+		pop eax
+	}
+
+	return scr3 & 0xFFFFF000UL;
+}
+
+/*
+ * Map page tables of linear range (one per 4 MB) to 'pts', return their
+ * count, 0 when range has large or not present page table or needs more
+ * than 'max' of them. Calls VMM, so never between wc_begin and wc_end.
+ */
+static DWORD wc_map_pts(DWORD linear, DWORD size, DWORD **pts, DWORD max)
+{
+	DWORD *pd;
+	DWORD first = linear >> 22;
+	DWORD last  = (linear + size - 1) >> 22;
+	DWORD pde;
+	DWORD i;
+
+	if(size == 0 || last - first + 1 > max)
+	{
+		return 0;
+	}
+
+	pd = (DWORD*)_MapPhysToLinear(wc_cr3(), 4096, 0);
+	if((DWORD)pd == MAPPING_FAILED)
+	{
+		return 0;
+	}
+
+	for(i = first; i <= last; i++)
+	{
+		pde = pd[i];
+		if((pde & PTE_PRESENT) == 0 || (pde & PTE_PS) != 0)
+		{
+			return 0;
+		}
+
+		pts[i - first] = (DWORD*)_MapPhysToLinear(pde & 0xFFFFF000UL, 4096, 0);
+		if((DWORD)pts[i - first] == MAPPING_FAILED)
+		{
+			return 0;
+		}
+	}
+
+	return last - first + 1;
+}
+
+/* switch PTEs of linear range to PAT entry 7, page tables are from wc_map_pts */
+static void wc_pat_pages(DWORD linear, DWORD size, DWORD **pts)
+{
+	DWORD first = linear >> 22;
+	DWORD page  = linear >> 12;
+	DWORD pages = ((linear & 0xFFF) + size + 4095) >> 12;
+	DWORD *pt;
+	DWORD i;
+
+	while(pages > 0)
+	{
+		pt = pts[(page >> 10) - first];
+		for(i = page & 0x3FF; i < 1024 && pages > 0; i++, page++, pages--)
+		{
+			if(pt[i] & PTE_PRESENT)
+			{
+				pt[i] |= PTE_PAT_WC;
+			}
+		}
+	}
+}
+
+static void wc_invlpg(DWORD linear)
+{
+	DWORD slinear = linear;
+
+	_asm
+	{
+		.586p
+		push eax
+		mov eax, [slinear]
+		invlpg [eax]
+		pop eax
+	}
+}
+
+/* page tables of dirty scan range, mapped by WC_DirtyMap */
+static DWORD *dirty_pts[WC_PT_MAX];
+static DWORD dirty_pts_cnt = 0;
+static DWORD dirty_base    = 0;
+static DWORD dirty_size    = 0;
+
+/*
+ * Map page tables of range scanned by WC_DirtyRuns (linear = 0 drops
+ * them). Calls VMM, so not from time-out and not while scan runs.
+ */
+BOOL WC_DirtyMap(DWORD linear, DWORD size)
+{
+	dirty_pts_cnt = 0;
+	dirty_base    = 0;
+	dirty_size    = 0;
+
+	if(linear == 0)
+	{
+		return TRUE;
+	}
+
+	dirty_pts_cnt = wc_map_pts(linear, size, dirty_pts, WC_PT_MAX);
+	if(dirty_pts_cnt == 0)
+	{
+		return FALSE;
+	}
+
+	dirty_base = linear;
+	dirty_size = size;
+
+	return TRUE;
+}
+
+/*
+ * Collect runs of dirty pages of first 'size' bytes of range from
+ * WC_DirtyMap and clear their dirty bits (TLB entry is flushed too, CPU
+ * wouldn't set the bit again otherwise). Run is pair of page indexes from
+ * start of range (first, end), when there are more than 'max' runs the
+ * last one is extended. Returns number of runs. No VMM calls, can be
+ * used from time-out.
+ */
+DWORD WC_DirtyRuns(DWORD size, DWORD *runs, DWORD max)
+{
+	DWORD *pt;
+	DWORD first = dirty_base >> 12;
+	DWORD page = first;
+	DWORD pages;
+	DWORD i;
+	DWORD cnt = 0;
+
+	if(max == 0 || dirty_pts_cnt == 0)
+	{
+		return 0;
+	}
+
+	if(size > dirty_size)
+	{
+		size = dirty_size;
+	}
+	pages = ((dirty_base & 0xFFF) + size + 4095) >> 12;
+
+	while(pages > 0)
+	{
+		pt = dirty_pts[(page >> 10) - (first >> 10)];
+
+		for(i = page & 0x3FF; i < 1024 && pages > 0; i++, page++, pages--)
+		{
+			if((pt[i] & (PTE_PRESENT | PTE_DIRTY)) != (PTE_PRESENT | PTE_DIRTY))
+			{
+				continue;
+			}
+
+			pt[i] &= ~PTE_DIRTY;
+			wc_invlpg(page << 12);
+
+			if(cnt > 0 && runs[cnt*2 - 1] == page - first)
+			{
+				runs[cnt*2 - 1]++;
+			}
+			else if(cnt < max)
+			{
+				runs[cnt*2]     = page - first;
+				runs[cnt*2 + 1] = page - first + 1;
+				cnt++;
+			}
+			else
+			{
+				runs[cnt*2 - 1] = page - first + 1;
+			}
+		}
+	}
+
+	return cnt;
+}
+
+/*
+ * Everything which can fail is checked before wc_begin, so PAT and PTEs
+ * are either changed together or not touched at all.
+ */
+static BOOL wc_pat(DWORD linear, DWORD size)
+{
+	static DWORD *pts[WC_PT_MAX];
+	DWORD lo, hi;
+	DWORD flags, cr0;
+	DWORD pa7;
+
+	wc_rdmsr(MSR_PAT, &lo, &hi);
+	pa7 = (hi >> PAT_WC_SHIFT) & 0x7;
+	if(pa7 != MEMTYPE_UC && pa7 != MEMTYPE_WC)
+	{
+		/* someone else is using PAT, don't touch it */
+		return FALSE;
+	}
+
+	if(wc_map_pts(linear, size, pts, WC_PT_MAX) == 0)
+	{
+		return FALSE;
+	}
+
+	flags = wc_begin(&cr0);
+	if(pa7 != MEMTYPE_WC)
+	{
+		hi = (hi & ~(0x7UL << PAT_WC_SHIFT)) | ((DWORD)MEMTYPE_WC << PAT_WC_SHIFT);
+		wc_wrmsr(MSR_PAT, lo, hi);
+	}
+	wc_pat_pages(linear, size, pts);
+	wc_end(flags, cr0);
+
+	return TRUE;
+}
+
+static BOOL wc_mtrr(DWORD phys, DWORD size)
+{
+	DWORD lo, hi;
+	DWORD cnt;
+	DWORD i;
+	DWORD free = MAPPING_FAILED;
+	DWORD range = 4096;
+	DWORD himask = 0xF; /* 36 bit physical address */
+	DWORD deflo, defhi;
+	DWORD flags, cr0;
+
+	wc_rdmsr(MSR_MTRRCAP, &lo, &hi);
+	if((lo & MTRRCAP_WC) == 0)
+	{
+		return FALSE;
+	}
+	cnt = lo & MTRRCAP_VCNT;
+
+	while(range < size && range != 0)
+	{
+		range <<= 1;
+	}
+
+	/* MTRR range must be aligned to its size */
+	if(range == 0 || (phys & (range - 1)) != 0)
+	{
+		return FALSE;
+	}
+
+	for(i = 0; i < cnt; i++)
+	{
+		wc_rdmsr(MSR_MTRRMASK(i), &lo, &hi);
+		if(lo & MTRR_VALID)
+		{
+			wc_rdmsr(MSR_MTRRBASE(i), &deflo, &defhi);
+			if((deflo & 0xFFFFF000UL) == phys && defhi == 0)
+			{
+				/* already set (driver reload) */
+				return (deflo & 0xFF) == MEMTYPE_WC;
+			}
+		}
+		else if(free == MAPPING_FAILED)
+		{
+			free = i;
+		}
+	}
+
+	if(free == MAPPING_FAILED)
+	{
+		return FALSE;
+	}
+
+	flags = wc_begin(&cr0);
+	wc_rdmsr(MSR_MTRRDEFTYPE, &deflo, &defhi);
+	wc_wrmsr(MSR_MTRRDEFTYPE, deflo & ~MTRR_ENABLE, defhi);
+	wc_wrmsr(MSR_MTRRBASE(free), phys | MEMTYPE_WC, 0);
+	wc_wrmsr(MSR_MTRRMASK(free), (~(range - 1) & 0xFFFFF000UL) | MTRR_VALID, himask);
+	wc_wrmsr(MSR_MTRRDEFTYPE, deflo, defhi);
+	wc_end(flags, cr0);
+
+	return TRUE;
+}
+
+/*
+ * Set write combining for framebuffer mapped on 'linear' (physical
+ * address 'phys'), return TRUE on success.
+ */
+BOOL WC_Enable(DWORD linear, DWORD phys, DWORD size)
+{
+	DWORD features = wc_cpuid(1);
+
+	if(size == 0)
+	{
+		return FALSE;
+	}
+
+	if(features & CPUID_PAT)
+	{
+		if(wc_pat(linear, size))
+		{
+			return TRUE;
+		}
+	}
+
+	if(features & CPUID_MTRR)
+	{
+		return wc_mtrr(phys, size);
+	}
+
+	return FALSE;
+}
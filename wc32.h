@@ -0,0 +1,8 @@
+#ifndef __WC32_H__INCLUDED__
+#define __WC32_H__INCLUDED__
+
+BOOL WC_Enable(DWORD linear, DWORD phys, DWORD size);
+BOOL WC_DirtyMap(DWORD linear, DWORD size);
+DWORD WC_DirtyRuns(DWORD size, DWORD *runs, DWORD max);
+
+#endif /* __WC32_H__INCLUDED__ */